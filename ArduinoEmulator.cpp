@@ -0,0 +1,80 @@
+/*
+*   ArduinoEmulator.cpp
+*	Film Scanner Master PC Control Software by Kyle Mikolajczyk
+*	kyle@kylem.org
+*/
+
+#include "ArduinoEmulator.h"
+#include <chrono>
+#include <cstring>
+#include "SerialConn.h"
+
+ArduinoEmulator::ArduinoEmulator(double baudRate, double replyDelayMs) : PtyDeviceEmulator(baudRate), replyDelayMs(replyDelayMs),
+    inMessage(false), frameId(0), stepperPos(0), commandsReceived(0)
+{
+}
+
+/*
+* Frame the bytes like readMessageFromSerial() in the sketch: skip until the start
+* delimiter, collect until the end delimiter
+*/
+void ArduinoEmulator::handleBytes(const char* data, size_t length)
+{
+    for (size_t i = 0; i < length; i++)
+    {
+        char c = data[i];
+        if (c == MSG_START_DELIM)
+        {
+            inMessage = true;
+            partial.clear();
+        }
+        else if (c == MSG_END_DELIM && inMessage)
+        {
+            inMessage = false;
+            commandsReceived++;
+            if (replyDelayMs > 0.0)
+            {
+                std::this_thread::sleep_for(std::chrono::duration<double, std::milli>(replyDelayMs));
+            }
+            send(std::string(1, MSG_START_DELIM) + replyTo(partial) + MSG_END_DELIM);
+        }
+        else if (inMessage && partial.size() < MSG_SIZE - 1)
+        {
+            partial += c;
+        }
+    }
+}
+
+/*
+* Same replies as handleCommandFromString() and handleCommand() in the sketch
+*/
+std::string ArduinoEmulator::replyTo(const std::string& command)
+{
+    const char* text = command.c_str();
+    if (strcmp(text, "SET_COLOR_RED") == 0)
+    {
+        return "READY_RED";
+    }
+    if (strcmp(text, "SET_COLOR_GREEN") == 0)
+    {
+        return "READY_GREEN";
+    }
+    if (strcmp(text, "SET_COLOR_BLUE") == 0)
+    {
+        return "READY_BLUE";
+    }
+    if (strcmp(text, "FRAME_STEP") == 0 || strcmp(text, "GET_FRAME_ID") == 0 || strcmp(text, "RESET_FRAME_ID") == 0 ||
+        strncmp(text, "GOTO_FRAME_ID:", 14) == 0)
+    {
+        return "CURRENT_FRAME_ID:" + std::to_string(frameId);
+    }
+    if (strcmp(text, "GET_STEPPER_POS") == 0 || strncmp(text, "GOTO_STEPPER_POS:", 17) == 0)
+    {
+        return "CURRENT_STEPPER_POS:" + std::to_string(stepperPos);
+    }
+    if (strncmp(text, "SET_FRAME_OFFSET:", 17) == 0)
+    {
+        return "ACK";
+    }
+    return "UNKNOWN_CMD";
+}
@@ -0,0 +1,36 @@
+/*
+*   ArduinoEmulator.h
+*	Film Scanner Master PC Control Software by Kyle Mikolajczyk
+*   kyle@kylem.org
+*/
+
+#pragma once
+
+#include <atomic>
+#include <string>
+#include "PtyDeviceEmulator.h"
+
+/*
+* Answers (...) commands the same way Arduino/scanner_arduino/scanner_arduino.ino does,
+* so SerialConn can be exercised and timed without the board plugged in
+*/
+class ArduinoEmulator : public PtyDeviceEmulator
+{
+	public:
+		ArduinoEmulator(double baudRate = 0.0, double replyDelayMs = 0.0);
+
+		uint64_t getCommandsReceived() { return commandsReceived; }
+
+	protected:
+		void handleBytes(const char* data, size_t length) override;
+
+	private:
+		double replyDelayMs; // Time the sketch spends before answering
+		std::string partial;
+		bool inMessage;
+		int frameId;
+		int stepperPos;
+		std::atomic<uint64_t> commandsReceived;
+
+		std::string replyTo(const std::string& command);
+};
@@ -0,0 +1,463 @@
+/*
+*   CaptureJournal.cpp
+*	Film Scanner Master PC Control Software by Kyle Mikolajczyk
+*	kyle@kylem.org
+*/
+
+#include "CaptureJournal.h"
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include "PipelineMetrics.h"
+
+// The header has a block to itself so the payload starts aligned too
+static const size_t HEADER_BLOCK_BYTES = DirectFile::ALIGNMENT;
+static_assert(sizeof(JournalRecordHeader) <= HEADER_BLOCK_BYTES, "Journal header does not fit its block");
+
+static size_t roundUpToBlock(size_t bytes)
+{
+    return (bytes + DirectFile::ALIGNMENT - 1) & ~(DirectFile::ALIGNMENT - 1);
+}
+
+CaptureJournal::CaptureJournal(const std::string& directory, const std::string& captureId, uint64_t segmentBytes, size_t inFlight, bool bypassCache)
+    : directory(directory), captureId(captureId), segmentBytes(segmentBytes), inFlight(std::max<size_t>(1, inFlight)), bypassCache(bypassCache),
+    allocatedRecords(0), nextSequence(0), closed(false), segmentIndex(-1), segmentUsed(0), writeFailed(false), started(false),
+    metrics(nullptr)
+{
+    writer = std::thread(&CaptureJournal::writerLoop, this);
+}
+
+std::string CaptureJournal::segmentPath(const std::string& directory, const std::string& captureId, int segment)
+{
+    std::ostringstream path;
+    path << directory << "journal" << captureId << "_" << std::setw(4) << std::setfill('0') << segment << ".raw";
+    return path.str();
+}
+
+/*
+* A buffer that is not waiting for the disk, allocating up to inFlight of them. Waits
+* for the writer to finish one when they are all queued.
+*/
+CaptureJournal::Record* CaptureJournal::takeFreeRecord(size_t bytes)
+{
+    auto start = std::chrono::steady_clock::now();
+    Record* record = nullptr;
+    {
+        std::unique_lock<std::mutex> lock(freeMutex);
+        freeAvailable.wait(lock, [this]() { return !freeRecords.empty() || allocatedRecords < inFlight; });
+        if (!freeRecords.empty())
+        {
+            record = freeRecords.back();
+            freeRecords.pop_back();
+        }
+        else
+        {
+            record = new Record();
+            allocatedRecords++;
+        }
+    }
+    double stallMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    {
+        std::lock_guard<std::mutex> lock(statsMutex);
+        stats.totalStallMs += stallMs;
+        stats.maxStallMs = std::max(stats.maxStallMs, stallMs);
+    }
+    if (metrics != nullptr)
+    {
+        metrics->record("journal_stall", stallMs);
+    }
+
+    if (record->capacity < bytes)
+    {
+        DirectFile::freeAligned(record->data);
+        record->data = (unsigned char*)DirectFile::allocateAligned(bytes);
+        record->capacity = record->data != nullptr ? bytes : 0;
+    }
+    return record;
+}
+
+bool CaptureJournal::append(const RawFrame& frame, int imageId, LedController::LedColor color, int exposureIndex, int exposureCount, double exposureMs)
+{
+    {
+        std::lock_guard<std::mutex> lock(statsMutex);
+        if (writeFailed || closed)
+        {
+            return false;
+        }
+        if (!started)
+        {
+            firstAppend = std::chrono::steady_clock::now();
+            started = true;
+        }
+    }
+
+    size_t payloadBytes = std::min(frame.bufferSize, rawFrameBytes(frame.format, frame.width, frame.height));
+    size_t recordBytes = HEADER_BLOCK_BYTES + roundUpToBlock(payloadBytes);
+    Record* record = takeFreeRecord(recordBytes);
+    if (record->data == nullptr)
+    {
+        std::cerr << "Error: Could not allocate " << recordBytes << " bytes for the capture journal." << std::endl;
+        std::lock_guard<std::mutex> lock(freeMutex);
+        freeRecords.push_back(record);
+        return false;
+    }
+
+    JournalRecordHeader header;
+    header.recordBytes = recordBytes;
+    header.payloadBytes = payloadBytes;
+    header.sequence = nextSequence++;
+    strncpy(header.captureId, captureId.c_str(), sizeof(header.captureId) - 1);
+    header.imageId = imageId;
+    header.color = color;
+    header.exposureIndex = exposureIndex;
+    header.exposureCount = exposureCount;
+    header.exposureMs = exposureMs;
+    auto arrived = std::chrono::system_clock::now() - std::chrono::duration_cast<std::chrono::system_clock::duration>(std::chrono::steady_clock::now() - frame.timestamp);
+    header.timestampNs = std::chrono::duration_cast<std::chrono::nanoseconds>(arrived.time_since_epoch()).count();
+    header.frameNumber = frame.frameNumber;
+    header.width = frame.width;
+    header.height = frame.height;
+    header.pixelFormat = frame.format;
+
+    // Padding is zeroed so a journal is the same bytes every time
+    memset(record->data, 0, HEADER_BLOCK_BYTES);
+    memcpy(record->data, &header, sizeof(header));
+    memcpy(record->data + HEADER_BLOCK_BYTES, frame.data, payloadBytes);
+    memset(record->data + HEADER_BLOCK_BYTES + payloadBytes, 0, recordBytes - HEADER_BLOCK_BYTES - payloadBytes);
+    record->bytes = recordBytes;
+
+    if (!pending.push(record))
+    {
+        std::lock_guard<std::mutex> lock(freeMutex);
+        freeRecords.push_back(record);
+        return false;
+    }
+    return true;
+}
+
+bool CaptureJournal::openSegment()
+{
+    segment.close();
+    segmentIndex++;
+    segmentUsed = 0;
+    if (segmentIndex == 0)
+    {
+        std::error_code error;
+        std::filesystem::create_directories(directory, error);
+    }
+    std::string path = segmentPath(directory, captureId, segmentIndex);
+    if (!segment.open(path, bypassCache))
+    {
+        return false;
+    }
+    if (!segment.preallocate(segmentBytes))
+    {
+        std::cout << "Journal segment " << path << " could not be preallocated, it grows as it is written." << std::endl;
+    }
+    std::lock_guard<std::mutex> lock(statsMutex);
+    stats.segments++;
+    return true;
+}
+
+/*
+* Only whole frames of the earlier run are kept: the records of the frame it was cut off
+* in are cut off the end of their segment, and segments after that are renamed to
+* .discarded, so a damaged record does not leave later ones the reader cannot get to.
+* Those frames are not verified in the session, they are taken again. New records go
+* into the next segment with the sequence carrying on, so the reader goes from the old
+* records to the new ones as if the run had never stopped. The writer thread has not
+* touched the segment yet, and the first append() hands it what is set here.
+*/
+bool CaptureJournal::resume()
+{
+    int keptSegment = 0;
+    uint64_t keptBytes = 0;
+    uint64_t keptRecords = 0;
+    uint64_t foundRecords = 0;
+    bool damaged = false;
+    {
+        JournalReader reader(directory, captureId);
+        JournalRecordHeader header;
+        while (reader.skip(header))
+        {
+            // The last exposure of blue finishes a frame
+            if (header.color == LedController::LED_BLUE && header.exposureIndex == header.exposureCount - 1)
+            {
+                keptSegment = reader.getSegmentIndex();
+                keptBytes = reader.getOffset();
+                keptRecords = reader.getRecordCount();
+            }
+        }
+        foundRecords = reader.getRecordCount();
+        damaged = reader.isDamaged();
+    }
+    if (!std::filesystem::exists(segmentPath(directory, captureId, 0)))
+    {
+        return true; // Nothing to carry on after
+    }
+
+    std::error_code error;
+    std::filesystem::resize_file(segmentPath(directory, captureId, keptSegment), keptBytes, error);
+    int discarded = 0;
+    for (int index = keptSegment + 1; !error && std::filesystem::exists(segmentPath(directory, captureId, index)); index++)
+    {
+        std::string path = segmentPath(directory, captureId, index);
+        std::filesystem::rename(path, path + ".discarded", error);
+        discarded++;
+    }
+    if (error)
+    {
+        std::cerr << "Error: The capture journal of the earlier run could not be cut back to its last whole frame (" << error.message()
+            << "), not journaling so it is not overwritten." << std::endl;
+        std::lock_guard<std::mutex> lock(statsMutex);
+        writeFailed = true;
+        return false;
+    }
+
+    segmentIndex = keptSegment; // openSegment() moves on to the next one
+    nextSequence = keptRecords;
+    std::cout << "Capture journal: carrying on after " << keptRecords << " exposures of an earlier run";
+    if (foundRecords > keptRecords)
+    {
+        std::cout << ", " << foundRecords - keptRecords << " of an unfinished frame cut off";
+    }
+    if (damaged)
+    {
+        std::cout << ", the rest was damaged";
+    }
+    if (discarded > 0)
+    {
+        std::cout << ", " << discarded << " later segment(s) set aside as .discarded";
+    }
+    std::cout << std::endl;
+    return true;
+}
+
+/*
+* Every record is a whole number of blocks in an aligned buffer, so with the page cache
+* bypassed it goes to disk in one write without being copied again
+*/
+bool CaptureJournal::writeRecord(const Record* record)
+{
+    if (!segment.isOpen() || (segmentUsed > 0 && segmentUsed + record->bytes > segmentBytes))
+    {
+        if (!openSegment())
+        {
+            return false;
+        }
+    }
+    if (!segment.write(record->data, record->bytes))
+    {
+        return false;
+    }
+    segmentUsed += record->bytes;
+    return true;
+}
+
+void CaptureJournal::writerLoop()
+{
+    Record* record;
+    while (pending.pop(record))
+    {
+        auto start = std::chrono::steady_clock::now();
+        bool written = !writeFailed && writeRecord(record); // writeFailed only changes on this thread
+        double writeMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        {
+            std::lock_guard<std::mutex> lock(statsMutex);
+            if (written)
+            {
+                stats.records++;
+                stats.bytesWritten += record->bytes;
+            }
+            else
+            {
+                if (!writeFailed)
+                {
+                    std::cerr << "Error: Capture journal could not be written, stopping it." << std::endl;
+                }
+                stats.failedRecords++;
+                writeFailed = true;
+            }
+            stats.totalWriteMs += writeMs;
+            stats.maxWriteMs = std::max(stats.maxWriteMs, writeMs);
+            stats.elapsedSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - firstAppend).count();
+        }
+        if (metrics != nullptr)
+        {
+            metrics->record("journal_write", writeMs, record->bytes);
+        }
+        {
+            std::lock_guard<std::mutex> lock(freeMutex);
+            freeRecords.push_back(record);
+        }
+        freeAvailable.notify_one();
+    }
+}
+
+bool CaptureJournal::close()
+{
+    {
+        std::lock_guard<std::mutex> lock(statsMutex);
+        closed = true;
+    }
+    pending.close();
+    if (writer.joinable())
+    {
+        writer.join();
+    }
+    bool closedCleanly = segment.close();
+    std::lock_guard<std::mutex> lock(statsMutex);
+    return closedCleanly && !writeFailed;
+}
+
+CaptureJournal::Stats CaptureJournal::getStats()
+{
+    std::lock_guard<std::mutex> lock(statsMutex);
+    return stats;
+}
+
+void CaptureJournal::printStats()
+{
+    Stats current = getStats();
+    double megabytes = current.bytesWritten / (1024.0 * 1024.0);
+    std::cout << "Capture journal: " << current.records << " exposures in " << current.segments << " segment(s), " << std::fixed << std::setprecision(1)
+        << megabytes << " MB";
+    if (current.elapsedSeconds > 0.0)
+    {
+        std::cout << ", " << megabytes / current.elapsedSeconds << " MB/s";
+    }
+    uint64_t writes = current.records + current.failedRecords;
+    if (writes > 0)
+    {
+        std::cout << ", write mean " << current.totalWriteMs / writes << " ms max " << current.maxWriteMs << " ms"
+            << ", capture held up " << current.totalStallMs << " ms in total (max " << current.maxStallMs << " ms)";
+    }
+    if (current.failedRecords > 0)
+    {
+        std::cout << ", " << current.failedRecords << " failed";
+    }
+    std::cout << std::defaultfloat << std::endl;
+}
+
+CaptureJournal::~CaptureJournal()
+{
+    close();
+    for (Record* record : freeRecords)
+    {
+        DirectFile::freeAligned(record->data);
+        delete record;
+    }
+}
+
+JournalReader::JournalReader(const std::string& directory, const std::string& captureId)
+    : directory(directory), captureId(captureId), segmentIndex(-1), offset(0), expectedSequence(0), damaged(false)
+{
+}
+
+bool JournalReader::openSegment(int index)
+{
+    std::string path = CaptureJournal::segmentPath(directory, captureId, index);
+    if (!std::filesystem::exists(path))
+    {
+        return false;
+    }
+    file.close();
+    file.clear();
+    file.open(path, std::ios::binary);
+    if (!file.is_open())
+    {
+        return false;
+    }
+    segmentIndex = index;
+    offset = 0;
+    return true;
+}
+
+/*
+* A segment ends where its file does, or at a block of zeros where the file system
+* preallocated by growing it. Past the end of the last segment there is nothing yet.
+*/
+bool JournalReader::next(JournalRecordHeader& header, std::vector<unsigned char>& payload)
+{
+    return readRecord(header, &payload, true);
+}
+
+bool JournalReader::skip(JournalRecordHeader& header)
+{
+    return readRecord(header, nullptr, true);
+}
+
+bool JournalReader::peek(JournalRecordHeader& header)
+{
+    return readRecord(header, nullptr, false);
+}
+
+bool JournalReader::readRecord(JournalRecordHeader& header, std::vector<unsigned char>* payload, bool advance)
+{
+    damaged = false;
+    if (segmentIndex < 0 && !openSegment(0))
+    {
+        return false;
+    }
+    while (true)
+    {
+        file.clear(); // The writer may have added to the file since we hit its end
+        file.seekg(0, std::ios::end);
+        uint64_t size = (uint64_t)file.tellg();
+        bool laterSegment = std::filesystem::exists(CaptureJournal::segmentPath(directory, captureId, segmentIndex + 1));
+
+        bool headerThere = size >= offset + HEADER_BLOCK_BYTES;
+        if (headerThere)
+        {
+            file.seekg(offset);
+            file.read((char*)&header, sizeof(header));
+            headerThere = file.good() && header.magic == JournalRecordHeader::MAGIC;
+        }
+        if (!headerThere)
+        {
+            if (laterSegment && openSegment(segmentIndex + 1))
+            {
+                continue;
+            }
+            return false;
+        }
+
+        if (header.version != JournalRecordHeader::VERSION || header.sequence != expectedSequence || header.recordBytes < HEADER_BLOCK_BYTES + header.payloadBytes)
+        {
+            std::cerr << "Error: Journal record " << expectedSequence << " in " << CaptureJournal::segmentPath(directory, captureId, segmentIndex) << " is damaged." << std::endl;
+            damaged = true;
+            return false;
+        }
+        if (size < offset + header.recordBytes)
+        {
+            // Still being written, unless the writer has moved on and it never will be
+            damaged = laterSegment;
+            if (damaged)
+            {
+                std::cerr << "Error: Journal record " << expectedSequence << " was cut off." << std::endl;
+            }
+            return false;
+        }
+
+        if (payload != nullptr)
+        {
+            payload->resize(header.payloadBytes);
+            file.seekg(offset + HEADER_BLOCK_BYTES);
+            file.read((char*)payload->data(), header.payloadBytes);
+            if (!file.good())
+            {
+                damaged = true;
+                return false;
+            }
+        }
+        if (advance)
+        {
+            offset += header.recordBytes;
+            expectedSequence++;
+        }
+        return true;
+    }
+}
@@ -0,0 +1,187 @@
+/*
+*   CaptureJournal.h
+*	Film Scanner Master PC Control Software by Kyle Mikolajczyk
+*   kyle@kylem.org
+*/
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "DirectFile.h"
+#include "FrameSource.h"
+#include "LedController.h"
+#include "RGBImageQueue.h"
+
+class PipelineMetrics;
+
+enum JournalMode
+{
+	JOURNAL_OFF,
+	JOURNAL_ONLY, // Raw exposures go to the journal and nothing is processed, see ImageCaptureController
+	JOURNAL_AND_PROCESS // Journal every exposure and process the frames in memory as well
+};
+
+/*
+* What comes before every exposure in the journal, at the start of its own block.
+* Little endian, as written by the scanning PC.
+*/
+struct JournalRecordHeader
+{
+	static const uint32_t MAGIC = 0x524A5346; // "FSJR"
+	static const uint32_t VERSION = 1;
+
+	uint32_t magic = MAGIC;
+	uint32_t version = VERSION;
+	uint64_t recordBytes = 0; // Header block, payload and the padding to the next record
+	uint64_t payloadBytes = 0; // The raw frame as the camera delivered it
+	uint64_t sequence = 0; // Records before this one in the journal
+	char captureId[32] = {};
+	int32_t imageId = 0;
+	int32_t color = 0; // LedController::LedColor
+	int32_t exposureIndex = 0; // In the HDR bracket of this colour, 0 without one
+	int32_t exposureCount = 1;
+	double exposureMs = 0.0; // 0 if the camera did not say
+	int64_t timestampNs = 0; // When the frame arrived, system clock since the epoch
+	uint64_t frameNumber = 0; // The camera's own count
+	int32_t width = 0;
+	int32_t height = 0;
+	int32_t pixelFormat = 0; // RawFrame::PixelFormat
+	int32_t reserved = 0;
+};
+
+/*
+* Append-only journal of raw exposures, for when scanning has to go faster than the
+* merge. The capture thread copies each exposure into an aligned buffer and goes
+* back to the camera, and a writer thread appends it to the current segment with one
+* unbuffered write. Every record starts on a DirectFile::ALIGNMENT boundary, so the
+* writes are sequential and aligned and never go through the page cache.
+*
+* Segments are journal<captureId>_<n>.raw, preallocated to segmentBytes and started
+* anew when the next record does not fit. Only inFlight exposures wait for the disk;
+* after that append() holds up the capture thread, so the scan runs at the speed of
+* the disk rather than filling memory.
+*
+* A new journal starts again at segment 0 over whatever is there; resume() carries on
+* after the records an earlier run of the same capture left instead.
+*/
+class CaptureJournal
+{
+	public:
+		struct Stats
+		{
+			uint64_t records = 0;
+			uint64_t failedRecords = 0;
+			uint64_t bytesWritten = 0; // Including headers and padding
+			uint64_t segments = 0;
+			double totalWriteMs = 0.0;
+			double maxWriteMs = 0.0;
+			double totalStallMs = 0.0; // Capture thread waiting for a free buffer
+			double maxStallMs = 0.0;
+			double elapsedSeconds = 0.0; // From the first append to the last completed write
+		};
+
+		CaptureJournal(const std::string& directory, const std::string& captureId, uint64_t segmentBytes, size_t inFlight, bool bypassCache);
+		~CaptureJournal();
+
+		// Copy the frame and queue it for the disk. The frame's data can be reused as soon
+		// as this returns. False if the journal cannot be written.
+		bool append(const RawFrame& frame, int imageId, LedController::LedColor color, int exposureIndex, int exposureCount, double exposureMs);
+		bool close(); // Write everything still queued and close the segment, false if anything failed
+		// Keep the records already in the directory and append after them, before the first
+		// append(). False, and every append() refused, if they could not be kept.
+		bool resume();
+
+		static std::string segmentPath(const std::string& directory, const std::string& captureId, int segment);
+
+		Stats getStats();
+		void printStats();
+		size_t getQueuedCount() { return pending.size(); } // Exposures copied and waiting for the disk
+
+		// Also record every exposure as "journal_stall" and "journal_write", before the first append
+		void setMetrics(PipelineMetrics* newMetrics) { metrics = newMetrics; }
+
+	private:
+		struct Record
+		{
+			unsigned char* data = nullptr; // Aligned, header block then payload
+			size_t capacity = 0;
+			size_t bytes = 0;
+		};
+
+		std::string directory;
+		std::string captureId;
+		uint64_t segmentBytes;
+		size_t inFlight;
+		bool bypassCache;
+
+		RGBImageQueue<Record> pending;
+		std::thread writer;
+		std::mutex freeMutex;
+		std::condition_variable freeAvailable;
+		std::vector<Record*> freeRecords;
+		size_t allocatedRecords;
+		uint64_t nextSequence; // Only touched by the capture thread
+		bool closed;
+
+		// Writer thread only
+		DirectFile segment;
+		int segmentIndex;
+		uint64_t segmentUsed;
+
+		std::mutex statsMutex;
+		Stats stats;
+		bool writeFailed; // Once set append() refuses, the scan should stop rather than lose frames
+		bool started;
+		std::chrono::steady_clock::time_point firstAppend;
+		PipelineMetrics* metrics;
+
+		Record* takeFreeRecord(size_t bytes);
+		void writerLoop();
+		bool writeRecord(const Record* record);
+		bool openSegment();
+};
+
+/*
+* Reads the records of a journal back in order, across its segments. Works on a
+* journal that is still being written: next() returns false at the last complete
+* record and can be called again later to pick up what has been added since.
+*/
+class JournalReader
+{
+	public:
+		JournalReader(const std::string& directory, const std::string& captureId);
+
+		// The next record and its raw frame, false if there is none (yet) or it is damaged
+		bool next(JournalRecordHeader& header, std::vector<unsigned char>& payload);
+		// The same without reading the frame, to get past records quickly
+		bool skip(JournalRecordHeader& header);
+		// The header of the record next() would return, without moving past it
+		bool peek(JournalRecordHeader& header);
+		// True once the last call to next() stopped at a damaged record rather than the end
+		bool isDamaged() { return damaged; }
+		// The segment the reader is in, where the next record starts in it and how many
+		// records have been read or skipped so far
+		int getSegmentIndex() { return segmentIndex; }
+		uint64_t getOffset() { return offset; }
+		uint64_t getRecordCount() { return expectedSequence; }
+
+	private:
+		std::string directory;
+		std::string captureId;
+		std::ifstream file;
+		int segmentIndex;
+		uint64_t offset; // Of the next record in the current segment
+		uint64_t expectedSequence;
+		bool damaged;
+
+		bool openSegment(int index);
+		bool readRecord(JournalRecordHeader& header, std::vector<unsigned char>* payload, bool advance);
+};
@@ -0,0 +1,227 @@
+/*
+*   CaptureSequencer.cpp
+*	Film Scanner Master PC Control Software by Kyle Mikolajczyk
+*	kyle@kylem.org
+*/
+
+// Extra time the LED is held after the exposure should have ended, to cover the
+// latency between the software trigger and the sensor actually starting
+#define EXPOSURE_END_MARGIN_MS 1.0
+
+#include "CaptureSequencer.h"
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <thread>
+#include "PipelineMetrics.h"
+
+static const char* COLOR_NAMES[CaptureSequencer::COLOR_COUNT] = { "red", "green", "blue" };
+static const char* STEP_NAMES[CaptureSequencer::STEP_COUNT] = { "LED wait", "exposure", "retrieve" };
+static const char* STEP_METRICS[CaptureSequencer::STEP_COUNT] = { "led_wait", "exposure", "retrieve" };
+
+static double millisecondsSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+CaptureSequencer::CaptureSequencer(FrameSource* source, LedController* led, bool overlap)
+    : source(source), led(led), overlap(overlap), triggered(false), exposureMs(0.0), pendingColor(LedController::LED_RED),
+    colorShown(false), shownColor(LedController::LED_RED),
+    frames(0), totalFrameMs(0.0), maxFrameMs(0.0), metrics(nullptr)
+{
+    std::fill(totalStepMs, totalStepMs + STEP_COUNT, 0.0);
+    std::fill(maxStepMs, maxStepMs + STEP_COUNT, 0.0);
+}
+
+bool CaptureSequencer::prepare()
+{
+    if (led == nullptr)
+    {
+        return true;
+    }
+    triggered = source->enableSoftwareTrigger();
+    exposureMs = triggered ? source->getExposureTimeMs() : 0.0;
+    std::cout << "Sequencing exposures with the " << led->getName() << " LED, "
+        << (triggered && overlap ? "switching colours during readout" : "one step at a time");
+    if (triggered)
+    {
+        std::cout << " (exposure " << exposureMs << " ms)" << std::endl;
+    }
+    else
+    {
+        std::cout << " (camera is free-running)" << std::endl;
+    }
+    return true;
+}
+
+/*
+* Start switching the LED in the background. Only one switch can be in flight.
+*/
+void CaptureSequencer::requestColor(LedController::LedColor color)
+{
+    if (pendingSwitch.valid())
+    {
+        pendingSwitch.wait();
+    }
+    pendingColor = color;
+    colorShown = false;
+    pendingSwitch = led->setColorAsync(color);
+}
+
+/*
+* Block until the LED is showing color, starting the switch now if nobody asked for it yet
+*/
+bool CaptureSequencer::waitForColor(LedController::LedColor color)
+{
+    if (!pendingSwitch.valid() && colorShown && shownColor == color)
+    {
+        return true; // Still on from the last exposure of a bracket
+    }
+    if (!pendingSwitch.valid() || pendingColor != color)
+    {
+        requestColor(color);
+    }
+    bool ready = pendingSwitch.get();
+    if (!ready)
+    {
+        std::cerr << "Error: LED did not switch to " << COLOR_NAMES[color] << "." << std::endl;
+    }
+    colorShown = ready;
+    shownColor = color;
+    return ready;
+}
+
+double CaptureSequencer::setExposureTimeMs(double newExposureMs)
+{
+    if (!source->setExposureTimeMs(newExposureMs))
+    {
+        return 0.0;
+    }
+    double actualMs = source->getExposureTimeMs();
+    if (actualMs <= 0.0)
+    {
+        actualMs = newExposureMs;
+    }
+    if (triggered)
+    {
+        exposureMs = actualMs; // How long the LED has to stay on
+    }
+    return actualMs;
+}
+
+void CaptureSequencer::beginFrame()
+{
+    current = FrameTiming();
+    frameStart = std::chrono::steady_clock::now();
+}
+
+OIIO::ImageBuf* CaptureSequencer::captureColor(LedController::LedColor color, LedController::LedColor nextColor, const std::function<OIIO::ImageBuf*()>& retrieve)
+{
+    OIIO::ImageBuf* image = nullptr;
+    captureExposure(color, nextColor, [&]() {
+        image = retrieve();
+        return image != nullptr;
+    });
+    return image;
+}
+
+bool CaptureSequencer::captureExposure(LedController::LedColor color, LedController::LedColor nextColor, const std::function<bool()>& retrieve)
+{
+    double* stepMs = current.stepMs[color];
+    auto stepStart = std::chrono::steady_clock::now();
+
+    if (led != nullptr)
+    {
+        if (!waitForColor(color))
+        {
+            return false;
+        }
+        stepMs[STEP_LED_WAIT] += millisecondsSince(stepStart);
+
+        if (triggered)
+        {
+            stepStart = std::chrono::steady_clock::now();
+            if (!source->triggerExposure())
+            {
+                return false;
+            }
+            // The light has to stay on this colour until the sensor has finished. The frame
+            // cannot arrive before that anyway, so sleeping here costs nothing.
+            std::this_thread::sleep_until(stepStart + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                std::chrono::duration<double, std::milli>(exposureMs + EXPOSURE_END_MARGIN_MS)));
+            stepMs[STEP_EXPOSURE] += millisecondsSince(stepStart);
+
+            if (overlap && nextColor != color)
+            {
+                requestColor(nextColor); // Runs while this exposure is read out
+            }
+        }
+    }
+
+    stepStart = std::chrono::steady_clock::now();
+    bool retrieved = retrieve();
+    stepMs[STEP_RETRIEVE] += millisecondsSince(stepStart);
+    return retrieved;
+}
+
+CaptureSequencer::FrameTiming CaptureSequencer::endFrame(int imageId)
+{
+    current.totalMs = millisecondsSince(frameStart);
+
+    frames++;
+    totalFrameMs += current.totalMs;
+    maxFrameMs = std::max(maxFrameMs, current.totalMs);
+    std::cout << std::fixed << std::setprecision(1) << "Frame " << imageId << " timing:";
+    for (int step = 0; step < STEP_COUNT; step++)
+    {
+        double stepTotal = 0.0;
+        for (int color = 0; color < COLOR_COUNT; color++)
+        {
+            stepTotal += current.stepMs[color][step];
+            maxStepMs[step] = std::max(maxStepMs[step], current.stepMs[color][step]);
+        }
+        totalStepMs[step] += stepTotal;
+        std::cout << " " << STEP_NAMES[step] << " " << stepTotal << " ms,";
+        // Without an LED only the retrieve step is timed
+        if (metrics != nullptr && (led != nullptr || step == STEP_RETRIEVE))
+        {
+            metrics->record(STEP_METRICS[step], stepTotal);
+        }
+    }
+    std::cout << " total " << current.totalMs << " ms" << std::defaultfloat << std::endl;
+    if (metrics != nullptr)
+    {
+        metrics->record("capture", current.totalMs);
+    }
+    return current;
+}
+
+/*
+* Mean time per frame in each step, and its share of the frame time. Whatever is left
+* over went to work outside the sequencer, e.g. the queue push.
+*/
+void CaptureSequencer::printStats()
+{
+    if (frames == 0)
+    {
+        return;
+    }
+    double meanFrameMs = totalFrameMs / frames;
+    std::cout << std::fixed << std::setprecision(2) << "Capture timing over " << frames << " frame(s), mean " << meanFrameMs
+        << " ms per frame (max " << maxFrameMs << " ms):" << std::endl;
+    for (int step = 0; step < STEP_COUNT; step++)
+    {
+        double meanMs = totalStepMs[step] / frames;
+        std::cout << "  " << std::setw(9) << std::left << STEP_NAMES[step] << std::right << meanMs << " ms/frame ("
+            << (meanFrameMs > 0.0 ? 100.0 * meanMs / meanFrameMs : 0.0) << "%), longest single step " << maxStepMs[step] << " ms" << std::endl;
+    }
+    std::cout << std::defaultfloat;
+}
+
+CaptureSequencer::~CaptureSequencer()
+{
+    if (pendingSwitch.valid())
+    {
+        pendingSwitch.wait(); // The background switch still uses the LED controller
+    }
+}
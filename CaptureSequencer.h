@@ -0,0 +1,90 @@
+/*
+*   CaptureSequencer.h
+*	Film Scanner Master PC Control Software by Kyle Mikolajczyk
+*   kyle@kylem.org
+*/
+
+#pragma once
+
+#include <OpenImageIO/imagebuf.h>
+#include <chrono>
+#include <functional>
+#include <future>
+#include "FrameSource.h"
+#include "LedController.h"
+
+class PipelineMetrics;
+
+/*
+* Runs the red, green, blue exposures of a frame against the LED. The only hard rule is
+* that the light shows the right colour for the whole exposure, so as soon as an
+* exposure has ended the switch to the next colour (command and READY_* acknowledgement)
+* is started in the background, and runs while the exposure is read out of the camera
+* and converted. The next exposure then only waits for whatever is left of the switch.
+*
+* Overlapping needs the camera on a software trigger, otherwise it free-runs and we
+* cannot say when an exposure ended. Without a trigger (or with overlap turned off) each
+* colour is set and acknowledged before its exposure is grabbed, one after the other.
+* Without an LED controller only the retrieve step is timed, like before.
+*/
+class CaptureSequencer
+{
+	public:
+		enum Step { STEP_LED_WAIT, STEP_EXPOSURE, STEP_RETRIEVE, STEP_COUNT };
+		static const int COLOR_COUNT = 3;
+
+		// Where one frame's time went, per colour and step
+		struct FrameTiming
+		{
+			double stepMs[COLOR_COUNT][STEP_COUNT] = {};
+			double totalMs = 0.0;
+		};
+
+		CaptureSequencer(FrameSource* source, LedController* led, bool overlap);
+		~CaptureSequencer();
+
+		bool prepare(); // Before the source starts grabbing: puts it on the software trigger when there is an LED
+
+		// Exposure of the following captures, for brackets. Returns the time the camera took,
+		// 0 if the source cannot change it.
+		double setExposureTimeMs(double exposureMs);
+
+		void beginFrame();
+		// Make sure the LED shows color, expose, start switching to nextColor, then call
+		// retrieve to collect the exposure. Returns what retrieve returned, or null. With
+		// nextColor the same as color (the next exposure of a bracket) the LED is left alone,
+		// and the steps of every exposure of a colour add up in the frame's timing.
+		OIIO::ImageBuf* captureColor(LedController::LedColor color, LedController::LedColor nextColor, const std::function<OIIO::ImageBuf*()>& retrieve);
+		// The same for an exposure that is not turned into an image, e.g. one that only goes to the journal
+		bool captureExposure(LedController::LedColor color, LedController::LedColor nextColor, const std::function<bool()>& retrieve);
+		FrameTiming endFrame(int imageId); // Prints the frame's timing line
+
+		void printStats();
+		// Also record every frame's steps and total, as "led_wait", "exposure", "retrieve" and "capture"
+		void setMetrics(PipelineMetrics* newMetrics) { metrics = newMetrics; }
+
+	private:
+		FrameSource* source;
+		LedController* led;
+		bool overlap;
+		bool triggered;
+		double exposureMs;
+
+		std::future<bool> pendingSwitch; // Colour change running in the background
+		LedController::LedColor pendingColor;
+		bool colorShown; // The LED is known to show shownColor, no switch since
+		LedController::LedColor shownColor;
+
+		std::chrono::steady_clock::time_point frameStart;
+		FrameTiming current;
+
+		uint64_t frames;
+		double totalStepMs[STEP_COUNT];
+		double maxStepMs[STEP_COUNT];
+		double totalFrameMs;
+		double maxFrameMs;
+		PipelineMetrics* metrics;
+
+		void requestColor(LedController::LedColor color);
+		bool waitForColor(LedController::LedColor color);
+};
@@ -0,0 +1,135 @@
+/*
+*   CaptureSettings.h
+*	Film Scanner Master PC Control Software by Kyle Mikolajczyk
+*   kyle@kylem.org
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include "CaptureJournal.h"
+#include "ColorTransform.h"
+#include "CompressedTiffWriter.h"
+#include "FilmBaseEstimator.h"
+#include "FrameStabilizer.h"
+#include "RGBImageQueue.h"
+#include "SequenceWriter.h"
+
+/*
+* Knobs for how ImageCaptureController runs its pipeline. The defaults match the
+* original single worker behaviour.
+*/
+struct CaptureSettings
+{
+	// Worker threads merging and writing frames in parallel
+	int workerCount = 1;
+
+	// With several workers frames can finish out of order. When set, finished frames
+	// wait in a reorder stage and are written strictly in image ID order.
+	bool commitInOrder = false;
+
+	// Frames allowed to wait for a worker, 0 for no limit. Caps memory on long reels.
+	size_t queueCapacity = 0;
+	// When the queue is full either hold up the capture thread or drop the frame and report it
+	QueueFullPolicy queueFullPolicy = QUEUE_BLOCK_WHEN_FULL;
+	// Lock free single producer/single consumer ring instead of the mutex queue. Only
+	// used with one worker; a queueCapacity of 0 gets a ring of 8.
+	bool useLockFreeQueue = false;
+
+	// Ask the camera for packed Mono12p when it has it. A quarter less data over USB per
+	// exposure, unpacked on the capture thread. Falls back to Mono12 otherwise.
+	bool usePackedPixels = true;
+
+	// With an LED controller and a software triggered camera, switch to the next colour
+	// while the last exposure is still being read out instead of after it
+	bool overlapLedSwitching = true;
+
+	// Extra threads splitting each frame into strips for calibration and merging, shared
+	// by all workers. 0 has every worker process its frames on its own.
+	int processingThreads = 0;
+
+	// Measure how far red and blue moved against green in every frame and shift them
+	// back before merging. The offsets are logged to a CSV next to the images.
+	bool registerChannels = false;
+
+	// Find the sprocket holes in every frame's green exposure and measure how far the frame
+	// sits from the first one. Logged to a CSV next to the images, and with
+	// STABILIZE_TRANSLATE also taken out while merging.
+	StabilizationMode stabilization = STABILIZE_OFF;
+	PerforationEdge perforationEdge = PERFORATION_LEFT;
+
+	// Exposures per colour. Above 1 every colour is shot as a bracket, hdrStops apart
+	// starting at the camera's exposure time, and fused into one float channel while
+	// the next exposure is being taken. Registration and stabilization are off then.
+	int hdrExposures = 1;
+	double hdrStops = 2.0;
+	// Fused frames are written as half floats, or full floats if this is off
+	bool hdrHalfFloat = true;
+
+	// Append every raw exposure to a journal of large preallocated segment files as it
+	// comes off the camera, with aligned unbuffered writes. JOURNAL_ONLY does nothing
+	// else, so a reel scans as fast as the transport and the disk allow and is processed
+	// from the journal afterwards. JOURNAL_AND_PROCESS also processes as before, and a
+	// frame dropped by a full queue is still in the journal.
+	JournalMode journalMode = JOURNAL_OFF;
+	std::string journalDirectory; // Empty for the output directory
+	uint64_t journalSegmentBytes = 4ull << 30;
+	// Exposures copied and waiting for the disk before the capture thread is held up
+	size_t journalInFlight = 4;
+
+	// Keep image<captureId>_session.csv next to the images, recording every frame as it
+	// is captured and written, so a scan that crashed can resume at the first frame that
+	// is not on disk (see SessionManifest). Frames only journaled count as not written.
+	// The journal of a session carries on after the one the crashed run left.
+	bool sessionManifest = false;
+
+	// Colour stage run on every 16 bit frame while it is merged: orange mask removal,
+	// negative inversion, curves and a 3D LUT (see ColorTransform). Off by default.
+	ColorSettings color;
+	// Estimate the film base from a region of every 16 bit frame as it is merged and hand
+	// it to the colour stage (see FilmBaseEstimator). Each frame's reading and the
+	// estimate are logged to image<captureId>_filmbase.csv.
+	FilmBaseSettings filmBaseEstimation;
+
+	// Make an 8 bit sRGB preview at 1/previewScale of the frame while merging (see
+	// FramePreview), 0 for none. It is written next to the frame as
+	// image<captureId>_<imageId>_proxy<previewExtension> and published to the shared
+	// memory ring previewRingName for a viewer (see PreviewRing), either can be turned
+	// off with previewFiles false or an empty ring name.
+	int previewScale = 0;
+	bool previewFiles = true;
+	std::string previewExtension = ".jpg";
+	std::string previewRingName = "FilmScannerPreview";
+	size_t previewRingSlots = 4;
+
+	// Threads encoding and writing finished frames behind the merge workers. 0 keeps
+	// the original behaviour of each worker writing its own frame before taking the next.
+	int writerThreads = 0;
+	// Frames allowed to wait for a writer before the merge workers are held up
+	size_t maxInFlightWrites = 2;
+	// Encode in memory and write with unbuffered I/O, so a long reel does not flush
+	// everything else out of the OS page cache
+	bool bypassPageCache = false;
+	// File format of the frames. DPX (16 bit frames) and EXR (16 bit or half float
+	// frames) are written by SequenceWriter straight from the frame buffer in large
+	// aligned writes, anything else through OIIO. DPX is marked as printing density when
+	// the colour stage inverts, linear otherwise.
+	OutputFormat outputFormat = OUTPUT_TIFF;
+	// Compress TIFF frames losslessly (see CompressedTiffWriter), for when the disk is
+	// what holds a scan up and there are cores to spare. The strips of each frame are
+	// compressed on compressionThreads threads besides the writer thread. Level 0 is the
+	// codec's default. The predictor makes 16 bit frames compress a lot better for little
+	// time.
+	OutputCompression outputCompression = COMPRESS_NONE;
+	int compressionLevel = 0;
+	bool compressionPredictor = true;
+	int compressionThreads = 0;
+
+	// Every stage's latency histogram and the queue and memory gauges (see PipelineMetrics)
+	// are written to <metricsPath>.json and <metricsPath>.prom every metricsIntervalSeconds
+	// while scanning. Empty for only the summary printed at the end.
+	std::string metricsPath;
+	double metricsIntervalSeconds = 5.0;
+};
@@ -0,0 +1,322 @@
+/*
+*   ChannelRegistration.cpp
+*	Film Scanner Master PC Control Software by Kyle Mikolajczyk
+*	kyle@kylem.org
+*/
+
+// Windows whose correlation peak is lower than this had too little detail to trust
+#define REGISTRATION_MIN_CONFIDENCE 0.05f
+// Windows further than this (in pixels) from the median are left out of the result
+#define REGISTRATION_MAX_DISAGREEMENT 1.0f
+
+#include "ChannelRegistration.h"
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include "StripThreadPool.h"
+
+static const double PI = 3.14159265358979323846;
+
+ChannelRegistration::ChannelRegistration(int windowSize, int downsample, int windowsAcross, int windowsDown)
+    : windowSize(windowSize), downsample(std::max(1, downsample)), windowsAcross(std::max(1, windowsAcross)), windowsDown(std::max(1, windowsDown))
+{
+    if (windowSize < 8 || (windowSize & (windowSize - 1)) != 0)
+    {
+        std::cerr << "Error: Registration window size " << windowSize << " is not a power of 2, using 128." << std::endl;
+        this->windowSize = windowSize = 128;
+    }
+
+    taper.resize(windowSize);
+    for (int i = 0; i < windowSize; i++)
+    {
+        taper[i] = (float)(0.5 - 0.5 * std::cos(2.0 * PI * i / (windowSize - 1)));
+    }
+    twiddles.resize(windowSize / 2);
+    for (int k = 0; k < windowSize / 2; k++)
+    {
+        twiddles[k] = Complex((float)std::cos(-2.0 * PI * k / windowSize), (float)std::sin(-2.0 * PI * k / windowSize));
+    }
+    // Gaussian weighting of the cross power spectrum, see correlate()
+    double sigma = windowSize / 8.0;
+    spectrumWeights.resize((size_t)windowSize * windowSize);
+    spectrumWeightTotal = 0.0;
+    for (int y = 0; y < windowSize; y++)
+    {
+        int fy = y <= windowSize / 2 ? y : y - windowSize;
+        for (int x = 0; x < windowSize; x++)
+        {
+            int fx = x <= windowSize / 2 ? x : x - windowSize;
+            float weight = (float)std::exp(-(fx * fx + fy * fy) / (2.0 * sigma * sigma));
+            spectrumWeights[(size_t)y * windowSize + x] = weight;
+            spectrumWeightTotal += weight;
+        }
+    }
+
+    int bits = 0;
+    while ((1 << bits) < windowSize)
+    {
+        bits++;
+    }
+    bitReversed.resize(windowSize);
+    for (int i = 0; i < windowSize; i++)
+    {
+        int reversed = 0;
+        for (int b = 0; b < bits; b++)
+        {
+            reversed |= ((i >> b) & 1) << (bits - 1 - b);
+        }
+        bitReversed[i] = reversed;
+    }
+}
+
+/*
+* In place radix 2 FFT of one row, not normalised
+*/
+void ChannelRegistration::fft(Complex* data, bool inverse) const
+{
+    int n = windowSize;
+    for (int i = 0; i < n; i++)
+    {
+        if (i < bitReversed[i])
+        {
+            std::swap(data[i], data[bitReversed[i]]);
+        }
+    }
+    for (int length = 2; length <= n; length <<= 1)
+    {
+        int half = length / 2;
+        int step = n / length;
+        for (int start = 0; start < n; start += length)
+        {
+            for (int k = 0; k < half; k++)
+            {
+                // Multiplied out by hand, std::complex checks for infinities on every product
+                float wr = twiddles[k * step].real();
+                float wi = inverse ? -twiddles[k * step].imag() : twiddles[k * step].imag();
+                Complex& even = data[start + k];
+                Complex& odd = data[start + k + half];
+                float oddReal = odd.real() * wr - odd.imag() * wi;
+                float oddImag = odd.real() * wi + odd.imag() * wr;
+                odd = Complex(even.real() - oddReal, even.imag() - oddImag);
+                even = Complex(even.real() + oddReal, even.imag() + oddImag);
+            }
+        }
+    }
+}
+
+/*
+* Rows, then columns through a scratch column so the column FFT runs on contiguous data
+*/
+void ChannelRegistration::fft2d(std::vector<Complex>& data, bool inverse, std::vector<Complex>& column) const
+{
+    int n = windowSize;
+    for (int y = 0; y < n; y++)
+    {
+        fft(&data[(size_t)y * n], inverse);
+    }
+    column.resize(n);
+    for (int x = 0; x < n; x++)
+    {
+        for (int y = 0; y < n; y++)
+        {
+            column[y] = data[(size_t)y * n + x];
+        }
+        fft(column.data(), inverse);
+        for (int y = 0; y < n; y++)
+        {
+            data[(size_t)y * n + x] = column[y];
+        }
+    }
+}
+
+/*
+* Box filter the window down, take out its mean level (so exposure differences between
+* the colours do not matter) and taper the edges
+*/
+void ChannelRegistration::loadWindow(const uint16_t* pixels, int imageWidth, int left, int top, std::vector<Complex>& window) const
+{
+    int n = windowSize;
+    window.resize((size_t)n * n);
+    double total = 0.0;
+    for (int y = 0; y < n; y++)
+    {
+        for (int x = 0; x < n; x++)
+        {
+            uint32_t sum = 0;
+            for (int sy = 0; sy < downsample; sy++)
+            {
+                const uint16_t* row = pixels + (size_t)(top + y * downsample + sy) * imageWidth + left + x * downsample;
+                for (int sx = 0; sx < downsample; sx++)
+                {
+                    sum += row[sx];
+                }
+            }
+            float value = (float)sum / (downsample * downsample);
+            window[(size_t)y * n + x] = Complex(value, 0.0f);
+            total += value;
+        }
+    }
+    float mean = (float)(total / ((double)n * n));
+    for (int y = 0; y < n; y++)
+    {
+        for (int x = 0; x < n; x++)
+        {
+            Complex& value = window[(size_t)y * n + x];
+            value = Complex((value.real() - mean) * taper[y] * taper[x], 0.0f);
+        }
+    }
+}
+
+/*
+* Normalised cross power spectrum of the two windows, so only the phase difference is
+* left, which transforms back into a single peak at the shift. The spectrum is weighted
+* with a gaussian first: that keeps grain noise at the highest frequencies out, and
+* makes the peak gaussian shaped, so a gaussian fit through the peak and its neighbours
+* finds the fraction of a pixel.
+*/
+ChannelShift ChannelRegistration::correlate(const std::vector<Complex>& reference, const std::vector<Complex>& moved, std::vector<Complex>& product, std::vector<Complex>& column) const
+{
+    int n = windowSize;
+    product.resize((size_t)n * n);
+    for (size_t i = 0; i < product.size(); i++)
+    {
+        float crossReal = moved[i].real() * reference[i].real() + moved[i].imag() * reference[i].imag();
+        float crossImag = moved[i].imag() * reference[i].real() - moved[i].real() * reference[i].imag();
+        float magnitude = std::sqrt(crossReal * crossReal + crossImag * crossImag);
+        float scale = magnitude > 1e-6f ? spectrumWeights[i] / magnitude : 0.0f;
+        product[i] = Complex(crossReal * scale, crossImag * scale);
+    }
+    fft2d(product, true, column);
+
+    size_t peak = 0;
+    for (size_t i = 1; i < product.size(); i++)
+    {
+        if (product[i].real() > product[peak].real())
+        {
+            peak = i;
+        }
+    }
+    int peakX = (int)(peak % n);
+    int peakY = (int)(peak / n);
+    auto at = [&](int x, int y) { return product[(size_t)((y + n) % n) * n + (x + n) % n].real(); };
+    auto refine = [](float before, float center, float after) {
+        if (before > 0.0f && center > 0.0f && after > 0.0f)
+        {
+            double a = std::log(before), b = std::log(center), c = std::log(after);
+            double curvature = a - 2.0 * b + c;
+            if (curvature < 0.0)
+            {
+                return (float)std::max(-0.5, std::min(0.5, (a - c) / (2.0 * curvature)));
+            }
+        }
+        double curvature = before - 2.0 * center + after; // Fall back to a parabola
+        return curvature < 0.0 ? (float)std::max(-0.5, std::min(0.5, (before - after) / (2.0 * curvature))) : 0.0f;
+    };
+    float center = product[peak].real();
+
+    ChannelShift shift;
+    float subX = refine(at(peakX - 1, peakY), center, at(peakX + 1, peakY));
+    float subY = refine(at(peakX, peakY - 1), center, at(peakX, peakY + 1));
+    shift.dx = ((peakX > n / 2 ? peakX - n : peakX) + subX) * downsample;
+    shift.dy = ((peakY > n / 2 ? peakY - n : peakY) + subY) * downsample;
+    shift.confidence = (float)(center / spectrumWeightTotal); // A perfect match puts all the weight in the peak
+    shift.windowsUsed = 1;
+    return shift;
+}
+
+/*
+* Median of the windows that found a clear peak, then the mean of the ones that agree
+* with it
+*/
+ChannelShift ChannelRegistration::estimateShift(const std::vector<ChannelShift>& windows)
+{
+    std::vector<float> xs, ys;
+    for (const ChannelShift& window : windows)
+    {
+        if (window.confidence >= REGISTRATION_MIN_CONFIDENCE)
+        {
+            xs.push_back(window.dx);
+            ys.push_back(window.dy);
+        }
+    }
+    ChannelShift result;
+    if (xs.empty())
+    {
+        return result;
+    }
+    std::nth_element(xs.begin(), xs.begin() + xs.size() / 2, xs.end());
+    std::nth_element(ys.begin(), ys.begin() + ys.size() / 2, ys.end());
+    float medianX = xs[xs.size() / 2];
+    float medianY = ys[ys.size() / 2];
+
+    double sumX = 0.0, sumY = 0.0, sumConfidence = 0.0;
+    for (const ChannelShift& window : windows)
+    {
+        if (window.confidence >= REGISTRATION_MIN_CONFIDENCE && std::fabs(window.dx - medianX) <= REGISTRATION_MAX_DISAGREEMENT &&
+            std::fabs(window.dy - medianY) <= REGISTRATION_MAX_DISAGREEMENT)
+        {
+            sumX += window.dx;
+            sumY += window.dy;
+            sumConfidence += window.confidence;
+            result.windowsUsed++;
+        }
+    }
+    if (result.windowsUsed == 0)
+    {
+        return ChannelShift(); // The medians of x and y came from windows that disagree with each other
+    }
+    result.dx = (float)(sumX / result.windowsUsed);
+    result.dy = (float)(sumY / result.windowsUsed);
+    result.confidence = (float)(sumConfidence / result.windowsUsed);
+    return result;
+}
+
+ChannelOffsets ChannelRegistration::measure(OIIO::ImageBuf* red, OIIO::ImageBuf* green, OIIO::ImageBuf* blue, StripThreadPool* pool) const
+{
+    ChannelOffsets offsets;
+    int width = green->spec().width;
+    int height = green->spec().height;
+    int span = windowSize * downsample;
+    if (width < span || height < span)
+    {
+        return offsets; // Too small to measure, merged as it is
+    }
+    const uint16_t* redPixels = (const uint16_t*)red->localpixels();
+    const uint16_t* greenPixels = (const uint16_t*)green->localpixels();
+    const uint16_t* bluePixels = (const uint16_t*)blue->localpixels();
+
+    size_t windowCount = (size_t)windowsAcross * windowsDown;
+    std::vector<ChannelShift> redWindows(windowCount), blueWindows(windowCount);
+    auto measureWindows = [&](size_t first, size_t end) {
+        thread_local std::vector<Complex> reference, moved, product, column;
+        for (size_t i = first; i < end; i++)
+        {
+            int across = (int)(i % windowsAcross);
+            int down = (int)(i / windowsAcross);
+            int left = (int)((long long)(width - span) * (2 * across + 1) / (2 * windowsAcross));
+            int top = (int)((long long)(height - span) * (2 * down + 1) / (2 * windowsDown));
+
+            loadWindow(greenPixels, width, left, top, reference);
+            fft2d(reference, false, column);
+            loadWindow(redPixels, width, left, top, moved);
+            fft2d(moved, false, column);
+            redWindows[i] = correlate(reference, moved, product, column);
+            loadWindow(bluePixels, width, left, top, moved);
+            fft2d(moved, false, column);
+            blueWindows[i] = correlate(reference, moved, product, column);
+        }
+    };
+    if (pool != nullptr)
+    {
+        pool->run(windowCount, 1, measureWindows);
+    }
+    else
+    {
+        measureWindows(0, windowCount);
+    }
+
+    offsets.red = estimateShift(redWindows);
+    offsets.blue = estimateShift(blueWindows);
+    offsets.measured = offsets.red.windowsUsed > 0 || offsets.blue.windowsUsed > 0;
+    return offsets;
+}
@@ -0,0 +1,73 @@
+/*
+*   ChannelRegistration.h
+*	Film Scanner Master PC Control Software by Kyle Mikolajczyk
+*   kyle@kylem.org
+*/
+
+#pragma once
+
+#include <OpenImageIO/imagebuf.h>
+#include <complex>
+#include <vector>
+
+class StripThreadPool;
+
+// How far a colour exposure sits from the green one, in pixels. A feature at (x, y) in
+// green is found at (x + dx, y + dy) in the other colour.
+struct ChannelShift
+{
+	float dx = 0.0f;
+	float dy = 0.0f;
+	float confidence = 0.0f; // Height of the correlation peak, 0 (no match) to 1 (identical)
+	int windowsUsed = 0; // Windows that agreed, 0 means nothing could be measured and the shift is 0
+};
+
+struct ChannelOffsets
+{
+	bool measured = false;
+	ChannelShift red;
+	ChannelShift blue;
+};
+
+/*
+* Measures how far the red and blue exposures of a frame have moved against green, so
+* the merge can shift them back before the colours are put together. Film vibration
+* or the frame creeping as the LED warms it shows up as colour fringes otherwise.
+*
+* The shift is found by phase correlation on a few windows spread over the frame. Each
+* window is box filtered down first, which makes the FFTs cheap and the estimate less
+* sensitive to grain, and the correlation peak is refined to a fraction of a pixel.
+* Windows without enough detail (clear film base, a black gap) are left out, and the
+* median of the rest is taken, so one window on a scratch does not throw the frame off.
+*/
+class ChannelRegistration
+{
+	public:
+		// windowSize is the FFT size (a power of 2) after downsampling by downsample, so a
+		// window covers windowSize * downsample pixels of the frame. Shifts of up to a
+		// quarter of that are found reliably.
+		ChannelRegistration(int windowSize = 128, int downsample = 2, int windowsAcross = 3, int windowsDown = 3);
+
+		// The windows are spread over the strip pool when one is given
+		ChannelOffsets measure(OIIO::ImageBuf* red, OIIO::ImageBuf* green, OIIO::ImageBuf* blue, StripThreadPool* pool = nullptr) const;
+
+		static ChannelShift estimateShift(const std::vector<ChannelShift>& windows);
+
+	private:
+		typedef std::complex<float> Complex;
+
+		int windowSize;
+		int downsample;
+		int windowsAcross;
+		int windowsDown;
+		std::vector<float> taper; // Hann window, so the window edges do not correlate
+		std::vector<float> spectrumWeights;
+		double spectrumWeightTotal;
+		std::vector<Complex> twiddles;
+		std::vector<int> bitReversed;
+
+		void loadWindow(const uint16_t* pixels, int imageWidth, int left, int top, std::vector<Complex>& window) const;
+		void fft2d(std::vector<Complex>& data, bool inverse, std::vector<Complex>& column) const;
+		void fft(Complex* data, bool inverse) const;
+		ChannelShift correlate(const std::vector<Complex>& reference, const std::vector<Complex>& moved, std::vector<Complex>& product, std::vector<Complex>& column) const;
+};
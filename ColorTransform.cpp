@@ -0,0 +1,276 @@
+/*
+*   ColorTransform.cpp
+*	Film Scanner Master PC Control Software by Kyle Mikolajczyk
+*	kyle@kylem.org
+*/
+
+#include "ColorTransform.h"
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include "PixelKernels.h"
+
+ColorTransform::ColorTransform() : active(false), lutSize(0)
+{
+}
+
+static uint16_t toLevel(double value)
+{
+    return (uint16_t)std::lround(std::min(1.0, std::max(0.0, value)) * 65535.0);
+}
+
+static double toDomain(double value, float domainMin, float domainMax)
+{
+    return domainMax > domainMin ? std::min(1.0, std::max(0.0, (value - domainMin) / (domainMax - domainMin))) : 0.0;
+}
+
+bool ColorTransform::build(const ColorSettings& newSettings)
+{
+    settings = newSettings;
+    active = false;
+    cube = Cube();
+    if (!settings.lutPath.empty() && !loadCube(settings.lutPath, cube))
+    {
+        return false;
+    }
+    buildTables();
+    return true;
+}
+
+/*
+* Only the curves change with the film base, the LUT file is not read again
+*/
+std::shared_ptr<ColorTransform> ColorTransform::withFilmBase(const double filmBase[3]) const
+{
+    std::shared_ptr<ColorTransform> transform = std::make_shared<ColorTransform>();
+    transform->settings = settings;
+    std::copy(filmBase, filmBase + 3, transform->settings.filmBase);
+    transform->cube = cube;
+    transform->buildTables();
+    return transform;
+}
+
+void ColorTransform::buildTables()
+{
+    lut.clear();
+    lutSize = 0;
+    const double densityRange = settings.densityRange > 0.0 ? settings.densityRange : 2.048;
+    const double darkest = std::pow(10.0, -densityRange);
+    curves.assign(3 * PixelKernels::CURVE_ENTRIES + PixelKernels::CURVE_PADDING, 0);
+    for (int channel = 0; channel < 3; channel++)
+    {
+        uint16_t* curve = &curves[channel * PixelKernels::CURVE_ENTRIES];
+        for (size_t level = 0; level < PixelKernels::CURVE_ENTRIES; level++)
+        {
+            double value = level / 65535.0;
+            if (settings.filmBase[channel] > 0.0)
+            {
+                value = std::min(1.0, level / settings.filmBase[channel]);
+            }
+            if (settings.invert)
+            {
+                value = -std::log10(std::max(value, darkest)) / densityRange;
+            }
+            if (settings.gamma > 0.0 && settings.gamma != 1.0)
+            {
+                value = std::pow(std::max(0.0, value), 1.0 / settings.gamma);
+            }
+            if (cube.size1d > 0)
+            {
+                double position = toDomain(value, cube.domainMin1d[channel], cube.domainMax1d[channel]) * (cube.size1d - 1);
+                int below = std::min((int)position, cube.size1d - 2);
+                double fraction = position - below;
+                value = cube.lut1d[below * 3 + channel] * (1.0 - fraction) + cube.lut1d[(below + 1) * 3 + channel] * fraction;
+            }
+            if (cube.size3d > 0)
+            {
+                value = toDomain(value, cube.domainMin3d[channel], cube.domainMax3d[channel]);
+            }
+            curve[level] = toLevel(value);
+        }
+    }
+
+    if (cube.size3d > 0)
+    {
+        lutSize = cube.size3d;
+        size_t entries = (size_t)lutSize * lutSize * lutSize;
+        lut.assign(entries * 4, 0);
+        for (size_t entry = 0; entry < entries; entry++)
+        {
+            for (int channel = 0; channel < 3; channel++)
+            {
+                lut[entry * 4 + channel] = toLevel(cube.lut3d[entry * 3 + channel]);
+            }
+        }
+    }
+    active = settings.isEnabled();
+}
+
+void ColorTransform::apply(const uint16_t* const source[3], uint16_t* const destination[3], size_t pixelCount) const
+{
+    PixelKernels::applyCurves3(source, destination, curves.data(), pixelCount);
+    if (lutSize > 0)
+    {
+        const uint16_t* curved[3] = { destination[0], destination[1], destination[2] };
+        PixelKernels::tetrahedral3(curved, destination, lut.data(), lutSize, pixelCount);
+    }
+}
+
+/*
+* Keywords we do not know (TITLE, LUT_IN_VIDEO_RANGE, ...) are skipped. Resolve writes
+* the input range of each table as LUT_1D_INPUT_RANGE and LUT_3D_INPUT_RANGE, Adobe one
+* DOMAIN_MIN and DOMAIN_MAX for whichever table there is. In a file with both tables the
+* 1D entries come first.
+*/
+bool ColorTransform::loadCube(const std::string& path, Cube& cube)
+{
+    std::ifstream file(path);
+    if (!file)
+    {
+        std::cerr << "Error: Could not open the LUT " << path << std::endl;
+        return false;
+    }
+    cube = Cube();
+    float domainMin[3] = { 0.0f, 0.0f, 0.0f };
+    float domainMax[3] = { 1.0f, 1.0f, 1.0f };
+    bool domainGiven = false, range1dGiven = false, range3dGiven = false;
+    std::vector<float> values;
+    std::string line;
+    int lineNumber = 0;
+    while (std::getline(file, line))
+    {
+        lineNumber++;
+        std::istringstream fields(line);
+        std::string keyword;
+        if (!(fields >> keyword) || keyword[0] == '#')
+        {
+            continue;
+        }
+        bool parsed = true;
+        if (keyword == "LUT_1D_SIZE")
+        {
+            parsed = (bool)(fields >> cube.size1d) && cube.size1d >= 2 && cube.size1d <= 65536;
+        }
+        else if (keyword == "LUT_3D_SIZE")
+        {
+            parsed = (bool)(fields >> cube.size3d) && cube.size3d >= PixelKernels::LUT_MIN_SIZE && cube.size3d <= PixelKernels::LUT_MAX_SIZE;
+        }
+        else if (keyword == "DOMAIN_MIN" || keyword == "DOMAIN_MAX")
+        {
+            float* domain = keyword == "DOMAIN_MIN" ? domainMin : domainMax;
+            parsed = (bool)(fields >> domain[0] >> domain[1] >> domain[2]);
+            domainGiven = true;
+        }
+        else if (keyword == "LUT_1D_INPUT_RANGE" || keyword == "LUT_3D_INPUT_RANGE")
+        {
+            bool is1d = keyword == "LUT_1D_INPUT_RANGE";
+            float low, high;
+            parsed = (bool)(fields >> low >> high);
+            for (int channel = 0; channel < 3 && parsed; channel++)
+            {
+                (is1d ? cube.domainMin1d : cube.domainMin3d)[channel] = low;
+                (is1d ? cube.domainMax1d : cube.domainMax3d)[channel] = high;
+            }
+            (is1d ? range1dGiven : range3dGiven) = true;
+        }
+        else if (std::isdigit((unsigned char)keyword[0]) || keyword[0] == '-' || keyword[0] == '.')
+        {
+            float entry[3];
+            std::istringstream numbers(line);
+            parsed = (bool)(numbers >> entry[0] >> entry[1] >> entry[2]);
+            values.insert(values.end(), entry, entry + 3);
+        }
+        if (!parsed)
+        {
+            std::cerr << "Error: Line " << lineNumber << " of the LUT " << path << " is not valid: " << line << std::endl;
+            return false;
+        }
+    }
+
+    size_t entries1d = (size_t)cube.size1d;
+    size_t entries3d = (size_t)cube.size3d * cube.size3d * cube.size3d;
+    if ((entries1d == 0 && entries3d == 0) || values.size() != (entries1d + entries3d) * 3)
+    {
+        std::cerr << "Error: The LUT " << path << " has " << values.size() / 3 << " entries, expected " << entries1d + entries3d << std::endl;
+        return false;
+    }
+    cube.lut1d.assign(values.begin(), values.begin() + entries1d * 3);
+    cube.lut3d.assign(values.begin() + entries1d * 3, values.end());
+    for (int channel = 0; channel < 3 && domainGiven; channel++)
+    {
+        if (!range1dGiven)
+        {
+            cube.domainMin1d[channel] = domainMin[channel];
+            cube.domainMax1d[channel] = domainMax[channel];
+        }
+        if (!range3dGiven)
+        {
+            cube.domainMin3d[channel] = domainMin[channel];
+            cube.domainMax3d[channel] = domainMax[channel];
+        }
+    }
+    return true;
+}
+
+/*
+* Written the way Resolve writes a file with both tables
+*/
+bool ColorTransform::saveCube(const std::string& path, const Cube& cube)
+{
+    std::ofstream file(path, std::ios::trunc);
+    file << std::setprecision(7);
+    file << "# Film Scanner LUT" << std::endl;
+    if (cube.size1d > 0)
+    {
+        file << "LUT_1D_SIZE " << cube.size1d << std::endl;
+        file << "LUT_1D_INPUT_RANGE " << cube.domainMin1d[0] << " " << cube.domainMax1d[0] << std::endl;
+    }
+    if (cube.size3d > 0)
+    {
+        file << "LUT_3D_SIZE " << cube.size3d << std::endl;
+        file << "LUT_3D_INPUT_RANGE " << cube.domainMin3d[0] << " " << cube.domainMax3d[0] << std::endl;
+    }
+    for (const std::vector<float>* table : { &cube.lut1d, &cube.lut3d })
+    {
+        for (size_t i = 0; i + 2 < table->size(); i += 3)
+        {
+            file << (*table)[i] << " " << (*table)[i + 1] << " " << (*table)[i + 2] << "\n";
+        }
+    }
+    if (!file)
+    {
+        std::cerr << "Error: Could not write the LUT " << path << std::endl;
+        return false;
+    }
+    return true;
+}
+
+void ColorTransform::printSummary() const
+{
+    std::cout << "Colour stage:";
+    if (settings.filmBase[0] > 0.0 || settings.filmBase[1] > 0.0 || settings.filmBase[2] > 0.0)
+    {
+        std::cout << " film base " << settings.filmBase[0] << " " << settings.filmBase[1] << " " << settings.filmBase[2] << " removed,";
+    }
+    if (settings.invert)
+    {
+        std::cout << " negative inverted over " << settings.densityRange << " D,";
+    }
+    if (settings.gamma != 1.0)
+    {
+        std::cout << " gamma " << settings.gamma << ",";
+    }
+    if (!settings.lutPath.empty())
+    {
+        std::cout << " LUT " << settings.lutPath;
+        if (lutSize > 0)
+        {
+            std::cout << " (" << lutSize << "^3)";
+        }
+        std::cout << ",";
+    }
+    std::cout << " " << PixelKernels::CURVE_ENTRIES << " entry curves" << std::endl;
+}
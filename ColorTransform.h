@@ -0,0 +1,93 @@
+/*
+*   ColorTransform.h
+*	Film Scanner Master PC Control Software by Kyle Mikolajczyk
+*   kyle@kylem.org
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+/*
+* What the colour stage does to a merged frame, see ColorTransform
+*/
+struct ColorSettings
+{
+	// Colour negative: the frame comes out as a positive in printing density,
+	// densityRange above the film base mapping to white, like a Cineon log scan. That is
+	// what film print emulation LUTs expect, or use gamma for a quick look.
+	bool invert = false;
+	double densityRange = 2.048;
+	// The film base (the orange mask) as measured on unexposed film between frames, in
+	// 16 bit levels per colour. Every channel is divided by it so the base comes out
+	// neutral, 0 for no mask removal.
+	double filmBase[3] = { 0.0, 0.0, 0.0 };
+	// Output curve, out = in^(1/gamma)
+	double gamma = 1.0;
+	// An Adobe/Resolve .cube file, with a 1D LUT (applied per channel after the above),
+	// a 3D LUT, or both
+	std::string lutPath;
+
+	bool isEnabled() const { return invert || filmBase[0] > 0.0 || filmBase[1] > 0.0 || filmBase[2] > 0.0 || gamma != 1.0 || !lutPath.empty(); }
+};
+
+/*
+* The colour stage of the merge, run strip by strip after calibration and
+* registration while the strip is still in cache. Everything per channel (mask
+* removal, inversion, gamma, a 1D LUT and the input domain of the 3D LUT) is folded into
+* one table of 65536 entries per channel when the transform is built, so a frame only
+* pays for one lookup per value plus the 3D LUT if there is one (PixelKernels::
+* applyCurves3 and tetrahedral3). 16 bit frames only: fused HDR brackets stay scene
+* linear.
+*/
+class ColorTransform
+{
+	public:
+		ColorTransform();
+
+		bool build(const ColorSettings& settings); // False if the LUT file could not be read
+		bool isActive() const { return active; }
+		// The same transform for another film base, e.g. from a FilmBaseEstimator
+		std::shared_ptr<ColorTransform> withFilmBase(const double filmBase[3]) const;
+		const ColorSettings& getSettings() const { return settings; }
+
+		// Transform pixelCount pixels of the three planes. A destination plane may be its
+		// own source plane.
+		void apply(const uint16_t* const source[3], uint16_t* const destination[3], size_t pixelCount) const;
+
+		const uint16_t* getCurves() const { return curves.data(); }
+		int getLutSize() const { return lutSize; } // 0 without a 3D LUT
+		const uint16_t* getLut() const { return lut.data(); }
+
+		// The tables of a .cube file, red, green, blue per entry with red changing fastest.
+		// Either may be empty. An input at domainMin of a table is its first entry and one at
+		// domainMax its last.
+		struct Cube
+		{
+			int size1d = 0;
+			std::vector<float> lut1d;
+			float domainMin1d[3] = { 0.0f, 0.0f, 0.0f };
+			float domainMax1d[3] = { 1.0f, 1.0f, 1.0f };
+			int size3d = 0;
+			std::vector<float> lut3d;
+			float domainMin3d[3] = { 0.0f, 0.0f, 0.0f };
+			float domainMax3d[3] = { 1.0f, 1.0f, 1.0f };
+		};
+		static bool loadCube(const std::string& path, Cube& cube);
+		static bool saveCube(const std::string& path, const Cube& cube);
+
+		void printSummary() const;
+
+	private:
+		ColorSettings settings;
+		Cube cube; // As loaded, for withFilmBase
+		bool active;
+		std::vector<uint16_t> curves; // PixelKernels::CURVE_ENTRIES per channel plus padding
+		std::vector<uint16_t> lut; // 16 bit red, green, blue and one unused value per entry
+		int lutSize;
+
+		void buildTables();
+};
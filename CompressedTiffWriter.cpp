@@ -0,0 +1,424 @@
+/*
+*   CompressedTiffWriter.cpp
+*	Film Scanner Master PC Control Software by Kyle Mikolajczyk
+*	kyle@kylem.org
+*/
+
+#include "CompressedTiffWriter.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <utility>
+#include <zlib.h>
+#ifdef SCANNER_HAVE_ZSTD
+#include <zstd.h>
+#endif
+#include "DirectFile.h"
+#include "PixelKernels.h"
+#include "StripThreadPool.h"
+
+CompressedTiffWriter::CompressedTiffWriter(OutputCompression compression, int level, bool predictor, StripThreadPool* pool, bool bypassCache)
+    : compression(compression), level(level), predictor(predictor), pool(pool), bypassCache(bypassCache), compressMs(0.0), writeMs(0.0), rawBytes(0)
+{
+}
+
+bool CompressedTiffWriter::parseCompression(const std::string& name, OutputCompression& compression)
+{
+    for (OutputCompression known : { COMPRESS_NONE, COMPRESS_LZW, COMPRESS_DEFLATE, COMPRESS_ZSTD })
+    {
+        if (name == getName(known))
+        {
+            compression = known;
+            return true;
+        }
+    }
+    return false;
+}
+
+const char* CompressedTiffWriter::getName(OutputCompression compression)
+{
+    switch (compression)
+    {
+    case COMPRESS_LZW: return "lzw";
+    case COMPRESS_DEFLATE: return "deflate";
+    case COMPRESS_ZSTD: return "zstd";
+    default: return "none";
+    }
+}
+
+bool CompressedTiffWriter::isAvailable(OutputCompression compression)
+{
+#ifdef SCANNER_HAVE_ZSTD
+    return true;
+#else
+    return compression != COMPRESS_ZSTD;
+#endif
+}
+
+bool CompressedTiffWriter::isNative(const OIIO::ImageSpec& spec)
+{
+    return spec.nchannels == 3 && (spec.format == OIIO::TypeDesc::UINT16 || spec.format == OIIO::TypeDesc::HALF);
+}
+
+/*
+* The variant of LZW in the TIFF 6.0 specification, as libtiff writes it: codes of 9 to
+* 12 bits packed from the most significant bit, a clear code first and whenever the
+* table is full, and the code width going up one code early. The table is hashed on
+* (prefix code, next byte), and clearing it only moves to a new generation instead of
+* wiping it, since it is cleared every few KB.
+*/
+void CompressedTiffWriter::encodeLzw(const unsigned char* data, size_t bytes, std::vector<unsigned char>& encoded)
+{
+    const int CLEAR = 256, END = 257, FIRST = 258, FULL = 4094;
+    const size_t TABLE_SIZE = 1 << 13;
+    thread_local std::vector<uint32_t> keys(TABLE_SIZE), generations(TABLE_SIZE, 0);
+    thread_local std::vector<uint16_t> codes(TABLE_SIZE);
+    thread_local uint32_t generation = 0;
+
+    encoded.clear();
+    encoded.reserve(bytes + bytes / 2 + 16);
+    uint32_t bitBuffer = 0;
+    int bitCount = 0;
+    int width = 9;
+    auto put = [&](int code)
+    {
+        bitBuffer = bitBuffer << width | (uint32_t)code;
+        bitCount += width;
+        while (bitCount >= 8)
+        {
+            bitCount -= 8;
+            encoded.push_back((unsigned char)(bitBuffer >> bitCount));
+        }
+    };
+
+    put(CLEAR);
+    generation++;
+    int nextCode = FIRST;
+    int prefix = -1;
+    for (size_t i = 0; i < bytes; i++)
+    {
+        if (prefix < 0)
+        {
+            prefix = data[i];
+            continue;
+        }
+        uint32_t key = (uint32_t)prefix << 8 | data[i];
+        size_t slot = (key * 2654435761u >> 19) & (TABLE_SIZE - 1);
+        while (generations[slot] == generation && keys[slot] != key)
+        {
+            slot = (slot + 1) & (TABLE_SIZE - 1);
+        }
+        if (generations[slot] == generation)
+        {
+            prefix = codes[slot];
+            continue;
+        }
+
+        put(prefix);
+        keys[slot] = key;
+        codes[slot] = (uint16_t)nextCode++;
+        generations[slot] = generation;
+        if (nextCode == FULL)
+        {
+            put(CLEAR);
+            generation++;
+            nextCode = FIRST;
+            width = 9;
+        }
+        else if (nextCode > (1 << width) - 1)
+        {
+            width++;
+        }
+        prefix = data[i];
+    }
+    if (prefix >= 0)
+    {
+        // The reader adds one more entry on this code, which can change the width of the end code
+        put(prefix);
+        nextCode++;
+        if (nextCode == FULL)
+        {
+            put(CLEAR);
+            width = 9;
+        }
+        else if (nextCode > (1 << width) - 1)
+        {
+            width++;
+        }
+    }
+    put(END);
+    if (bitCount > 0)
+    {
+        encoded.push_back((unsigned char)(bitBuffer << (8 - bitCount)));
+    }
+}
+
+bool CompressedTiffWriter::compressStrip(OutputCompression compression, int level, const unsigned char* data, size_t bytes, std::vector<unsigned char>& compressed)
+{
+    switch (compression)
+    {
+    case COMPRESS_NONE:
+        compressed.assign(data, data + bytes);
+        return true;
+    case COMPRESS_LZW:
+        encodeLzw(data, bytes, compressed);
+        return true;
+    case COMPRESS_DEFLATE:
+    {
+        uLongf length = compressBound((uLong)bytes);
+        compressed.resize(length);
+        if (compress2(compressed.data(), &length, data, (uLong)bytes, level > 0 ? std::min(level, 9) : 6) != Z_OK)
+        {
+            return false;
+        }
+        compressed.resize(length);
+        return true;
+    }
+#ifdef SCANNER_HAVE_ZSTD
+    case COMPRESS_ZSTD:
+    {
+        // A context per thread saves setting up its tables for every strip
+        thread_local std::unique_ptr<ZSTD_CCtx, size_t (*)(ZSTD_CCtx*)> context(ZSTD_createCCtx(), ZSTD_freeCCtx);
+        compressed.resize(ZSTD_compressBound(bytes));
+        size_t length = ZSTD_compressCCtx(context.get(), compressed.data(), compressed.size(), data, bytes, level > 0 ? level : 3);
+        if (ZSTD_isError(length))
+        {
+            return false;
+        }
+        compressed.resize(length);
+        return true;
+    }
+#endif
+    default:
+        return false;
+    }
+}
+
+namespace
+{
+    /*
+    * The image file directory, with the values that do not fit in an entry collected
+    * to go right behind it
+    */
+    class TiffDirectory
+    {
+        public:
+            static const uint16_t SHORT = 3;
+            static const uint16_t LONG = 4;
+
+            void add(uint16_t tag, uint16_t type, const std::vector<uint32_t>& values)
+            {
+                entries.push_back({ tag, type, values });
+            }
+
+            // The header, the directory and its values, for the strips to follow at
+            // getSize()
+            std::vector<unsigned char> build() const
+            {
+                std::vector<unsigned char> file;
+                const unsigned char header[8] = { 'I', 'I', 42, 0, 8, 0, 0, 0 };
+                file.insert(file.end(), header, header + 8);
+                put16(file, (uint16_t)entries.size());
+                size_t valuesOffset = 8 + 2 + entries.size() * 12 + 4;
+                std::vector<unsigned char> values;
+                for (const Entry& entry : entries)
+                {
+                    put16(file, entry.tag);
+                    put16(file, entry.type);
+                    put32(file, (uint32_t)entry.values.size());
+                    std::vector<unsigned char> packed;
+                    for (uint32_t value : entry.values)
+                    {
+                        entry.type == SHORT ? put16(packed, (uint16_t)value) : put32(packed, value);
+                    }
+                    if (packed.size() <= 4)
+                    {
+                        packed.resize(4, 0);
+                        file.insert(file.end(), packed.begin(), packed.end());
+                    }
+                    else
+                    {
+                        put32(file, (uint32_t)(valuesOffset + values.size()));
+                        values.insert(values.end(), packed.begin(), packed.end());
+                    }
+                }
+                put32(file, 0); // No next directory
+                file.insert(file.end(), values.begin(), values.end());
+                return file;
+            }
+
+            size_t getSize() const
+            {
+                size_t size = 8 + 2 + entries.size() * 12 + 4;
+                for (const Entry& entry : entries)
+                {
+                    size_t packed = entry.values.size() * (entry.type == SHORT ? 2 : 4);
+                    size += packed > 4 ? packed : 0;
+                }
+                return size;
+            }
+
+        private:
+            struct Entry
+            {
+                uint16_t tag;
+                uint16_t type;
+                std::vector<uint32_t> values;
+            };
+            std::vector<Entry> entries; // In ascending tag order, as the format wants
+
+            static void put16(std::vector<unsigned char>& file, uint16_t value)
+            {
+                file.push_back((unsigned char)value);
+                file.push_back((unsigned char)(value >> 8));
+            }
+
+            static void put32(std::vector<unsigned char>& file, uint32_t value)
+            {
+                put16(file, (uint16_t)value);
+                put16(file, (uint16_t)(value >> 16));
+            }
+    };
+}
+
+/*
+* Half floats go in without the predictor. Differences between the bit patterns of
+* floats are no smaller than the values, and readers only take the floating point
+* predictor for them.
+*/
+bool CompressedTiffWriter::write(const OIIO::ImageBuf* image, const std::string& filename, uint64_t& bytes)
+{
+    auto start = std::chrono::steady_clock::now();
+    compressMs = 0.0;
+    writeMs = 0.0;
+    bytes = 0;
+    const OIIO::ImageSpec& spec = image->spec();
+    rawBytes = spec.image_bytes();
+    if (!isNative(spec) || image->localpixels() == nullptr || !isAvailable(compression))
+    {
+        std::cerr << "Error: " << filename << " can not be compressed with " << getName(compression) << std::endl;
+        return false;
+    }
+
+    const bool isHalf = spec.format == OIIO::TypeDesc::HALF;
+    const bool differenced = predictor && !isHalf && compression != COMPRESS_NONE;
+    const size_t lineValues = (size_t)spec.width * 3;
+    const size_t lineBytes = lineValues * sizeof(uint16_t);
+    const size_t stripRows = std::max<size_t>(1, STRIP_BYTES / lineBytes);
+    const size_t stripCount = ((size_t)spec.height + stripRows - 1) / stripRows;
+    const unsigned char* pixels = (const unsigned char*)image->localpixels();
+    if (strips.size() < stripCount)
+    {
+        strips.resize(stripCount);
+    }
+
+    std::atomic<bool> compressed(true);
+    auto compressRows = [&](size_t firstRow, size_t endRow)
+    {
+        const unsigned char* data = pixels + firstRow * lineBytes;
+        size_t length = (endRow - firstRow) * lineBytes;
+        thread_local std::vector<uint16_t> differences;
+        if (differenced)
+        {
+            differences.resize((endRow - firstRow) * lineValues);
+            for (size_t row = firstRow; row < endRow; row++)
+            {
+                PixelKernels::horizontalDifference16((const uint16_t*)(pixels + row * lineBytes), &differences[(row - firstRow) * lineValues], lineValues, 3);
+            }
+            data = (const unsigned char*)differences.data();
+        }
+        if (!compressStrip(compression, level, data, length, strips[firstRow / stripRows]))
+        {
+            compressed = false;
+        }
+    };
+    if (compression == COMPRESS_NONE)
+    {
+        // Nothing to do, the strips are written straight from the frame
+    }
+    else if (pool != nullptr)
+    {
+        pool->run((size_t)spec.height, stripRows, compressRows);
+    }
+    else
+    {
+        for (size_t row = 0; row < (size_t)spec.height; row += stripRows)
+        {
+            compressRows(row, std::min(row + stripRows, (size_t)spec.height));
+        }
+    }
+    auto compressedAt = std::chrono::steady_clock::now();
+    compressMs = std::chrono::duration<double, std::milli>(compressedAt - start).count();
+    if (!compressed)
+    {
+        std::cerr << "Error: Could not compress " << filename << " with " << getName(compression) << std::endl;
+        return false;
+    }
+
+    stripData.resize(stripCount);
+    for (size_t strip = 0; strip < stripCount; strip++)
+    {
+        size_t rows = std::min(stripRows, (size_t)spec.height - strip * stripRows);
+        stripData[strip] = compression == COMPRESS_NONE ? std::make_pair(pixels + strip * stripRows * lineBytes, rows * lineBytes)
+            : std::make_pair((const unsigned char*)strips[strip].data(), strips[strip].size());
+    }
+
+    const uint32_t compressionCodes[] = { 1, 5, 8, 50000 };
+    stripOffsets.resize(stripCount);
+    stripCounts.resize(stripCount);
+    auto makeDirectory = [&]()
+    {
+        TiffDirectory directory;
+        directory.add(256, TiffDirectory::LONG, { (uint32_t)spec.width });
+        directory.add(257, TiffDirectory::LONG, { (uint32_t)spec.height });
+        directory.add(258, TiffDirectory::SHORT, { 16, 16, 16 });
+        directory.add(259, TiffDirectory::SHORT, { compressionCodes[compression] });
+        directory.add(262, TiffDirectory::SHORT, { 2 }); // RGB
+        directory.add(273, TiffDirectory::LONG, stripOffsets);
+        directory.add(277, TiffDirectory::SHORT, { 3 });
+        directory.add(278, TiffDirectory::LONG, { (uint32_t)stripRows });
+        directory.add(279, TiffDirectory::LONG, stripCounts);
+        directory.add(284, TiffDirectory::SHORT, { 1 }); // Interleaved
+        directory.add(317, TiffDirectory::SHORT, { differenced ? 2u : 1u });
+        const uint32_t sampleFormat = isHalf ? 3 : 1; // Float or unsigned
+        directory.add(339, TiffDirectory::SHORT, { sampleFormat, sampleFormat, sampleFormat });
+        return directory;
+    };
+    // The size of the directory does not depend on where the strips go
+    uint64_t offset = makeDirectory().getSize();
+    for (size_t strip = 0; strip < stripCount; strip++)
+    {
+        stripOffsets[strip] = (uint32_t)offset;
+        stripCounts[strip] = (uint32_t)stripData[strip].second;
+        offset += stripData[strip].second;
+    }
+    if (offset > UINT32_MAX)
+    {
+        std::cerr << "Error: " << filename << " would be over 4 GB, too big for a TIFF" << std::endl;
+        return false;
+    }
+    std::vector<unsigned char> header = makeDirectory().build();
+
+    DirectFile file;
+    if (!file.open(filename, bypassCache))
+    {
+        return false;
+    }
+    bool ok = file.write(header.data(), header.size());
+    for (size_t strip = 0; strip < stripCount && ok; strip++)
+    {
+        ok = file.write(stripData[strip].first, stripData[strip].second);
+    }
+    ok = file.close() && ok;
+    writeMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - compressedAt).count();
+    if (!ok)
+    {
+        std::cerr << "Error: Could not write " << filename << std::endl;
+        return false;
+    }
+    bytes = file.getSize();
+    return true;
+}
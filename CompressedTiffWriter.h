@@ -0,0 +1,85 @@
+/*
+*   CompressedTiffWriter.h
+*	Film Scanner Master PC Control Software by Kyle Mikolajczyk
+*   kyle@kylem.org
+*/
+
+#pragma once
+
+#include <OpenImageIO/imagebuf.h>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+class StripThreadPool;
+
+enum OutputCompression
+{
+	COMPRESS_NONE,
+	COMPRESS_LZW, // TIFF's own, every reader has it
+	COMPRESS_DEFLATE, // zlib ("Adobe Deflate"), smaller and about as widely read
+	COMPRESS_ZSTD // Zstandard, only when built with SCANNER_HAVE_ZSTD and read by libtiff 4.0.10 on
+};
+
+/*
+* Writes 16 bit or half float RGB frames as losslessly compressed TIFFs. The frame is
+* cut into strips of about STRIP_BYTES that are compressed independently, so a
+* StripThreadPool compresses them all at once, and each strip can go through TIFF's
+* horizontal predictor first (PixelKernels::horizontalDifference16), which turns the
+* slowly changing values of a scan into small differences that compress two to three
+* times better. The file is then put together from the compressed strips with
+* DirectFile: the header and the directory first, the strips after it in order.
+*
+* One per writer thread (FrameWriter keeps one per merge worker without writer threads),
+* it keeps the compressed strips and the strip table between frames. Several may share
+* one pool.
+*/
+class CompressedTiffWriter
+{
+	public:
+		static const size_t STRIP_BYTES = 1024 * 1024;
+
+		// level 0 takes the codec's default (6 for deflate, 3 for zstd), LZW has none.
+		// pool may be null to compress every strip on the calling thread.
+		CompressedTiffWriter(OutputCompression compression, int level, bool predictor, StripThreadPool* pool, bool bypassCache);
+
+		// "none", "lzw", "deflate" or "zstd", false for anything else
+		static bool parseCompression(const std::string& name, OutputCompression& compression);
+		static const char* getName(OutputCompression compression);
+		// zstd is only there when built with it
+		static bool isAvailable(OutputCompression compression);
+		// 3 channel UINT16 or HALF, anything else is for OIIO
+		static bool isNative(const OIIO::ImageSpec& spec);
+
+		// bytes is the size of the file
+		bool write(const OIIO::ImageBuf* image, const std::string& filename, uint64_t& bytes);
+
+		// Time the last write spent compressing and writing, and the size of its pixels
+		// before compression
+		double getCompressMs() const { return compressMs; }
+		double getWriteMs() const { return writeMs; }
+		uint64_t getRawBytes() const { return rawBytes; }
+
+		// One strip as it goes into the file, false if the codec failed
+		static bool compressStrip(OutputCompression compression, int level, const unsigned char* data, size_t bytes, std::vector<unsigned char>& compressed);
+
+	private:
+		OutputCompression compression;
+		int level;
+		bool predictor;
+		StripThreadPool* pool;
+		bool bypassCache;
+		std::vector<std::vector<unsigned char>> strips;
+		// Where each strip of the frame being written comes from, and where it goes in the file
+		std::vector<std::pair<const unsigned char*, size_t>> stripData;
+		std::vector<uint32_t> stripOffsets;
+		std::vector<uint32_t> stripCounts;
+
+		double compressMs;
+		double writeMs;
+		uint64_t rawBytes;
+
+		static void encodeLzw(const unsigned char* data, size_t bytes, std::vector<unsigned char>& encoded);
+};
@@ -0,0 +1,339 @@
+/*
+*   ContinuousTransport.cpp
+*	Film Scanner Master PC Control Software by Kyle Mikolajczyk
+*	kyle@kylem.org
+*/
+
+// The last part of a wait for a mark is spun rather than slept, sleeps overshoot by
+// about a millisecond (a whole timer tick on Windows)
+#define SPIN_MS 2.0
+// Polls that may fail in a row before the position counts as lost
+#define MAX_FAILED_POLLS 3
+// How long stop() waits for the drive to stand still
+#define STOP_TIMEOUT_MS 5000
+// Frames finished the write rate is measured over
+#define WRITE_RATE_FRAMES 6
+
+#include "ContinuousTransport.h"
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include "MDriveConn.h"
+
+static double secondsBetween(std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end)
+{
+    return std::chrono::duration<double>(end - start).count();
+}
+
+ContinuousTransport::ContinuousTransport(MDriveConn* drive, const ContinuousMotionSettings& settings)
+    : drive(drive), settings(settings), samples(0), velocity(0.0), commandedFps(0.0), captureSeconds(0.0), lost(false),
+    running(false), captured(0), finished(0), missed(0),
+    polls(0), totalPollMs(0.0), maxPollMs(0.0), speedChanges(0), missedAtLastControl(0), totalErrorSteps(0.0), maxErrorSteps(0.0)
+{
+}
+
+ContinuousTransport::~ContinuousTransport()
+{
+    stop();
+}
+
+bool ContinuousTransport::start()
+{
+    if (running)
+    {
+        return true;
+    }
+    // Where the film stands, so a frame already on its mark is taken straight away
+    int64_t position = 0;
+    std::chrono::steady_clock::time_point latchedAt;
+    if (!drive->readPosition(position, latchedAt))
+    {
+        std::cerr << "Error: Could not read the MDrive position." << std::endl;
+        return false;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        last.position = (double)position;
+        last.time = latchedAt;
+        samples = 1;
+        velocity = 0.0;
+        captureSeconds = 0.0;
+        lost = false;
+        finishTimes.clear();
+    }
+    if (!setSpeed(settings.startFps))
+    {
+        std::cerr << "Error: Could not start the MDrive slewing." << std::endl;
+        return false;
+    }
+    running = true;
+    pollThread = std::thread(&ContinuousTransport::pollLoop, this);
+    return true;
+}
+
+void ContinuousTransport::stop()
+{
+    if (!running)
+    {
+        return;
+    }
+    running = false;
+    sampled.notify_all();
+    if (pollThread.joinable())
+    {
+        pollThread.join();
+    }
+    if (!drive->slew(0))
+    {
+        std::cerr << "Error: Could not stop the MDrive." << std::endl;
+        return;
+    }
+    commandedFps = 0.0;
+
+    // Standing still once two positions a poll apart are the same
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(STOP_TIMEOUT_MS);
+    int64_t position = 0, lastPosition = 0;
+    bool first = true;
+    while (std::chrono::steady_clock::now() < deadline && drive->readPosition(position))
+    {
+        if (!first && position == lastPosition)
+        {
+            return;
+        }
+        first = false;
+        lastPosition = position;
+        std::this_thread::sleep_for(std::chrono::milliseconds(settings.pollIntervalMs));
+    }
+    std::cerr << "Error: The MDrive did not come to a stop." << std::endl;
+}
+
+/*
+* Poll the position, and every controlIntervalMs let the speed control have a look
+*/
+void ContinuousTransport::pollLoop()
+{
+    auto nextControl = std::chrono::steady_clock::now() + std::chrono::milliseconds(settings.controlIntervalMs);
+    int failedPolls = 0;
+    while (running)
+    {
+        auto pollStart = std::chrono::steady_clock::now();
+        int64_t position = 0;
+        std::chrono::steady_clock::time_point latchedAt;
+        bool ok = drive->readPosition(position, latchedAt);
+        double pollMs = secondsBetween(pollStart, std::chrono::steady_clock::now()) * 1000.0;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            failedPolls = ok ? 0 : failedPolls + 1;
+            lost = failedPolls >= MAX_FAILED_POLLS;
+            if (ok)
+            {
+                Sample sample;
+                sample.position = (double)position;
+                sample.time = latchedAt;
+                double dt = samples > 0 ? secondsBetween(last.time, sample.time) : 0.0;
+                if (dt > 0.0)
+                {
+                    // Smoothed, a millisecond off in one sample's time is several percent
+                    // of the velocity between two of them
+                    double measured = (sample.position - last.position) / dt;
+                    velocity = samples > 1 ? velocity + 0.4 * (measured - velocity) : measured;
+                }
+                last = sample;
+                samples++;
+                polls++;
+                totalPollMs += pollMs;
+                maxPollMs = std::max(maxPollMs, pollMs);
+            }
+        }
+        sampled.notify_all();
+        if (lost)
+        {
+            std::cerr << "Error: Lost the MDrive position after " << MAX_FAILED_POLLS << " failed polls." << std::endl;
+            return;
+        }
+
+        if (std::chrono::steady_clock::now() >= nextControl)
+        {
+            adjustSpeed();
+            nextControl += std::chrono::milliseconds(settings.controlIntervalMs);
+        }
+        std::this_thread::sleep_until(pollStart + std::chrono::milliseconds(settings.pollIntervalMs));
+    }
+}
+
+/*
+* Speed up while the backlog is under its target and slow down while it is over, in
+* proportion to how far off it is, but never faster than the captures can follow, and
+* back off after a missed frame
+*/
+void ContinuousTransport::adjustSpeed()
+{
+    double fps = commandedFps;
+    double backlog = (double)captured - (double)finished;
+    double seconds, writtenFps = 0.0;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        seconds = captureSeconds;
+        if (finishTimes.size() >= 3)
+        {
+            writtenFps = (finishTimes.size() - 1) / secondsBetween(finishTimes.front(), finishTimes.back());
+        }
+    }
+    // The write rate only holds the film back once the writer is behind. Until then, and
+    // until enough frames are written to say how fast, from the speed it has now.
+    double base = writtenFps > 0.0 && backlog >= settings.targetBacklog ? writtenFps : fps;
+    double next = base * (1.0 + settings.gain * (settings.targetBacklog - backlog) / (settings.targetBacklog + 1.0));
+    if (seconds > 0.0)
+    {
+        next = std::min(next, 0.9 / seconds);
+    }
+    if (missed > missedAtLastControl)
+    {
+        next = std::min(next, fps * 0.8);
+        missedAtLastControl = missed;
+    }
+    next = std::max(settings.minFps, std::min(settings.maxFps, next));
+    if (std::fabs(next - fps) > settings.minSpeedChange * fps)
+    {
+        setSpeed(next);
+    }
+}
+
+bool ContinuousTransport::setSpeed(double fps)
+{
+    if (!drive->slew(std::llround(fps * settings.stepsPerFrame)))
+    {
+        return false;
+    }
+    commandedFps = fps;
+    speedChanges++;
+    return true;
+}
+
+double ContinuousTransport::predict(std::chrono::steady_clock::time_point time)
+{
+    return last.position + velocity * secondsBetween(last.time, time);
+}
+
+bool ContinuousTransport::waitForFrame(int frame, double& errorSteps)
+{
+    double target = settings.firstFrameSteps + frame * settings.stepsPerFrame;
+    std::unique_lock<std::mutex> lock(mutex);
+    auto now = std::chrono::steady_clock::now();
+    if (captured > 0)
+    {
+        // Everything between the last mark and now went to capturing that frame
+        double seconds = secondsBetween(lastCapture, now);
+        captureSeconds = captureSeconds > 0.0 ? captureSeconds + 0.3 * (seconds - captureSeconds) : seconds;
+    }
+
+    for (;;)
+    {
+        if (!running || lost)
+        {
+            return false;
+        }
+        now = std::chrono::steady_clock::now();
+        double position = predict(now) + velocity * settings.triggerLeadMs / 1000.0;
+        if (position >= target)
+        {
+            errorSteps = position - target;
+            break;
+        }
+        if (velocity <= 0.0)
+        {
+            sampled.wait_for(lock, std::chrono::milliseconds(settings.pollIntervalMs * 2));
+            continue;
+        }
+        // Sleep to the mark as it is predicted now, or until the next sample moves it
+        double waitMs = (target - position) / velocity * 1000.0;
+        if (waitMs > settings.pollIntervalMs)
+        {
+            sampled.wait_for(lock, std::chrono::milliseconds(settings.pollIntervalMs));
+        }
+        else
+        {
+            lock.unlock();
+            if (waitMs > SPIN_MS)
+            {
+                std::this_thread::sleep_for(std::chrono::duration<double, std::milli>(waitMs - SPIN_MS));
+            }
+            else
+            {
+                std::this_thread::yield();
+            }
+            lock.lock();
+        }
+    }
+
+    lastCapture = now;
+    captured++;
+    if (errorSteps > settings.missTolerance)
+    {
+        missed++;
+    }
+    totalErrorSteps += errorSteps;
+    maxErrorSteps = std::max(maxErrorSteps, errorSteps);
+    return true;
+}
+
+int ContinuousTransport::run(int firstFrame, int frameCount, const std::function<bool(int frame)>& capture)
+{
+    int capturedFrames = 0;
+    for (int frame = firstFrame; frame < firstFrame + frameCount; frame++)
+    {
+        double errorSteps = 0.0;
+        if (!waitForFrame(frame, errorSteps))
+        {
+            std::cerr << "Error: Lost the film position before frame " << frame << ", stopping." << std::endl;
+            break;
+        }
+        if (errorSteps > settings.missTolerance)
+        {
+            std::cerr << "Frame " << frame << " was " << errorSteps << " steps past its mark when it was captured." << std::endl;
+        }
+        if (!capture(frame))
+        {
+            break;
+        }
+        capturedFrames++;
+    }
+    return capturedFrames;
+}
+
+void ContinuousTransport::frameFinished()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    finished++;
+    finishTimes.push_back(std::chrono::steady_clock::now());
+    if (finishTimes.size() > WRITE_RATE_FRAMES)
+    {
+        finishTimes.pop_front();
+    }
+}
+
+bool ContinuousTransport::getPosition(int64_t& position)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (samples == 0)
+    {
+        return false;
+    }
+    position = std::llround(predict(std::chrono::steady_clock::now()));
+    return true;
+}
+
+double ContinuousTransport::getSpeedFps()
+{
+    return commandedFps;
+}
+
+void ContinuousTransport::printStats()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    std::cout << std::fixed << std::setprecision(2) << "Continuous transport: " << captured << " frames, " << missed << " missed, trigger error mean "
+        << (captured > 0 ? totalErrorSteps / captured : 0.0) << " max " << maxErrorSteps << " steps, "
+        << speedChanges << " speed changes, now " << commandedFps.load() << " frames/s, position polls mean "
+        << (polls > 0 ? totalPollMs / polls : 0.0) << " ms max " << maxPollMs << " ms" << std::endl;
+}
@@ -0,0 +1,137 @@
+/*
+*   ContinuousTransport.h
+*	Film Scanner Master PC Control Software by Kyle Mikolajczyk
+*   kyle@kylem.org
+*/
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+class MDriveConn;
+
+/*
+* Where the frames are on the film and how fast the transport may run them past the
+* camera, see ContinuousTransport
+*/
+struct ContinuousMotionSettings
+{
+	// Microsteps from one frame to the next, and where frame 0 is after homing
+	double stepsPerFrame = 25600.0;
+	double firstFrameSteps = 0.0;
+	// Frames per second to start at, and the range the speed is kept in
+	double startFps = 1.0;
+	double minFps = 0.1;
+	double maxFps = 6.0;
+	// How often the position is asked for. Each poll is a round trip over the serial
+	// line, about 20 ms at 9600 baud.
+	int pollIntervalMs = 25;
+	// Fire this much before the frame is on its mark, for the time from the trigger to
+	// the middle of the exposure
+	double triggerLeadMs = 0.0;
+	// Frames captured but not written yet that the speed control aims for, how often it
+	// looks and how strongly it reacts
+	int targetBacklog = 2;
+	int controlIntervalMs = 250;
+	double gain = 0.25;
+	// Speed changes smaller than this (relative) are not sent, each one costs a round trip
+	double minSpeedChange = 0.02;
+	// A frame passed by more than this many steps before it was captured counts as missed
+	double missTolerance = 256.0;
+};
+
+/*
+* Scans on the fly: the MDrive slews at a constant speed and never stops, and every
+* frame is captured as it passes its mark instead of the transport stopping for it.
+*
+* A thread polls the drive's position and keeps the last sample, timed at when the drive
+* read it, so the position at any moment is predicted from it and the velocity the
+* samples show rather than from the commanded speed (the drive's clock and ramps do not
+* follow it exactly). MCode has no way to stream the position without a program running
+* on the drive, which would keep it from taking SL, so it is asked for. waitForFrame()
+* sleeps until the prediction says the frame is at its mark, less triggerLeadMs.
+*
+* The same thread runs the speed control. The film can only move as fast as the rest
+* of the scanner keeps up, so the speed follows the rate frames are written at, a little
+* faster while fewer than targetBacklog are captured but not written yet and slower
+* while more are (frameFinished() is meant for ImageCaptureController's frame finished
+* callback), and is capped by how long each capture takes. A frame that could not be
+* captured before it passed counts as missed and slows the transport down as well.
+*/
+class ContinuousTransport
+{
+	public:
+		ContinuousTransport(MDriveConn* drive, const ContinuousMotionSettings& settings = ContinuousMotionSettings());
+		~ContinuousTransport();
+
+		bool start(); // Start slewing at startFps, and polling
+		void stop(); // Stop the drive and wait for it to stand still
+
+		// Block until frame is on its mark. errorSteps is how far past the mark the film is
+		// predicted to be when it returns, more than missTolerance when the frame was missed.
+		// False if the position is lost or the transport is stopped.
+		bool waitForFrame(int frame, double& errorSteps);
+		// A captured frame is done with, written or not. Every captured frame has to be
+		// finished exactly once, including ones dropped, skipped or only journaled, or the
+		// backlog never shrinks and the transport slows down to a stop.
+		void frameFinished();
+
+		// Wait for each of frameCount frames from firstFrame in turn and capture it,
+		// between start() and stop(). Stops early when capture returns false.
+		int run(int firstFrame, int frameCount, const std::function<bool(int frame)>& capture);
+
+		// The position predicted for now, for ImageCaptureController's motor position source
+		bool getPosition(int64_t& position);
+		double getSpeedFps();
+		uint64_t getMissedFrames() { return missed; }
+		void printStats();
+
+	private:
+		// A position and when the drive had it
+		struct Sample
+		{
+			double position = 0.0;
+			std::chrono::steady_clock::time_point time;
+		};
+
+		MDriveConn* drive;
+		ContinuousMotionSettings settings;
+
+		std::mutex mutex;
+		std::condition_variable sampled;
+		Sample last;
+		int samples; // Since start(), the first taken standing
+		double velocity; // Steps/s, from the samples
+		std::atomic<double> commandedFps;
+		std::chrono::steady_clock::time_point lastCapture; // When the previous waitForFrame() returned
+		double captureSeconds; // Smoothed time from a frame's mark to asking for the next one
+		bool lost; // Polling failed
+		std::deque<std::chrono::steady_clock::time_point> finishTimes; // Of the last frames finished
+
+		std::atomic<bool> running;
+		std::atomic<uint64_t> captured;
+		std::atomic<uint64_t> finished;
+		std::atomic<uint64_t> missed;
+		std::thread pollThread;
+
+		// For printStats()
+		uint64_t polls;
+		double totalPollMs;
+		double maxPollMs;
+		std::atomic<uint64_t> speedChanges; // Also counted outside the mutex, by setSpeed()
+		uint64_t missedAtLastControl;
+		double totalErrorSteps;
+		double maxErrorSteps;
+
+		void pollLoop();
+		void adjustSpeed();
+		bool setSpeed(double fps);
+		double predict(std::chrono::steady_clock::time_point time); // Needs mutex
+};
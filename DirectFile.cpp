@@ -0,0 +1,335 @@
+/*
+*   DirectFile.cpp
+*	Film Scanner Master PC Control Software by Kyle Mikolajczyk
+*	kyle@kylem.org
+*/
+
+#include "DirectFile.h"
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#ifdef _WIN32
+#    include <malloc.h>
+#    include <windows.h>
+#else
+#    include <fcntl.h>
+#    include <unistd.h>
+#endif
+
+#ifdef _WIN32
+const DirectFile::Handle DirectFile::INVALID = INVALID_HANDLE_VALUE;
+#else
+const DirectFile::Handle DirectFile::INVALID = -1;
+#endif
+
+void* DirectFile::allocateAligned(size_t bytes)
+{
+#ifdef _WIN32
+    return _aligned_malloc(bytes, ALIGNMENT);
+#else
+    void* memory = nullptr;
+    if (posix_memalign(&memory, ALIGNMENT, bytes) != 0)
+    {
+        return nullptr;
+    }
+    return memory;
+#endif
+}
+
+void DirectFile::freeAligned(void* memory)
+{
+#ifdef _WIN32
+    _aligned_free(memory);
+#else
+    free(memory);
+#endif
+}
+
+DirectFile::DirectFile() : handle(INVALID), bypassing(false), logicalSize(0), staging(nullptr), stagedBytes(0)
+{
+}
+
+/*
+* Create (or truncate) the file. Falls back to normal buffered I/O when the file
+* system does not support bypassing the cache, e.g. tmpfs.
+*/
+bool DirectFile::open(const std::string& path, bool bypassCache)
+{
+    close();
+    logicalSize = 0;
+    stagedBytes = 0;
+    bypassing = false;
+
+#ifdef _WIN32
+    if (bypassCache)
+    {
+        handle = CreateFileA(path.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS,
+            FILE_ATTRIBUTE_NORMAL | FILE_FLAG_NO_BUFFERING | FILE_FLAG_WRITE_THROUGH, nullptr);
+        bypassing = handle != INVALID;
+    }
+    if (handle == INVALID)
+    {
+        handle = CreateFileA(path.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    }
+#else
+#ifdef O_DIRECT
+    if (bypassCache)
+    {
+        handle = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+        bypassing = handle != INVALID;
+    }
+#endif
+    if (handle == INVALID)
+    {
+        handle = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+#ifdef F_NOCACHE
+        // macOS has no O_DIRECT, but can be asked not to cache a file after opening it
+        if (handle != INVALID && bypassCache)
+        {
+            bypassing = fcntl(handle, F_NOCACHE, 1) == 0;
+        }
+#endif
+    }
+#endif
+
+    if (handle == INVALID)
+    {
+        std::cerr << "Error: Could not open " << path << " for writing." << std::endl;
+        return false;
+    }
+    if (bypassing && staging == nullptr)
+    {
+        staging = (unsigned char*)allocateAligned(STAGING_SIZE);
+        if (staging == nullptr)
+        {
+            std::cerr << "Error: Could not allocate the direct I/O staging buffer." << std::endl;
+            close();
+            return false;
+        }
+    }
+    return true;
+}
+
+bool DirectFile::openForAppend(const std::string& path)
+{
+    close();
+    logicalSize = 0;
+    stagedBytes = 0;
+    bypassing = false;
+#ifdef _WIN32
+    handle = CreateFileA(path.c_str(), FILE_APPEND_DATA, FILE_SHARE_READ, nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+#else
+    handle = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+#endif
+    if (handle == INVALID)
+    {
+        std::cerr << "Error: Could not open " << path << " for appending." << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool DirectFile::writeRaw(const void* data, size_t bytes)
+{
+    const unsigned char* cursor = (const unsigned char*)data;
+    while (bytes > 0)
+    {
+#ifdef _WIN32
+        DWORD chunk = (DWORD)(bytes > (1u << 30) ? (1u << 30) : bytes);
+        DWORD written = 0;
+        if (!WriteFile(handle, cursor, chunk, &written, nullptr) || written == 0)
+        {
+            std::cerr << "Error: Write failed with error " << GetLastError() << std::endl;
+            return false;
+        }
+#else
+        ssize_t written = ::write(handle, cursor, bytes);
+        if (written <= 0)
+        {
+            std::cerr << "Error: Write failed: " << strerror(errno) << std::endl;
+            return false;
+        }
+#endif
+        cursor += written;
+        bytes -= written;
+    }
+    return true;
+}
+
+/*
+* Write out the staging buffer. Only the final flush may write a partial block,
+* padded with zeros to the alignment, which close() then truncates away.
+*/
+bool DirectFile::flushStaging(bool final)
+{
+    if (stagedBytes == 0)
+    {
+        return true;
+    }
+    size_t toWrite = stagedBytes;
+    if (final)
+    {
+        size_t padded = (stagedBytes + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+        memset(staging + stagedBytes, 0, padded - stagedBytes);
+        toWrite = padded;
+    }
+    bool ok = writeRaw(staging, toWrite);
+    stagedBytes = 0;
+    return ok;
+}
+
+bool DirectFile::write(const void* data, size_t bytes)
+{
+    if (handle == INVALID)
+    {
+        return false;
+    }
+    logicalSize += bytes;
+    if (!bypassing)
+    {
+        return writeRaw(data, bytes);
+    }
+
+    const unsigned char* cursor = (const unsigned char*)data;
+    while (bytes > 0)
+    {
+        // Aligned data with nothing staged in front of it can skip the copy
+        if (stagedBytes == 0 && ((uintptr_t)cursor & (ALIGNMENT - 1)) == 0 && bytes >= ALIGNMENT)
+        {
+            size_t direct = bytes & ~(ALIGNMENT - 1);
+            if (!writeRaw(cursor, direct))
+            {
+                return false;
+            }
+            cursor += direct;
+            bytes -= direct;
+            continue;
+        }
+
+        size_t chunk = STAGING_SIZE - stagedBytes;
+        if (chunk > bytes)
+        {
+            chunk = bytes;
+        }
+        memcpy(staging + stagedBytes, cursor, chunk);
+        stagedBytes += chunk;
+        cursor += chunk;
+        bytes -= chunk;
+        if (stagedBytes == STAGING_SIZE && !flushStaging(false))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+* Only what has reached the file, anything still staged for unbuffered I/O waits for
+* close()
+*/
+bool DirectFile::sync()
+{
+    if (handle == INVALID)
+    {
+        return false;
+    }
+#if defined(_WIN32)
+    return FlushFileBuffers(handle) != 0;
+#elif defined(F_FULLFSYNC)
+    // fsync() on macOS stops at the drive's own cache
+    return fcntl(handle, F_FULLFSYNC) == 0 || fsync(handle) == 0;
+#else
+    return fsync(handle) == 0;
+#endif
+}
+
+bool DirectFile::truncateTo(uint64_t size)
+{
+#ifdef _WIN32
+    FILE_END_OF_FILE_INFO info;
+    info.EndOfFile.QuadPart = (LONGLONG)size;
+    return SetFileInformationByHandle(handle, FileEndOfFileInfo, &info, sizeof(info)) != 0;
+#else
+    return ftruncate(handle, (off_t)size) == 0;
+#endif
+}
+
+bool DirectFile::preallocate(uint64_t bytes)
+{
+    if (handle == INVALID)
+    {
+        return false;
+    }
+#if defined(_WIN32)
+    FILE_ALLOCATION_INFO info;
+    info.AllocationSize.QuadPart = (LONGLONG)bytes;
+    return SetFileInformationByHandle(handle, FileAllocationInfo, &info, sizeof(info)) != 0;
+#elif defined(FALLOC_FL_KEEP_SIZE)
+    return fallocate(handle, FALLOC_FL_KEEP_SIZE, 0, (off_t)bytes) == 0;
+#elif defined(F_PREALLOCATE)
+    fstore_t store = { F_ALLOCATECONTIG, F_PEOFPOSMODE, 0, (off_t)bytes, 0 };
+    if (fcntl(handle, F_PREALLOCATE, &store) == 0)
+    {
+        return true;
+    }
+    store.fst_flags = F_ALLOCATEALL; // Not in one piece then
+    return fcntl(handle, F_PREALLOCATE, &store) == 0;
+#else
+    return false;
+#endif
+}
+
+void DirectFile::closeHandle()
+{
+#ifdef _WIN32
+    CloseHandle(handle);
+#else
+    ::close(handle);
+#endif
+    handle = INVALID;
+}
+
+/*
+* Flush what is left and cut the file back to the size that was actually written
+*/
+bool DirectFile::close()
+{
+    if (handle == INVALID)
+    {
+        return true;
+    }
+    bool ok = true;
+    if (bypassing)
+    {
+        bool padded = (stagedBytes & (ALIGNMENT - 1)) != 0;
+        ok = flushStaging(true);
+        if (ok && padded)
+        {
+            ok = truncateTo(logicalSize);
+        }
+    }
+    closeHandle();
+    return ok;
+}
+
+bool DirectFile::writeFile(const std::string& path, const void* data, size_t bytes, bool bypassCache)
+{
+    DirectFile file;
+    if (!file.open(path, bypassCache))
+    {
+        return false;
+    }
+    bool ok = file.write(data, bytes);
+    return file.close() && ok;
+}
+
+DirectFile::~DirectFile()
+{
+    close();
+    if (staging != nullptr)
+    {
+        freeAligned(staging);
+    }
+}
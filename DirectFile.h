@@ -0,0 +1,71 @@
+/*
+*   DirectFile.h
+*	Film Scanner Master PC Control Software by Kyle Mikolajczyk
+*   kyle@kylem.org
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/*
+* Sequential file writer that can bypass the OS page cache (O_DIRECT on Linux,
+* F_NOCACHE on macOS, FILE_FLAG_NO_BUFFERING on Windows). Unbuffered I/O has to be
+* done in whole, aligned blocks, so writes are staged through an aligned buffer and
+* flushed in large chunks. Aligned data goes straight to disk without the copy. On
+* close the padding of the last block is cut off again.
+*
+* If the file system refuses unbuffered I/O the file is opened normally instead.
+*/
+class DirectFile
+{
+	public:
+		static constexpr size_t ALIGNMENT = 4096;
+		static const size_t STAGING_SIZE = 8 * 1024 * 1024;
+
+		DirectFile();
+		~DirectFile();
+
+		bool open(const std::string& path, bool bypassCache);
+		// Add to the end of the file, creating it if needed. Always buffered, appends
+		// are rarely whole blocks.
+		bool openForAppend(const std::string& path);
+		bool write(const void* data, size_t bytes);
+		bool sync(); // Wait until everything written so far is on the disk itself
+		bool close();
+		// Reserve bytes on disk up front so a long sequential write does not fragment. The
+		// file size does not change. False if the platform or file system cannot.
+		bool preallocate(uint64_t bytes);
+
+		bool isOpen() { return handle != INVALID; }
+		bool isBypassingCache() { return bypassing; }
+		uint64_t getSize() { return logicalSize; }
+
+		// Write a whole file in one go
+		static bool writeFile(const std::string& path, const void* data, size_t bytes, bool bypassCache);
+
+		// Memory on an ALIGNMENT boundary, which unbuffered writes can take without a copy
+		static void* allocateAligned(size_t bytes);
+		static void freeAligned(void* memory);
+
+	private:
+#ifdef _WIN32
+		typedef void* Handle;
+#else
+		typedef int Handle;
+#endif
+		static const Handle INVALID;
+
+		Handle handle;
+		bool bypassing;
+		uint64_t logicalSize; // Bytes the caller has written, without padding
+		unsigned char* staging;
+		size_t stagedBytes;
+
+		bool writeRaw(const void* data, size_t bytes);
+		bool flushStaging(bool final);
+		bool truncateTo(uint64_t size);
+		void closeHandle();
+};
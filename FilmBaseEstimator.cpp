@@ -0,0 +1,191 @@
+/*
+*   FilmBaseEstimator.cpp
+*	Film Scanner Master PC Control Software by Kyle Mikolajczyk
+*	kyle@kylem.org
+*/
+
+#include "FilmBaseEstimator.h"
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+FilmBaseSample::FilmBaseSample(const FilmBaseSettings& settings) : settings(settings), frameWidth(0), firstColumn(0), endColumn(0),
+    firstRegionRow(0), endRegionRow(0), samples(0), clipped(0)
+{
+}
+
+bool FilmBaseSample::prepare(int newFrameWidth, int frameHeight)
+{
+    auto toPixel = [](float fraction, int size) { return (size_t)std::lround(std::min(1.0f, std::max(0.0f, fraction)) * size); };
+    frameWidth = (size_t)newFrameWidth;
+    firstColumn = toPixel(settings.left, newFrameWidth);
+    endColumn = toPixel(settings.right, newFrameWidth);
+    firstRegionRow = toPixel(settings.top, frameHeight);
+    endRegionRow = toPixel(settings.bottom, frameHeight);
+    histograms.assign(3 * BIN_COUNT, 0);
+    samples = 0;
+    clipped = 0;
+    return firstColumn < endColumn && firstRegionRow < endRegionRow;
+}
+
+void FilmBaseSample::addRows(const uint16_t* const planes[3], size_t firstRow, size_t endRow)
+{
+    const size_t step = (size_t)std::max(1, settings.sampleStep);
+    size_t row = std::max(firstRow, firstRegionRow);
+    row += (step - row % step) % step; // Rows on the same grid whichever strip they are in
+    endRow = std::min(endRow, endRegionRow);
+    if (row >= endRow || firstColumn >= endColumn)
+    {
+        return;
+    }
+
+    // Gathered first so the lock is only held for the binning
+    thread_local std::vector<uint16_t> gathered[3];
+    for (int channel = 0; channel < 3; channel++)
+    {
+        gathered[channel].clear();
+        for (size_t y = row; y < endRow; y += step)
+        {
+            const uint16_t* pixels = planes[channel] + (y - firstRow) * frameWidth;
+            for (size_t x = firstColumn; x < endColumn; x += step)
+            {
+                gathered[channel].push_back(pixels[x]);
+            }
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    const uint16_t clipLevel = (uint16_t)std::min(65535, std::max(1, settings.clipLevel));
+    for (size_t i = 0; i < gathered[0].size(); i++)
+    {
+        // A pixel any channel clips in is not base in any of them
+        if (gathered[0][i] >= clipLevel || gathered[1][i] >= clipLevel || gathered[2][i] >= clipLevel)
+        {
+            clipped++;
+            continue;
+        }
+        for (int channel = 0; channel < 3; channel++)
+        {
+            histograms[channel * BIN_COUNT + (gathered[channel][i] >> BIN_SHIFT)]++;
+        }
+    }
+    samples += gathered[0].size();
+}
+
+/*
+* Within the bin the median falls in, the samples are taken as spread evenly over its
+* levels
+*/
+bool FilmBaseSample::getMedian(double level[3]) const
+{
+    uint64_t unclipped = samples - clipped;
+    if (unclipped == 0 || unclipped * 4 < samples)
+    {
+        return false;
+    }
+    for (int channel = 0; channel < 3; channel++)
+    {
+        const uint32_t* histogram = &histograms[channel * BIN_COUNT];
+        double half = unclipped / 2.0;
+        uint64_t below = 0;
+        int bin = 0;
+        while (bin < BIN_COUNT - 1 && below + histogram[bin] < half)
+        {
+            below += histogram[bin++];
+        }
+        double fraction = histogram[bin] > 0 ? (half - below) / histogram[bin] : 0.5;
+        level[channel] = ((double)bin + fraction) * (1 << BIN_SHIFT);
+    }
+    return true;
+}
+
+void FilmBaseEstimator::RunningMedian::add(double value)
+{
+    if (lower.empty() || value <= lower.top())
+    {
+        lower.push(value);
+    }
+    else
+    {
+        upper.push(value);
+    }
+    // lower keeps the extra value when there is an odd number
+    if (lower.size() > upper.size() + 1)
+    {
+        upper.push(lower.top());
+        lower.pop();
+    }
+    else if (upper.size() > lower.size())
+    {
+        lower.push(upper.top());
+        upper.pop();
+    }
+}
+
+double FilmBaseEstimator::RunningMedian::get() const
+{
+    if (lower.empty())
+    {
+        return 0.0;
+    }
+    return lower.size() > upper.size() ? lower.top() : (lower.top() + upper.top()) / 2.0;
+}
+
+FilmBaseEstimator::FilmBaseEstimator(const FilmBaseSettings& settings) : settings(settings), frames(0), rejected(0)
+{
+}
+
+bool FilmBaseEstimator::addFrame(const FilmBaseSample& sample, double level[3])
+{
+    bool measured = sample.getMedian(level);
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!measured)
+    {
+        rejected++;
+        return false;
+    }
+    for (int channel = 0; channel < 3; channel++)
+    {
+        medians[channel].add(level[channel]);
+    }
+    frames++;
+    return true;
+}
+
+bool FilmBaseEstimator::getEstimate(double filmBase[3]) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (frames == 0 || frames < settings.minFrames)
+    {
+        return false;
+    }
+    for (int channel = 0; channel < 3; channel++)
+    {
+        filmBase[channel] = medians[channel].get();
+    }
+    return true;
+}
+
+int FilmBaseEstimator::getFrameCount() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return frames;
+}
+
+int FilmBaseEstimator::getRejectedCount() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return rejected;
+}
+
+void FilmBaseEstimator::printSummary() const
+{
+    double filmBase[3];
+    bool estimated = getEstimate(filmBase);
+    std::cout << "Film base: " << getFrameCount() << " frame(s) measured, " << getRejectedCount() << " without enough base in the region";
+    if (estimated)
+    {
+        std::cout << ", estimate " << std::lround(filmBase[0]) << " " << std::lround(filmBase[1]) << " " << std::lround(filmBase[2]);
+    }
+    std::cout << std::endl;
+}
@@ -0,0 +1,126 @@
+/*
+*   FilmBaseEstimator.h
+*	Film Scanner Master PC Control Software by Kyle Mikolajczyk
+*   kyle@kylem.org
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <vector>
+
+/*
+* Where the film base shows on every frame and how its estimate is used, see
+* FilmBaseEstimator
+*/
+struct FilmBaseSettings
+{
+	// Measure the film base on every frame and feed the estimate for the roll to the
+	// colour stage in place of ColorSettings::filmBase, which is used until there is one
+	bool estimate = false;
+	// The part of the frame that only ever has film base on it, as fractions of the
+	// frame's width and height: the rebate between the sprocket holes and the picture,
+	// or the frame line. Sprocket holes in it are fine, they are left out as clipped.
+	float left = 0.0f;
+	float top = 0.0f;
+	float right = 0.04f;
+	float bottom = 1.0f;
+	// Pixels this bright or brighter are light straight through a hole or past the edge
+	// of the film, not base
+	int clipLevel = 64000;
+	// Every sampleStep-th pixel of every sampleStep-th row of the region is looked at
+	int sampleStep = 2;
+	// Frames measured before the estimate is used, and how far it has to move (relative,
+	// in any channel) before the colour stage is built again
+	int minFrames = 5;
+	double rebuildChange = 0.002;
+};
+
+/*
+* One frame's film base region, filled from the merge's strips while they are still in
+* cache (see ProcessingOptions::filmBaseSample), so measuring costs a few percent of a
+* pass over the region and nothing over the rest of the frame. The unclipped samples of
+* each channel go into a histogram of BIN_COUNT bins.
+*/
+class FilmBaseSample
+{
+	public:
+		static const int BIN_SHIFT = 4;
+		static const int BIN_COUNT = 65536 >> BIN_SHIFT;
+
+		FilmBaseSample(const FilmBaseSettings& settings = FilmBaseSettings());
+
+		// Clear it for a frame, keeping the memory. False if the region is empty on it.
+		bool prepare(int frameWidth, int frameHeight);
+
+		// Rows [firstRow, endRow) of each channel, planes pointing at firstRow. Several
+		// threads may add different rows.
+		void addRows(const uint16_t* const planes[3], size_t firstRow, size_t endRow);
+
+		// The median of each channel's unclipped samples. False if under a quarter of what
+		// was sampled was unclipped, when the region was mostly holes or not on the film.
+		bool getMedian(double level[3]) const;
+
+		uint64_t getSampleCount() const { return samples; }
+		uint64_t getClippedCount() const { return clipped; }
+
+	private:
+		FilmBaseSettings settings;
+		size_t frameWidth;
+		size_t firstColumn;
+		size_t endColumn;
+		size_t firstRegionRow;
+		size_t endRegionRow;
+
+		std::mutex mutex;
+		std::vector<uint32_t> histograms; // BIN_COUNT per channel
+		uint64_t samples;
+		uint64_t clipped;
+};
+
+/*
+* The film base of a roll, from the film base region of every frame merged. Each frame
+* gives one reading per channel (the median of its region), and the estimate is the
+* running median of the readings, kept in two heaps per channel so adding a frame is
+* O(log frames). Frames where the region was not film base, like leader or a splice,
+* only move the median by one place however far off they are.
+*
+* Safe to add frames from several workers at once.
+*/
+class FilmBaseEstimator
+{
+	public:
+		FilmBaseEstimator(const FilmBaseSettings& settings);
+
+		// Fold a frame's sample in. level is the frame's own reading, false if the region
+		// did not show enough film base and the frame was left out.
+		bool addFrame(const FilmBaseSample& sample, double level[3]);
+
+		// The estimate for the roll, false until settings.minFrames frames were measured
+		bool getEstimate(double filmBase[3]) const;
+		int getFrameCount() const;
+		int getRejectedCount() const;
+
+		const FilmBaseSettings& getSettings() const { return settings; }
+		void printSummary() const;
+
+	private:
+		struct RunningMedian
+		{
+			std::priority_queue<double> lower;
+			std::priority_queue<double, std::vector<double>, std::greater<double>> upper;
+
+			void add(double value);
+			double get() const;
+		};
+
+		FilmBaseSettings settings;
+		mutable std::mutex mutex;
+		RunningMedian medians[3];
+		int frames;
+		int rejected;
+};
@@ -0,0 +1,282 @@
+/*
+*   FlatFieldCalibration.cpp
+*	Film Scanner Master PC Control Software by Kyle Mikolajczyk
+*	kyle@kylem.org
+*/
+
+// A pixel whose flat signal is below this fraction of the mean is treated as defective
+// (dead pixel, or dust right on the sensor) and left alone rather than amplified
+#define FLAT_FIELD_MIN_SIGNAL 0.05
+
+#include "FlatFieldCalibration.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include "PixelKernels.h"
+
+static const char CALIBRATION_MAGIC[8] = { 'F', 'S', 'C', 'A', 'L', 'I', 'B', '\0' };
+static const uint32_t CALIBRATION_VERSION = 1;
+static const char* COLOR_NAMES[3] = { "red", "green", "blue" };
+
+// Start of a calibration file, followed by the offset table and the red, green and blue
+// gain tables, width * height uint16 each, in the byte order of the machine that wrote it
+struct CalibrationFileHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint32_t gainBits;
+    uint32_t darkFrames;
+    uint32_t flatFrames[3];
+    float flatLevel[3];
+    uint32_t defectivePixels[3];
+};
+
+FlatFieldCalibration::FlatFieldCalibration() : width(0), height(0), ready(false), darkSumFrames(0), darkFrames(0)
+{
+    std::fill(flatSumFrames, flatSumFrames + COLOR_COUNT, 0);
+    std::fill(flatFrames, flatFrames + COLOR_COUNT, 0);
+    std::fill(flatLevel, flatLevel + COLOR_COUNT, 0.0f);
+    std::fill(defectivePixels, defectivePixels + COLOR_COUNT, 0);
+}
+
+/*
+* Add one mono16 exposure to a running sum. The first frame added fixes the size.
+*/
+bool FlatFieldCalibration::accumulate(std::vector<uint32_t>& sum, OIIO::ImageBuf* image)
+{
+    if (image == nullptr || image->spec().nchannels != 1 || image->spec().format != OIIO::TypeDesc::UINT16 || image->localpixels() == nullptr)
+    {
+        std::cerr << "Error: Calibration frames have to be single channel 16 bit images." << std::endl;
+        return false;
+    }
+    if (width == 0 && height == 0)
+    {
+        width = image->spec().width;
+        height = image->spec().height;
+    }
+    if (image->spec().width != width || image->spec().height != height)
+    {
+        std::cerr << "Error: Calibration frame is " << image->spec().width << "x" << image->spec().height << ", expected " << width << "x" << height << std::endl;
+        return false;
+    }
+
+    size_t pixelCount = (size_t)width * height;
+    if (sum.empty())
+    {
+        sum.assign(pixelCount, 0);
+    }
+    const uint16_t* pixels = (const uint16_t*)image->localpixels();
+    for (size_t i = 0; i < pixelCount; i++)
+    {
+        sum[i] += pixels[i];
+    }
+    ready = false;
+    return true;
+}
+
+bool FlatFieldCalibration::addDarkFrame(OIIO::ImageBuf* image)
+{
+    if (!accumulate(darkSum, image))
+    {
+        return false;
+    }
+    darkSumFrames++;
+    return true;
+}
+
+bool FlatFieldCalibration::addFlatFrame(LedController::LedColor color, OIIO::ImageBuf* image)
+{
+    if (!accumulate(flatSum[color], image))
+    {
+        return false;
+    }
+    flatSumFrames[color]++;
+    return true;
+}
+
+/*
+* offset = mean dark, gain = mean flat level / (mean flat - offset) for each pixel.
+* Every colour keeps its own mean level, so the correction evens out the field
+* without changing the colour balance.
+*/
+bool FlatFieldCalibration::build()
+{
+    for (int color = 0; color < COLOR_COUNT; color++)
+    {
+        if (flatSumFrames[color] == 0 || flatSum[color].empty())
+        {
+            std::cerr << "Error: No " << COLOR_NAMES[color] << " flat frames to calibrate with." << std::endl;
+            return false;
+        }
+    }
+
+    size_t pixelCount = (size_t)width * height;
+    offsets.assign(pixelCount, 0);
+    if (darkSumFrames > 0 && !darkSum.empty())
+    {
+        for (size_t i = 0; i < pixelCount; i++)
+        {
+            offsets[i] = (uint16_t)((darkSum[i] + darkSumFrames / 2) / darkSumFrames);
+        }
+    }
+    else
+    {
+        std::cout << "Warning: No dark frames, calibrating with a zero offset." << std::endl;
+    }
+
+    const double unityGain = 1 << PixelKernels::FLAT_FIELD_GAIN_BITS;
+    std::vector<float> signal(pixelCount);
+    for (int color = 0; color < COLOR_COUNT; color++)
+    {
+        double total = 0.0;
+        for (size_t i = 0; i < pixelCount; i++)
+        {
+            signal[i] = std::max(0.0f, (float)flatSum[color][i] / flatSumFrames[color] - offsets[i]);
+            total += signal[i];
+        }
+        double level = pixelCount > 0 ? total / pixelCount : 0.0;
+        flatLevel[color] = (float)level;
+        defectivePixels[color] = 0;
+
+        gains[color].resize(pixelCount);
+        for (size_t i = 0; i < pixelCount; i++)
+        {
+            if (signal[i] < level * FLAT_FIELD_MIN_SIGNAL || signal[i] <= 0.0f)
+            {
+                gains[color][i] = (uint16_t)unityGain;
+                defectivePixels[color]++;
+                continue;
+            }
+            double gain = std::round(level / signal[i] * unityGain);
+            gains[color][i] = (uint16_t)std::min(gain, 65535.0);
+        }
+    }
+
+    // The sums are several times the size of the tables, no need to keep them
+    std::vector<uint32_t>().swap(darkSum);
+    darkFrames = darkSumFrames;
+    darkSumFrames = 0;
+    for (int color = 0; color < COLOR_COUNT; color++)
+    {
+        std::vector<uint32_t>().swap(flatSum[color]);
+        flatFrames[color] = flatSumFrames[color];
+        flatSumFrames[color] = 0;
+    }
+    ready = true;
+    return true;
+}
+
+void FlatFieldCalibration::apply(LedController::LedColor color, const uint16_t* source, uint16_t* destination, size_t firstPixel, size_t count) const
+{
+    PixelKernels::flatField(source, offsets.data() + firstPixel, gains[color].data() + firstPixel, destination, count);
+}
+
+bool FlatFieldCalibration::save(const std::string& path) const
+{
+    if (!ready)
+    {
+        std::cerr << "Error: Calibration has not been built, nothing to save." << std::endl;
+        return false;
+    }
+    CalibrationFileHeader header = {};
+    memcpy(header.magic, CALIBRATION_MAGIC, sizeof(header.magic));
+    header.version = CALIBRATION_VERSION;
+    header.width = width;
+    header.height = height;
+    header.gainBits = PixelKernels::FLAT_FIELD_GAIN_BITS;
+    header.darkFrames = darkFrames;
+    for (int color = 0; color < COLOR_COUNT; color++)
+    {
+        header.flatFrames[color] = flatFrames[color];
+        header.flatLevel[color] = flatLevel[color];
+        header.defectivePixels[color] = (uint32_t)defectivePixels[color];
+    }
+
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    size_t tableBytes = offsets.size() * sizeof(uint16_t);
+    file.write((const char*)&header, sizeof(header));
+    file.write((const char*)offsets.data(), tableBytes);
+    for (int color = 0; color < COLOR_COUNT; color++)
+    {
+        file.write((const char*)gains[color].data(), tableBytes);
+    }
+    if (!file)
+    {
+        std::cerr << "Error: Could not write calibration to " << path << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool FlatFieldCalibration::load(const std::string& path)
+{
+    std::ifstream file(path, std::ios::binary);
+    CalibrationFileHeader header;
+    if (!file.read((char*)&header, sizeof(header)) || memcmp(header.magic, CALIBRATION_MAGIC, sizeof(header.magic)) != 0)
+    {
+        std::cerr << "Error: " << path << " is not a calibration file." << std::endl;
+        return false;
+    }
+    if (header.version != CALIBRATION_VERSION || header.gainBits != PixelKernels::FLAT_FIELD_GAIN_BITS)
+    {
+        std::cerr << "Error: " << path << " is calibration version " << header.version << " with " << header.gainBits
+            << " gain bits, expected version " << CALIBRATION_VERSION << " with " << PixelKernels::FLAT_FIELD_GAIN_BITS << std::endl;
+        return false;
+    }
+
+    size_t pixelCount = (size_t)header.width * header.height;
+    size_t tableBytes = pixelCount * sizeof(uint16_t);
+    offsets.resize(pixelCount);
+    bool complete = (bool)file.read((char*)offsets.data(), tableBytes);
+    for (int color = 0; color < COLOR_COUNT && complete; color++)
+    {
+        gains[color].resize(pixelCount);
+        complete = (bool)file.read((char*)gains[color].data(), tableBytes);
+    }
+    if (!complete)
+    {
+        std::cerr << "Error: " << path << " is truncated." << std::endl;
+        ready = false;
+        return false;
+    }
+
+    width = header.width;
+    height = header.height;
+    darkFrames = header.darkFrames;
+    for (int color = 0; color < COLOR_COUNT; color++)
+    {
+        flatFrames[color] = header.flatFrames[color];
+        flatLevel[color] = header.flatLevel[color];
+        defectivePixels[color] = header.defectivePixels[color];
+    }
+    ready = true;
+    return true;
+}
+
+/*
+* The gain range tells how strong the falloff is. A lot of defective pixels usually
+* means the flats were underexposed.
+*/
+void FlatFieldCalibration::printSummary() const
+{
+    if (!ready)
+    {
+        std::cout << "Calibration not built." << std::endl;
+        return;
+    }
+    const double unityGain = 1 << PixelKernels::FLAT_FIELD_GAIN_BITS;
+    std::cout << std::fixed << std::setprecision(3) << "Calibration " << width << "x" << height << " from " << darkFrames << " dark frame(s):" << std::endl;
+    for (int color = 0; color < COLOR_COUNT; color++)
+    {
+        auto range = std::minmax_element(gains[color].begin(), gains[color].end());
+        std::cout << "  " << std::setw(5) << std::left << COLOR_NAMES[color] << std::right << " " << flatFrames[color] << " flat(s), level "
+            << std::setprecision(1) << flatLevel[color] << std::setprecision(3) << ", gain " << *range.first / unityGain << " to " << *range.second / unityGain
+            << ", " << defectivePixels[color] << " pixel(s) left uncorrected" << std::endl;
+    }
+    std::cout << std::defaultfloat;
+}
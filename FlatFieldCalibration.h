@@ -0,0 +1,79 @@
+/*
+*   FlatFieldCalibration.h
+*	Film Scanner Master PC Control Software by Kyle Mikolajczyk
+*   kyle@kylem.org
+*/
+
+#pragma once
+
+#include <OpenImageIO/imagebuf.h>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "LedController.h"
+
+/*
+* Per-pixel dark and flat correction for the three colour exposures. Dark frames are
+* taken with no light reaching the sensor (lens capped or gate closed) and give the
+* fixed pattern offset of every pixel. Flat frames are taken under each LED colour
+* with no film in the gate and give how much light each pixel really sees, which takes
+* out the LED falloff towards the corners, dust on the diffuser and the pixel to pixel
+* sensitivity differences.
+*
+* Frames are averaged as they are added, then build() turns the averages into one
+* 16 bit offset table (shared by all colours, the exposure is the same) and one
+* 16 bit fixed point gain table per colour, which is what PixelKernels::flatField
+* reads. The tables are saved as they are in memory, so loading is a header check
+* and four straight reads.
+*/
+class FlatFieldCalibration
+{
+	public:
+		FlatFieldCalibration();
+
+		// Every frame has to be the same size as the first one. False if it is not.
+		bool addDarkFrame(OIIO::ImageBuf* image);
+		bool addFlatFrame(LedController::LedColor color, OIIO::ImageBuf* image);
+		// Needs at least one flat per colour, without dark frames the offset is 0. Uses the
+		// frames added since the last build(), so building again needs new frames.
+		bool build();
+
+		bool save(const std::string& path) const;
+		bool load(const std::string& path);
+
+		bool isReady() const { return ready; }
+		bool matches(int imageWidth, int imageHeight) const { return ready && imageWidth == width && imageHeight == height; }
+		int getWidth() const { return width; }
+		int getHeight() const { return height; }
+		const uint16_t* getOffsets() const { return offsets.data(); }
+		const uint16_t* getGains(LedController::LedColor color) const { return gains[color].data(); }
+
+		// Correct count pixels of one colour, starting at firstPixel of the frame
+		void apply(LedController::LedColor color, const uint16_t* source, uint16_t* destination, size_t firstPixel, size_t count) const;
+
+		void printSummary() const;
+
+	private:
+		static const int COLOR_COUNT = 3;
+
+		int width;
+		int height;
+		bool ready;
+
+		// Running sums while frames are being added and how many frames are in them, freed
+		// and reset by build()
+		std::vector<uint32_t> darkSum;
+		std::vector<uint32_t> flatSum[COLOR_COUNT];
+		uint32_t darkSumFrames;
+		uint32_t flatSumFrames[COLOR_COUNT];
+		// What the tables were built from
+		uint32_t darkFrames;
+		uint32_t flatFrames[COLOR_COUNT];
+
+		std::vector<uint16_t> offsets;
+		std::vector<uint16_t> gains[COLOR_COUNT];
+		float flatLevel[COLOR_COUNT]; // Mean flat signal above dark, what a corrected flat comes out at
+		size_t defectivePixels[COLOR_COUNT]; // Too little flat signal to correct, left at a gain of 1
+
+		bool accumulate(std::vector<uint32_t>& sum, OIIO::ImageBuf* image);
+};
@@ -0,0 +1,182 @@
+/*
+*   FrameBufferPool.cpp
+*	Film Scanner Master PC Control Software by Kyle Mikolajczyk
+*	kyle@kylem.org
+*/
+
+#include "FrameBufferPool.h"
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#ifdef _WIN32
+#    include <malloc.h>
+#endif
+
+/*
+* Capacities are how many buffers of each kind we keep around. A frame in flight
+* needs three mono buffers until it is merged and one RGB buffer until it is written.
+*/
+FrameBufferPool::FrameBufferPool(size_t monoCapacity, size_t rgbCapacity) : monoCapacity(monoCapacity), rgbCapacity(rgbCapacity)
+{
+}
+
+void* FrameBufferPool::allocateAligned(size_t bytes)
+{
+    // Round up so the allocation is a whole number of pages
+    size_t rounded = (bytes + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+#ifdef _WIN32
+    return _aligned_malloc(rounded, PAGE_SIZE);
+#else
+    void* memory = nullptr;
+    if (posix_memalign(&memory, PAGE_SIZE, rounded) != 0)
+    {
+        return nullptr;
+    }
+    return memory;
+#endif
+}
+
+void FrameBufferPool::freeAligned(void* memory)
+{
+#ifdef _WIN32
+    _aligned_free(memory);
+#else
+    free(memory);
+#endif
+}
+
+/*
+* Allocate count buffers of one size and write to every page, so the page faults
+* happen now rather than while we are scanning
+*/
+void FrameBufferPool::reserveSizeClass(size_t bytes, size_t count)
+{
+    std::vector<Block>& blocks = freeBlocks[bytes];
+    for (size_t i = 0; i < count; i++)
+    {
+        void* memory = allocateAligned(bytes);
+        if (memory == nullptr)
+        {
+            std::cerr << "Frame buffer pool could not reserve " << count << " buffers of " << bytes << " bytes." << std::endl;
+            return;
+        }
+        memset(memory, 0, bytes);
+        reservedMemory.push_back(memory);
+        blocks.push_back({ memory, bytes, true });
+        stats.bytesReserved += bytes;
+    }
+}
+
+OIIO::ImageBuf* FrameBufferPool::acquire(const OIIO::ImageSpec& spec)
+{
+    size_t bytes = spec.image_bytes();
+    Block block = { nullptr, bytes, true };
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto sizeClass = freeBlocks.find(bytes);
+        if (sizeClass == freeBlocks.end())
+        {
+            // First frame of this size, set up the whole class in one go
+            reserveSizeClass(bytes, spec.nchannels == 1 ? monoCapacity : rgbCapacity);
+            sizeClass = freeBlocks.find(bytes);
+        }
+
+        if (!sizeClass->second.empty())
+        {
+            block = sizeClass->second.back();
+            sizeClass->second.pop_back();
+            stats.hits++;
+        }
+        else
+        {
+            stats.misses++;
+        }
+    }
+
+    if (block.memory == nullptr)
+    {
+        block.memory = allocateAligned(bytes);
+        block.pooled = false;
+        if (block.memory == nullptr)
+        {
+            std::cerr << "Error: Out of memory allocating a " << bytes << " byte frame buffer." << std::endl;
+            return nullptr;
+        }
+    }
+
+    OIIO::ImageBuf* image = new OIIO::ImageBuf(spec, block.memory); // Wraps our memory, does not own it
+
+    std::lock_guard<std::mutex> lock(mutex);
+    borrowed[image] = block;
+    stats.inUse++;
+    stats.bytesInUse += bytes;
+    if (stats.inUse > stats.highWaterMark)
+    {
+        stats.highWaterMark = stats.inUse;
+    }
+    if (stats.bytesInUse > stats.bytesHighWaterMark)
+    {
+        stats.bytesHighWaterMark = stats.bytesInUse;
+    }
+    return image;
+}
+
+void FrameBufferPool::release(OIIO::ImageBuf* image)
+{
+    if (image == nullptr)
+    {
+        return;
+    }
+
+    Block block;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = borrowed.find(image);
+        if (it == borrowed.end())
+        {
+            std::cerr << "Error: Released an image that did not come from the frame buffer pool." << std::endl;
+            return;
+        }
+        block = it->second;
+        borrowed.erase(it);
+        stats.inUse--;
+        stats.bytesInUse -= block.bytes;
+        if (block.pooled)
+        {
+            freeBlocks[block.bytes].push_back(block);
+        }
+    }
+
+    delete image;
+    if (!block.pooled)
+    {
+        freeAligned(block.memory);
+    }
+}
+
+FrameBufferPool::Stats FrameBufferPool::getStats()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return stats;
+}
+
+void FrameBufferPool::printStats()
+{
+    Stats current = getStats();
+    std::cout << "Frame buffer pool: " << current.hits << " hits, " << current.misses << " misses, "
+        << "high water mark " << current.highWaterMark << " buffers (" << current.bytesHighWaterMark / (1024 * 1024) << " MB), "
+        << current.bytesReserved / (1024 * 1024) << " MB reserved" << std::endl;
+}
+
+FrameBufferPool::~FrameBufferPool()
+{
+    if (!borrowed.empty())
+    {
+        std::cerr << "Warning: " << borrowed.size() << " frame buffers were never returned to the pool." << std::endl;
+    }
+    for (void* memory : reservedMemory)
+    {
+        freeAligned(memory);
+    }
+}
@@ -0,0 +1,69 @@
+/*
+*   FrameBufferPool.h
+*	Film Scanner Master PC Control Software by Kyle Mikolajczyk
+*   kyle@kylem.org
+*/
+
+#pragma once
+
+#include <OpenImageIO/imagebuf.h>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+/*
+* Fixed size pool of page aligned pixel buffers for the mono exposures and the merged
+* RGB frames. Buffers are allocated and touched once, the first time a frame of a given
+* size is asked for, and then handed out again and again wrapped in an ImageBuf that
+* does not own its pixels. When the pool is empty a temporary buffer is allocated and
+* counted as a miss, and it is freed again when released.
+*/
+class FrameBufferPool
+{
+	public:
+		struct Stats
+		{
+			uint64_t hits = 0;
+			uint64_t misses = 0;
+			size_t inUse = 0; // Buffers currently handed out
+			size_t highWaterMark = 0; // Most buffers handed out at once
+			size_t bytesInUse = 0;
+			size_t bytesHighWaterMark = 0;
+			size_t bytesReserved = 0; // Memory held by the pool itself
+		};
+
+		FrameBufferPool(size_t monoCapacity, size_t rgbCapacity);
+		~FrameBufferPool();
+
+		// Borrow a buffer that fits spec. Give it back with release(), never delete it.
+		OIIO::ImageBuf* acquire(const OIIO::ImageSpec& spec);
+		void release(OIIO::ImageBuf* image);
+
+		Stats getStats();
+		void printStats();
+
+		static const size_t PAGE_SIZE = 4096;
+
+	private:
+		struct Block
+		{
+			void* memory;
+			size_t bytes;
+			bool pooled; // false for the temporary buffers allocated on a miss
+		};
+
+		size_t monoCapacity;
+		size_t rgbCapacity;
+
+		std::mutex mutex;
+		std::map<size_t, std::vector<Block>> freeBlocks; // Keyed by buffer size in bytes
+		std::unordered_map<OIIO::ImageBuf*, Block> borrowed;
+		std::vector<void*> reservedMemory;
+		Stats stats;
+
+		void reserveSizeClass(size_t bytes, size_t count);
+		static void* allocateAligned(size_t bytes);
+		static void freeAligned(void* memory);
+};
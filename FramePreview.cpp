@@ -0,0 +1,131 @@
+/*
+*   FramePreview.cpp
+*	Film Scanner Master PC Control Software by Kyle Mikolajczyk
+*	kyle@kylem.org
+*/
+
+#include "FramePreview.h"
+#include <OpenImageIO/imagebuf.h>
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include "ImagesProcessor.h"
+#include "PixelKernels.h"
+
+FramePreview::FramePreview() : frameWidth(0), frameHeight(0), scale(0), width(0), height(0)
+{
+}
+
+bool FramePreview::prepare(int newFrameWidth, int newFrameHeight, int newScale)
+{
+    if (newScale < MIN_SCALE || newScale > MAX_SCALE || newFrameWidth < newScale || newFrameHeight < newScale)
+    {
+        return false;
+    }
+    frameWidth = newFrameWidth;
+    frameHeight = newFrameHeight;
+    scale = newScale;
+    width = frameWidth / scale;
+    height = frameHeight / scale;
+    pixels.resize(getBytes());
+    return true;
+}
+
+/*
+* 16 bit linear to 8 bit sRGB, so the preview looks like the film does on screen
+*/
+const uint8_t* FramePreview::toneCurve()
+{
+    static const std::vector<uint8_t> curve = []() {
+        std::vector<uint8_t> values(65536);
+        for (int i = 0; i < 65536; i++)
+        {
+            double linear = i / 65535.0;
+            double encoded = linear <= 0.0031308 ? 12.92 * linear : 1.055 * std::pow(linear, 1.0 / 2.4) - 0.055;
+            values[i] = (uint8_t)std::lround(std::min(1.0, encoded) * 255.0);
+        }
+        return values;
+    }();
+    return curve.data();
+}
+
+/*
+* Sums of scale columns each to the preview pixels they make, out being every third
+* byte. The rounded mean is taken with a multiply by 2^40 / area rounded up instead of a
+* divide: a block sum is below 2^24, so that is off by less than 2^-16, and a mean that
+* is not whole is at least 1/256 away from the next one.
+*/
+template <int SCALE>
+static void finishColumns(const uint32_t* sums, uint8_t* out, size_t pixelCount, int scale, const uint8_t* curve)
+{
+    // SCALE 0 for a scale only known at run time, the usual ones get unrolled
+    const int blockScale = SCALE > 0 ? SCALE : scale;
+    uint64_t area = (uint64_t)blockScale * blockScale;
+    uint64_t reciprocal = ((1ull << 40) + area - 1) / area;
+    for (size_t x = 0; x < pixelCount; x++)
+    {
+        uint32_t sum = (uint32_t)(area / 2);
+        for (int i = 0; i < blockScale; i++)
+        {
+            sum += sums[x * blockScale + i];
+        }
+        out[x * 3] = curve[(sum * reciprocal) >> 40];
+    }
+}
+
+void FramePreview::addRows(const uint16_t* const planes[3], size_t firstRow, size_t endRow)
+{
+    const size_t blockColumns = (size_t)width * scale;
+    const uint8_t* curve = toneCurve();
+    thread_local std::vector<uint32_t> sums;
+    sums.resize(blockColumns);
+    for (size_t block = (firstRow + scale - 1) / scale; block < (size_t)height && (block + 1) * scale <= endRow; block++)
+    {
+        uint8_t* out = &pixels[block * width * 3];
+        for (int channel = 0; channel < 3; channel++)
+        {
+            PixelKernels::sumColumns(planes[channel] + (block * scale - firstRow) * frameWidth, frameWidth, scale, sums.data(), blockColumns);
+            switch (scale)
+            {
+            case 2: finishColumns<2>(sums.data(), out + channel, width, scale, curve); break;
+            case 4: finishColumns<4>(sums.data(), out + channel, width, scale, curve); break;
+            case 8: finishColumns<8>(sums.data(), out + channel, width, scale, curve); break;
+            default: finishColumns<0>(sums.data(), out + channel, width, scale, curve); break;
+            }
+        }
+    }
+}
+
+/*
+* Fused radiance is clamped to white and quantised to 16 bits on the way in, which is
+* far finer than the 8 bit preview can show
+*/
+void FramePreview::addRows(const float* const planes[3], size_t firstRow, size_t endRow)
+{
+    thread_local std::vector<uint16_t> quantised;
+    quantised.resize((size_t)frameWidth * 3 * scale);
+    for (size_t block = (firstRow + scale - 1) / scale; block < (size_t)height && (block + 1) * scale <= endRow; block++)
+    {
+        size_t blockOffset = (block * scale - firstRow) * frameWidth;
+        size_t blockPixels = (size_t)frameWidth * scale;
+        const uint16_t* blockPlanes[3];
+        for (int channel = 0; channel < 3; channel++)
+        {
+            uint16_t* plane = &quantised[channel * blockPixels];
+            const float* source = planes[channel] + blockOffset;
+            for (size_t i = 0; i < blockPixels; i++)
+            {
+                plane[i] = (uint16_t)(std::min(1.0f, std::max(0.0f, source[i])) * 65535.0f + 0.5f);
+            }
+            blockPlanes[channel] = plane;
+        }
+        addRows(blockPlanes, block * scale, (block + 1) * scale);
+    }
+}
+
+bool FramePreview::save(const std::string& path) const
+{
+    OIIO::ImageSpec spec(width, height, 3, OIIO::TypeDesc::UINT8);
+    OIIO::ImageBuf image(spec, const_cast<uint8_t*>(pixels.data()));
+    return ImagesProcessor::saveImage(&image, path);
+}
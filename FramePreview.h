@@ -0,0 +1,61 @@
+/*
+*   FramePreview.h
+*	Film Scanner Master PC Control Software by Kyle Mikolajczyk
+*   kyle@kylem.org
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/*
+* An 8 bit sRGB copy of a frame at 1/scale of its size, for looking at while the reel
+* is scanned and for reviewing it afterwards. It is made from the merge's strips while
+* they are still in cache, so it costs a fraction of a pass over the frame instead of
+* decoding the TIFF again later.
+*
+* Each preview pixel is the mean of a scale x scale block of frame pixels: the rows of a
+* block are added up per column in SIMD registers with PixelKernels::sumColumns, and the
+* column sums are added across and put through the tone curve once per block. Frame rows
+* and columns past the last whole block are left out. The strips handed to addRows()
+* have to start on a block, see StripPipeline::setRowAlignment().
+*/
+class FramePreview
+{
+	public:
+		static const int MIN_SCALE = 2;
+		static const int MAX_SCALE = 16; // Keeps the block sums of 16 bit pixels in 32 bits
+
+		FramePreview();
+
+		// Size the preview for a frame, keeping the memory of an earlier one. False if
+		// scale is out of range or the frame is smaller than a block.
+		bool prepare(int frameWidth, int frameHeight, int scale);
+
+		// Rows [firstRow, endRow) of each channel, planes pointing at firstRow. A block
+		// that does not fit in the rows is left out. Several threads may add different rows.
+		void addRows(const uint16_t* const planes[3], size_t firstRow, size_t endRow);
+		// The same for fused HDR channels, 1.0 being white
+		void addRows(const float* const planes[3], size_t firstRow, size_t endRow);
+
+		int getWidth() const { return width; }
+		int getHeight() const { return height; }
+		int getScale() const { return scale; }
+		const uint8_t* getPixels() const { return pixels.data(); } // Packed RGB, top row first
+		size_t getBytes() const { return (size_t)width * height * 3; }
+
+		bool save(const std::string& path) const; // The extension picks the format
+
+	private:
+		int frameWidth;
+		int frameHeight;
+		int scale;
+		int width;
+		int height;
+		std::vector<uint8_t> pixels;
+
+		static const uint8_t* toneCurve();
+};
@@ -0,0 +1,72 @@
+/*
+*   FrameSource.h
+*	Film Scanner Master PC Control Software by Kyle Mikolajczyk
+*   kyle@kylem.org
+*/
+
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/*
+* One raw mono exposure handed out by a FrameSource. The pixel data is owned by the
+* source and is only valid until the next call to grabFrame() or stopGrabbing().
+*/
+struct RawFrame
+{
+	enum PixelFormat
+	{
+		MONO12, // 12 bits stored in the low bits of a 16 bit container
+		MONO12P // Mono12p, two pixels packed into every three bytes
+	};
+
+	const void* data = nullptr;
+	size_t bufferSize = 0;
+	int width = 0;
+	int height = 0;
+	PixelFormat format = MONO12;
+	uint64_t frameNumber = 0;
+	std::chrono::steady_clock::time_point timestamp;
+};
+
+/*
+* Anything that can deliver raw exposures to the ImageCaptureController. The Basler
+* camera is the real one, but keeping it behind this interface lets us run the whole
+* capture -> merge -> write pipeline without hardware attached.
+*/
+class FrameSource
+{
+	public:
+		virtual ~FrameSource() {}
+
+		virtual bool open() = 0; // Connect and configure the device, false if unavailable
+		virtual void startGrabbing() = 0;
+		virtual void stopGrabbing() = 0;
+		virtual bool isGrabbing() = 0;
+
+		// Wait up to timeoutMs for the next exposure, false on timeout or grab error
+		virtual bool grabFrame(RawFrame& frame, unsigned int timeoutMs) = 0;
+
+		// Software triggered exposures, so each one can be lined up with the LED colour.
+		// Sources that can only free-run return false from enableSoftwareTrigger().
+		virtual bool enableSoftwareTrigger() { return false; } // Call before startGrabbing()
+		virtual bool triggerExposure() { return false; }
+		virtual double getExposureTimeMs() { return 0.0; }
+		// For exposure brackets. The camera may round it, read it back with getExposureTimeMs().
+		virtual bool setExposureTimeMs(double /*exposureMs*/) { return false; }
+
+		// Optional live view of the last grabbed frame
+		virtual void displayLastFrame() {}
+
+		virtual std::string getName() = 0;
+};
+
+// Bytes a frame of the given format needs at least
+inline size_t rawFrameBytes(RawFrame::PixelFormat format, int width, int height)
+{
+	size_t pixelCount = (size_t)width * height;
+	return format == RawFrame::MONO12P ? (pixelCount * 3 + 1) / 2 : pixelCount * sizeof(uint16_t);
+}
@@ -0,0 +1,311 @@
+/*
+*   FrameStabilizer.cpp
+*	Film Scanner Master PC Control Software by Kyle Mikolajczyk
+*	kyle@kylem.org
+*/
+
+// The holes have to stand out from the film by at least this much (16 bit scale),
+// otherwise there are no holes in the band, or the light is off
+#define PERFORATION_MIN_CONTRAST 4096.0f
+// Share of a proxy column that has to be bright for it to count as crossing the holes
+#define PERFORATION_MIN_COLUMN_FILL 0.1f
+
+#include "FrameStabilizer.h"
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+FrameStabilizer::FrameStabilizer(PerforationEdge edge, float bandFraction, int downsample)
+    : edge(edge), bandFraction(std::min(1.0f, std::max(0.01f, bandFraction))), downsample(std::max(1, downsample))
+{
+}
+
+/*
+* Box filter the band into proxy[along][across], with across 0 at the edge of the image
+* whichever side the holes are on
+*/
+void FrameStabilizer::buildProxy(const uint16_t* pixels, int width, int height, int bandSize, std::vector<float>& proxy, int& across, int& along) const
+{
+    bool holesOnSide = edge == PERFORATION_LEFT || edge == PERFORATION_RIGHT;
+    across = bandSize / downsample;
+    along = (holesOnSide ? height : width) / downsample;
+    proxy.assign((size_t)across * along, 0.0f);
+    float scale = 1.0f / (downsample * downsample);
+
+    for (int v = 0; v < along; v++)
+    {
+        float* proxyRow = &proxy[(size_t)v * across];
+        for (int j = 0; j < downsample; j++)
+        {
+            int b = v * downsample + j;
+            for (int u = 0; u < across; u++)
+            {
+                uint32_t sum = 0;
+                for (int i = 0; i < downsample; i++)
+                {
+                    int a = u * downsample + i;
+                    switch (edge)
+                    {
+                    case PERFORATION_LEFT: sum += pixels[(size_t)b * width + a]; break;
+                    case PERFORATION_RIGHT: sum += pixels[(size_t)b * width + (width - 1 - a)]; break;
+                    case PERFORATION_TOP: sum += pixels[(size_t)a * width + b]; break;
+                    case PERFORATION_BOTTOM: sum += pixels[(size_t)(height - 1 - a) * width + b]; break;
+                    }
+                }
+                proxyRow[u] += sum * scale;
+            }
+        }
+    }
+}
+
+PerforationPosition FrameStabilizer::detect(OIIO::ImageBuf* image, const PerforationPosition* near) const
+{
+    PerforationPosition position;
+    if (image == nullptr || image->spec().nchannels != 1 || image->spec().format != OIIO::TypeDesc::UINT16 || image->localpixels() == nullptr)
+    {
+        return position;
+    }
+    int width = image->spec().width;
+    int height = image->spec().height;
+    bool holesOnSide = edge == PERFORATION_LEFT || edge == PERFORATION_RIGHT;
+    int bandSize = std::max(downsample * 4, (int)((holesOnSide ? width : height) * bandFraction));
+    bandSize = std::min(bandSize, holesOnSide ? width : height);
+
+    thread_local std::vector<float> proxy;
+    int across, along;
+    buildProxy((const uint16_t*)image->localpixels(), width, height, bandSize, proxy, across, along);
+    if (across < 4 || along < 4)
+    {
+        return position;
+    }
+
+    // Film level from the median, hole level from the top half percent
+    std::vector<uint32_t> histogram(1024, 0);
+    for (float value : proxy)
+    {
+        histogram[std::min(1023, (int)(value / 64.0f))]++;
+    }
+    float median = 0.0f, bright = 0.0f;
+    size_t seen = 0;
+    for (int bin = 0; bin < 1024; bin++)
+    {
+        size_t before = seen;
+        seen += histogram[bin];
+        if (before < proxy.size() / 2 && seen >= proxy.size() / 2)
+        {
+            median = bin * 64.0f + 32.0f;
+        }
+        if (before < proxy.size() * 995 / 1000 && seen >= proxy.size() * 995 / 1000)
+        {
+            bright = bin * 64.0f + 32.0f;
+        }
+    }
+    if (bright - median < PERFORATION_MIN_CONTRAST)
+    {
+        return position;
+    }
+    float threshold = median + 0.5f * (bright - median);
+
+    // The run of columns the holes cross
+    std::vector<float> columnFill(across, 0.0f);
+    for (int v = 0; v < along; v++)
+    {
+        for (int u = 0; u < across; u++)
+        {
+            columnFill[u] += proxy[(size_t)v * across + u] > threshold ? 1.0f : 0.0f;
+        }
+    }
+    int runFirst = -1, runLast = -1;
+    float bestFill = 0.0f;
+    for (int u = 0; u < across;)
+    {
+        if (columnFill[u] < PERFORATION_MIN_COLUMN_FILL * along)
+        {
+            u++;
+            continue;
+        }
+        int first = u;
+        float fill = 0.0f;
+        while (u < across && columnFill[u] >= PERFORATION_MIN_COLUMN_FILL * along)
+        {
+            fill += columnFill[u++];
+        }
+        if (fill > bestFill)
+        {
+            bestFill = fill;
+            runFirst = first;
+            runLast = u - 1;
+        }
+    }
+    if (runFirst < 0)
+    {
+        return position;
+    }
+
+    // Along the film, through the middle of those columns so the rounded corners of the
+    // holes do not blur the ends
+    int quarter = (runLast - runFirst + 1) / 4;
+    int coreFirst = runFirst + quarter;
+    int coreLast = std::max(coreFirst, runLast - quarter);
+    std::vector<float> alongProfile(along, 0.0f);
+    for (int v = 0; v < along; v++)
+    {
+        float sum = 0.0f;
+        for (int u = coreFirst; u <= coreLast; u++)
+        {
+            sum += proxy[(size_t)v * across + u];
+        }
+        alongProfile[v] = sum / (coreLast - coreFirst + 1);
+    }
+
+    // Every complete hole, keeping the one nearest the middle of the frame, or the one
+    // nearest the reference so a frame that moved does not jump to the next hole
+    float target = (along - 1) * 0.5f;
+    if (near != nullptr && near->found)
+    {
+        target = ((holesOnSide ? near->y : near->x) + 0.5f) / downsample - 0.5f;
+    }
+    int holeFirst = -1, holeLast = -1;
+    for (int v = 1; v < along; v++)
+    {
+        if (alongProfile[v - 1] > threshold || alongProfile[v] <= threshold)
+        {
+            continue;
+        }
+        int w = v;
+        while (w < along && alongProfile[w] > threshold)
+        {
+            w++;
+        }
+        if (v < 3 || w + 3 >= along)
+        {
+            v = w; // Too close to the end of the frame to see both edges
+            continue;
+        }
+        if (holeFirst < 0 || std::fabs((v + w - 1) * 0.5f - target) < std::fabs((holeFirst + holeLast) * 0.5f - target))
+        {
+            holeFirst = v;
+            holeLast = w - 1;
+        }
+        v = w;
+    }
+    if (holeFirst < 0 || holeLast - holeFirst < 2)
+    {
+        return position;
+    }
+
+    // Where the threshold is crossed between two proxy pixels depends on where the edge
+    // falls inside them, but the area under the edge does not, so the hole is measured by
+    // how much light it lets through. Every proxy pixel over the edges counts as the
+    // fraction of it that is hole, between the film level just outside and the hole level.
+    auto coverage = [](float value, float film, float hole) { return (value - film) / (hole - film); };
+    float holeLevel = 0.0f;
+    for (int v = holeFirst + 1; v < holeLast; v++)
+    {
+        holeLevel += alongProfile[v] / (holeLast - holeFirst - 1);
+    }
+    float filmLevel = 0.25f * (alongProfile[holeFirst - 3] + alongProfile[holeFirst - 2] + alongProfile[holeLast + 2] + alongProfile[holeLast + 3]);
+    if (holeLevel - filmLevel < PERFORATION_MIN_CONTRAST)
+    {
+        return position;
+    }
+    float holeArea = 0.0f, holeMoment = 0.0f;
+    for (int v = holeFirst - 1; v <= holeLast + 1; v++)
+    {
+        float covered = coverage(alongProfile[v], filmLevel, holeLevel);
+        holeArea += covered;
+        holeMoment += covered * v;
+    }
+    float holeCentre = holeMoment / holeArea;
+
+    // Across the film, the inner edge, from the middle half of that hole's rows
+    int rowFirst = holeFirst + (holeLast - holeFirst) / 4;
+    int rowLast = holeLast - (holeLast - holeFirst) / 4;
+    std::vector<float> acrossProfile(across, 0.0f);
+    for (int v = rowFirst; v <= rowLast; v++)
+    {
+        for (int u = 0; u < across; u++)
+        {
+            acrossProfile[u] += proxy[(size_t)v * across + u] / (rowLast - rowFirst + 1);
+        }
+    }
+    int inside = (runFirst + runLast) / 2;
+    if (acrossProfile[inside] <= threshold)
+    {
+        return position;
+    }
+    int outside = inside;
+    while (outside < across && acrossProfile[outside] > threshold)
+    {
+        outside++;
+    }
+    outside++;
+    if (outside + 1 >= across)
+    {
+        return position; // The hole reaches past the band, it needs to be wider
+    }
+    float insideLevel = 0.0f;
+    for (int u = inside; u <= outside - 3; u++)
+    {
+        insideLevel += acrossProfile[u] / (outside - 2 - inside);
+    }
+    if (outside - 3 < inside)
+    {
+        insideLevel = acrossProfile[inside];
+    }
+    float outsideLevel = 0.5f * (acrossProfile[outside] + acrossProfile[outside + 1]);
+    float innerEdge = inside - 0.5f;
+    for (int u = inside; u < outside; u++)
+    {
+        innerEdge += coverage(acrossProfile[u], outsideLevel, insideLevel);
+    }
+
+    // Back to frame pixels. Proxy pixel i is the average of frame pixels i * downsample
+    // up to (i + 1) * downsample - 1, so its centre is at (i + 0.5) * downsample - 0.5.
+    float acrossPixels = (innerEdge + 0.5f) * downsample - 0.5f;
+    float alongPixels = (holeCentre + 0.5f) * downsample - 0.5f;
+    switch (edge)
+    {
+    case PERFORATION_LEFT: position.x = acrossPixels; position.y = alongPixels; break;
+    case PERFORATION_RIGHT: position.x = width - 1 - acrossPixels; position.y = alongPixels; break;
+    case PERFORATION_TOP: position.x = alongPixels; position.y = acrossPixels; break;
+    case PERFORATION_BOTTOM: position.x = alongPixels; position.y = height - 1 - acrossPixels; break;
+    }
+    position.holeLength = holeArea * downsample;
+    position.found = true;
+    return position;
+}
+
+FrameStabilizer::Result FrameStabilizer::measure(OIIO::ImageBuf* image)
+{
+    Result result;
+    PerforationPosition current = getReference();
+    result.hole = detect(image, &current);
+    if (!result.hole.found)
+    {
+        return result;
+    }
+    std::lock_guard<std::mutex> lock(referenceMutex);
+    if (!reference.found)
+    {
+        reference = result.hole;
+        std::cout << "Stabilizing to the sprocket hole at " << reference.x << ", " << reference.y << std::endl;
+    }
+    result.correction.dx = result.hole.x - reference.x;
+    result.correction.dy = result.hole.y - reference.y;
+    result.correction.confidence = 1.0f;
+    result.correction.windowsUsed = 1;
+    return result;
+}
+
+void FrameStabilizer::setReference(const PerforationPosition& position)
+{
+    std::lock_guard<std::mutex> lock(referenceMutex);
+    reference = position;
+}
+
+PerforationPosition FrameStabilizer::getReference()
+{
+    std::lock_guard<std::mutex> lock(referenceMutex);
+    return reference;
+}
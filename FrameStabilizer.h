@@ -0,0 +1,74 @@
+/*
+*   FrameStabilizer.h
+*	Film Scanner Master PC Control Software by Kyle Mikolajczyk
+*   kyle@kylem.org
+*/
+
+#pragma once
+
+#include <OpenImageIO/imagebuf.h>
+#include <mutex>
+#include <vector>
+#include "ChannelRegistration.h"
+
+// Which side of the image the sprocket holes are on
+enum PerforationEdge { PERFORATION_LEFT, PERFORATION_RIGHT, PERFORATION_TOP, PERFORATION_BOTTOM };
+
+enum StabilizationMode
+{
+	STABILIZE_OFF,
+	STABILIZE_LOG_ONLY, // Find the holes and write the offsets to the sidecar, leave the images alone
+	STABILIZE_TRANSLATE // Also move every frame so its hole lands where the first frame's did
+};
+
+// A sprocket hole in frame pixels. Along the film it is the middle of the hole, across
+// the film it is the edge facing the picture, since the outer edge may be cut off by
+// the gate.
+struct PerforationPosition
+{
+	bool found = false;
+	float x = 0.0f;
+	float y = 0.0f;
+	float holeLength = 0.0f; // Size of the hole along the film
+};
+
+/*
+* Keeps frames still by locking onto the sprocket holes, since the MDrive does not
+* stop at exactly the same place every frame. The band of the exposure that holds the
+* holes is box filtered down into a small proxy, and the holes are found as the
+* brightest runs in its profiles (the light shines straight through them). Their edges
+* are interpolated between proxy pixels, so the result is good to well under a pixel
+* of the full frame while only reading the band once.
+*
+* The first frame a hole is found in becomes the reference, and every frame after is
+* measured against it.
+*/
+class FrameStabilizer
+{
+	public:
+		struct Result
+		{
+			PerforationPosition hole;
+			ChannelShift correction; // How far this frame sits from the reference, windowsUsed is 0 if unknown
+		};
+
+		// bandFraction is how far into the image the holes reach, downsample the proxy factor
+		FrameStabilizer(PerforationEdge edge = PERFORATION_LEFT, float bandFraction = 0.15f, int downsample = 4);
+
+		// The hole nearest the middle of the frame, or nearest near when it is given and found
+		PerforationPosition detect(OIIO::ImageBuf* image, const PerforationPosition* near = nullptr) const;
+		Result measure(OIIO::ImageBuf* image); // detect(), and the offset to the reference, safe from several workers
+
+		void setReference(const PerforationPosition& position);
+		PerforationPosition getReference();
+
+	private:
+		PerforationEdge edge;
+		float bandFraction;
+		int downsample;
+
+		std::mutex referenceMutex;
+		PerforationPosition reference;
+
+		void buildProxy(const uint16_t* pixels, int width, int height, int bandSize, std::vector<float>& proxy, int& across, int& along) const;
+};
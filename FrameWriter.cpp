@@ -0,0 +1,248 @@
+/*
+*   FrameWriter.cpp
+*	Film Scanner Master PC Control Software by Kyle Mikolajczyk
+*	kyle@kylem.org
+*/
+
+#include "FrameWriter.h"
+#include <algorithm>
+#include <filesystem>
+#include <iomanip>
+#include <iostream>
+#include "DirectFile.h"
+#include "ImagesProcessor.h"
+#include "PipelineMetrics.h"
+
+FrameWriter::FrameWriter(FrameBufferPool* pool, int threadCount, size_t maxInFlight, bool bypassCache, OutputFormat format)
+    : pool(pool), bypassCache(bypassCache), format(format), printingDensity(false), compression(COMPRESS_NONE), compressionLevel(0),
+    compressionPredictor(true), metrics(nullptr), started(false)
+{
+    if (threadCount > 0)
+    {
+        queue.reset(new RGBImageQueue<WriteJob>(std::max<size_t>(1, maxInFlight), QUEUE_BLOCK_WHEN_FULL));
+        for (int i = 0; i < threadCount; i++)
+        {
+            threads.push_back(std::thread(&FrameWriter::writerLoop, this));
+        }
+    }
+}
+
+void FrameWriter::setCompression(OutputCompression newCompression, int level, bool predictor, int threadCount)
+{
+    compression = newCompression;
+    compressionLevel = level;
+    compressionPredictor = predictor;
+    compressionPool.reset(compression != COMPRESS_NONE && threadCount > 0 ? new StripThreadPool(threadCount) : nullptr);
+}
+
+void FrameWriter::submit(RGBImage* frame, OIIO::ImageBuf* image, const std::string& filename)
+{
+    {
+        std::lock_guard<std::mutex> lock(statsMutex);
+        if (!started)
+        {
+            firstSubmit = std::chrono::steady_clock::now();
+            started = true;
+        }
+    }
+
+    WriteJob* job = new WriteJob{ frame, image, filename };
+    if (!queue)
+    {
+        writeJob(job, getSubmitState());
+        return;
+    }
+    if (!queue->push(job)) // Blocks while maxInFlight writes are already waiting
+    {
+        std::cerr << "Error: Frame writer is closed, dropping " << filename << std::endl;
+        if (completionCallback)
+        {
+            completionCallback(frame, false, filename, 0);
+        }
+        pool->release(image);
+        delete frame;
+        delete job;
+    }
+}
+
+/*
+* The state the calling thread writes with inside submit(), kept from one frame to the
+* next like a writer thread's so the headers and buffers are not built again every frame.
+* Several workers submit at once, so each gets its own.
+*/
+FrameWriter::ThreadState& FrameWriter::getSubmitState()
+{
+    std::lock_guard<std::mutex> lock(submitStatesMutex);
+    std::unique_ptr<ThreadState>& state = submitStates[std::this_thread::get_id()];
+    if (!state)
+    {
+        state.reset(new ThreadState());
+    }
+    return *state; // Stays put while other threads add theirs
+}
+
+void FrameWriter::writerLoop()
+{
+    ThreadState state; // Buffers reused for every frame this thread writes
+    WriteJob* job;
+    while (queue->pop(job))
+    {
+        writeJob(job, state);
+    }
+}
+
+/*
+* Encode and write one frame, then free it. With bypassCache the TIFF is encoded into
+* memory and written with DirectFile, so it never goes through the page cache. DPX, EXR
+* and compressed TIFFs are put together by their own writers, also through DirectFile.
+*/
+void FrameWriter::writeJob(WriteJob* job, ThreadState& state)
+{
+    auto start = std::chrono::steady_clock::now();
+    bool saved = false;
+    uint64_t bytes = 0;
+    bool timedApart = bypassCache; // Encoding and writing recorded apart rather than as "save"
+    double compressMs = 0.0;
+    uint64_t rawBytes = 0;
+
+    if (SequenceWriter::isNative(format, job->image->spec()))
+    {
+        if (!state.sequenceWriter)
+        {
+            state.sequenceWriter.reset(new SequenceWriter(format, bypassCache));
+        }
+        state.sequenceWriter->setPrintingDensity(printingDensity);
+        saved = state.sequenceWriter->write(job->image, job->filename, job->frame->getImageId(), bytes);
+        timedApart = true;
+        if (metrics != nullptr)
+        {
+            metrics->record("encode", state.sequenceWriter->getConvertMs(), bytes);
+            metrics->record("write", state.sequenceWriter->getWriteMs(), bytes);
+        }
+    }
+    else if (format == OUTPUT_TIFF && compression != COMPRESS_NONE && CompressedTiffWriter::isNative(job->image->spec()))
+    {
+        if (!state.tiffWriter)
+        {
+            state.tiffWriter.reset(new CompressedTiffWriter(compression, compressionLevel, compressionPredictor, compressionPool.get(), bypassCache));
+        }
+        saved = state.tiffWriter->write(job->image, job->filename, bytes);
+        timedApart = true;
+        compressMs = state.tiffWriter->getCompressMs();
+        rawBytes = saved ? state.tiffWriter->getRawBytes() : 0;
+        if (metrics != nullptr)
+        {
+            metrics->record("encode", compressMs, bytes);
+            metrics->record("write", state.tiffWriter->getWriteMs(), bytes);
+        }
+    }
+    else if (bypassCache)
+    {
+        if (ImagesProcessor::encodeImage(job->image, job->filename, state.encodeBuffer))
+        {
+            auto encoded = std::chrono::steady_clock::now();
+            saved = DirectFile::writeFile(job->filename, state.encodeBuffer.data(), state.encodeBuffer.size(), true);
+            bytes = state.encodeBuffer.size();
+            if (metrics != nullptr)
+            {
+                metrics->record("encode", std::chrono::duration<double, std::milli>(encoded - start).count(), bytes);
+                metrics->record("write", std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - encoded).count(), bytes);
+            }
+        }
+    }
+    else
+    {
+        saved = ImagesProcessor::saveImage(job->image, job->filename);
+        std::error_code ec;
+        bytes = saved ? std::filesystem::file_size(job->filename, ec) : 0;
+    }
+    pool->release(job->image);
+
+    auto end = std::chrono::steady_clock::now();
+    double writeMs = std::chrono::duration<double, std::milli>(end - start).count();
+    if (metrics != nullptr && !timedApart)
+    {
+        metrics->record("save", writeMs, bytes);
+    }
+    {
+        std::lock_guard<std::mutex> lock(statsMutex);
+        if (saved)
+        {
+            stats.framesWritten++;
+            stats.bytesWritten += bytes;
+            if (rawBytes > 0)
+            {
+                stats.rawBytes += rawBytes;
+                stats.compressedBytes += bytes;
+                stats.totalCompressMs += compressMs;
+            }
+        }
+        else
+        {
+            stats.framesFailed++;
+        }
+        stats.totalWriteMs += writeMs;
+        stats.maxWriteMs = std::max(stats.maxWriteMs, writeMs);
+        stats.elapsedSeconds = std::chrono::duration<double>(end - firstSubmit).count();
+    }
+
+    if (completionCallback)
+    {
+        completionCallback(job->frame, saved, job->filename, bytes);
+    }
+    delete job->frame;
+    delete job;
+}
+
+void FrameWriter::close()
+{
+    if (queue)
+    {
+        queue->close();
+    }
+    for (std::thread& thread : threads)
+    {
+        if (thread.joinable())
+        {
+            thread.join();
+        }
+    }
+}
+
+FrameWriter::Stats FrameWriter::getStats()
+{
+    std::lock_guard<std::mutex> lock(statsMutex);
+    return stats;
+}
+
+void FrameWriter::printStats()
+{
+    Stats current = getStats();
+    uint64_t writes = current.framesWritten + current.framesFailed;
+    double megabytes = current.bytesWritten / (1024.0 * 1024.0);
+    std::cout << "Frame writer: " << current.framesWritten << " frames, " << std::fixed << std::setprecision(1)
+        << megabytes << " MB";
+    if (current.elapsedSeconds > 0.0)
+    {
+        std::cout << ", " << megabytes / current.elapsedSeconds << " MB/s";
+    }
+    if (writes > 0)
+    {
+        std::cout << ", write latency mean " << current.totalWriteMs / writes << " ms max " << current.maxWriteMs << " ms";
+    }
+    if (current.compressedBytes > 0 && current.totalCompressMs > 0.0)
+    {
+        std::cout << ", compressed " << std::setprecision(2) << (double)current.rawBytes / current.compressedBytes << ":1 at " << std::setprecision(1)
+            << current.rawBytes / (1024.0 * 1024.0) / (current.totalCompressMs / 1000.0) << " MB/s";
+    }
+    if (current.framesFailed > 0)
+    {
+        std::cout << ", " << current.framesFailed << " failed";
+    }
+    std::cout << std::defaultfloat << std::endl;
+}
+
+FrameWriter::~FrameWriter()
+{
+    close();
+}
@@ -0,0 +1,120 @@
+/*
+*   FrameWriter.h
+*	Film Scanner Master PC Control Software by Kyle Mikolajczyk
+*   kyle@kylem.org
+*/
+
+#pragma once
+
+#include <OpenImageIO/imagebuf.h>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "CompressedTiffWriter.h"
+#include "FrameBufferPool.h"
+#include "RGBImage.h"
+#include "RGBImageQueue.h"
+#include "SequenceWriter.h"
+#include "StripThreadPool.h"
+
+class PipelineMetrics;
+
+/*
+* Write-behind output stage. Merge workers hand finished frames to submit() and go
+* straight back to merging, while the writer threads do the TIFF encoding and the
+* file write (or the DPX or EXR conversion, see SequenceWriter, or the compression, see
+* CompressedTiffWriter). The queue in between is bounded by the number of in-flight writes, so
+* if the disk falls behind the merge workers wait rather than memory filling up.
+*/
+class FrameWriter
+{
+	public:
+		struct Stats
+		{
+			uint64_t framesWritten = 0;
+			uint64_t framesFailed = 0;
+			uint64_t bytesWritten = 0;
+			double totalWriteMs = 0.0;
+			double maxWriteMs = 0.0;
+			double elapsedSeconds = 0.0; // From the first submit to the last completed write
+			uint64_t rawBytes = 0; // Pixels of the frames written compressed, before compression
+			uint64_t compressedBytes = 0; // And the files they went into
+			double totalCompressMs = 0.0;
+		};
+
+		// threadCount 0 writes synchronously inside submit(), like the original pipeline.
+		// bypassCache encodes in memory and writes with DirectFile instead of through OIIO.
+		// DPX and EXR frames SequenceWriter can write natively always go through DirectFile,
+		// bypassing the cache or not.
+		FrameWriter(FrameBufferPool* pool, int threadCount, size_t maxInFlight, bool bypassCache, OutputFormat format = OUTPUT_TIFF);
+		~FrameWriter();
+
+		// Called on a writer thread after each frame, before the frame is deleted, with
+		// whether it was saved and the size of the file on disk
+		typedef std::function<void(RGBImage* frame, bool saved, const std::string& filename, uint64_t bytes)> CompletionFn;
+		void setCompletionCallback(CompletionFn callback) { completionCallback = callback; }
+		// Mark DPX files as printing density rather than linear. Set before the first submit.
+		void setPrintingDensity(bool newPrintingDensity) { printingDensity = newPrintingDensity; }
+		// Write TIFF frames losslessly compressed, their strips spread over threadCount
+		// threads shared by the writer threads (each writer thread works on its own frame's
+		// strips too). Set before the first submit.
+		void setCompression(OutputCompression compression, int level, bool predictor, int threadCount);
+
+		// Takes ownership of both frame and image (which goes back to the pool once written)
+		void submit(RGBImage* frame, OIIO::ImageBuf* image, const std::string& filename);
+		void close(); // Finish every queued write and stop the threads
+
+		Stats getStats();
+		void printStats();
+		size_t getQueuedCount() { return queue ? queue->size() : 0; } // Frames waiting for a writer thread
+
+		// Also record every frame as "encode" and "write" with bypassCache or a native DPX or
+		// EXR, or as "save" when OIIO does both, with the bytes written
+		void setMetrics(PipelineMetrics* newMetrics) { metrics = newMetrics; }
+
+	private:
+		struct WriteJob
+		{
+			RGBImage* frame;
+			OIIO::ImageBuf* image;
+			std::string filename;
+		};
+
+		FrameBufferPool* pool;
+		bool bypassCache;
+		OutputFormat format;
+		bool printingDensity;
+		OutputCompression compression;
+		int compressionLevel;
+		bool compressionPredictor;
+		std::unique_ptr<StripThreadPool> compressionPool;
+		std::unique_ptr<RGBImageQueue<WriteJob>> queue;
+		std::vector<std::thread> threads;
+		CompletionFn completionCallback;
+		PipelineMetrics* metrics;
+
+		std::mutex statsMutex;
+		Stats stats;
+		bool started;
+		std::chrono::steady_clock::time_point firstSubmit;
+
+		// What a writer thread keeps from frame to frame
+		struct ThreadState
+		{
+			std::vector<unsigned char> encodeBuffer;
+			std::unique_ptr<SequenceWriter> sequenceWriter;
+			std::unique_ptr<CompressedTiffWriter> tiffWriter;
+		};
+		// Without writer threads, one for each merge worker that writes in submit()
+		std::mutex submitStatesMutex;
+		std::map<std::thread::id, std::unique_ptr<ThreadState>> submitStates;
+
+		void writerLoop();
+		ThreadState& getSubmitState();
+		void writeJob(WriteJob* job, ThreadState& state);
+};
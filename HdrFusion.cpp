@@ -0,0 +1,82 @@
+/*
+*   HdrFusion.cpp
+*	Film Scanner Master PC Control Software by Kyle Mikolajczyk
+*	kyle@kylem.org
+*/
+
+// Pixels per strip, the calibrated copy of the exposure and its radiance stay in L2
+#define FUSION_STRIP_PIXELS (64 * 1024)
+
+#include "HdrFusion.h"
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include "FlatFieldCalibration.h"
+#include "PixelKernels.h"
+#include "StripThreadPool.h"
+
+std::vector<double> HdrFusion::bracketExposures(double shortestMs, int count, double stops)
+{
+    std::vector<double> exposures;
+    for (int i = 0; i < count; i++)
+    {
+        exposures.push_back(shortestMs * std::pow(2.0, stops * i));
+    }
+    return exposures;
+}
+
+OIIO::ImageSpec HdrFusion::radianceSpec(const OIIO::ImageSpec& exposureSpec)
+{
+    return OIIO::ImageSpec(exposureSpec.width, exposureSpec.height, 1, OIIO::TypeDesc::FLOAT);
+}
+
+bool HdrFusion::fold(OIIO::ImageBuf* radiance, OIIO::ImageBuf* exposure, double relativeExposure, bool first,
+    const FlatFieldCalibration* calibration, LedController::LedColor color, StripThreadPool* stripPool)
+{
+    const OIIO::ImageSpec& spec = exposure->spec();
+    if (radiance->spec().width != spec.width || radiance->spec().height != spec.height || radiance->spec().format != OIIO::TypeDesc::FLOAT ||
+        spec.format != OIIO::TypeDesc::UINT16 || spec.nchannels != 1)
+    {
+        std::cerr << "Error: Exposure does not fit the radiance it is fused into." << std::endl;
+        return false;
+    }
+    if (calibration != nullptr && !calibration->matches(spec.width, spec.height))
+    {
+        calibration = nullptr; // The merge reports the mismatch
+    }
+
+    const uint16_t* source = (const uint16_t*)exposure->localpixels();
+    float* destination = (float*)radiance->localpixels();
+    float scale = (float)(1.0 / (65535.0 * relativeExposure));
+    size_t width = spec.width;
+    auto foldStrip = [&](size_t firstRow, size_t endRow) {
+        size_t firstPixel = firstRow * width;
+        size_t count = (endRow - firstRow) * width;
+        const uint16_t* pixels = source + firstPixel;
+        if (calibration != nullptr)
+        {
+            thread_local std::vector<uint16_t> corrected;
+            if (corrected.size() < count)
+            {
+                corrected.resize(count);
+            }
+            calibration->apply(color, pixels, corrected.data(), firstPixel, count);
+            pixels = corrected.data();
+        }
+        PixelKernels::fuseExposure(pixels, destination + firstPixel, count, scale, first);
+    };
+
+    size_t stripRows = std::max<size_t>(1, FUSION_STRIP_PIXELS / std::max<size_t>(1, width));
+    if (stripPool != nullptr)
+    {
+        stripPool->run(spec.height, stripRows, foldStrip);
+    }
+    else
+    {
+        for (size_t row = 0; row < (size_t)spec.height; row += stripRows)
+        {
+            foldStrip(row, std::min((size_t)spec.height, row + stripRows));
+        }
+    }
+    return true;
+}
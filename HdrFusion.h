@@ -0,0 +1,43 @@
+/*
+*   HdrFusion.h
+*	Film Scanner Master PC Control Software by Kyle Mikolajczyk
+*   kyle@kylem.org
+*/
+
+#pragma once
+
+#include <OpenImageIO/imagebuf.h>
+#include <vector>
+#include "LedController.h"
+
+class FlatFieldCalibration;
+class StripThreadPool;
+
+/*
+* Merges a bracket of exposures of one colour into a single float channel, for dense
+* negatives and print stock that clip in one 12 bit exposure. The bracket is shot
+* shortest exposure first and every exposure is folded into the running radiance as
+* soon as it is off the camera, so a colour never holds more than its radiance and the
+* exposure being folded in, however long the bracket is. Longer exposures replace the
+* shorter ones wherever they are not near clipping, since they have the cleaner
+* shadows (see PixelKernels::fuseExposure).
+*
+* The radiance is scaled so 1.0 is full scale of the shortest exposure, and the dark
+* end goes down by the ratio of the longest to the shortest.
+*/
+class HdrFusion
+{
+	public:
+		// count exposure times, stops apart, starting at shortestMs
+		static std::vector<double> bracketExposures(double shortestMs, int count, double stops);
+
+		// Float mono spec for the radiance of exposures with spec exposureSpec
+		static OIIO::ImageSpec radianceSpec(const OIIO::ImageSpec& exposureSpec);
+
+		// Fold exposure into radiance. relativeExposure is its exposure time over the
+		// shortest one, first is set for the shortest. The calibration is applied to the
+		// exposure on the way in, if there is one of the right size. Strips of the frame
+		// run on the strip pool when there is one.
+		static bool fold(OIIO::ImageBuf* radiance, OIIO::ImageBuf* exposure, double relativeExposure, bool first,
+			const FlatFieldCalibration* calibration, LedController::LedColor color, StripThreadPool* stripPool);
+};
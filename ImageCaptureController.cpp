@@ -6,91 +6,247 @@
 
 #define REQUIRE_MANUAL_STEP false
 
-#include "ImageCaptureController.h"
+// Frames that can wait in an unbounded queue before the frame pool has to allocate. Each
+// one holds 3 exposures. On top of that the capture thread holds the frame it is filling,
+// and every worker holds one more frame while merging plus the merged image. Merged images
+// waiting for or inside a writer thread need their own RGB buffers.
+#define FRAME_POOL_QUEUED_FRAMES 4
 
-// Initialize the static member variable
-bool ImageCaptureController::pylonInitialized = false;
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <sstream>
+#include "ImageCaptureController.h"
+#include "PixelKernels.h"
+#include "PylonFrameSource.h"
 
 /*
-* 
+* Kept here so callers do not need to know which camera backend is in use
 */
 void ImageCaptureController::initializePylon()
 {
-    if (!pylonInitialized)
-    {
-        PylonInitialize();
-        pylonInitialized = true;;
-    }
+    PylonFrameSource::initializePylon();
 }
 
 /*
 * 
 */
-ImageCaptureController::ImageCaptureController(std::string id) : captureId(id), stopWorker(false), lastImageId(0)
-{   
-    try {
-        camera.Attach(CTlFactory::GetInstance().CreateFirstDevice());
-
-        // Print the model name of the camera.
-        cout << "Using device " << camera.GetDeviceInfo().GetModelName() << endl;
-
-        // The parameter MaxNumBuffer can be used to control the count of buffers
-        // allocated for grabbing. The default value of this parameter is 10.
-        camera.MaxNumBuffer = 5;
+ImageCaptureController::ImageCaptureController(std::string id, const CaptureSettings& settings) : ImageCaptureController(id, new PylonFrameSource(settings.usePackedPixels), settings)
+{
+}
 
-        // Start the worker thread
-        workerThread = std::thread(&ImageCaptureController::processQueue, this);
-        initializeCamera();
+/*
+* Build a controller around any frame source, e.g. the SyntheticFrameSource when
+* benchmarking without a camera attached
+*/
+ImageCaptureController::ImageCaptureController(std::string id, FrameSource* source, const CaptureSettings& settings) : ImageCaptureController(id, source, nullptr, settings)
+{
+}
 
-        // Pre-allocate buffers and start grabbing
-        camera.StartGrabbing(GrabStrategy_OneByOne, GrabLoop_ProvidedByUser);
+/*
+* With an LED controller every colour is exposed under its own light, see CaptureSequencer
+*/
+ImageCaptureController::ImageCaptureController(std::string id, FrameSource* source, LedController* led, const CaptureSettings& settings) : settings(settings),
+    frameSource(source), ledController(led), sequencer(source, led, settings.overlapLedSwitching),
+    lastImageId(0), captureId(id), outputDirectory("img/"),
+    framePool(3 * ((settings.queueCapacity > 0 ? settings.queueCapacity : FRAME_POOL_QUEUED_FRAMES) + std::max(1, settings.workerCount) + 1), std::max(1, settings.workerCount) + 1 + (settings.writerThreads > 0 ? settings.maxInFlightWrites + settings.writerThreads : 0)),
+    imageQueue(createImageQueue()), foldFailed(false), committing(false)
+{
+    if (settings.processingThreads > 0)
+    {
+        stripPool.reset(new StripThreadPool(settings.processingThreads));
     }
-    catch (const GenericException& e)
+    if (settings.registerChannels)
     {
-        cerr << "Pylon Camera was not found, please check the connection." << endl
-            << e.GetDescription() << endl;
-        std::exit(EXIT_FAILURE);
+        registration.reset(new ChannelRegistration());
+    }
+    if (settings.stabilization != STABILIZE_OFF)
+    {
+        stabilizer.reset(new FrameStabilizer(settings.perforationEdge));
+    }
+    if (settings.previewScale != 0 && (settings.previewScale < FramePreview::MIN_SCALE || settings.previewScale > FramePreview::MAX_SCALE))
+    {
+        cerr << "Error: Preview scale " << settings.previewScale << " is not between " << FramePreview::MIN_SCALE << " and " << FramePreview::MAX_SCALE
+            << ", not making previews." << endl;
+        this->settings.previewScale = 0;
+    }
+    std::fill(appliedFilmBase, appliedFilmBase + 3, 0.0);
+    if (settings.filmBaseEstimation.estimate)
+    {
+        filmBaseEstimator.reset(new FilmBaseEstimator(settings.filmBaseEstimation));
+    }
+    // With an estimator the stage is built even if it has nothing to do yet, so each new
+    // estimate is only a matter of the curves
+    if (settings.color.isEnabled() || filmBaseEstimator)
+    {
+        std::shared_ptr<ColorTransform> transform = std::make_shared<ColorTransform>();
+        if (transform->build(settings.color))
+        {
+            colorTransform = transform;
+        }
+        else
+        {
+            cerr << "Error: Could not set up the colour stage, frames are written without it." << endl;
+        }
+    }
+    if (this->settings.previewScale > 0 && !settings.previewRingName.empty())
+    {
+        previewRing.reset(new PreviewRing(settings.previewRingName, settings.previewRingSlots));
+    }
+    frameWriter.reset(new FrameWriter(&framePool, settings.writerThreads, settings.maxInFlightWrites, settings.bypassPageCache, settings.outputFormat));
+    frameWriter->setPrintingDensity(settings.color.invert);
+    OutputCompression compression = settings.outputCompression;
+    if (!CompressedTiffWriter::isAvailable(compression))
+    {
+        cerr << "Error: This build cannot write " << CompressedTiffWriter::getName(compression) << ", frames are compressed with deflate instead." << endl;
+        compression = COMPRESS_DEFLATE;
+    }
+    frameWriter->setCompression(compression, settings.compressionLevel, settings.compressionPredictor, settings.compressionThreads);
+    frameWriter->setCompletionCallback([this](RGBImage* rgbImage, bool saved, const std::string& filename, uint64_t bytes)
+    {
+        if (saved)
+        {
+            metrics.record("frame_latency", std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - rgbImage->getCaptureStartTime()).count(), bytes);
+        }
+        if (saved && session)
+        {
+            session->frameWritten(rgbImage->getImageId(), filename, bytes);
+        }
+        if (frameFinishedCallback)
+        {
+            frameFinishedCallback(rgbImage, saved);
+        }
+    });
+
+    sequencer.setMetrics(&metrics);
+    processingTimings.setMetrics(&metrics, "merge");
+    frameWriter->setMetrics(&metrics);
+    metrics.addGauge("frame_queue_depth", [this]() { return (double)imageQueue->size(); });
+    metrics.addGauge("write_queue_depth", [this]() { return (double)frameWriter->getQueuedCount(); });
+    metrics.addGauge("frame_buffers_in_use", [this]() { return (double)framePool.getStats().inUse; });
+    metrics.addGauge("frame_bytes_in_use", [this]() { return (double)framePool.getStats().bytesInUse; });
+    if (filmBaseEstimator)
+    {
+        const char* names[3] = { "film_base_red", "film_base_green", "film_base_blue" };
+        for (int channel = 0; channel < 3; channel++)
+        {
+            metrics.addGauge(names[channel], [this, channel]() {
+                double filmBase[3];
+                return filmBaseEstimator->getEstimate(filmBase) ? filmBase[channel] : 0.0;
+            });
+        }
     }
+    startCapture();
 }
 
 /*
-* Setup the camera and various parameters to configure
-* that is different from the default values (such as set it to 12bit mode
+* Pick the queue between the capture thread and the workers from the settings
 */
-void ImageCaptureController::initializeCamera()
+FrameQueue<RGBImage>* ImageCaptureController::createImageQueue()
 {
-    try
+    if (settings.useLockFreeQueue)
     {
-        // Ensure the camera is open
-        if (!camera.IsOpen())
+        if (settings.workerCount <= 1)
         {
-            cout << "Opening camera..." << endl;
-            camera.Open();
+            size_t capacity = settings.queueCapacity > 0 ? settings.queueCapacity : 8;
+            cout << "Using lock free frame queue with " << capacity << " slots" << endl;
+            return new SpscRingQueue<RGBImage>(capacity, settings.queueFullPolicy);
         }
+        cout << "Lock free frame queue needs a single worker, using the locking queue instead." << endl;
+    }
+    return new RGBImageQueue<RGBImage>(settings.queueCapacity, settings.queueFullPolicy);
+}
 
-        // Set the pixel format to Mono16
-        GenApi::INodeMap& nodemap = camera.GetNodeMap();
-        GenApi::CEnumerationPtr pixelFormat(nodemap.GetNode("PixelFormat"));
-        if (IsAvailable(pixelFormat->GetEntryByName("Mono12")))
+/*
+* Open the frame source, start the worker threads and begin grabbing
+*/
+void ImageCaptureController::startCapture()
+{
+    if (!frameSource->open())
+    {
+        cerr << "Frame source " << frameSource->getName() << " could not be opened." << endl;
+        std::exit(EXIT_FAILURE);
+    }
+
+    // Start the worker threads
+    int workerCount = std::max(1, settings.workerCount);
+    for (int i = 0; i < workerCount; i++)
+    {
+        workerThreads.push_back(std::thread(&ImageCaptureController::processQueue, this));
+    }
+    cout << "Processing with " << workerCount << " worker thread(s)" << (settings.commitInOrder ? ", committing in order" : "") << endl;
+    if (stripPool)
+    {
+        cout << "Splitting frames into strips over " << settings.processingThreads << " extra thread(s)" << endl;
+    }
+    if (settings.writerThreads > 0)
+    {
+        cout << "Writing with " << settings.writerThreads << " writer thread(s), up to " << settings.maxInFlightWrites << " frame(s) in flight"
+            << (settings.bypassPageCache ? ", bypassing the page cache" : "") << endl;
+    }
+    if (colorTransform && colorTransform->isActive())
+    {
+        colorTransform->printSummary();
+    }
+    if (filmBaseEstimator)
+    {
+        const FilmBaseSettings& region = settings.filmBaseEstimation;
+        cout << "Estimating the film base from " << region.left * 100.0f << "-" << region.right * 100.0f << "% across and " << region.top * 100.0f
+            << "-" << region.bottom * 100.0f << "% down every frame, used once " << region.minFrames << " frame(s) are measured" << endl;
+    }
+    if (settings.previewScale > 0)
+    {
+        cout << "Making 1/" << settings.previewScale << " previews";
+        if (settings.previewFiles)
         {
-            pixelFormat->FromString("Mono12");
-            cout << "Pixel format set to Mono12" << endl;
+            cout << ", written as *_proxy" << settings.previewExtension;
         }
-        else
+        if (previewRing)
         {
-            cout << "Mono12 pixel format not available. Cannot proceed." << endl;
-            std::exit(EXIT_FAILURE);
+            cout << ", published to " << settings.previewRingName;
         }
+        cout << endl;
+    }
+
+    metrics.start(settings.metricsPath, settings.metricsIntervalSeconds);
 
+    // Pre-allocate buffers and start grabbing
+    sequencer.prepare();
+    currentExposureMs = frameSource->getExposureTimeMs();
+    if (settings.journalMode != JOURNAL_OFF)
+    {
+        cout << "Journaling raw exposures" << (settings.journalMode == JOURNAL_ONLY ? " without processing them" : "") << ", "
+            << (settings.journalSegmentBytes >> 20) << " MB segments" << endl;
     }
-    catch (const GenericException& e)
+    if (settings.hdrExposures > 1)
     {
-        cerr << "An exception occurred while initializing the camera." << endl
-            << e.GetDescription() << endl;
+        double shortestMs = frameSource->getExposureTimeMs();
+        if (shortestMs <= 0.0)
+        {
+            cerr << "Error: Exposure time of " << frameSource->getName() << " is not known, capturing single exposures instead of HDR brackets." << endl;
+        }
+        else
+        {
+            bracketMs = HdrFusion::bracketExposures(shortestMs, settings.hdrExposures, settings.hdrStops);
+            cout << "HDR bracket of " << bracketMs.size() << " exposures per colour:";
+            for (double exposureMs : bracketMs)
+            {
+                cout << " " << exposureMs;
+            }
+            cout << " ms, written as " << (settings.hdrHalfFloat ? "half" : "full") << " floats" << endl;
+            if (colorTransform && (colorTransform->isActive() || filmBaseEstimator))
+            {
+                cout << "The colour stage only works on 16 bit frames, fused brackets are written scene linear without it." << endl;
+            }
+            if (registration || stabilizer)
+            {
+                cout << "Channel registration and stabilization need single exposures, they are off for HDR brackets." << endl;
+                registration.reset();
+                stabilizer.reset();
+            }
+        }
     }
-    // Create a window and set its size
-    window.Create(1);
-
+    frameSource->startGrabbing();
 }
 
 /*
@@ -112,26 +268,77 @@ void ImageCaptureController::manuallyStepThroughImage()
 */
 int ImageCaptureController::captureFrame()
 {
-    manuallyStepThroughImage();
-	// Capture the red image
-	OIIO::ImageBuf* redImageBuff = captureImageAsBuffer();
+    auto captureStartTime = std::chrono::steady_clock::now();
 
-	// Set LED to green
-	//arduinoConnection.sendCommand(SerialConn::SET_COLOR_GREEN);
+    if (settings.sessionManifest && !session)
+    {
+        openSession();
+    }
+    if (settings.journalMode != JOURNAL_OFF && !journal)
+    {
+        // Opened with the first frame, the output directory is only known by then
+        std::string directory = settings.journalDirectory.empty() ? outputDirectory : settings.journalDirectory;
+        if (!directory.empty() && directory.back() != '/' && directory.back() != '\\')
+        {
+            directory += "/";
+        }
+        journal.reset(new CaptureJournal(directory, captureId, settings.journalSegmentBytes, settings.journalInFlight, true));
+        journal->setMetrics(&metrics);
+        // A session skips the frames an earlier run finished, so the journal has to keep
+        // their exposures rather than start over them
+        if (session)
+        {
+            journal->resume();
+        }
+        CaptureJournal* openedJournal = journal.get(); // Kept until the destructor, after metrics.stop()
+        metrics.addGauge("journal_queue_depth", [openedJournal]() { return (double)openedJournal->getQueuedCount(); });
+    }
+    if (session && session->isVerified(lastImageId))
+    {
+        cout << "Image " << lastImageId << " is already on disk, skipping it" << endl;
+        skipInOrder(lastImageId, lastImageId + 1);
+        lastImageId++;
+        return FRAME_SKIPPED;
+    }
+    if (settings.journalMode == JOURNAL_ONLY)
+    {
+        return captureFrameToJournal();
+    }
+
+    sequencer.beginFrame();
+    foldFailed = false;
+
+    std::shared_ptr<const FlatFieldCalibration> frameCalibration = std::atomic_load(&calibration); // Only needed here for brackets
 
     manuallyStepThroughImage();
-	// Capture the green image
-	OIIO::ImageBuf* greenImageBuff = captureImageAsBuffer();
+	// Capture the red image. The LED starts switching to green while red is read out.
+	OIIO::ImageBuf* redImageBuff = captureChannel(LedController::LED_RED, LedController::LED_GREEN, frameCalibration.get());
 
-	// Set LED to blue
-	//arduinoConnection.sendCommand(SerialConn::SET_COLOR_BLUE);
+    manuallyStepThroughImage();
+	// Capture the green image
+	OIIO::ImageBuf* greenImageBuff = captureChannel(LedController::LED_GREEN, LedController::LED_BLUE, frameCalibration.get());
 
     manuallyStepThroughImage();
-	// Capture the blue image
-	OIIO::ImageBuf* blueImageBuff = captureImageAsBuffer();
+	// Capture the blue image, and get red ready for the next frame
+	OIIO::ImageBuf* blueImageBuff = captureChannel(LedController::LED_BLUE, LedController::LED_RED, frameCalibration.get());
+
+    // The last exposure of a bracket is still being fused. A frame with any fold that
+    // failed goes on without its colours, like one with a failed grab, and is dropped
+    // by the worker rather than merged from a radiance that was never filled.
+    waitForFold();
+    if (foldFailed)
+    {
+        cerr << "Error: Fusing the exposures of image " << lastImageId << " failed, dropping it." << endl;
+        framePool.release(redImageBuff);
+        framePool.release(greenImageBuff);
+        framePool.release(blueImageBuff);
+        redImageBuff = greenImageBuff = blueImageBuff = nullptr;
+    }
+
+    sequencer.endFrame(lastImageId);
 
 	// Create an RGBImage object and set the images
-	RGBImage* rgbImage = new RGBImage();
+	RGBImage* rgbImage = new RGBImage(&framePool);
 	rgbImage->setRedImage(redImageBuff);
 	rgbImage->setGreenImage(greenImageBuff);
 	rgbImage->setBlueImage(blueImageBuff);
@@ -139,160 +346,682 @@ int ImageCaptureController::captureFrame()
     // File details
 	rgbImage->setCaptureId(captureId);
 	rgbImage->setImageId(lastImageId);
+	rgbImage->setCaptureStartTime(captureStartTime);
 
-    // Push the RGBImage object to the queue
-    imageQueue.push(rgbImage);
+    // Recorded before a worker can possibly have written it
+    recordCapture();
 
-    // Notify the worker thread that a new image is available
-    stopCondition.notify_all();
+    // Push the RGBImage object to the queue, which wakes a worker. If the queue is
+    // bounded this either waits for room or drops the frame, depending on the policy.
+    int result = FRAME_QUEUED;
+    if (!imageQueue->push(rgbImage))
+    {
+        cerr << "Warning: Processing queue is full, dropped image " << lastImageId << endl;
+        droppedImageIds.push_back(lastImageId);
+        delete rgbImage;
+        skipInOrder(lastImageId, lastImageId + 1);
+        result = FRAME_DROPPED;
+    }
 
     lastImageId++;
-    return 0;
+    return result;
+}
+
+/*
+* The exposures of a frame straight into the journal, for JOURNAL_ONLY. Nothing is
+* converted or queued, the frames are processed from the journal later.
+*/
+int ImageCaptureController::captureFrameToJournal()
+{
+    const LedController::LedColor colors[] = { LedController::LED_RED, LedController::LED_GREEN, LedController::LED_BLUE };
+    int exposureCount = bracketMs.empty() ? 1 : (int)bracketMs.size();
+    bool captured = true;
+    sequencer.beginFrame();
+    for (int i = 0; i < 3 && captured; i++)
+    {
+        manuallyStepThroughImage();
+        for (int exposure = 0; exposure < exposureCount && captured; exposure++)
+        {
+            if (!bracketMs.empty())
+            {
+                setBracketExposure(exposure);
+            }
+            LedController::LedColor nextColor = exposure + 1 < exposureCount ? colors[i] : colors[(i + 1) % 3];
+            captured = sequencer.captureExposure(colors[i], nextColor, [this, &colors, i, exposure]() { return grabIntoJournal(colors[i], exposure); });
+        }
+    }
+    sequencer.endFrame(lastImageId);
+    recordCapture();
+
+    int result = FRAME_JOURNALED;
+    if (!captured)
+    {
+        cerr << "Error: Image " << lastImageId << " could not be journaled." << endl;
+        droppedImageIds.push_back(lastImageId);
+        result = FRAME_DROPPED;
+    }
+    lastImageId++;
+    return result;
+}
+
+/*
+* Opened once the output directory is settled. Without it the scan carries on, it just
+* cannot be resumed.
+*/
+bool ImageCaptureController::openSession()
+{
+    session.reset(new SessionManifest(SessionManifest::pathFor(outputDirectory, captureId)));
+    if (!session->open())
+    {
+        cerr << "Error: Session manifest could not be opened, this scan cannot be resumed after a crash." << endl;
+        session.reset();
+        return false;
+    }
+    return true;
+}
+
+int ImageCaptureController::resumeSession()
+{
+    if (!session && !openSession())
+    {
+        return lastImageId;
+    }
+    setNextImageId(session->getResumeImageId());
+    return lastImageId;
+}
+
+void ImageCaptureController::setNextImageId(int imageId)
+{
+    // The reorder stage would wait for the IDs in between otherwise
+    if (imageId > lastImageId)
+    {
+        skipInOrder(lastImageId, imageId);
+    }
+    lastImageId = imageId;
+}
+
+void ImageCaptureController::recordCapture()
+{
+    if (!session)
+    {
+        return;
+    }
+    int64_t position = 0;
+    bool positionKnown = motorPositionSource && motorPositionSource(position);
+    session->frameCaptured(lastImageId, positionKnown, position);
+}
+
+/*
+* Same exposures as captureFrame(), but each one is added to the calibration and given
+* straight back to the pool. For dark frames every colour is added, which only works
+* with no light reaching the sensor.
+*/
+bool ImageCaptureController::captureCalibrationFrames(FlatFieldCalibration& calibration, bool dark, int frameCount)
+{
+    const LedController::LedColor colors[] = { LedController::LED_RED, LedController::LED_GREEN, LedController::LED_BLUE };
+    cout << "Capturing " << frameCount << (dark ? " dark" : " flat") << " calibration frame(s)" << endl;
+    if (!bracketMs.empty())
+    {
+        sequencer.setExposureTimeMs(bracketMs[0]); // Calibrated at the shortest exposure of the bracket
+    }
+    for (int frame = 0; frame < frameCount; frame++)
+    {
+        sequencer.beginFrame();
+        for (int i = 0; i < 3; i++)
+        {
+            OIIO::ImageBuf* exposure = captureColor(colors[i], colors[(i + 1) % 3], -1);
+            if (exposure == nullptr)
+            {
+                cerr << "Error: Calibration exposure could not be captured." << endl;
+                return false;
+            }
+            bool added = dark ? calibration.addDarkFrame(exposure) : calibration.addFlatFrame(colors[i], exposure);
+            framePool.release(exposure);
+            if (!added)
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/*
+* One colour of the frame, with the LED and exposure handled by the sequencer
+*/
+OIIO::ImageBuf* ImageCaptureController::captureColor(LedController::LedColor color, LedController::LedColor nextColor, int exposureIndex)
+{
+    return sequencer.captureColor(color, nextColor, [this, color, exposureIndex]() { return captureImageAsBuffer(color, exposureIndex); });
 }
 
 /*
-* Capture a single image from the Basler camera. From here convert the basler image type
+* One colour of the frame, a single exposure or the fused HDR bracket
+*/
+OIIO::ImageBuf* ImageCaptureController::captureChannel(LedController::LedColor color, LedController::LedColor nextColor, const FlatFieldCalibration* frameCalibration)
+{
+    return bracketMs.empty() ? captureColor(color, nextColor, 0) : captureBracket(color, nextColor, frameCalibration);
+}
+
+/*
+* Shoot the bracket of one colour, shortest exposure first. Each exposure is fused on
+* a background thread (spread over the strip pool) while the camera takes the next
+* one, and goes back to the pool as soon as it is fused. The result is 1.0 at full
+* scale of the exposure the camera actually took for the shortest one.
+*/
+OIIO::ImageBuf* ImageCaptureController::captureBracket(LedController::LedColor color, LedController::LedColor nextColor, const FlatFieldCalibration* frameCalibration)
+{
+    OIIO::ImageBuf* radiance = nullptr;
+    double shortestMs = 0.0;
+    for (size_t i = 0; i < bracketMs.size(); i++)
+    {
+        double exposureMs = setBracketExposure((int)i);
+        OIIO::ImageBuf* exposure = captureColor(color, i + 1 < bracketMs.size() ? color : nextColor, (int)i);
+        if (exposure == nullptr)
+        {
+            waitForFold();
+            framePool.release(radiance);
+            return nullptr;
+        }
+        if (radiance == nullptr)
+        {
+            radiance = framePool.acquire(HdrFusion::radianceSpec(exposure->spec()));
+            shortestMs = exposureMs;
+            if (radiance == nullptr)
+            {
+                framePool.release(exposure);
+                return nullptr;
+            }
+        }
+
+        // Only one fold at a time, the previous one may still be writing this radiance.
+        // Before the first exposure it is the last colour's, which captureFrame() checks.
+        if (!waitForFold() && i > 0)
+        {
+            framePool.release(exposure);
+            framePool.release(radiance);
+            return nullptr;
+        }
+        double relativeExposure = exposureMs / shortestMs;
+        bool first = i == 0;
+        StripThreadPool* pool = stripPool.get();
+        pendingFold = std::async(std::launch::async, [this, radiance, exposure, relativeExposure, first, frameCalibration, color, pool]()
+        {
+            bool fused = HdrFusion::fold(radiance, exposure, relativeExposure, first, frameCalibration, color, pool);
+            framePool.release(exposure);
+            return fused;
+        });
+    }
+    return radiance;
+}
+
+/*
+* Exposure time of the next captures for exposure index of the bracket. Returns what
+* the camera took, or what was asked for if it cannot say.
+*/
+double ImageCaptureController::setBracketExposure(int index)
+{
+    double exposureMs = sequencer.setExposureTimeMs(bracketMs[index]);
+    currentExposureMs = exposureMs > 0.0 ? exposureMs : bracketMs[index];
+    return currentExposureMs;
+}
+
+/*
+* True if there was nothing to wait for or the fold worked. A failed fold also sets
+* foldFailed.
+*/
+bool ImageCaptureController::waitForFold()
+{
+    if (!pendingFold.valid())
+    {
+        return true;
+    }
+    bool fused = pendingFold.get();
+    foldFailed = foldFailed || !fused;
+    return fused;
+}
+
+/*
+* Capture a single image from the frame source (normally the Basler camera). From here convert the raw image type
 * to an OIIO image type that can be manipulated better. Also, if this is a windows 
 * computer we can view the image through the Basler DisplayImage function.
 */
-OIIO::ImageBuf* ImageCaptureController::captureImageAsBuffer()
+OIIO::ImageBuf* ImageCaptureController::captureImageAsBuffer(LedController::LedColor color, int exposureIndex)
 {
     OIIO::ImageBuf* image = nullptr; // Image to return
-    try
+    RawFrame frame;
+
+    // Wait for an image and then retrieve it. A timeout of 5000 ms is used.
+    auto grabStart = std::chrono::steady_clock::now();
+    if (frameSource->grabFrame(frame, 5000))
     {
-        // Wait for an image and then retrieve it. A timeout of 5000 ms is used.
-        camera.RetrieveResult(5000, ptrGrabResult, TimeoutHandling_ThrowException);
+        metrics.record("grab_wait", std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - grabStart).count(), frame.bufferSize);
+        cout << "Grabbed image: " << lastImageId << endl;
+        cout << "Image buffer size: " << frame.bufferSize << endl;
 
-        // Image grabbed successfully?
-        if (ptrGrabResult->GrabSucceeded())
+        // Get image specifications
+        int width = frame.width;
+        int height = frame.height;
+        size_t pixelCount = (size_t)width * height;
+
+        if (frame.bufferSize < rawFrameBytes(frame.format, width, height))
         {
-            cout << "Grabbed image: " << lastImageId << endl;
-            cout << "Image buffer size: " << ptrGrabResult->GetBufferSize() << endl;
+            cerr << "Error: Grab buffer is smaller than a " << width << "x" << height << (frame.format == RawFrame::MONO12P ? " Mono12p" : " Mono12") << " image." << endl;
+            return nullptr;
+        }
 
-            // TODO: Offload all this image processing to the "display" function to the processing queue
-            // so that we do not bog down the main capture thread
-            const uint16_t* pImageBuffer = (uint16_t*)ptrGrabResult->GetBuffer();
+        // The raw frame goes to the journal before anything is done to it
+        if (exposureIndex >= 0 && journal && !journalExposure(frame, color, exposureIndex))
+        {
+            cerr << "Warning: Image " << lastImageId << " is processed but missing from the journal." << endl;
+        }
 
-            // Get image specifications
-            int width = ptrGrabResult->GetWidth();
-            int height = ptrGrabResult->GetHeight();
+        // Number of channels in the image
+        int nchannels = 1; // Assumed monochrome
 
-			// Number of channels in the image
-            int nchannels = 1; // Assumed monochrome
+        // Determine the data type based on the pixel type
+        OIIO::TypeDesc dataType = OIIO::TypeDesc::UINT16; // Cast to 16 because OIIO does not have 12bit
 
-            EPixelType pixelType = ptrGrabResult->GetPixelType();
+        // Create an ImageSpec
+        OIIO::ImageSpec spec(width, height, nchannels, dataType);
 
-            // Debugging information
-           /* cout << "Pixel type value: " << static_cast<int>(pixelType) << endl;
-            cout << "PixelType_Mono16 value: " << static_cast<int>(PixelType_Mono12) << endl;
-            cout << "Comparison result: " << (pixelType == PixelType_Mono12) << endl;*/
+        // Borrow a buffer for the frame from the pool, it goes back once the frame is merged
+        image = framePool.acquire(spec);
+        if (image == nullptr)
+        {
+            return nullptr;
+        }
 
+        // Scale the 12-bit data to the full 16-bit range, straight from the grab buffer into the ImageBuf.
+        // Packed frames are unpacked in the same pass.
+        auto scaleStart = std::chrono::steady_clock::now();
+        if (frame.format == RawFrame::MONO12P)
+        {
+            PixelKernels::unpack12pTo16((const uint8_t*)frame.data, (uint16_t*)image->localpixels(), pixelCount);
+        }
+        else
+        {
+            PixelKernels::shift12To16((const uint16_t*)frame.data, (uint16_t*)image->localpixels(), pixelCount);
+        }
+        metrics.record("scale_12_to_16", std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - scaleStart).count(), pixelCount * sizeof(uint16_t));
 
-            // Determine the data type based on the pixel type
-            OIIO::TypeDesc dataType = OIIO::TypeDesc::UINT16; // Cast to 16 because OIIO does not have 12bit
+        frameSource->displayLastFrame();
+    }
 
-            // Create an ImageSpec
-            OIIO::ImageSpec spec(width, height, nchannels, dataType);
+    return image;
+}
 
-            // Create an ImageBuf from the raw image data
-            image = new OIIO::ImageBuf(spec);
+/*
+* Grab the next exposure and append it to the journal as it is
+*/
+bool ImageCaptureController::grabIntoJournal(LedController::LedColor color, int exposureIndex)
+{
+    RawFrame frame;
+    auto grabStart = std::chrono::steady_clock::now();
+    if (!frameSource->grabFrame(frame, 5000))
+    {
+        cerr << "Error: No exposure from " << frameSource->getName() << " for image " << lastImageId << endl;
+        return false;
+    }
+    metrics.record("grab_wait", std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - grabStart).count(), frame.bufferSize);
+    bool journaled = journalExposure(frame, color, exposureIndex);
+    frameSource->displayLastFrame();
+    return journaled;
+}
 
-            // Scale the 12-bit data to the full 16-bit range
-            std::vector<uint16_t> scaledBuffer = scale12BitTo16Bit(pImageBuffer, width, height);
+bool ImageCaptureController::journalExposure(const RawFrame& frame, LedController::LedColor color, int exposureIndex)
+{
+    return journal->append(frame, lastImageId, color, exposureIndex, bracketMs.empty() ? 1 : (int)bracketMs.size(), currentExposureMs);
+}
 
-            image->set_pixels(OIIO::ROI::All(), dataType, scaledBuffer.data());
+/*
+* In seperate threads than the main application, process the mono images into the final 
+* full color full bit image, and write to disk. Several of these can run at once.
+*/
+void ImageCaptureController::processQueue()
+{
+    FramePreview preview; // Reused for every frame this worker merges
+    FilmBaseSample filmBaseSample(settings.filmBaseEstimation);
 
-            #ifdef PYLON_WIN_BUILD
-            window.SetImage(ptrGrabResult);
-            window.Show();
-            #endif
+    // pop() only returns false once the queue is closed and empty
+    RGBImage* rgbImage;
+    while (imageQueue->pop(rgbImage))
+    {
+        cout << "Processing image " << rgbImage->getImageId() << endl;
+        OIIO::ImageBuf* mergedImage = nullptr;
+        if (rgbImage->isReadyToMerge())
+        {
+            auto processingStart = std::chrono::steady_clock::now();
+            std::shared_ptr<const FlatFieldCalibration> frameCalibration = std::atomic_load(&calibration); // Stays alive for this frame
+            std::shared_ptr<const ColorTransform> frameColor = std::atomic_load(&colorTransform);
+            ProcessingOptions processing;
+            processing.calibration = frameCalibration.get();
+            processing.color = frameColor.get();
+            processing.stripPool = stripPool.get();
+            processing.halfFloatOutput = settings.hdrHalfFloat;
+            processing.timings = &processingTimings;
+            if (settings.previewScale > 0)
+            {
+                processing.preview = &preview;
+                processing.previewScale = settings.previewScale;
+            }
+            if (filmBaseEstimator && bracketMs.empty())
+            {
+                processing.filmBaseSample = &filmBaseSample;
+            }
+            if (registration)
+            {
+                auto stageStart = std::chrono::steady_clock::now();
+                rgbImage->setChannelOffsets(registration->measure(rgbImage->getRedImage(), rgbImage->getGreenImage(), rgbImage->getBlueImage(), stripPool.get()));
+                processingTimings.add("register", std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - stageStart).count());
+                processing.channelOffsets = &rgbImage->getChannelOffsets();
+                logChannelOffsets(rgbImage);
+            }
+            if (stabilizer)
+            {
+                auto stageStart = std::chrono::steady_clock::now();
+                rgbImage->setStabilization(stabilizer->measure(rgbImage->getGreenImage()));
+                processingTimings.add("stabilize", std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - stageStart).count());
+                if (settings.stabilization == STABILIZE_TRANSLATE)
+                {
+                    processing.frameShift = &rgbImage->getStabilization().correction;
+                }
+                logStabilization(rgbImage);
+            }
+            mergedImage = ImagesProcessor::createProcessedRGBImage(rgbImage->getRedImage(), rgbImage->getGreenImage(), rgbImage->getBlueImage(), &framePool, processing);
+            if (mergedImage == nullptr)
+            {
+                cout << "Error: Merged image is null." << endl;
+            }
+            else if (processing.preview != nullptr)
+            {
+                auto stageStart = std::chrono::steady_clock::now();
+                savePreview(rgbImage->getImageId(), preview);
+                processingTimings.add("proxy", std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - stageStart).count());
+            }
+            if (mergedImage != nullptr && processing.filmBaseSample != nullptr)
+            {
+                updateFilmBase(rgbImage->getImageId(), filmBaseSample);
+            }
+            processingTimings.addFrame(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - processingStart).count());
         }
         else
         {
-            cout << "Error: " << std::hex << ptrGrabResult->GetErrorCode() << std::dec << " " << ptrGrabResult->GetErrorDescription() << endl;
+            cout << "Error: Not all images are ready to be merged." << endl;
         }
+        rgbImage->releaseChannels(); // The exposures are not needed once merged
 
-        return image;
+        if (settings.commitInOrder)
+        {
+            commitInOrder(rgbImage, mergedImage);
+        }
+        else
+        {
+            writeFrame(rgbImage, mergedImage);
+        }
     }
-    catch (const GenericException& e)
+}
+
+/*
+* The preview the merge just made, as a proxy file next to the frame and in the ring
+* for a viewer
+*/
+void ImageCaptureController::savePreview(int imageId, const FramePreview& preview)
+{
+    if (preview.getBytes() == 0)
+    {
+        return; // The frame is smaller than a block
+    }
+    if (settings.previewFiles)
     {
-        // Error handling.
-        cerr << "An exception occurred." << endl
-            << e.GetDescription() << endl;
-        return nullptr;
+        std::string filename = outputDirectory + "image" + captureId + "_" + std::to_string(imageId) + "_proxy" + settings.previewExtension;
+        if (!preview.save(filename))
+        {
+            cerr << "Error: Preview of image " << imageId << " could not be written to " << filename << endl;
+        }
+    }
+    if (previewRing)
+    {
+        previewRing->publish(imageId, preview.getWidth(), preview.getHeight(), preview.getPixels());
     }
 }
 
 /*
-* The camera is set to 12bit mode but OIIO does not support 12bit, only 8 or 16, thus
-* we will use a 16bit container with the 12bit data, so we have to scale it to the 
-* correct range or else the image wil appear much darker
+* One line per frame in image<captureId>_registration.csv, in the order the workers
+* finish them. A shift with no windows used could not be measured and was not applied.
 */
-std::vector<uint16_t> ImageCaptureController::scale12BitTo16Bit(const uint16_t* pImageBuffer, int width, int height)
+void ImageCaptureController::logChannelOffsets(RGBImage* rgbImage)
 {
-    std::vector<uint16_t> scaledBuffer(width * height);
-    for (int i = 0; i < width * height; ++i)
+    const ChannelOffsets& offsets = rgbImage->getChannelOffsets();
+    cout << "Image " << rgbImage->getImageId() << " channel offsets: red " << offsets.red.dx << ", " << offsets.red.dy
+        << " blue " << offsets.blue.dx << ", " << offsets.blue.dy << (offsets.measured ? "" : " (not measured)") << endl;
+
+    std::ostringstream line;
+    line << rgbImage->getImageId() << "," << offsets.red.dx << "," << offsets.red.dy << "," << offsets.red.confidence << "," << offsets.red.windowsUsed
+        << "," << offsets.blue.dx << "," << offsets.blue.dy << "," << offsets.blue.confidence << "," << offsets.blue.windowsUsed;
+    appendSidecarLine(registrationLog, "_registration.csv", "image_id,red_dx,red_dy,red_confidence,red_windows,blue_dx,blue_dy,blue_confidence,blue_windows", line.str());
+}
+
+/*
+* One line per frame in image<captureId>_stabilization.csv, so the offsets can be
+* applied later when the frames were written as they were. The correction is where
+* the hole is minus where it was in the reference frame.
+*/
+void ImageCaptureController::logStabilization(RGBImage* rgbImage)
+{
+    const FrameStabilizer::Result& result = rgbImage->getStabilization();
+    bool applied = result.hole.found && settings.stabilization == STABILIZE_TRANSLATE;
+    if (!result.hole.found)
     {
-        scaledBuffer[i] = pImageBuffer[i] << 4; // Left shift by 4 bits to scale to 16-bit range
+        cout << "Image " << rgbImage->getImageId() << ": no sprocket hole found, not stabilized" << endl;
     }
-    return scaledBuffer;
+
+    std::ostringstream line;
+    line << rgbImage->getImageId() << "," << (result.hole.found ? 1 : 0) << "," << result.hole.x << "," << result.hole.y << ","
+        << result.correction.dx << "," << result.correction.dy << "," << (applied ? 1 : 0);
+    appendSidecarLine(stabilizationLog, "_stabilization.csv", "image_id,found,hole_x,hole_y,correction_dx,correction_dy,applied", line.str());
 }
 
 /*
-* In a seperate thread than the main application, process the mono images into the final 
-* full color full bit image, and write to disk
+* Fold the film base measured on a merged frame into the estimate for the roll, and
+* once that has moved far enough build the colour stage again for it. Frames already
+* merging keep the stage they started with. One line per frame goes to
+* image<captureId>_filmbase.csv, with the frame's own reading and the estimate after it.
 */
-void ImageCaptureController::processQueue()
+void ImageCaptureController::updateFilmBase(int imageId, const FilmBaseSample& sample)
+{
+    double level[3] = { 0.0, 0.0, 0.0 };
+    bool measured = filmBaseEstimator->addFrame(sample, level);
+    double estimate[3] = { 0.0, 0.0, 0.0 };
+    bool estimated = filmBaseEstimator->getEstimate(estimate);
+    bool rebuilt = false;
+
+    // A worker that finds another one building just carries on, the next frame catches up
+    std::unique_lock<std::mutex> lock(filmBaseMutex, std::try_to_lock);
+    if (estimated && lock.owns_lock())
+    {
+        bool moved = false;
+        for (int channel = 0; channel < 3; channel++)
+        {
+            moved = moved || fabs(estimate[channel] - appliedFilmBase[channel]) > settings.filmBaseEstimation.rebuildChange * estimate[channel];
+        }
+        std::shared_ptr<const ColorTransform> current = std::atomic_load(&colorTransform);
+        if (moved && current)
+        {
+            auto buildStart = std::chrono::steady_clock::now();
+            setColorTransform(current->withFilmBase(estimate));
+            std::copy(estimate, estimate + 3, appliedFilmBase);
+            processingTimings.add("recolor", std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - buildStart).count());
+            rebuilt = true;
+        }
+    }
+    if (lock.owns_lock())
+    {
+        lock.unlock();
+    }
+
+    std::ostringstream line;
+    line << imageId << "," << (measured ? 1 : 0) << "," << level[0] << "," << level[1] << "," << level[2] << "," << sample.getSampleCount() << ","
+        << sample.getClippedCount() << "," << estimate[0] << "," << estimate[1] << "," << estimate[2] << "," << (rebuilt ? 1 : 0);
+    appendSidecarLine(filmBaseLog, "_filmbase.csv", "image_id,measured,frame_red,frame_green,frame_blue,samples,clipped,estimate_red,estimate_green,estimate_blue,rebuilt",
+        line.str());
+}
+
+/*
+* Append to a CSV next to the images, creating it with its header the first time
+*/
+void ImageCaptureController::appendSidecarLine(std::ofstream& log, const std::string& suffix, const std::string& header, const std::string& line)
+{
+    std::lock_guard<std::mutex> lock(sidecarLogMutex);
+    if (!log.is_open())
+    {
+        std::string path = outputDirectory + "image" + captureId + suffix;
+        log.open(path, std::ios::trunc);
+        if (!log)
+        {
+            cerr << "Error: Could not open " << path << endl;
+            return;
+        }
+        log << header << endl;
+    }
+    log << line << endl;
+}
+
+/*
+* Hand a finished frame to the reorder stage. Whichever worker finds the next image ID
+* ready writes it, and keeps going while the following IDs are ready too. The others
+* return straight away, so only one frame is ever being written at a time and always
+* in order, while the rest of the workers carry on merging. With writer threads the
+* frames are handed to the writer in order instead; a single writer keeps them in order
+* on disk too.
+*/
+void ImageCaptureController::commitInOrder(RGBImage* rgbImage, OIIO::ImageBuf* mergedImage)
+{
+    {
+        std::lock_guard<std::mutex> lock(commitMutex);
+        reorderBuffer.push(rgbImage->getImageId(), PendingFrame{ rgbImage, mergedImage });
+        if (committing)
+        {
+            return; // The worker that is committing will pick this frame up
+        }
+        committing = true;
+    }
+    commitReadyFrames();
+}
+
+/*
+* Tell the reorder stage that image IDs first up to end will never reach it (dropped, or
+* not captured at all), so the frames after them are not held back waiting. This runs
+* on the capture thread, which must never end up encoding and writing frames, so the
+* skip is only recorded: the next worker to commit a frame writes whatever it let
+* through, or the destructor does if no frame comes after it.
+*/
+void ImageCaptureController::skipInOrder(int firstImageId, int endImageId)
+{
+    if (!settings.commitInOrder)
+    {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(commitMutex);
+    reorderBuffer.skip(firstImageId, endImageId);
+}
+
+/*
+* Write frames out of the reorder stage while the next one is ready, for the caller that
+* set committing
+*/
+void ImageCaptureController::commitReadyFrames()
 {
     while (true)
     {
-        RGBImage* rgbImage;
+        PendingFrame frame;
         {
-            std::unique_lock<std::mutex> lock(stopMutex);
-            stopCondition.wait(lock, [this] { return stopWorker || !imageQueue.empty(); });
-            if (stopWorker && imageQueue.empty())
+            std::lock_guard<std::mutex> lock(commitMutex);
+            if (!reorderBuffer.popReady(frame))
             {
-                break;
+                committing = false;
+                return;
             }
         }
+        writeFrame(frame.rgbImage, frame.mergedImage);
+    }
+}
 
-        if (imageQueue.pop(rgbImage))
+/*
+* Pass a merged frame to the writer, which writes it to disk (now or on a writer thread)
+* and frees everything belonging to it. A null merged image means processing failed,
+* and we only clean up.
+*/
+void ImageCaptureController::writeFrame(RGBImage* rgbImage, OIIO::ImageBuf* mergedImage)
+{
+    if (mergedImage == nullptr)
+    {
+        if (frameFinishedCallback)
         {
-            cout << "Processing image " << rgbImage->getImageId() << endl;
-            if (rgbImage->isReadyToMerge())
-            {
-                OIIO::ImageBuf* mergedImage = ImagesProcessor::createProcessedRGBImage(rgbImage->getRedImage(), rgbImage->getGreenImage(), rgbImage->getBlueImage());
-                if (mergedImage != nullptr)
-                {
-                    ImagesProcessor::saveImage(mergedImage, "img/image" + rgbImage->getCaptureId() + "_" + to_string(rgbImage->getImageId()) + ".tiff");
-                    delete mergedImage;
-                }
-                else
-                {
-                    cout << "Error: Merged image is null." << endl;
-                }
-            }
-            else
-            {
-                cout << "Error: Not all images are ready to be merged." << endl;
-            }
-            delete rgbImage; // Don't forget to delete the RGBImage object
+            frameFinishedCallback(rgbImage, false);
         }
+        delete rgbImage; // Don't forget to delete the RGBImage object
+        return;
     }
+    std::string filename = outputDirectory + "image" + rgbImage->getCaptureId() + "_" + to_string(rgbImage->getImageId()) + SequenceWriter::getExtension(settings.outputFormat);
+    frameWriter->submit(rgbImage, mergedImage, filename);
 }
 
 ImageCaptureController::~ImageCaptureController()
 {
+    waitForFold();
+    // Workers only exit once the queue is empty, so this drains every captured frame
+    imageQueue->close();
+    for (std::thread& worker : workerThreads)
+    {
+        worker.join();
+    }
+    // Frames a skip let through with no worker left to write them, then anything still in
+    // the reorder stage, which is behind an image ID that never came: better on disk out
+    // of order than lost
+    commitReadyFrames();
+    PendingFrame frame;
+    int strandedFrames = 0;
+    while (reorderBuffer.popAny(frame))
+    {
+        writeFrame(frame.rgbImage, frame.mergedImage);
+        strandedFrames++;
+    }
+    if (strandedFrames > 0)
+    {
+        cerr << "Error: " << strandedFrames << " frame(s) were still waiting for an earlier image ID, written out of order." << endl;
+    }
+    frameWriter->close(); // Waits for the writes still in flight
+    if (session && !session->close())
+    {
+        cerr << "Error: The session manifest is incomplete, some frames may be taken again on resume." << endl;
+    }
+    if (journal && !journal->close())
+    {
+        cerr << "Error: The capture journal is incomplete." << endl;
+    }
+    frameSource->stopGrabbing();
+    metrics.stop(); // Last sample and files, while everything the gauges read is still here
+    if (!droppedImageIds.empty())
+    {
+        cerr << "Dropped " << droppedImageIds.size() << " frame(s) because processing fell behind:";
+        for (int id : droppedImageIds)
+        {
+            cerr << " " << id;
+        }
+        cerr << endl;
+    }
+    sequencer.printStats();
+    processingTimings.printStats();
+    frameWriter->printStats();
+    if (journal)
     {
-        std::lock_guard<std::mutex> lock(stopMutex);
-        stopWorker = true;
+        journal->printStats();
     }
-    stopCondition.notify_all();
-    workerThread.join();
-    if (camera.IsGrabbing())
+    framePool.printStats();
+    if (filmBaseEstimator)
     {
-        camera.StopGrabbing();
+        filmBaseEstimator->printSummary();
     }
-    //PylonTerminate();
+    metrics.printSummary();
 }
 
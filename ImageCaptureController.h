@@ -7,54 +7,156 @@
 #pragma once
 
 #include <OpenImageIO/imagebuf.h>
-// Include files to use the pylon API.
-#include <pylon/PylonIncludes.h>
-#ifdef PYLON_WIN_BUILD
-#    include <pylon/PylonGUI.h>
-#endif
-#include <pylon/BaslerUniversalInstantCamera.h>
+#include <fstream>
 #include <string>
 #include <thread>
-#include <atomic>
-#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include "CaptureSequencer.h"
+#include "ChannelRegistration.h"
+#include "CaptureSettings.h"
+#include "ColorTransform.h"
+#include "FilmBaseEstimator.h"
+#include "FlatFieldCalibration.h"
+#include "FrameBufferPool.h"
+#include "FramePreview.h"
+#include "FrameSource.h"
+#include "FrameStabilizer.h"
+#include "FrameWriter.h"
+#include "HdrFusion.h"
+#include "LedController.h"
+#include "PipelineMetrics.h"
+#include "PreviewRing.h"
 #include "RGBImage.h"
 #include "RGBImageQueue.h"
+#include "SpscRingQueue.h"
+#include "ReorderBuffer.h"
+#include "SessionManifest.h"
+#include "StripPipeline.h"
+#include "StripThreadPool.h"
 
 using namespace std;
-using namespace Pylon;
 
 class ImageCaptureController
 {
 	public:
 		enum ImageType { RED, GREEN, BLUE }; // Define the enum for image types
 		static void initializePylon(); // Static method to initialize Pylon
-		void initializeCamera();
-		ImageCaptureController(std::string id);
+		ImageCaptureController(std::string id, const CaptureSettings& settings = CaptureSettings()); // Uses the first Basler camera found
+		ImageCaptureController(std::string id, FrameSource* source, const CaptureSettings& settings = CaptureSettings()); // Takes ownership of source
+		// Also switches the LED for each colour. Takes ownership of both, led may be null.
+		ImageCaptureController(std::string id, FrameSource* source, LedController* led, const CaptureSettings& settings = CaptureSettings());
 		~ImageCaptureController();
-		int captureFrame(); // Will get all colors for 1 frame
-		
-	private:
+		// What captureFrame() did with the frame. Only a queued frame reaches the frame
+		// finished callback later, the others are done with by the time it returns.
+		enum FrameResult
+		{
+			FRAME_DROPPED = -1, // The queue was full, or the journal failed
+			FRAME_QUEUED = 0,
+			FRAME_SKIPPED = 1, // Already on disk from an earlier run
+			FRAME_JOURNALED = 2 // JOURNAL_ONLY, journaled and not processed
+		};
+		int captureFrame(); // Will get all colors for 1 frame, returns a FrameResult
+
+		void setOutputDirectory(std::string directory) { outputDirectory = directory; }
+		// Image ID the next captureFrame() gets, e.g. when reprocessing frames out of a journal.
+		// The IDs jumped over count as never captured.
+		void setNextImageId(int imageId);
+		// Open the session manifest in the output directory and carry on where an earlier
+		// run stopped. Returns the image ID capturing resumes at; frames after it that are
+		// already on disk are skipped by captureFrame() without being taken again.
+		int resumeSession();
+		// Asked for the motor position as each frame is captured, for the session manifest.
+		// Returns false if the position is not known.
+		void setMotorPositionSource(std::function<bool(int64_t& position)> source) { motorPositionSource = source; }
+		// Called once for every queued frame when it is done with, saved tells whether it
+		// made it to disk (processing or the write may have failed). On a worker thread or a
+		// writer thread when those are enabled, it can be called from several threads at once.
+		void setFrameFinishedCallback(std::function<void(RGBImage*, bool saved)> callback) { frameFinishedCallback = callback; }
 
-		static bool pylonInitialized; // Static flag to check if Pylon is initialized
+		// Grab frameCount frames (all three colours) into calibration, as dark frames or as
+		// flats for each colour. Nothing is queued or written, and the image IDs do not move.
+		bool captureCalibrationFrames(FlatFieldCalibration& calibration, bool dark, int frameCount);
+		// Correct every frame processed from now on, null to stop. Safe while capturing.
+		void setCalibration(std::shared_ptr<const FlatFieldCalibration> newCalibration) { std::atomic_store(&calibration, newCalibration); }
+		// Colour stage for every frame processed from now on, null to stop. Safe while capturing.
+		void setColorTransform(std::shared_ptr<const ColorTransform> newTransform) { std::atomic_store(&colorTransform, newTransform); }
+
+	private:
+		struct PendingFrame
+		{
+			RGBImage* rgbImage = nullptr;
+			OIIO::ImageBuf* mergedImage = nullptr; // null if processing failed
+		};
 
-		// This smart pointer will receive the grab result data.
-		CGrabResultPtr ptrGrabResult;
-		CInstantCamera camera;
+		CaptureSettings settings;
+		PipelineMetrics metrics; // Declared first so everything recording into it goes before it
+		std::unique_ptr<FrameSource> frameSource;
+		std::unique_ptr<LedController> ledController;
+		CaptureSequencer sequencer; // Lines the exposures up with the LED and times each step
 
 		int lastImageId;
 		std::string captureId;
+		std::string outputDirectory;
+		std::function<void(RGBImage*, bool)> frameFinishedCallback;
 
-		RGBImageQueue<RGBImage> imageQueue;
-		std::thread workerThread;
-		std::atomic<bool> stopWorker;
-		std::condition_variable stopCondition;
-		std::mutex stopMutex;
+		FrameBufferPool framePool; // Declared before the queue so it outlives every queued frame
+		std::unique_ptr<FrameQueue<RGBImage>> imageQueue; // Closing it is what stops the workers
+		std::vector<std::thread> workerThreads;
+		std::unique_ptr<FrameWriter> frameWriter; // Encodes and writes merged frames, possibly on its own threads
+		std::unique_ptr<StripThreadPool> stripPool; // Only with settings.processingThreads
+		StageTimings processingTimings; // Where the workers' time goes, per stage of the processing
+		std::shared_ptr<const FlatFieldCalibration> calibration; // Swapped atomically, workers take a reference per frame
+		std::shared_ptr<const ColorTransform> colorTransform; // The same
+		std::unique_ptr<FilmBaseEstimator> filmBaseEstimator; // Only with settings.filmBaseEstimation.estimate
+		std::mutex filmBaseMutex; // Held by the worker building the colour stage for a new estimate
+		double appliedFilmBase[3]; // The film base the colour stage was last built for
+		std::unique_ptr<ChannelRegistration> registration; // Only with settings.registerChannels
+		std::unique_ptr<FrameStabilizer> stabilizer; // Only with settings.stabilization
+		std::mutex sidecarLogMutex; // Guards the logs
+		std::ofstream registrationLog; // Opened with the first measured frame
+		std::ofstream stabilizationLog;
+		std::ofstream filmBaseLog;
+		std::vector<double> bracketMs; // Exposure times of an HDR bracket, empty when there is none
+		double currentExposureMs; // What the camera is set to, for the journal
+		std::future<bool> pendingFold; // Last exposure being fused, the capture thread only waits for it when it needs the next
+		bool foldFailed; // A fold of the frame being captured failed, set by waitForFold()
+		std::unique_ptr<CaptureJournal> journal; // Only with settings.journalMode, opened with the first frame
+		std::unique_ptr<SessionManifest> session; // With settings.sessionManifest or resumeSession(), opened with the first frame
+		std::function<bool(int64_t&)> motorPositionSource;
+		std::unique_ptr<PreviewRing> previewRing; // With settings.previewScale and a ring name
 
-		std::vector<uint16_t> scale12BitTo16Bit(const uint16_t* pImageBuffer, int width, int height);
+		// Reorder stage, only used with settings.commitInOrder
+		ReorderBuffer<PendingFrame> reorderBuffer;
+		std::mutex commitMutex;
+		bool committing; // A worker is currently writing frames out of the reorder stage
+
+		std::vector<int> droppedImageIds;
+
+		void startCapture();
+		FrameQueue<RGBImage>* createImageQueue();
 		void processQueue();
-		OIIO::ImageBuf* captureImageAsBuffer();
+		void commitInOrder(RGBImage* rgbImage, OIIO::ImageBuf* mergedImage);
+		void skipInOrder(int firstImageId, int endImageId);
+		void commitReadyFrames();
+		void writeFrame(RGBImage* rgbImage, OIIO::ImageBuf* mergedImage);
+		bool openSession();
+		void recordCapture();
+		void savePreview(int imageId, const FramePreview& preview);
+		void logChannelOffsets(RGBImage* rgbImage);
+		void logStabilization(RGBImage* rgbImage);
+		void updateFilmBase(int imageId, const FilmBaseSample& sample);
+		void appendSidecarLine(std::ofstream& log, const std::string& suffix, const std::string& header, const std::string& line);
+		// exposureIndex is the exposure's place in the bracket, -1 keeps it out of the journal
+		OIIO::ImageBuf* captureColor(LedController::LedColor color, LedController::LedColor nextColor, int exposureIndex);
+		OIIO::ImageBuf* captureChannel(LedController::LedColor color, LedController::LedColor nextColor, const FlatFieldCalibration* frameCalibration);
+		OIIO::ImageBuf* captureBracket(LedController::LedColor color, LedController::LedColor nextColor, const FlatFieldCalibration* frameCalibration);
+		double setBracketExposure(int index);
+		bool waitForFold();
+		OIIO::ImageBuf* captureImageAsBuffer(LedController::LedColor color, int exposureIndex);
+		int captureFrameToJournal();
+		bool grabIntoJournal(LedController::LedColor color, int exposureIndex);
+		bool journalExposure(const RawFrame& frame, LedController::LedColor color, int exposureIndex);
 		void manuallyStepThroughImage();
-
-		Pylon::CPylonImageWindow window;
 };
-
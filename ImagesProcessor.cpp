@@ -4,13 +4,29 @@
 *   kyle@kylem.org
 */
 
+// Pixels of one channel per strip. The strip of all three channels, the corrected
+// copies and the merged RGB stay in the L2 cache between the steps.
+#define PROCESSING_STRIP_PIXELS (64 * 1024)
+
 #include "ImagesProcessor.h"
+#include <OpenImageIO/filesystem.h>
+#include <OpenImageIO/imageio.h>
+#include <algorithm>
+#include <cmath>
+#include "ChannelRegistration.h"
+#include "ColorTransform.h"
+#include "FilmBaseEstimator.h"
+#include "FlatFieldCalibration.h"
+#include "FramePreview.h"
+#include "PixelKernels.h"
+#include "StripPipeline.h"
 
 /*
 * Create a master full color/bitdepth from the 3 mono16 ImageBufs,
 * complete with all post-processing
 */
-OIIO::ImageBuf* ImagesProcessor::createProcessedRGBImage(OIIO::ImageBuf* redChannel, OIIO::ImageBuf* greenChannel, OIIO::ImageBuf* blueChannel) {
+OIIO::ImageBuf* ImagesProcessor::createProcessedRGBImage(OIIO::ImageBuf* redChannel, OIIO::ImageBuf* greenChannel, OIIO::ImageBuf* blueChannel, FrameBufferPool* pool,
+    const ProcessingOptions& options) {
     // Check for null pointers
     if (!redChannel || !greenChannel || !blueChannel) {
         std::cerr << "Error: One or more input image buffers are null." << std::endl;
@@ -24,10 +40,20 @@ OIIO::ImageBuf* ImagesProcessor::createProcessedRGBImage(OIIO::ImageBuf* redChan
         return nullptr;
     }
 
-    // Create an empty image buffer for the final RGB image
+    // Fused HDR brackets are float, and have to stay float
+    bool floatChannels = redChannel->spec().format == OIIO::TypeDesc::FLOAT;
+    if (floatChannels != (greenChannel->spec().format == OIIO::TypeDesc::FLOAT) || floatChannels != (blueChannel->spec().format == OIIO::TypeDesc::FLOAT)) {
+        std::cerr << "Error: Input image buffers have different pixel formats." << std::endl;
+        return nullptr;
+    }
+
+    // Create an empty image buffer for the final RGB image. Every pixel gets written by the merge.
     OIIO::ImageSpec spec = redChannel->spec();
     spec.nchannels = 3; // Set the number of channels to 3 (RGB)
-    OIIO::ImageBuf* rgbImage = new OIIO::ImageBuf(spec);
+    if (floatChannels) {
+        spec.set_format(options.halfFloatOutput ? OIIO::TypeDesc::HALF : OIIO::TypeDesc::FLOAT);
+    }
+    OIIO::ImageBuf* rgbImage = pool ? pool->acquire(spec) : new OIIO::ImageBuf(spec, OIIO::InitializePixels::No);
 
 
     // Check if the output image buffer was created successfully
@@ -45,12 +71,22 @@ OIIO::ImageBuf* ImagesProcessor::createProcessedRGBImage(OIIO::ImageBuf* redChan
     // Check for null pointers in the data arrays
     if (!redData || !greenData || !blueData || !rgbData) {
         std::cerr << "Error: One or more image data arrays are null." << std::endl;
-        delete rgbImage;
+        if (pool) {
+            pool->release(rgbImage);
+        }
+        else {
+            delete rgbImage;
+        }
         return nullptr;
     }
 
-    // Merge the channels by copying the data directly based on the data type
-    mergeChannels(static_cast<const uint16_t*>(redData), static_cast<const uint16_t*>(greenData), static_cast<const uint16_t*>(blueData), static_cast<uint16_t*>(rgbData), spec.width, spec.height);
+    // Calibrate and merge the channels, strip by strip
+    if (floatChannels) {
+        mergeFloatChannels(static_cast<const float*>(redData), static_cast<const float*>(greenData), static_cast<const float*>(blueData), rgbData, spec.width, spec.height, options);
+    }
+    else {
+        mergeChannels(static_cast<const uint16_t*>(redData), static_cast<const uint16_t*>(greenData), static_cast<const uint16_t*>(blueData), static_cast<uint16_t*>(rgbData), spec.width, spec.height, options);
+    }
 
     // TODO: More Image Processing here, to the rgbData array now
 
@@ -60,19 +96,208 @@ OIIO::ImageBuf* ImagesProcessor::createProcessedRGBImage(OIIO::ImageBuf* redChan
 }
 
 /*
-* Take 3 arrays of the image data (16bit scaled) and merge them into the master rgbData 
+* Sub-pixel shift of one channel, worked out once per frame. Output pixel (x, y) is
+* sampled from (x + shiftX + fraction, y + shiftY + fraction) in the source, with the
+* fractions rounded to 1/16 pixel so the four bilinear weights add up to exactly 256.
+*/
+struct ChannelShiftPlan {
+    bool shifted = false;
+    int shiftX = 0;
+    int shiftY = 0;
+    uint16_t weights[4] = { 256, 0, 0, 0 };
+};
+
+static ChannelShiftPlan planShift(const ChannelShift& shift) {
+    ChannelShiftPlan plan;
+    int sixteenthsX = (int)std::lround(shift.dx * 16.0f);
+    int sixteenthsY = (int)std::lround(shift.dy * 16.0f);
+    if (shift.windowsUsed == 0 || (sixteenthsX == 0 && sixteenthsY == 0)) {
+        return plan;
+    }
+    plan.shifted = true;
+    plan.shiftX = sixteenthsX >> 4; // Floor, also for negative shifts
+    plan.shiftY = sixteenthsY >> 4;
+    int fractionX = sixteenthsX & 15;
+    int fractionY = sixteenthsY & 15;
+    plan.weights[0] = (uint16_t)((16 - fractionX) * (16 - fractionY));
+    plan.weights[1] = (uint16_t)(fractionX * (16 - fractionY));
+    plan.weights[2] = (uint16_t)((16 - fractionX) * fractionY);
+    plan.weights[3] = (uint16_t)(fractionX * fractionY);
+    return plan;
+}
+
+/*
+* One shifted row. Output pixels whose source falls off the left or right edge repeat
+* the edge pixel, the rest go through the SIMD kernel.
 */
-void ImagesProcessor::mergeChannels(const uint16_t* redData, const uint16_t* greenData, const uint16_t* blueData, uint16_t* rgbData, int width, int height) {
-    for (int y = 0; y < height; ++y) {
-        for (int x = 0; x < width; ++x) {
-            int index = y * width + x;
-            rgbData[index * 3 + 0] = redData[index];
-            rgbData[index * 3 + 1] = greenData[index];
-            rgbData[index * 3 + 2] = blueData[index];
+static void shiftRow(const uint16_t* top, const uint16_t* bottom, uint16_t* destination, int width, const ChannelShiftPlan& plan) {
+    int interiorBegin = std::min(width, std::max(0, -plan.shiftX));
+    int interiorEnd = std::max(interiorBegin, std::min(width, width - 1 - plan.shiftX));
+    if (interiorEnd > interiorBegin) {
+        PixelKernels::bilinearRow(top + interiorBegin + plan.shiftX, bottom + interiorBegin + plan.shiftX, destination + interiorBegin, interiorEnd - interiorBegin, plan.weights);
+    }
+    for (int x = 0; x < width; x++) {
+        if (x == interiorBegin) {
+            x = interiorEnd;
+            if (x >= width) {
+                break;
+            }
         }
+        int left = std::min(width - 1, std::max(0, x + plan.shiftX));
+        int right = std::min(width - 1, std::max(0, x + plan.shiftX + 1));
+        uint32_t sum = plan.weights[0] * top[left] + plan.weights[1] * top[right] + plan.weights[2] * bottom[left] + plan.weights[3] * bottom[right];
+        destination[x] = (uint16_t)((sum + 128) >> 8);
     }
 }
 
+/*
+* Take 3 arrays of the image data (16bit scaled) and merge them into the master rgbData.
+* The steps run as stages of a StripPipeline: for each strip of rows every channel is
+* calibrated, shifted and colour corrected in a small per-thread buffer and interleaved
+* from there while it is still in cache, so no step adds another pass over the frame in
+* memory. A shifted channel is calibrated over the source rows its strip samples from,
+* one band per strip. Stages with nothing to do are left out.
+*/
+void ImagesProcessor::mergeChannels(const uint16_t* redData, const uint16_t* greenData, const uint16_t* blueData, uint16_t* rgbData, int width, int height, const ProcessingOptions& options) {
+    const FlatFieldCalibration* calibration = options.calibration;
+    if (calibration != nullptr && !calibration->matches(width, height)) {
+        std::cerr << "Warning: Calibration is " << calibration->getWidth() << "x" << calibration->getHeight() << " but the frame is "
+            << width << "x" << height << ", merging uncorrected." << std::endl;
+        calibration = nullptr;
+    }
+    // Green is the reference for the colours and only moves with the whole frame
+    ChannelShift shifts[3];
+    if (options.channelOffsets != nullptr && options.channelOffsets->measured) {
+        shifts[0] = options.channelOffsets->red;
+        shifts[2] = options.channelOffsets->blue;
+    }
+    if (options.frameShift != nullptr && options.frameShift->windowsUsed > 0) {
+        for (ChannelShift& shift : shifts) {
+            shift.dx += options.frameShift->dx;
+            shift.dy += options.frameShift->dy;
+            shift.windowsUsed = std::max(shift.windowsUsed, options.frameShift->windowsUsed);
+        }
+    }
+    ChannelShiftPlan plans[3];
+    for (int channel = 0; channel < 3; channel++) {
+        plans[channel] = planShift(shifts[channel]);
+    }
+    bool shifting = plans[0].shifted || plans[1].shifted || plans[2].shifted;
+
+    // Buffers 0-2 hold each channel of the strip, 3-5 the calibrated band a shifted channel samples from
+    const uint16_t* sources[3] = { redData, greenData, blueData };
+    const LedController::LedColor colors[3] = { LedController::LED_RED, LedController::LED_GREEN, LedController::LED_BLUE };
+    auto sourceBand = [&](const StripPipeline::Strip& strip, int channel, int& bandFirst, int& bandLast) {
+        bandFirst = std::min(height - 1, std::max(0, (int)strip.firstRow + plans[channel].shiftY));
+        bandLast = std::min(height - 1, std::max(0, (int)strip.endRow + plans[channel].shiftY));
+    };
+    StripPipeline pipeline(width, height, sources);
+
+    if (calibration != nullptr) {
+        pipeline.addStage("calibrate", [&](StripPipeline::Strip& strip) {
+            for (int channel = 0; channel < 3; channel++) {
+                if (!plans[channel].shifted) {
+                    uint16_t* plane = strip.buffer(channel, strip.pixelCount);
+                    calibration->apply(colors[channel], strip.planes[channel], plane, strip.firstPixel, strip.pixelCount);
+                    strip.planes[channel] = plane;
+                    continue;
+                }
+                int bandFirst, bandLast;
+                sourceBand(strip, channel, bandFirst, bandLast);
+                size_t bandPixels = (size_t)(bandLast - bandFirst + 1) * width;
+                calibration->apply(colors[channel], sources[channel] + (size_t)bandFirst * width, strip.buffer(3 + channel, bandPixels),
+                    (size_t)bandFirst * width, bandPixels);
+            }
+        });
+    }
+    if (shifting) {
+        pipeline.addStage("shift", [&](StripPipeline::Strip& strip) {
+            for (int channel = 0; channel < 3; channel++) {
+                const ChannelShiftPlan& plan = plans[channel];
+                if (!plan.shifted) {
+                    continue;
+                }
+                int bandFirst, bandLast;
+                sourceBand(strip, channel, bandFirst, bandLast);
+                size_t bandPixels = (size_t)(bandLast - bandFirst + 1) * width;
+                const uint16_t* bandData = calibration != nullptr ? strip.buffer(3 + channel, bandPixels) : sources[channel] + (size_t)bandFirst * width;
+                uint16_t* plane = strip.buffer(channel, strip.pixelCount);
+                for (size_t row = strip.firstRow; row < strip.endRow; row++) {
+                    int top = std::min(height - 1, std::max(0, (int)row + plan.shiftY));
+                    int bottom = std::min(height - 1, std::max(0, (int)row + plan.shiftY + 1));
+                    shiftRow(bandData + (size_t)(top - bandFirst) * width, bandData + (size_t)(bottom - bandFirst) * width,
+                        plane + (row - strip.firstRow) * width, width, plan);
+                }
+                strip.planes[channel] = plane;
+            }
+        });
+    }
+    if (options.filmBaseSample != nullptr && options.filmBaseSample->prepare(width, height)) {
+        pipeline.addStage("film_base", [&](StripPipeline::Strip& strip) {
+            options.filmBaseSample->addRows(strip.planes, strip.firstRow, strip.endRow);
+        });
+    }
+    if (options.color != nullptr && options.color->isActive()) {
+        pipeline.addStage("color", [&](StripPipeline::Strip& strip) {
+            // In place when an earlier stage already copied the channel into its buffer
+            uint16_t* planes[3];
+            for (int channel = 0; channel < 3; channel++) {
+                planes[channel] = strip.buffer(channel, strip.pixelCount);
+            }
+            options.color->apply(strip.planes, planes, strip.pixelCount);
+            for (int channel = 0; channel < 3; channel++) {
+                strip.planes[channel] = planes[channel];
+            }
+        });
+    }
+    if (options.preview != nullptr && options.preview->prepare(width, height, options.previewScale)) {
+        pipeline.setRowAlignment(options.previewScale);
+        pipeline.addStage("preview", [&](StripPipeline::Strip& strip) {
+            options.preview->addRows(strip.planes, strip.firstRow, strip.endRow);
+        });
+    }
+    pipeline.addStage("interleave", [&](StripPipeline::Strip& strip) {
+        PixelKernels::interleave3(strip.planes[0], strip.planes[1], strip.planes[2], rgbData + strip.firstPixel * 3, strip.pixelCount);
+    });
+
+    pipeline.run(options.stripPool, options.stripPixels > 0 ? options.stripPixels : PROCESSING_STRIP_PIXELS);
+    pipeline.addTimings(options.timings);
+}
+
+/*
+* Merge of fused HDR channels. They were calibrated while the bracket was fused, and
+* registration and stabilization only work on single exposures, so this is only the
+* interleave, converting to half floats on the way when asked to.
+*/
+void ImagesProcessor::mergeFloatChannels(const float* redData, const float* greenData, const float* blueData, void* rgbData, int width, int height, const ProcessingOptions& options) {
+    const uint16_t* noPlanes[3] = { nullptr, nullptr, nullptr };
+    StripPipeline pipeline(width, height, noPlanes);
+    if (options.preview != nullptr && options.preview->prepare(width, height, options.previewScale)) {
+        pipeline.setRowAlignment(options.previewScale);
+        pipeline.addStage("preview", [&](StripPipeline::Strip& strip) {
+            const float* planes[3] = { redData + strip.firstPixel, greenData + strip.firstPixel, blueData + strip.firstPixel };
+            options.preview->addRows(planes, strip.firstRow, strip.endRow);
+        });
+    }
+    pipeline.addStage("interleave", [&](StripPipeline::Strip& strip) {
+        size_t first = strip.firstPixel;
+        size_t count = strip.pixelCount;
+        if (options.halfFloatOutput) {
+            PixelKernels::interleave3Half(redData + first, greenData + first, blueData + first, static_cast<uint16_t*>(rgbData) + first * 3, count);
+            return;
+        }
+        float* rgb = static_cast<float*>(rgbData) + first * 3;
+        for (size_t i = 0; i < count; i++) {
+            rgb[i * 3 + 0] = redData[first + i];
+            rgb[i * 3 + 1] = greenData[first + i];
+            rgb[i * 3 + 2] = blueData[first + i];
+        }
+    });
+
+    pipeline.run(options.stripPool, options.stripPixels > 0 ? options.stripPixels : PROCESSING_STRIP_PIXELS);
+    pipeline.addTimings(options.timings);
+}
+
 /*
 * Save an image to a file, with the extension determining the file type
 */
@@ -83,3 +308,23 @@ bool ImagesProcessor::saveImage(OIIO::ImageBuf* image, std::string filename) {
 	}
 	return true;
 }
+
+/*
+* Same as saveImage, but the file is built in memory so the caller decides how it
+* reaches the disk. encoded is cleared first, pass the same vector in again to reuse it.
+*/
+bool ImagesProcessor::encodeImage(OIIO::ImageBuf* image, std::string filename, std::vector<unsigned char>& encoded) {
+    encoded.clear();
+    OIIO::Filesystem::IOVecOutput memoryOutput(encoded);
+    auto output = OIIO::ImageOutput::create(filename);
+    if (!output || !output->supports("ioproxy") || !output->set_ioproxy(&memoryOutput)) {
+        std::cerr << "Error: No in-memory writer for " << filename << std::endl;
+        return false;
+    }
+    const OIIO::ImageSpec& spec = image->spec();
+    if (!output->open(filename, spec) || !output->write_image(spec.format, image->localpixels()) || !output->close()) {
+        std::cerr << "Error encoding image: " << output->geterror() << std::endl;
+        return false;
+    }
+    return true;
+}
@@ -8,15 +8,47 @@
 
 #include <OpenImageIO/imagebuf.h>
 #include <iostream>
+#include <vector>
+#include "FrameBufferPool.h"
 
 using namespace std;
 
+class ColorTransform;
+class FilmBaseSample;
+class FlatFieldCalibration;
+class FramePreview;
+class StageTimings;
+class StripThreadPool;
+struct ChannelOffsets;
+struct ChannelShift;
+
+// What createProcessedRGBImage does on top of merging the channels. Nothing is owned.
+struct ProcessingOptions
+{
+	const FlatFieldCalibration* calibration = nullptr; // Dark and flat correction, skipped if null or a different size
+	const ChannelOffsets* channelOffsets = nullptr; // Red and blue are shifted back onto green by these
+	const ChannelShift* frameShift = nullptr; // All three channels are moved by this on top, to steady the frame
+	StripThreadPool* stripPool = nullptr; // Spreads the strips of a frame over threads, null runs them on the calling thread
+	bool halfFloatOutput = true; // Float channels (fused HDR brackets) come out as half floats, otherwise as float
+	size_t stripPixels = 0; // Pixels per channel of a strip, 0 for the default that keeps a strip in L2
+	FilmBaseSample* filmBaseSample = nullptr; // Filled from the film base region before the colour stage, 16 bit frames only
+	const ColorTransform* color = nullptr; // Inversion, curves and 3D LUT after the shifts, 16 bit frames only
+	StageTimings* timings = nullptr; // Gets the CPU time of every stage of the merge
+	FramePreview* preview = nullptr; // Filled with a downsampled 8 bit copy as the strips go by, prepared for previewScale
+	int previewScale = 0;
+};
+
 class ImagesProcessor
 {
 	public:
-		static OIIO::ImageBuf* createProcessedRGBImage(OIIO::ImageBuf* redChannel, OIIO::ImageBuf* greenChannel, OIIO::ImageBuf* blueChannel);
+		// The result comes from pool when one is given (give it back with pool->release), otherwise delete it
+		static OIIO::ImageBuf* createProcessedRGBImage(OIIO::ImageBuf* redChannel, OIIO::ImageBuf* greenChannel, OIIO::ImageBuf* blueChannel, FrameBufferPool* pool = nullptr,
+			const ProcessingOptions& options = ProcessingOptions());
 		static bool saveImage(OIIO::ImageBuf* image, std::string filename);
+		// Encode into memory instead of a file, the extension of filename picks the format
+		static bool encodeImage(OIIO::ImageBuf* image, std::string filename, std::vector<unsigned char>& encoded);
 	private:
-		static void mergeChannels(const uint16_t* redData, const uint16_t* greenData, const uint16_t* blueData, uint16_t* rgbData, int width, int height);
+		static void mergeChannels(const uint16_t* redData, const uint16_t* greenData, const uint16_t* blueData, uint16_t* rgbData, int width, int height, const ProcessingOptions& options);
+		static void mergeFloatChannels(const float* redData, const float* greenData, const float* blueData, void* rgbData, int width, int height, const ProcessingOptions& options);
 };
 
@@ -0,0 +1,184 @@
+/*
+*   JournalFrameSource.cpp
+*	Film Scanner Master PC Control Software by Kyle Mikolajczyk
+*	kyle@kylem.org
+*/
+
+#include "JournalFrameSource.h"
+#include <algorithm>
+#include <iostream>
+
+JournalFrameSource::JournalFrameSource(const std::string& directory, const std::string& captureId, int firstImageId, int lastImageId, size_t readAhead)
+    : directory(directory), captureId(captureId), firstImageId(firstImageId), lastImageId(lastImageId), opened(false), exposureCount(1),
+    reader(directory, captureId), records(std::max<size_t>(1, readAhead)), bytesRead(0), skippedFrames(0)
+{
+}
+
+bool JournalFrameSource::open()
+{
+    if (!opened)
+    {
+        opened = true;
+        readerThread = std::thread(&JournalFrameSource::readLoop, this);
+    }
+    Record* first = peek();
+    if (first == nullptr)
+    {
+        std::cerr << "Error: Journal " << CaptureJournal::segmentPath(directory, captureId, 0) << " has no complete frames";
+        if (lastImageId >= 0)
+        {
+            std::cerr << " from image " << firstImageId << " to " << lastImageId;
+        }
+        else if (firstImageId > 0)
+        {
+            std::cerr << " from image " << firstImageId;
+        }
+        std::cerr << "." << std::endl;
+        return false;
+    }
+    exposureCount = first->header.exposureCount;
+    return true;
+}
+
+/*
+* Records before the range are skipped by their headers, so starting halfway through a
+* reel does not read the first half of it. Stops at the end of the range or of the
+* journal, whichever comes first.
+*/
+void JournalFrameSource::readLoop()
+{
+    JournalRecordHeader header;
+    while (reader.peek(header) && header.imageId < firstImageId)
+    {
+        reader.skip(header);
+    }
+
+    std::vector<Record*> frame;
+    bool queueOpen = true;
+    while (queueOpen)
+    {
+        std::unique_ptr<Record> record(new Record());
+        if (!reader.next(record->header, record->payload))
+        {
+            break;
+        }
+        bytesRead += record->header.recordBytes;
+        if (lastImageId >= 0 && record->header.imageId > lastImageId)
+        {
+            break;
+        }
+        if (!frame.empty() && frame[0]->header.imageId != record->header.imageId)
+        {
+            queueOpen = queueFrame(frame);
+        }
+        frame.push_back(record.release());
+    }
+    if (queueOpen && !frame.empty())
+    {
+        queueFrame(frame);
+    }
+    for (Record* record : frame)
+    {
+        delete record;
+    }
+    records.close();
+}
+
+/*
+* Queue the exposures of one frame if they are all there, in the order the controller
+* asks for them: red, green, blue, each colour's bracket shortest first. Empties frame
+* either way. False once the queue has been closed.
+*/
+bool JournalFrameSource::queueFrame(std::vector<Record*>& frame)
+{
+    int count = frame[0]->header.exposureCount;
+    bool complete = count > 0 && frame.size() == (size_t)(3 * count);
+    for (size_t i = 0; i < frame.size() && complete; i++)
+    {
+        complete = frame[i]->header.color == (int)(i / count) && frame[i]->header.exposureIndex == (int)(i % count);
+    }
+    if (!complete)
+    {
+        std::cerr << "Error: Image " << frame[0]->header.imageId << " is not complete in the journal (" << frame.size() << " of "
+            << 3 * count << " exposures), skipping it." << std::endl;
+        skippedFrames++;
+    }
+
+    bool queueOpen = true;
+    for (Record* record : frame)
+    {
+        bool queued = complete && queueOpen && records.push(record);
+        if (complete && !queued)
+        {
+            queueOpen = false; // Only a closed queue refuses
+        }
+        if (!queued)
+        {
+            delete record;
+        }
+    }
+    frame.clear();
+    return queueOpen;
+}
+
+JournalFrameSource::Record* JournalFrameSource::peek()
+{
+    Record* record;
+    if (!next && records.pop(record))
+    {
+        next.reset(record);
+    }
+    return next.get();
+}
+
+int JournalFrameSource::peekImageId()
+{
+    Record* record = peek();
+    return record != nullptr ? record->header.imageId : -1;
+}
+
+/*
+* Never waits longer than it takes to read the next record, timeoutMs does not apply
+*/
+bool JournalFrameSource::grabFrame(RawFrame& frame, unsigned int /*timeoutMs*/)
+{
+    if (peek() == nullptr)
+    {
+        return false;
+    }
+    current = std::move(next);
+    const JournalRecordHeader& header = current->header;
+    frame.data = current->payload.data();
+    frame.bufferSize = current->payload.size();
+    frame.width = header.width;
+    frame.height = header.height;
+    frame.format = (RawFrame::PixelFormat)header.pixelFormat;
+    frame.frameNumber = header.frameNumber;
+    frame.timestamp = std::chrono::steady_clock::now();
+    return true;
+}
+
+double JournalFrameSource::getExposureTimeMs()
+{
+    Record* record = peek();
+    return record != nullptr ? record->header.exposureMs : 0.0;
+}
+
+std::string JournalFrameSource::getName()
+{
+    return "journal " + captureId + " in " + directory;
+}
+
+JournalFrameSource::~JournalFrameSource()
+{
+    records.close();
+    if (readerThread.joinable())
+    {
+        readerThread.join();
+    }
+    Record* record;
+    while (records.tryPop(record))
+    {
+        delete record;
+    }
+}
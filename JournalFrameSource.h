@@ -0,0 +1,74 @@
+/*
+*   JournalFrameSource.h
+*	Film Scanner Master PC Control Software by Kyle Mikolajczyk
+*   kyle@kylem.org
+*/
+
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "CaptureJournal.h"
+#include "FrameSource.h"
+#include "RGBImageQueue.h"
+
+/*
+* Plays the exposures of a capture journal back as if they came off the camera, so a
+* reel can go through ImageCaptureController again without rescanning it. A thread
+* streams the records of the frames in [firstImageId, lastImageId] from disk a few
+* exposures ahead of the controller. Frames that are not complete in the journal are
+* skipped as a whole, so the colours can never slip into the next frame.
+*
+* Exposure times come from the journal: getExposureTimeMs() is the exposure of the next
+* record, which is what an HDR bracket fuses with.
+*/
+class JournalFrameSource : public FrameSource
+{
+	public:
+		// lastImageId of -1 reads to the end of the journal
+		JournalFrameSource(const std::string& directory, const std::string& captureId, int firstImageId = 0, int lastImageId = -1, size_t readAhead = 6);
+		~JournalFrameSource();
+
+		bool open() override; // Waits for the first complete frame, false if there is none
+		void startGrabbing() override {}
+		void stopGrabbing() override {}
+		bool isGrabbing() override { return true; }
+		bool grabFrame(RawFrame& frame, unsigned int timeoutMs) override;
+		double getExposureTimeMs() override;
+		bool setExposureTimeMs(double /*exposureMs*/) override { return true; } // What was shot is in the journal
+		std::string getName() override;
+
+		int peekImageId(); // Image ID of the next exposure, -1 once the journal is done
+		int getExposureCount() { return exposureCount; } // Per colour, from the first frame
+		uint64_t getBytesRead() { return bytesRead.load(); }
+		uint64_t getSkippedFrames() { return skippedFrames.load(); }
+
+	private:
+		struct Record
+		{
+			JournalRecordHeader header;
+			std::vector<unsigned char> payload;
+		};
+
+		std::string directory;
+		std::string captureId;
+		int firstImageId;
+		int lastImageId;
+		bool opened;
+		int exposureCount;
+
+		JournalReader reader;
+		RGBImageQueue<Record> records;
+		std::thread readerThread;
+		std::atomic<uint64_t> bytesRead;
+		std::atomic<uint64_t> skippedFrames;
+
+		std::unique_ptr<Record> current; // Handed out by the last grabFrame()
+		std::unique_ptr<Record> next; // Taken off the queue to peek at
+
+		void readLoop();
+		bool queueFrame(std::vector<Record*>& frame);
+		Record* peek();
+};
@@ -0,0 +1,53 @@
+/*
+*   LedController.h
+*	Film Scanner Master PC Control Software by Kyle Mikolajczyk
+*   kyle@kylem.org
+*/
+
+#pragma once
+
+#include <chrono>
+#include <future>
+#include <string>
+#include <thread>
+
+/*
+* The light behind the film. Each frame is exposed once per colour, and the light has
+* to be showing that colour for the whole exposure.
+*/
+class LedController
+{
+	public:
+		enum LedColor { LED_RED, LED_GREEN, LED_BLUE };
+
+		virtual ~LedController() {}
+
+		// Switch colour and block until the light reports it is on, false on error/timeout
+		virtual bool setColor(LedColor color) = 0;
+		// Same without blocking. Runs setColor on another thread unless the controller can do better.
+		virtual std::future<bool> setColorAsync(LedColor color)
+		{
+			return std::async(std::launch::async, [this, color]() { return setColor(color); });
+		}
+		virtual std::string getName() = 0;
+};
+
+/*
+* Stand-in for the Arduino when benchmarking. Each switch takes as long as a serial
+* round trip plus the LED settling would.
+*/
+class SimulatedLedController : public LedController
+{
+	public:
+		SimulatedLedController(double switchMs) : switchMs(switchMs) {}
+
+		bool setColor(LedColor /*color*/) override
+		{
+			std::this_thread::sleep_for(std::chrono::duration<double, std::milli>(switchMs));
+			return true;
+		}
+		std::string getName() override { return "Simulated"; }
+
+	private:
+		double switchMs;
+};
@@ -5,9 +5,12 @@
 */
 
 #include "MDriveConn.h"
+#include <algorithm>
+#include <chrono>
+#include <sstream>
 
 MDriveConn::MDriveConn(const std::string& port, unsigned int baud_rate)
-    : io(), serial(io, port)
+    : io(), serial(io, port), byteSeconds(10.0 / baud_rate), replyOutstanding(false)
 {
     serial.set_option(boost::asio::serial_port_base::baud_rate(baud_rate));
     serial.set_option(boost::asio::serial_port_base::character_size(8)); // 8 data bits
@@ -57,4 +60,129 @@ void MDriveConn::initializeAndHome()
             return; // Exit the loop if "Ready." is found
         }
     }
-}
\ No newline at end of file
+}
+
+/*
+* Like read(), a byte at a time so nothing after the prompt is taken from the port, but
+* giving up at the deadline. prompt is '>' when the drive is ready and '?' after an error.
+*/
+bool MDriveConn::readUntilPrompt(std::string& result, char& prompt, int timeoutMs)
+{
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+    result.clear();
+    for (;;)
+    {
+        char c = 0;
+        bool done = false;
+        boost::system::error_code error;
+        boost::asio::async_read(serial, boost::asio::buffer(&c, 1), [&](const boost::system::error_code& ec, size_t) {
+            error = ec;
+            done = true;
+        });
+        io.restart();
+        io.run_until(deadline);
+        if (!done)
+        {
+            // Cancelled reads still complete, their handler has to run before c goes away
+            serial.cancel();
+            io.restart();
+            io.run();
+            return false;
+        }
+        if (error)
+        {
+            return false;
+        }
+
+        if (c == '?' || c == '>')
+        {
+            prompt = c;
+            return true;
+        }
+        result += c;
+    }
+}
+
+bool MDriveConn::query(const std::string& command, std::string& reply, int timeoutMs)
+{
+    size_t replyBytes = 0;
+    return transact(command, reply, replyBytes, timeoutMs);
+}
+
+/*
+* replyBytes is what came after the echo of the command, the echo itself goes out while
+* the command is still coming in. A reply that timed out is read up to its prompt and
+* dropped first, or it would be taken for the answer to this command and every reply
+* after it would be one behind. If it does not come within timeoutMs either, nothing
+* more is expected.
+*/
+bool MDriveConn::transact(const std::string& command, std::string& reply, size_t& replyBytes, int timeoutMs)
+{
+    std::lock_guard<std::mutex> lock(transactionMutex);
+    reply.clear();
+    std::string response;
+    char prompt = 0;
+    if (replyOutstanding)
+    {
+        readUntilPrompt(response, prompt, timeoutMs);
+        replyOutstanding = false;
+    }
+    write(command);
+    if (!readUntilPrompt(response, prompt, timeoutMs))
+    {
+        std::cerr << "Error: MDrive did not answer " << command << std::endl;
+        replyOutstanding = true;
+        return false;
+    }
+    replyBytes = response.size() + 1 - std::min(response.size(), command.size());
+
+    // The drive echoes what it is sent unless told otherwise (EM), so the echo is skipped
+    std::istringstream lines(response);
+    std::string line;
+    while (std::getline(lines, line))
+    {
+        line.erase(0, line.find_first_not_of(" \r\t"));
+        line.erase(line.find_last_not_of(" \r\t") + 1);
+        if (!line.empty() && line != command)
+        {
+            reply += reply.empty() ? line : " " + line;
+        }
+    }
+    return prompt == '>';
+}
+
+bool MDriveConn::readPosition(int64_t& position)
+{
+    std::chrono::steady_clock::time_point latchedAt;
+    return readPosition(position, latchedAt);
+}
+
+bool MDriveConn::readPosition(int64_t& position, std::chrono::steady_clock::time_point& latchedAt)
+{
+    std::string reply;
+    size_t replyBytes = 0;
+    auto sent = std::chrono::steady_clock::now();
+    if (!transact("PR P", reply, replyBytes, DEFAULT_TIMEOUT_MS))
+    {
+        return false;
+    }
+    auto received = std::chrono::steady_clock::now();
+    latchedAt = std::max(sent, received - std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+        std::chrono::duration<double>(replyBytes * byteSeconds)));
+    try
+    {
+        size_t parsed = 0;
+        position = std::stoll(reply, &parsed);
+        return parsed == reply.size();
+    }
+    catch (const std::exception&)
+    {
+        return false;
+    }
+}
+
+bool MDriveConn::slew(int64_t stepsPerSecond)
+{
+    std::string reply;
+    return query("SL " + std::to_string(stepsPerSecond), reply);
+}
@@ -4,20 +4,46 @@
 *	kyle@kylem.org
 */
 
+#pragma once
+
 #include <boost/asio.hpp>
+#include <chrono>
+#include <cstdint>
 #include <iostream>
+#include <mutex>
 #include <string>
 
 class MDriveConn
 {
     public:
+        static const int DEFAULT_TIMEOUT_MS = 1000;
+
         MDriveConn(const std::string& port, unsigned int baud_rate);
         void write(const std::string& data);
         std::string read();
 
         void initializeAndHome();
 
+        // Send one command and wait for the drive's prompt, as one transaction so several
+        // threads can share the drive. reply is what the drive printed in between, without
+        // the echo of the command and the line breaks. False if it answered with the error
+        // prompt or not within timeoutMs.
+        bool query(const std::string& command, std::string& reply, int timeoutMs = DEFAULT_TIMEOUT_MS);
+        // PR P, the position counter in microsteps. latchedAt is when the drive read it: the
+        // reply came in less the time its bytes after the echo took on the wire.
+        bool readPosition(int64_t& position);
+        bool readPosition(int64_t& position, std::chrono::steady_clock::time_point& latchedAt);
+        // SL, slew at a constant velocity in microsteps/s until told otherwise. The drive
+        // ramps there with its A and D, 0 stops it.
+        bool slew(int64_t stepsPerSecond);
+
     private:
         boost::asio::io_service io;
         boost::asio::serial_port serial;
-};
\ No newline at end of file
+        double byteSeconds; // On the wire, 10 bits per byte
+        std::mutex transactionMutex;
+        bool replyOutstanding; // The last reply timed out, what is left of it may still come
+
+        bool readUntilPrompt(std::string& result, char& prompt, int timeoutMs);
+        bool transact(const std::string& command, std::string& reply, size_t& replyBytes, int timeoutMs);
+};
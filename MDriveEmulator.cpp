@@ -0,0 +1,237 @@
+/*
+*   MDriveEmulator.cpp
+*	Film Scanner Master PC Control Software by Kyle Mikolajczyk
+*	kyle@kylem.org
+*/
+
+// What PR PN answers, an MDrive Plus 23 with encoder
+#define EMULATED_PART_NUMBER "MDI1PRD23C4-EQ"
+// The drive's defaults for A and D
+#define DEFAULT_ACCELERATION 1000000.0
+
+#include "MDriveEmulator.h"
+#include <algorithm>
+#include <cmath>
+#include <sstream>
+#include <thread>
+
+MDriveEmulator::MDriveEmulator(double baudRate, double speedError, double homingMs) : PtyDeviceEmulator(baudRate),
+    speedError(speedError), homingMs(homingMs), commandsReceived(0), nextReplyDelayMs(0.0), changeTime(std::chrono::steady_clock::now()),
+    changePosition(0.0), changeVelocity(0.0), targetVelocity(0.0), acceleration(DEFAULT_ACCELERATION), deceleration(DEFAULT_ACCELERATION)
+{
+}
+
+MDriveEmulator::~MDriveEmulator()
+{
+    // Nothing may run handleBytes() or the program once this part is gone
+    stop();
+    if (homingThread.joinable())
+    {
+        homingThread.join();
+    }
+}
+
+/*
+* A ramp at constant acceleration from changeVelocity to targetVelocity, then constant
+* velocity
+*/
+void MDriveEmulator::motionAt(std::chrono::steady_clock::time_point time, double& position, double& velocity)
+{
+    double elapsed = std::chrono::duration<double>(time - changeTime).count();
+    double change = targetVelocity - changeVelocity;
+    bool speedingUp = std::fabs(targetVelocity) > std::fabs(changeVelocity);
+    double rate = std::copysign(speedingUp ? acceleration : deceleration, change);
+    double rampSeconds = change / rate;
+    double ramp = std::min(elapsed, rampSeconds);
+    velocity = changeVelocity + rate * ramp;
+    position = changePosition + changeVelocity * ramp + 0.5 * rate * ramp * ramp + velocity * (elapsed - ramp);
+}
+
+void MDriveEmulator::setMotion(double position, double velocity)
+{
+    changeTime = std::chrono::steady_clock::now();
+    changePosition = position;
+    changeVelocity = velocity;
+}
+
+double MDriveEmulator::getPosition()
+{
+    std::lock_guard<std::mutex> lock(motionMutex);
+    double position, velocity;
+    motionAt(std::chrono::steady_clock::now(), position, velocity);
+    return position;
+}
+
+double MDriveEmulator::getVelocity()
+{
+    std::lock_guard<std::mutex> lock(motionMutex);
+    double position, velocity;
+    motionAt(std::chrono::steady_clock::now(), position, velocity);
+    return velocity;
+}
+
+/*
+* Echo as the bytes come, and run each line on its carriage return. A real drive echoes
+* each character as it arrives, so the echo costs no wire time after the line. Line
+* feeds are ignored, the drive ends lines itself.
+*/
+void MDriveEmulator::handleBytes(const char* data, size_t length)
+{
+    std::string typed;
+    for (size_t i = 0; i < length; i++)
+    {
+        char c = data[i];
+        if (c == '\n')
+        {
+            continue;
+        }
+        if (c != '\r')
+        {
+            typed += c;
+            line += c;
+            continue;
+        }
+
+        echo(typed);
+        typed.clear();
+        commandsReceived++;
+        std::string output;
+        bool ok = execute(line, output);
+        line.clear();
+        double delayMs = nextReplyDelayMs.exchange(0.0);
+        if (delayMs > 0.0)
+        {
+            std::this_thread::sleep_for(std::chrono::duration<double, std::milli>(delayMs));
+        }
+        send("\r\n" + output + (ok ? ">" : "?"));
+    }
+    echo(typed);
+}
+
+/*
+* The part of MCode the scanner uses. Variables are set with "X=n" or "X n".
+*/
+bool MDriveEmulator::execute(const std::string& command, std::string& output)
+{
+    std::string text = command;
+    size_t equals = text.find('=');
+    if (equals != std::string::npos)
+    {
+        text[equals] = ' ';
+    }
+    std::istringstream words(text);
+    std::string name;
+    if (!(words >> name))
+    {
+        return true; // An empty line only gets the prompt
+    }
+
+    if (name == "PR")
+    {
+        std::string rest;
+        std::getline(words, rest);
+        std::istringstream items(rest);
+        std::string item;
+        while (std::getline(items, item, ','))
+        {
+            item.erase(0, item.find_first_not_of(' '));
+            item.erase(item.find_last_not_of(' ') + 1);
+            if (item.size() >= 2 && item.front() == '"' && item.back() == '"')
+            {
+                output += item.substr(1, item.size() - 2);
+            }
+            else if (!printValue(item, output))
+            {
+                return false;
+            }
+        }
+        output += "\r\n";
+        return true;
+    }
+    if (name == "EX")
+    {
+        std::string label;
+        if (!(words >> label) || label != "SS")
+        {
+            return false;
+        }
+        // The program runs on its own, the prompt comes straight back
+        if (homingThread.joinable())
+        {
+            homingThread.join();
+        }
+        homingThread = std::thread(&MDriveEmulator::home, this);
+        return true;
+    }
+
+    double value = 0.0;
+    if (!(words >> value))
+    {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(motionMutex);
+    double position, velocity;
+    motionAt(std::chrono::steady_clock::now(), position, velocity);
+    if (name == "SL")
+    {
+        setMotion(position, velocity);
+        targetVelocity = value * (1.0 + speedError);
+        return true;
+    }
+    if (name == "P")
+    {
+        setMotion(value, velocity);
+        return true;
+    }
+    if ((name == "A" || name == "D") && value > 0.0)
+    {
+        setMotion(position, velocity);
+        (name == "A" ? acceleration : deceleration) = value;
+        return true;
+    }
+    return false;
+}
+
+bool MDriveEmulator::printValue(const std::string& name, std::string& output)
+{
+    if (name == "PN")
+    {
+        output += EMULATED_PART_NUMBER;
+        return true;
+    }
+    std::lock_guard<std::mutex> lock(motionMutex);
+    double position, velocity;
+    motionAt(std::chrono::steady_clock::now(), position, velocity);
+    if (name == "P")
+    {
+        output += std::to_string(std::llround(std::floor(position)));
+    }
+    else if (name == "V")
+    {
+        output += std::to_string(std::llround(velocity / (1.0 + speedError)));
+    }
+    else if (name == "A" || name == "D")
+    {
+        output += std::to_string(std::llround(name == "A" ? acceleration : deceleration));
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+/*
+* Program SS: find home, zero P there and say so the way HomeCalibrate.ixt does
+*/
+void MDriveEmulator::home()
+{
+    std::this_thread::sleep_for(std::chrono::duration<double, std::milli>(homingMs));
+    {
+        std::lock_guard<std::mutex> lock(motionMutex);
+        targetVelocity = 0.0;
+        setMotion(0.0, 0.0);
+    }
+    send("Homed at 0\r\n");
+    send("Homed OK. Ready.?\r\n");
+}
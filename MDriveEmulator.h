@@ -0,0 +1,67 @@
+/*
+*   MDriveEmulator.h
+*	Film Scanner Master PC Control Software by Kyle Mikolajczyk
+*   kyle@kylem.org
+*/
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "PtyDeviceEmulator.h"
+
+/*
+* Answers MCode the way an MDrive does, as far as MDriveConn and ContinuousTransport use
+* it: what it is sent is echoed, a line runs on the carriage return, PR prints, and the
+* '>' prompt follows, or '?' for anything it does not know. EX SS runs the homing program
+* of MCode/HomeCalibrate.ixt in homingMs.
+*
+* The motor is simulated: SL ramps the velocity to the new one at A (D when slowing
+* down) and the position counter P follows it exactly. speedError makes the drive's
+* clock run that much fast, so the velocity it reaches is off from the one commanded
+* like on a real drive.
+*/
+class MDriveEmulator : public PtyDeviceEmulator
+{
+	public:
+		MDriveEmulator(double baudRate = 0.0, double speedError = 0.0, double homingMs = 0.0);
+		~MDriveEmulator();
+
+		// Where the motor really is now, to check what the host thinks against
+		double getPosition();
+		double getVelocity();
+		uint64_t getCommandsReceived() { return commandsReceived; }
+		// Hold the reply to the next command back by ms, like a drive busy with something
+		// else. Commands that come in meanwhile wait behind it.
+		void delayNextReply(double ms) { nextReplyDelayMs = ms; }
+
+	protected:
+		void handleBytes(const char* data, size_t length) override;
+
+	private:
+		double speedError;
+		double homingMs;
+		std::string line;
+		std::atomic<uint64_t> commandsReceived;
+		std::atomic<double> nextReplyDelayMs;
+		std::thread homingThread; // Program SS
+
+		// Motion since the last change: at changeTime the motor was at changePosition going
+		// changeVelocity, ramping to targetVelocity
+		std::mutex motionMutex;
+		std::chrono::steady_clock::time_point changeTime;
+		double changePosition;
+		double changeVelocity;
+		double targetVelocity;
+		double acceleration; // A and D, in microsteps/s²
+		double deceleration;
+
+		void motionAt(std::chrono::steady_clock::time_point time, double& position, double& velocity); // Needs motionMutex
+		void setMotion(double position, double velocity);
+		bool execute(const std::string& command, std::string& output);
+		bool printValue(const std::string& name, std::string& output);
+		void home();
+};
@@ -0,0 +1,378 @@
+/*
+*   PipelineMetrics.cpp
+*	Film Scanner Master PC Control Software by Kyle Mikolajczyk
+*	kyle@kylem.org
+*/
+
+#include "PipelineMetrics.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+LatencyHistogram::LatencyHistogram() : count(0), bytes(0), totalNs(0), maxNs(0)
+{
+    for (int i = 0; i <= BUCKET_COUNT; i++)
+    {
+        buckets[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+double LatencyHistogram::getBucketUpperMs(int bucket)
+{
+    return FIRST_BUCKET_MS * std::exp2((double)bucket / BUCKETS_PER_DOUBLING);
+}
+
+/*
+* The exponent gives the doubling and three compares the quarter within it, which is a
+* good deal cheaper than a log2 on every record
+*/
+int LatencyHistogram::bucketFor(double ms)
+{
+    static const double QUARTER_EDGES[BUCKETS_PER_DOUBLING - 1] = { std::exp2(0.25), std::exp2(0.5), std::exp2(0.75) };
+    if (!(ms > FIRST_BUCKET_MS))
+    {
+        return 0;
+    }
+    int exponent;
+    double fraction = 2.0 * std::frexp(ms / FIRST_BUCKET_MS, &exponent); // 1 <= fraction < 2
+    int bucket = BUCKETS_PER_DOUBLING * (exponent - 1);
+    if (fraction > 1.0)
+    {
+        bucket++;
+        for (int quarter = 0; quarter < BUCKETS_PER_DOUBLING - 1 && fraction > QUARTER_EDGES[quarter]; quarter++)
+        {
+            bucket++;
+        }
+    }
+    return std::min(bucket, (int)BUCKET_COUNT);
+}
+
+void LatencyHistogram::record(double ms, uint64_t itemBytes)
+{
+    uint64_t ns = ms > 0.0 ? (uint64_t)(ms * 1e6) : 0;
+    buckets[bucketFor(ms)].fetch_add(1, std::memory_order_relaxed);
+    count.fetch_add(1, std::memory_order_relaxed);
+    bytes.fetch_add(itemBytes, std::memory_order_relaxed);
+    totalNs.fetch_add(ns, std::memory_order_relaxed);
+    uint64_t longest = maxNs.load(std::memory_order_relaxed);
+    while (ns > longest && !maxNs.compare_exchange_weak(longest, ns, std::memory_order_relaxed))
+    {
+    }
+}
+
+double LatencyHistogram::getMeanMs() const
+{
+    uint64_t items = getCount();
+    return items > 0 ? getTotalMs() / items : 0.0;
+}
+
+/*
+* The upper edge of the bucket the item at that rank fell in, so with 4 buckets to a
+* doubling never more than 2^(1/4) above the true percentile
+*/
+double LatencyHistogram::getPercentileMs(double fraction) const
+{
+    uint64_t items = getCount();
+    if (items == 0)
+    {
+        return 0.0;
+    }
+    uint64_t rank = std::max<uint64_t>(1, (uint64_t)std::ceil(fraction * items));
+    uint64_t seen = 0;
+    for (int bucket = 0; bucket <= BUCKET_COUNT; bucket++)
+    {
+        seen += buckets[bucket].load(std::memory_order_relaxed);
+        if (seen >= rank)
+        {
+            // The last bucket has no upper edge
+            return bucket < BUCKET_COUNT ? std::min(getBucketUpperMs(bucket), getMaxMs()) : getMaxMs();
+        }
+    }
+    return getMaxMs(); // Recorded into while we counted
+}
+
+uint64_t LatencyHistogram::getCountUpTo(int bucket) const
+{
+    uint64_t seen = 0;
+    for (int i = 0; i <= bucket && i <= BUCKET_COUNT; i++)
+    {
+        seen += buckets[i].load(std::memory_order_relaxed);
+    }
+    return seen;
+}
+
+PipelineMetrics::PipelineMetrics() : startTime(std::chrono::steady_clock::now()), stopping(false), intervalSeconds(0.0)
+{
+}
+
+LatencyHistogram* PipelineMetrics::stage(const std::string& name)
+{
+    std::lock_guard<std::mutex> lock(stagesMutex);
+    std::unique_ptr<LatencyHistogram>& histogram = stages[name];
+    if (!histogram)
+    {
+        histogram.reset(new LatencyHistogram());
+        order.push_back(name);
+    }
+    return histogram.get();
+}
+
+std::vector<std::pair<std::string, LatencyHistogram*>> PipelineMetrics::getStages()
+{
+    std::lock_guard<std::mutex> lock(stagesMutex);
+    std::vector<std::pair<std::string, LatencyHistogram*>> result;
+    for (const std::string& name : order)
+    {
+        result.push_back(std::make_pair(name, stages[name].get()));
+    }
+    return result;
+}
+
+void PipelineMetrics::addGauge(const std::string& name, std::function<double()> read)
+{
+    std::lock_guard<std::mutex> lock(gaugesMutex);
+    Gauge gauge;
+    gauge.name = name;
+    gauge.read = read;
+    gauges.push_back(gauge);
+}
+
+void PipelineMetrics::sampleGauges()
+{
+    std::lock_guard<std::mutex> lock(gaugesMutex);
+    for (Gauge& gauge : gauges)
+    {
+        gauge.last = gauge.read();
+        gauge.max = gauge.samples > 0 ? std::max(gauge.max, gauge.last) : gauge.last;
+        gauge.total += gauge.last;
+        gauge.samples++;
+    }
+}
+
+double PipelineMetrics::getElapsedSeconds()
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+}
+
+void PipelineMetrics::start(const std::string& newPath, double newIntervalSeconds)
+{
+    stop();
+    path = newPath;
+    intervalSeconds = newIntervalSeconds > 0.0 ? newIntervalSeconds : 5.0;
+    stopping = false;
+    sampler = std::thread(&PipelineMetrics::samplerLoop, this);
+    if (!path.empty())
+    {
+        std::cout << "Writing pipeline metrics to " << path << ".json and " << path << ".prom every " << intervalSeconds << " s" << std::endl;
+    }
+}
+
+void PipelineMetrics::samplerLoop()
+{
+    auto nextWrite = std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+        std::chrono::duration<double>(intervalSeconds));
+    std::unique_lock<std::mutex> lock(samplerMutex);
+    while (!stopRequested.wait_for(lock, std::chrono::milliseconds(SAMPLE_MS), [this]() { return stopping; }))
+    {
+        lock.unlock();
+        sampleGauges();
+        if (!path.empty() && std::chrono::steady_clock::now() >= nextWrite)
+        {
+            writeFiles(path);
+            nextWrite += std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(intervalSeconds));
+        }
+        lock.lock();
+    }
+}
+
+void PipelineMetrics::stop()
+{
+    if (!sampler.joinable())
+    {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(samplerMutex);
+        stopping = true;
+    }
+    stopRequested.notify_all();
+    sampler.join();
+    sampleGauges();
+    if (!path.empty())
+    {
+        writeFiles(path);
+    }
+}
+
+std::string PipelineMetrics::toJson()
+{
+    double elapsed = getElapsedSeconds();
+    std::ostringstream out;
+    out << std::setprecision(6);
+    out << "{\n  \"elapsed_seconds\": " << elapsed << ",\n  \"stages\": {";
+    bool first = true;
+    for (const auto& entry : getStages())
+    {
+        const LatencyHistogram* histogram = entry.second;
+        out << (first ? "\n" : ",\n") << "    \"" << entry.first << "\": {"
+            << "\"count\": " << histogram->getCount()
+            << ", \"per_second\": " << histogram->getCount() / elapsed
+            << ", \"mean_ms\": " << histogram->getMeanMs()
+            << ", \"p50_ms\": " << histogram->getPercentileMs(0.50)
+            << ", \"p95_ms\": " << histogram->getPercentileMs(0.95)
+            << ", \"p99_ms\": " << histogram->getPercentileMs(0.99)
+            << ", \"max_ms\": " << histogram->getMaxMs()
+            << ", \"busy_fraction\": " << histogram->getTotalMs() / 1000.0 / elapsed
+            << ", \"bytes\": " << histogram->getBytes()
+            << ", \"mb_per_second\": " << histogram->getBytes() / 1e6 / elapsed << "}";
+        first = false;
+    }
+    out << "\n  },\n  \"gauges\": {";
+    first = true;
+    {
+        std::lock_guard<std::mutex> lock(gaugesMutex);
+        for (const Gauge& gauge : gauges)
+        {
+            out << (first ? "\n" : ",\n") << "    \"" << gauge.name << "\": {"
+                << "\"value\": " << gauge.last
+                << ", \"max\": " << gauge.max
+                << ", \"mean\": " << (gauge.samples > 0 ? gauge.total / gauge.samples : 0.0) << "}";
+            first = false;
+        }
+    }
+    out << "\n  }\n}\n";
+    return out.str();
+}
+
+/*
+* Bucket edges every doubling rather than all four to one, which is plenty for
+* histogram_quantile() and keeps a scrape small
+*/
+std::string PipelineMetrics::toPrometheus()
+{
+    std::ostringstream out;
+    out << std::setprecision(9);
+    out << "# HELP scanner_elapsed_seconds Time since the capture session started.\n"
+        << "# TYPE scanner_elapsed_seconds gauge\n"
+        << "scanner_elapsed_seconds " << getElapsedSeconds() << "\n";
+
+    std::vector<std::pair<std::string, LatencyHistogram*>> stageList = getStages();
+    out << "# HELP scanner_stage_seconds Time taken per item by each stage of the pipeline.\n"
+        << "# TYPE scanner_stage_seconds histogram\n";
+    for (const auto& entry : stageList)
+    {
+        const LatencyHistogram* histogram = entry.second;
+        const std::string label = "stage=\"" + entry.first + "\"";
+        for (int bucket = 0; bucket < LatencyHistogram::BUCKET_COUNT; bucket += LatencyHistogram::BUCKETS_PER_DOUBLING)
+        {
+            out << "scanner_stage_seconds_bucket{" << label << ",le=\"" << LatencyHistogram::getBucketUpperMs(bucket) / 1000.0 << "\"} "
+                << histogram->getCountUpTo(bucket) << "\n";
+        }
+        uint64_t items = histogram->getCount();
+        out << "scanner_stage_seconds_bucket{" << label << ",le=\"+Inf\"} " << items << "\n"
+            << "scanner_stage_seconds_sum{" << label << "} " << histogram->getTotalMs() / 1000.0 << "\n"
+            << "scanner_stage_seconds_count{" << label << "} " << items << "\n";
+    }
+    out << "# HELP scanner_stage_bytes_total Bytes moved by each stage of the pipeline.\n"
+        << "# TYPE scanner_stage_bytes_total counter\n";
+    for (const auto& entry : stageList)
+    {
+        if (entry.second->getBytes() > 0)
+        {
+            out << "scanner_stage_bytes_total{stage=\"" << entry.first << "\"} " << entry.second->getBytes() << "\n";
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(gaugesMutex);
+    for (const Gauge& gauge : gauges)
+    {
+        out << "# TYPE scanner_" << gauge.name << " gauge\n"
+            << "scanner_" << gauge.name << " " << gauge.last << "\n"
+            << "# TYPE scanner_" << gauge.name << "_max gauge\n"
+            << "scanner_" << gauge.name << "_max " << gauge.max << "\n";
+    }
+    return out.str();
+}
+
+static bool replaceFile(const std::string& path, const std::string& contents)
+{
+    std::string partialPath = path + ".partial";
+    {
+        std::ofstream out(partialPath, std::ios::binary | std::ios::trunc);
+        out << contents;
+        if (!out)
+        {
+            std::cerr << "Error: Could not write " << partialPath << std::endl;
+            return false;
+        }
+    }
+    std::remove(path.c_str()); // rename() does not replace on Windows
+    if (std::rename(partialPath.c_str(), path.c_str()) != 0)
+    {
+        std::cerr << "Error: Could not replace " << path << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool PipelineMetrics::writeFiles(const std::string& basePath)
+{
+    bool jsonWritten = replaceFile(basePath + ".json", toJson());
+    bool prometheusWritten = replaceFile(basePath + ".prom", toPrometheus());
+    return jsonWritten && prometheusWritten;
+}
+
+/*
+* busy is the time spent in a stage against the time since the start. Above 100% the
+* stage ran on several threads at once; a stage near 100% times its thread count is
+* the one holding the scan up.
+*/
+void PipelineMetrics::printSummary()
+{
+    std::vector<std::pair<std::string, LatencyHistogram*>> stageList = getStages();
+    if (stageList.empty())
+    {
+        return;
+    }
+    double elapsed = getElapsedSeconds();
+    std::cout << "Pipeline stages over " << std::fixed << std::setprecision(1) << elapsed << " s (times in ms):" << std::endl;
+    std::cout << std::left << std::setw(16) << "stage" << std::right << std::setw(9) << "count" << std::setw(10) << "per s"
+              << std::setw(10) << "mean" << std::setw(10) << "p50" << std::setw(10) << "p95" << std::setw(10) << "p99"
+              << std::setw(10) << "max" << std::setw(8) << "busy" << std::setw(10) << "MB/s" << std::endl;
+    for (const auto& entry : stageList)
+    {
+        const LatencyHistogram* histogram = entry.second;
+        std::cout << std::left << std::setw(16) << entry.first << std::right << " " << std::setw(8) << histogram->getCount()
+                  << std::setprecision(2) << " " << std::setw(9) << histogram->getCount() / elapsed
+                  << " " << std::setw(9) << histogram->getMeanMs()
+                  << " " << std::setw(9) << histogram->getPercentileMs(0.50)
+                  << " " << std::setw(9) << histogram->getPercentileMs(0.95)
+                  << " " << std::setw(9) << histogram->getPercentileMs(0.99)
+                  << " " << std::setw(9) << histogram->getMaxMs()
+                  << std::setprecision(0) << " " << std::setw(6) << 100.0 * histogram->getTotalMs() / 1000.0 / elapsed << "%";
+        if (histogram->getBytes() > 0)
+        {
+            std::cout << std::setprecision(1) << " " << std::setw(9) << histogram->getBytes() / 1e6 / elapsed;
+        }
+        std::cout << std::endl;
+    }
+    {
+        std::lock_guard<std::mutex> lock(gaugesMutex);
+        for (const Gauge& gauge : gauges)
+        {
+            std::cout << std::left << std::setw(28) << gauge.name << std::right << std::setprecision(1)
+                      << " mean " << std::setw(10) << (gauge.samples > 0 ? gauge.total / gauge.samples : 0.0)
+                      << " max " << std::setw(10) << gauge.max << std::endl;
+        }
+    }
+    std::cout << std::defaultfloat << std::setprecision(6);
+}
+
+PipelineMetrics::~PipelineMetrics()
+{
+    stop();
+}
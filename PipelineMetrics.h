@@ -0,0 +1,128 @@
+/*
+*   PipelineMetrics.h
+*	Film Scanner Master PC Control Software by Kyle Mikolajczyk
+*   kyle@kylem.org
+*/
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+* Distribution of the time one stage of the pipeline takes per item (an exposure, a
+* frame, a write), in buckets four to a doubling from 1 us up to 16 s. Recording is a
+* handful of relaxed atomic adds and never takes a lock, so it can be called from any
+* thread as often as needed. Percentiles come out as the upper edge of their bucket,
+* so at most 19% high, and never above the longest time recorded.
+*/
+class LatencyHistogram
+{
+	public:
+		static const int BUCKETS_PER_DOUBLING = 4;
+		static const int BUCKET_COUNT = 96; // Plus one for everything longer
+		static constexpr double FIRST_BUCKET_MS = 0.001;
+
+		LatencyHistogram();
+
+		// bytes is what the item moved, for a throughput in MB/s, 0 if that means nothing
+		void record(double ms, uint64_t bytes = 0);
+
+		uint64_t getCount() const { return count.load(std::memory_order_relaxed); }
+		uint64_t getBytes() const { return bytes.load(std::memory_order_relaxed); }
+		double getTotalMs() const { return totalNs.load(std::memory_order_relaxed) / 1e6; }
+		double getMaxMs() const { return maxNs.load(std::memory_order_relaxed) / 1e6; }
+		double getMeanMs() const;
+		double getPercentileMs(double fraction) const;
+		// Items with a time up to the upper edge of bucket, for the cumulative buckets of
+		// the Prometheus text format
+		uint64_t getCountUpTo(int bucket) const;
+
+		static double getBucketUpperMs(int bucket);
+		static int bucketFor(double ms);
+
+	private:
+		std::atomic<uint64_t> buckets[BUCKET_COUNT + 1];
+		std::atomic<uint64_t> count;
+		std::atomic<uint64_t> bytes;
+		std::atomic<uint64_t> totalNs;
+		std::atomic<uint64_t> maxNs;
+};
+
+/*
+* Every stage's LatencyHistogram plus gauges for what cannot be timed, like how many
+* frames wait in a queue or how much frame memory is handed out. Gauges are read by a
+* sampling thread every SAMPLE_MS, which also writes <path>.json and <path>.prom (the
+* Prometheus text format, for node_exporter's textfile collector or anything else that
+* scrapes it) every intervalSeconds, each replaced in one rename so a reader never
+* sees half of one. printSummary() is the same at the end of a session, as a table.
+*
+* Stages are created the first time something is recorded for them and kept in that
+* order. A stage's histogram stays where it is, so a hot path can look it up once and
+* record into it directly.
+*/
+class PipelineMetrics
+{
+	public:
+		static constexpr int SAMPLE_MS = 100;
+
+		PipelineMetrics();
+		~PipelineMetrics();
+
+		LatencyHistogram* stage(const std::string& name);
+		void record(const std::string& name, double ms, uint64_t bytes = 0) { stage(name)->record(ms, bytes); }
+
+		// read is called on the sampling thread and must be safe there. A gauge cannot be
+		// removed, so whatever it reads has to outlive stop().
+		void addGauge(const std::string& name, std::function<double()> read);
+
+		// Start sampling the gauges and, unless path is empty, writing the files
+		void start(const std::string& path, double intervalSeconds);
+		void stop(); // Takes a last sample and writes the files once more
+
+		std::string toJson();
+		std::string toPrometheus();
+		bool writeFiles(const std::string& path);
+		void printSummary();
+
+	private:
+		struct Gauge
+		{
+			std::string name;
+			std::function<double()> read;
+			double last = 0.0;
+			double max = 0.0;
+			double total = 0.0;
+			uint64_t samples = 0;
+		};
+
+		std::chrono::steady_clock::time_point startTime;
+
+		std::mutex stagesMutex;
+		std::vector<std::string> order; // Stages in the order they were first seen
+		std::map<std::string, std::unique_ptr<LatencyHistogram>> stages;
+
+		std::mutex gaugesMutex; // Also held while a gauge is read
+		std::vector<Gauge> gauges;
+
+		std::mutex samplerMutex;
+		std::condition_variable stopRequested;
+		bool stopping;
+		std::thread sampler;
+		std::string path;
+		double intervalSeconds;
+
+		void sampleGauges();
+		void samplerLoop();
+		double getElapsedSeconds();
+		std::vector<std::pair<std::string, LatencyHistogram*>> getStages();
+};
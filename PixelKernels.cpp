@@ -0,0 +1,606 @@
+/*
+*   PixelKernels.cpp
+*	Film Scanner Master PC Control Software by Kyle Mikolajczyk
+*	kyle@kylem.org
+*
+*   Scalar kernels and the runtime CPU dispatch. The SIMD variants live in
+*   PixelKernelsSSE41.cpp, PixelKernelsAVX2.cpp and PixelKernelsAVX512.cpp.
+*/
+
+#include "PixelKernels.h"
+#include <algorithm>
+#include <cstring>
+
+#ifdef PIXEL_KERNELS_X86
+#    ifdef _MSC_VER
+#        include <intrin.h>
+#    else
+#        include <cpuid.h>
+#    endif
+#endif
+
+PixelKernels::Isa PixelKernels::activeIsa = PixelKernels::detectIsa();
+
+#ifdef PIXEL_KERNELS_X86
+static void cpuid(int leaf, int subleaf, unsigned int regs[4])
+{
+#ifdef _MSC_VER
+    int info[4];
+    __cpuidex(info, leaf, subleaf);
+    for (int i = 0; i < 4; i++)
+    {
+        regs[i] = (unsigned int)info[i];
+    }
+#else
+    __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+/*
+* Which register states the OS saves on a context switch. A CPU can report AVX
+* while the OS does not support it, in which case using it would crash.
+*/
+static unsigned long long readXcr0()
+{
+#ifdef _MSC_VER
+    return _xgetbv(0);
+#else
+    unsigned int eax, edx;
+    __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    return ((unsigned long long)edx << 32) | eax;
+#endif
+}
+#endif
+
+/*
+* Work out the best instruction set once, at startup
+*/
+PixelKernels::Isa PixelKernels::detectIsa()
+{
+#ifdef PIXEL_KERNELS_X86
+    unsigned int regs[4];
+    cpuid(0, 0, regs);
+    unsigned int maxLeaf = regs[0];
+
+    cpuid(1, 0, regs);
+    bool sse41 = (regs[2] & (1u << 19)) != 0;
+    bool osxsave = (regs[2] & (1u << 27)) != 0;
+    bool f16c = (regs[2] & (1u << 29)) != 0; // Every AVX2 CPU has it, the half float kernels rely on that
+    if (!sse41)
+    {
+        return SCALAR;
+    }
+    if (!osxsave || maxLeaf < 7)
+    {
+        return SSE41;
+    }
+
+    unsigned long long xcr0 = readXcr0();
+    bool osAvx = (xcr0 & 0x6) == 0x6; // XMM and YMM state
+    bool osAvx512 = (xcr0 & 0xE6) == 0xE6; // plus opmask and both halves of the ZMM state
+
+    cpuid(7, 0, regs);
+    bool avx2 = (regs[1] & (1u << 5)) != 0;
+    bool avx512f = (regs[1] & (1u << 16)) != 0;
+    bool avx512bw = (regs[1] & (1u << 30)) != 0;
+
+    if (osAvx512 && avx512f && avx512bw && f16c)
+    {
+        return AVX512;
+    }
+    if (osAvx && avx2 && f16c)
+    {
+        return AVX2;
+    }
+    return SSE41;
+#else
+    return SCALAR;
+#endif
+}
+
+PixelKernels::Isa PixelKernels::getBestIsa()
+{
+    static const Isa best = detectIsa();
+    return best;
+}
+
+PixelKernels::Isa PixelKernels::getActiveIsa()
+{
+    return activeIsa;
+}
+
+/*
+* Only lets us step down, never up to something the CPU cannot run
+*/
+void PixelKernels::setActiveIsa(Isa isa)
+{
+    activeIsa = isIsaSupported(isa) ? isa : getBestIsa();
+}
+
+bool PixelKernels::isIsaSupported(Isa isa)
+{
+    return isa >= SCALAR && isa <= getBestIsa();
+}
+
+const char* PixelKernels::getIsaName(Isa isa)
+{
+    switch (isa)
+    {
+    case SCALAR: return "scalar";
+    case SSE41: return "SSE4.1";
+    case AVX2: return "AVX2";
+    case AVX512: return "AVX-512";
+    default: return "unknown";
+    }
+}
+
+PixelKernels::Interleave3Fn PixelKernels::getInterleave3(Isa isa)
+{
+    switch (isa)
+    {
+    case SCALAR: return &interleave3Scalar;
+#ifdef PIXEL_KERNELS_X86
+    case SSE41: return &interleave3SSE41;
+    case AVX2: return &interleave3AVX2;
+    case AVX512: return &interleave3AVX512;
+#endif
+    default: return nullptr;
+    }
+}
+
+void PixelKernels::interleave3(const uint16_t* red, const uint16_t* green, const uint16_t* blue, uint16_t* rgb, size_t pixelCount)
+{
+    getInterleave3(activeIsa)(red, green, blue, rgb, pixelCount);
+}
+
+/*
+* Reference version, one pixel at a time. The SIMD variants use this for their tails.
+*/
+void PixelKernels::interleave3Scalar(const uint16_t* red, const uint16_t* green, const uint16_t* blue, uint16_t* rgb, size_t pixelCount)
+{
+    for (size_t i = 0; i < pixelCount; ++i)
+    {
+        rgb[i * 3 + 0] = red[i];
+        rgb[i * 3 + 1] = green[i];
+        rgb[i * 3 + 2] = blue[i];
+    }
+}
+
+PixelKernels::Shift12To16Fn PixelKernels::getShift12To16(Isa isa)
+{
+    switch (isa)
+    {
+    case SCALAR: return &shift12To16Scalar;
+#ifdef PIXEL_KERNELS_X86
+    case SSE41: return &shift12To16SSE41;
+    case AVX2: return &shift12To16AVX2;
+    case AVX512: return &shift12To16AVX512;
+#endif
+    default: return nullptr;
+    }
+}
+
+void PixelKernels::shift12To16(const uint16_t* source, uint16_t* destination, size_t pixelCount)
+{
+    getShift12To16(activeIsa)(source, destination, pixelCount);
+}
+
+/*
+* The camera is set to 12bit mode but OIIO does not support 12bit, only 8 or 16, thus
+* we will use a 16bit container with the 12bit data, so we have to scale it to the
+* correct range or else the image wil appear much darker
+*/
+void PixelKernels::shift12To16Scalar(const uint16_t* source, uint16_t* destination, size_t pixelCount)
+{
+    for (size_t i = 0; i < pixelCount; ++i)
+    {
+        destination[i] = (uint16_t)(source[i] << 4); // Left shift by 4 bits to scale to 16-bit range
+    }
+}
+
+PixelKernels::Unpack12pTo16Fn PixelKernels::getUnpack12pTo16(Isa isa)
+{
+    switch (isa)
+    {
+    case SCALAR: return &unpack12pTo16Scalar;
+#ifdef PIXEL_KERNELS_X86
+    case SSE41: return &unpack12pTo16SSE41;
+    case AVX2: return &unpack12pTo16AVX2;
+    case AVX512: return &unpack12pTo16AVX512;
+#endif
+    default: return nullptr;
+    }
+}
+
+void PixelKernels::unpack12pTo16(const uint8_t* source, uint16_t* destination, size_t pixelCount)
+{
+    getUnpack12pTo16(activeIsa)(source, destination, pixelCount);
+}
+
+/*
+* Mono12p (GenICam PFNC) packs each pair of pixels little endian into three bytes:
+*   byte 0 = p0 bits 0-7, byte 1 = p0 bits 8-11 | p1 bits 0-3 << 4, byte 2 = p1 bits 4-11
+* The unpacked values get the same << 4 as shift12To16 so both modes give identical images.
+*/
+void PixelKernels::unpack12pTo16Scalar(const uint8_t* source, uint16_t* destination, size_t pixelCount)
+{
+    size_t i = 0;
+    for (; i + 2 <= pixelCount; i += 2, source += 3)
+    {
+        destination[i] = (uint16_t)((source[0] | (source[1] & 0x0F) << 8) << 4);
+        destination[i + 1] = (uint16_t)(((source[1] >> 4) | source[2] << 4) << 4);
+    }
+    if (i < pixelCount)
+    {
+        destination[i] = (uint16_t)((source[0] | (source[1] & 0x0F) << 8) << 4); // Odd pixel count, last byte only half used
+    }
+}
+
+PixelKernels::FlatFieldFn PixelKernels::getFlatField(Isa isa)
+{
+    switch (isa)
+    {
+    case SCALAR: return &flatFieldScalar;
+#ifdef PIXEL_KERNELS_X86
+    case SSE41: return &flatFieldSSE41;
+    case AVX2: return &flatFieldAVX2;
+    case AVX512: return &flatFieldAVX512;
+#endif
+    default: return nullptr;
+    }
+}
+
+void PixelKernels::flatField(const uint16_t* source, const uint16_t* offset, const uint16_t* gain, uint16_t* destination, size_t pixelCount)
+{
+    getFlatField(activeIsa)(source, offset, gain, destination, pixelCount);
+}
+
+/*
+* Pixels darker than the dark frame clip to 0 and anything pushed past full scale
+* clips to 65535, so a hot pixel or a dust speck on the flat cannot wrap around
+*/
+void PixelKernels::flatFieldScalar(const uint16_t* source, const uint16_t* offset, const uint16_t* gain, uint16_t* destination, size_t pixelCount)
+{
+    for (size_t i = 0; i < pixelCount; ++i)
+    {
+        uint32_t value = source[i] > offset[i] ? source[i] - offset[i] : 0;
+        uint32_t scaled = (value * gain[i]) >> FLAT_FIELD_GAIN_BITS;
+        destination[i] = (uint16_t)(scaled > 0xFFFF ? 0xFFFF : scaled);
+    }
+}
+
+PixelKernels::BilinearRowFn PixelKernels::getBilinearRow(Isa isa)
+{
+    switch (isa)
+    {
+    case SCALAR: return &bilinearRowScalar;
+#ifdef PIXEL_KERNELS_X86
+    case SSE41: return &bilinearRowSSE41;
+    case AVX2: return &bilinearRowAVX2;
+    case AVX512: return &bilinearRowAVX512;
+#endif
+    default: return nullptr;
+    }
+}
+
+void PixelKernels::bilinearRow(const uint16_t* top, const uint16_t* bottom, uint16_t* destination, size_t pixelCount, const uint16_t weights[4])
+{
+    getBilinearRow(activeIsa)(top, bottom, destination, pixelCount, weights);
+}
+
+/*
+* Rounded to nearest. With the weights adding up to 256 the result never leaves 16 bits.
+*/
+void PixelKernels::bilinearRowScalar(const uint16_t* top, const uint16_t* bottom, uint16_t* destination, size_t pixelCount, const uint16_t weights[4])
+{
+    for (size_t i = 0; i < pixelCount; ++i)
+    {
+        uint32_t sum = weights[0] * top[i] + weights[1] * top[i + 1] + weights[2] * bottom[i] + weights[3] * bottom[i + 1];
+        destination[i] = (uint16_t)((sum + 128) >> 8);
+    }
+}
+
+PixelKernels::FuseExposureFn PixelKernels::getFuseExposure(Isa isa)
+{
+    switch (isa)
+    {
+    case SCALAR: return &fuseExposureScalar;
+#ifdef PIXEL_KERNELS_X86
+    case SSE41: return &fuseExposureSSE41;
+    case AVX2: return &fuseExposureAVX2;
+    case AVX512: return &fuseExposureAVX512;
+#endif
+    default: return nullptr;
+    }
+}
+
+void PixelKernels::fuseExposure(const uint16_t* exposure, float* radiance, size_t pixelCount, float scale, bool first)
+{
+    getFuseExposure(activeIsa)(exposure, radiance, pixelCount, scale, first);
+}
+
+void PixelKernels::fuseExposureScalar(const uint16_t* exposure, float* radiance, size_t pixelCount, float scale, bool first)
+{
+    if (first)
+    {
+        for (size_t i = 0; i < pixelCount; ++i)
+        {
+            radiance[i] = exposure[i] * scale;
+        }
+        return;
+    }
+    const float slope = 1.0f / (HDR_CLIP - HDR_KNEE);
+    for (size_t i = 0; i < pixelCount; ++i)
+    {
+        float value = (float)exposure[i];
+        float weight = std::min(1.0f, std::max(0.0f, ((float)HDR_CLIP - value) * slope));
+        radiance[i] += weight * (value * scale - radiance[i]);
+    }
+}
+
+PixelKernels::Interleave3HalfFn PixelKernels::getInterleave3Half(Isa isa)
+{
+    switch (isa)
+    {
+    case SCALAR: return &interleave3HalfScalar;
+#ifdef PIXEL_KERNELS_X86
+    case SSE41: return &interleave3HalfScalar;
+    case AVX2: return &interleave3HalfAVX2;
+    case AVX512: return &interleave3HalfAVX512;
+#endif
+    default: return nullptr;
+    }
+}
+
+void PixelKernels::interleave3Half(const float* red, const float* green, const float* blue, uint16_t* rgb, size_t pixelCount)
+{
+    getInterleave3Half(activeIsa)(red, green, blue, rgb, pixelCount);
+}
+
+/*
+* Round to nearest even, overflow to infinity, small values to half denormals. NaNs all
+* become the same quiet NaN.
+*/
+uint16_t PixelKernels::floatToHalf(float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    uint32_t sign = (bits >> 16) & 0x8000;
+    bits &= 0x7FFFFFFF;
+    if (bits >= 0x47800000) // 65536 and up, infinity and NaN
+    {
+        return (uint16_t)(sign | (bits > 0x7F800000 ? 0x7E00 : 0x7C00));
+    }
+    if (bits < 0x38800000) // Below the smallest normal half, let the float adder do the rounding
+    {
+        const uint32_t denormalMagicBits = ((127 - 15) + (23 - 10) + 1) << 23;
+        float denormalMagic, sum;
+        memcpy(&denormalMagic, &denormalMagicBits, sizeof(denormalMagic));
+        memcpy(&sum, &bits, sizeof(sum));
+        sum += denormalMagic;
+        uint32_t sumBits;
+        memcpy(&sumBits, &sum, sizeof(sumBits));
+        return (uint16_t)(sign | (sumBits - denormalMagicBits));
+    }
+    uint32_t odd = (bits >> 13) & 1;
+    bits += ((uint32_t)(15 - 127) << 23) + 0xFFF + odd;
+    return (uint16_t)(sign | (bits >> 13));
+}
+
+void PixelKernels::interleave3HalfScalar(const float* red, const float* green, const float* blue, uint16_t* rgb, size_t pixelCount)
+{
+    for (size_t i = 0; i < pixelCount; ++i)
+    {
+        rgb[i * 3 + 0] = floatToHalf(red[i]);
+        rgb[i * 3 + 1] = floatToHalf(green[i]);
+        rgb[i * 3 + 2] = floatToHalf(blue[i]);
+    }
+}
+
+PixelKernels::SumColumnsFn PixelKernels::getSumColumns(Isa isa)
+{
+    switch (isa)
+    {
+    case SCALAR: return &sumColumnsScalar;
+#ifdef PIXEL_KERNELS_X86
+    case SSE41: return &sumColumnsSSE41;
+    case AVX2: return &sumColumnsAVX2;
+    case AVX512: return &sumColumnsAVX512;
+#endif
+    default: return nullptr;
+    }
+}
+
+void PixelKernels::sumColumns(const uint16_t* source, size_t rowStride, int rowCount, uint32_t* sums, size_t pixelCount)
+{
+    getSumColumns(activeIsa)(source, rowStride, rowCount, sums, pixelCount);
+}
+
+void PixelKernels::sumColumnsScalar(const uint16_t* source, size_t rowStride, int rowCount, uint32_t* sums, size_t pixelCount)
+{
+    for (size_t i = 0; i < pixelCount; ++i)
+    {
+        uint32_t sum = 0;
+        for (int row = 0; row < rowCount; row++)
+        {
+            sum += source[row * rowStride + i];
+        }
+        sums[i] = sum;
+    }
+}
+
+PixelKernels::ApplyCurves3Fn PixelKernels::getApplyCurves3(Isa isa)
+{
+    switch (isa)
+    {
+    case SCALAR: return &applyCurves3Scalar;
+#ifdef PIXEL_KERNELS_X86
+    case SSE41: return &applyCurves3Scalar;
+    case AVX2: return &applyCurves3AVX2;
+    case AVX512: return &applyCurves3AVX512;
+#endif
+    default: return nullptr;
+    }
+}
+
+void PixelKernels::applyCurves3(const uint16_t* const source[3], uint16_t* const destination[3], const uint16_t* curves, size_t pixelCount)
+{
+    getApplyCurves3(activeIsa)(source, destination, curves, pixelCount);
+}
+
+void PixelKernels::applyCurves3Scalar(const uint16_t* const source[3], uint16_t* const destination[3], const uint16_t* curves, size_t pixelCount)
+{
+    for (int channel = 0; channel < 3; channel++)
+    {
+        const uint16_t* curve = curves + channel * CURVE_ENTRIES;
+        for (size_t i = 0; i < pixelCount; ++i)
+        {
+            destination[channel][i] = curve[source[channel][i]];
+        }
+    }
+}
+
+PixelKernels::Tetrahedral3Fn PixelKernels::getTetrahedral3(Isa isa)
+{
+    switch (isa)
+    {
+    case SCALAR: return &tetrahedral3Scalar;
+#ifdef PIXEL_KERNELS_X86
+    case SSE41: return &tetrahedral3Scalar;
+    case AVX2: return &tetrahedral3AVX2;
+    case AVX512: return &tetrahedral3AVX2;
+#endif
+    default: return nullptr;
+    }
+}
+
+void PixelKernels::tetrahedral3(const uint16_t* const source[3], uint16_t* const destination[3], const uint16_t* lut, int lutSize, size_t pixelCount)
+{
+    getTetrahedral3(activeIsa)(source, destination, lut, lutSize, pixelCount);
+}
+
+/*
+* A value v sits at (v + v / 32768) * (lutSize - 1) / 65536 along its axis, so 65535
+* lands exactly on the last entry. The cube around the pixel is cut into six
+* tetrahedra along its diagonal, and the one the pixel is in is found by ordering the
+* three fractions: walking from the corner below along the axis with the largest
+* fraction, then the middle one, reaches the corner above. Where two fractions are
+* equal the corner that depends on their order gets no weight.
+*/
+void PixelKernels::tetrahedral3Scalar(const uint16_t* const source[3], uint16_t* const destination[3], const uint16_t* lut, int lutSize, size_t pixelCount)
+{
+    const uint32_t steps = (uint32_t)lutSize - 1;
+    const size_t strides[3] = { 4, 4 * (size_t)lutSize, 4 * (size_t)lutSize * lutSize };
+    for (size_t i = 0; i < pixelCount; ++i)
+    {
+        uint32_t fractions[3];
+        size_t base = 0;
+        for (int channel = 0; channel < 3; channel++)
+        {
+            uint32_t value = source[channel][i];
+            uint32_t position = (value + (value >> 15)) * steps;
+            uint32_t index = std::min(position >> 16, steps - 1);
+            fractions[channel] = position - (index << 16);
+            base += index * strides[channel];
+        }
+        int first = fractions[0] >= fractions[1] && fractions[0] >= fractions[2] ? 0 : (fractions[1] >= fractions[2] ? 1 : 2);
+        int last = fractions[2] <= fractions[1] && fractions[2] <= fractions[0] ? 2 : (fractions[1] <= fractions[0] ? 1 : 0);
+        int middle = 3 - first - last;
+        const uint16_t* corner0 = lut + base;
+        const uint16_t* corner1 = corner0 + strides[first];
+        const uint16_t* corner2 = corner1 + strides[middle];
+        const uint16_t* corner3 = corner0 + strides[0] + strides[1] + strides[2];
+        uint32_t weight0 = 65536 - fractions[first];
+        uint32_t weight1 = fractions[first] - fractions[middle];
+        uint32_t weight2 = fractions[middle] - fractions[last];
+        uint32_t weight3 = fractions[last];
+        for (int channel = 0; channel < 3; channel++)
+        {
+            uint32_t sum = weight0 * corner0[channel] + weight1 * corner1[channel] + weight2 * corner2[channel] + weight3 * corner3[channel];
+            destination[channel][i] = (uint16_t)((sum + 32768) >> 16);
+        }
+    }
+}
+
+PixelKernels::SwapBytes16Fn PixelKernels::getSwapBytes16(Isa isa)
+{
+    switch (isa)
+    {
+    case SCALAR: return &swapBytes16Scalar;
+#ifdef PIXEL_KERNELS_X86
+    case SSE41: return &swapBytes16SSE41;
+    case AVX2: return &swapBytes16AVX2;
+    case AVX512: return &swapBytes16AVX512;
+#endif
+    default: return nullptr;
+    }
+}
+
+void PixelKernels::swapBytes16(const uint16_t* source, uint16_t* destination, size_t count)
+{
+    getSwapBytes16(activeIsa)(source, destination, count);
+}
+
+void PixelKernels::swapBytes16Scalar(const uint16_t* source, uint16_t* destination, size_t count)
+{
+    for (size_t i = 0; i < count; ++i)
+    {
+        destination[i] = (uint16_t)(source[i] >> 8 | source[i] << 8);
+    }
+}
+
+PixelKernels::Deinterleave3Fn PixelKernels::getDeinterleave3(Isa isa)
+{
+    switch (isa)
+    {
+    case SCALAR: return &deinterleave3Scalar;
+#ifdef PIXEL_KERNELS_X86
+    case SSE41: return &deinterleave3SSE41;
+    case AVX2: return &deinterleave3SSE41;
+    case AVX512: return &deinterleave3SSE41;
+#endif
+    default: return nullptr;
+    }
+}
+
+void PixelKernels::deinterleave3(const uint16_t* rgb, uint16_t* red, uint16_t* green, uint16_t* blue, size_t pixelCount)
+{
+    getDeinterleave3(activeIsa)(rgb, red, green, blue, pixelCount);
+}
+
+void PixelKernels::deinterleave3Scalar(const uint16_t* rgb, uint16_t* red, uint16_t* green, uint16_t* blue, size_t pixelCount)
+{
+    for (size_t i = 0; i < pixelCount; ++i)
+    {
+        red[i] = rgb[i * 3 + 0];
+        green[i] = rgb[i * 3 + 1];
+        blue[i] = rgb[i * 3 + 2];
+    }
+}
+
+PixelKernels::HorizontalDifference16Fn PixelKernels::getHorizontalDifference16(Isa isa)
+{
+    switch (isa)
+    {
+    case SCALAR: return &horizontalDifference16Scalar;
+#ifdef PIXEL_KERNELS_X86
+    case SSE41: return &horizontalDifference16SSE41;
+    case AVX2: return &horizontalDifference16AVX2;
+    case AVX512: return &horizontalDifference16AVX512;
+#endif
+    default: return nullptr;
+    }
+}
+
+void PixelKernels::horizontalDifference16(const uint16_t* source, uint16_t* destination, size_t count, size_t stride)
+{
+    getHorizontalDifference16(activeIsa)(source, destination, count, stride);
+}
+
+void PixelKernels::horizontalDifference16Scalar(const uint16_t* source, uint16_t* destination, size_t count, size_t stride)
+{
+    for (size_t i = 0; i < count; ++i)
+    {
+        destination[i] = i < stride ? source[i] : (uint16_t)(source[i] - source[i - stride]);
+    }
+}
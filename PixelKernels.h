@@ -0,0 +1,231 @@
+/*
+*   PixelKernels.h
+*	Film Scanner Master PC Control Software by Kyle Mikolajczyk
+*   kyle@kylem.org
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#    define PIXEL_KERNELS_X86 1
+#endif
+
+// Lets a single function use a newer instruction set than the rest of the file is built for.
+// MSVC always allows the intrinsics, GCC and Clang need to be told per function.
+#if defined(PIXEL_KERNELS_X86) && (defined(__GNUC__) || defined(__clang__))
+#    define PIXEL_KERNELS_TARGET(isa) __attribute__((target(isa)))
+#else
+#    define PIXEL_KERNELS_TARGET(isa)
+#endif
+
+/*
+* Hot per-pixel loops of the pipeline. Each kernel has a plain C++ version, which is
+* the reference and the fallback, plus SIMD versions that are picked at runtime
+* based on what the CPU we are running on supports.
+*/
+class PixelKernels
+{
+	public:
+		enum Isa { SCALAR, SSE41, AVX2, AVX512, ISA_COUNT };
+
+		typedef void (*Interleave3Fn)(const uint16_t* red, const uint16_t* green, const uint16_t* blue, uint16_t* rgb, size_t pixelCount);
+		typedef void (*Shift12To16Fn)(const uint16_t* source, uint16_t* destination, size_t pixelCount);
+		typedef void (*Unpack12pTo16Fn)(const uint8_t* source, uint16_t* destination, size_t pixelCount);
+		typedef void (*FlatFieldFn)(const uint16_t* source, const uint16_t* offset, const uint16_t* gain, uint16_t* destination, size_t pixelCount);
+		typedef void (*BilinearRowFn)(const uint16_t* top, const uint16_t* bottom, uint16_t* destination, size_t pixelCount, const uint16_t weights[4]);
+		typedef void (*FuseExposureFn)(const uint16_t* exposure, float* radiance, size_t pixelCount, float scale, bool first);
+		typedef void (*Interleave3HalfFn)(const float* red, const float* green, const float* blue, uint16_t* rgb, size_t pixelCount);
+		typedef void (*SumColumnsFn)(const uint16_t* source, size_t rowStride, int rowCount, uint32_t* sums, size_t pixelCount);
+		typedef void (*ApplyCurves3Fn)(const uint16_t* const source[3], uint16_t* const destination[3], const uint16_t* curves, size_t pixelCount);
+		typedef void (*SwapBytes16Fn)(const uint16_t* source, uint16_t* destination, size_t count);
+		typedef void (*HorizontalDifference16Fn)(const uint16_t* source, uint16_t* destination, size_t count, size_t stride);
+		typedef void (*Deinterleave3Fn)(const uint16_t* rgb, uint16_t* red, uint16_t* green, uint16_t* blue, size_t pixelCount);
+		typedef void (*Tetrahedral3Fn)(const uint16_t* const source[3], uint16_t* const destination[3], const uint16_t* lut, int lutSize, size_t pixelCount);
+
+		// Fractional bits of the fixed point gains used by flatField, so 4096 is a gain of 1
+		static const int FLAT_FIELD_GAIN_BITS = 12;
+		// 16 bit levels over which fuseExposure hands over from a longer exposure to the
+		// shorter ones before it, fully trusted below the knee and not at all from the clip
+		static const int HDR_KNEE = 56000;
+		static const int HDR_CLIP = 63000;
+		// Entries of each of the three curves applyCurves3 looks up in, and how many more
+		// have to follow the last one, which the SIMD variants read past with 32 bit gathers
+		static const size_t CURVE_ENTRIES = 65536;
+		static const size_t CURVE_PADDING = 2;
+		static const int LUT_MIN_SIZE = 2;
+		static const int LUT_MAX_SIZE = 256;
+
+		static Isa getBestIsa(); // Fastest instruction set this CPU and OS support
+		static Isa getActiveIsa(); // What the dispatched calls below are using
+		static void setActiveIsa(Isa isa); // Force a slower path, e.g. when benchmarking
+		static bool isIsaSupported(Isa isa);
+		static const char* getIsaName(Isa isa);
+
+		// Interleave three planar 16 bit channels into packed RGB48
+		static void interleave3(const uint16_t* red, const uint16_t* green, const uint16_t* blue, uint16_t* rgb, size_t pixelCount);
+		static Interleave3Fn getInterleave3(Isa isa); // nullptr if the variant was not built
+
+		static void interleave3Scalar(const uint16_t* red, const uint16_t* green, const uint16_t* blue, uint16_t* rgb, size_t pixelCount);
+#ifdef PIXEL_KERNELS_X86
+		static void interleave3SSE41(const uint16_t* red, const uint16_t* green, const uint16_t* blue, uint16_t* rgb, size_t pixelCount);
+		static void interleave3AVX2(const uint16_t* red, const uint16_t* green, const uint16_t* blue, uint16_t* rgb, size_t pixelCount);
+		static void interleave3AVX512(const uint16_t* red, const uint16_t* green, const uint16_t* blue, uint16_t* rgb, size_t pixelCount);
+#endif
+
+		// Scale Mono12 samples (in 16 bit containers) up to the full 16 bit range
+		static void shift12To16(const uint16_t* source, uint16_t* destination, size_t pixelCount);
+		static Shift12To16Fn getShift12To16(Isa isa);
+
+		static void shift12To16Scalar(const uint16_t* source, uint16_t* destination, size_t pixelCount);
+#ifdef PIXEL_KERNELS_X86
+		static void shift12To16SSE41(const uint16_t* source, uint16_t* destination, size_t pixelCount);
+		static void shift12To16AVX2(const uint16_t* source, uint16_t* destination, size_t pixelCount);
+		static void shift12To16AVX512(const uint16_t* source, uint16_t* destination, size_t pixelCount);
+#endif
+
+		// Unpack Mono12p (two pixels in three bytes) and scale to 16 bit in the same pass
+		static void unpack12pTo16(const uint8_t* source, uint16_t* destination, size_t pixelCount);
+		static Unpack12pTo16Fn getUnpack12pTo16(Isa isa);
+
+		static void unpack12pTo16Scalar(const uint8_t* source, uint16_t* destination, size_t pixelCount);
+#ifdef PIXEL_KERNELS_X86
+		static void unpack12pTo16SSE41(const uint8_t* source, uint16_t* destination, size_t pixelCount);
+		static void unpack12pTo16AVX2(const uint8_t* source, uint16_t* destination, size_t pixelCount);
+		static void unpack12pTo16AVX512(const uint8_t* source, uint16_t* destination, size_t pixelCount);
+#endif
+
+		// Dark and flat correction: (source - offset) * gain, saturating at both ends. The
+		// gain is fixed point with FLAT_FIELD_GAIN_BITS fractional bits, the result is
+		// truncated. source and destination may be the same buffer.
+		static void flatField(const uint16_t* source, const uint16_t* offset, const uint16_t* gain, uint16_t* destination, size_t pixelCount);
+		static FlatFieldFn getFlatField(Isa isa);
+
+		static void flatFieldScalar(const uint16_t* source, const uint16_t* offset, const uint16_t* gain, uint16_t* destination, size_t pixelCount);
+#ifdef PIXEL_KERNELS_X86
+		static void flatFieldSSE41(const uint16_t* source, const uint16_t* offset, const uint16_t* gain, uint16_t* destination, size_t pixelCount);
+		static void flatFieldAVX2(const uint16_t* source, const uint16_t* offset, const uint16_t* gain, uint16_t* destination, size_t pixelCount);
+		static void flatFieldAVX512(const uint16_t* source, const uint16_t* offset, const uint16_t* gain, uint16_t* destination, size_t pixelCount);
+#endif
+
+		// One output row of a sub-pixel shift: each pixel is the weighted sum of source
+		// pixels i and i + 1 of the top and bottom rows, weights in the order top left,
+		// top right, bottom left, bottom right, adding up to 256. Reads pixelCount + 1
+		// pixels of each row.
+		static void bilinearRow(const uint16_t* top, const uint16_t* bottom, uint16_t* destination, size_t pixelCount, const uint16_t weights[4]);
+		static BilinearRowFn getBilinearRow(Isa isa);
+
+		static void bilinearRowScalar(const uint16_t* top, const uint16_t* bottom, uint16_t* destination, size_t pixelCount, const uint16_t weights[4]);
+#ifdef PIXEL_KERNELS_X86
+		static void bilinearRowSSE41(const uint16_t* top, const uint16_t* bottom, uint16_t* destination, size_t pixelCount, const uint16_t weights[4]);
+		static void bilinearRowAVX2(const uint16_t* top, const uint16_t* bottom, uint16_t* destination, size_t pixelCount, const uint16_t weights[4]);
+		static void bilinearRowAVX512(const uint16_t* top, const uint16_t* bottom, uint16_t* destination, size_t pixelCount, const uint16_t weights[4]);
+#endif
+
+		// Fold one exposure of an HDR bracket into the radiance of its channel, exposure *
+		// scale being the radiance it saw. The bracket goes shortest exposure first: the
+		// first sets the radiance, and every longer one replaces it wherever it is below
+		// HDR_KNEE, blending between the two up to HDR_CLIP so there is no seam. The SIMD
+		// variants may round the blend differently in the last bit.
+		static void fuseExposure(const uint16_t* exposure, float* radiance, size_t pixelCount, float scale, bool first);
+		static FuseExposureFn getFuseExposure(Isa isa);
+
+		static void fuseExposureScalar(const uint16_t* exposure, float* radiance, size_t pixelCount, float scale, bool first);
+#ifdef PIXEL_KERNELS_X86
+		static void fuseExposureSSE41(const uint16_t* exposure, float* radiance, size_t pixelCount, float scale, bool first);
+		static void fuseExposureAVX2(const uint16_t* exposure, float* radiance, size_t pixelCount, float scale, bool first);
+		static void fuseExposureAVX512(const uint16_t* exposure, float* radiance, size_t pixelCount, float scale, bool first);
+#endif
+
+		// Interleave three planar float channels into packed RGB half floats, rounded to
+		// nearest even like the F16C instructions do. SSE4.1 has no conversion and uses
+		// the scalar version.
+		static void interleave3Half(const float* red, const float* green, const float* blue, uint16_t* rgb, size_t pixelCount);
+		static Interleave3HalfFn getInterleave3Half(Isa isa);
+		static uint16_t floatToHalf(float value);
+
+		static void interleave3HalfScalar(const float* red, const float* green, const float* blue, uint16_t* rgb, size_t pixelCount);
+#ifdef PIXEL_KERNELS_X86
+		static void interleave3HalfAVX2(const float* red, const float* green, const float* blue, uint16_t* rgb, size_t pixelCount);
+		static void interleave3HalfAVX512(const float* red, const float* green, const float* blue, uint16_t* rgb, size_t pixelCount);
+#endif
+
+		// sums[i] = the sum of source[r * rowStride + i] over rowCount rows, in 32 bits. The
+		// vertical half of the box filter that downsamples previews, see FramePreview.
+		static void sumColumns(const uint16_t* source, size_t rowStride, int rowCount, uint32_t* sums, size_t pixelCount);
+		static SumColumnsFn getSumColumns(Isa isa);
+
+		static void sumColumnsScalar(const uint16_t* source, size_t rowStride, int rowCount, uint32_t* sums, size_t pixelCount);
+#ifdef PIXEL_KERNELS_X86
+		static void sumColumnsSSE41(const uint16_t* source, size_t rowStride, int rowCount, uint32_t* sums, size_t pixelCount);
+		static void sumColumnsAVX2(const uint16_t* source, size_t rowStride, int rowCount, uint32_t* sums, size_t pixelCount);
+		static void sumColumnsAVX512(const uint16_t* source, size_t rowStride, int rowCount, uint32_t* sums, size_t pixelCount);
+#endif
+
+		// destination[c][i] = curves[c * CURVE_ENTRIES + source[c][i]] for the three channels,
+		// see ColorTransform. A destination plane may be its own source plane.
+		static void applyCurves3(const uint16_t* const source[3], uint16_t* const destination[3], const uint16_t* curves, size_t pixelCount);
+		static ApplyCurves3Fn getApplyCurves3(Isa isa);
+
+		static void applyCurves3Scalar(const uint16_t* const source[3], uint16_t* const destination[3], const uint16_t* curves, size_t pixelCount);
+#ifdef PIXEL_KERNELS_X86
+		static void applyCurves3AVX2(const uint16_t* const source[3], uint16_t* const destination[3], const uint16_t* curves, size_t pixelCount);
+		static void applyCurves3AVX512(const uint16_t* const source[3], uint16_t* const destination[3], const uint16_t* curves, size_t pixelCount);
+#endif
+
+		// Look every pixel up in a lutSize^3 3D LUT with tetrahedral interpolation. The LUT
+		// holds 16 bit red, green, blue and one unused value per entry, red changing
+		// fastest, and covers 0 to 65535 on every axis. Weights are in 1/65536ths and the
+		// result is rounded, so all variants agree to the bit. A destination plane may be
+		// its own source plane. SSE4.1 has no gathers and uses the scalar version, AVX-512
+		// the AVX2 one, which waits on the same gathers.
+		static void tetrahedral3(const uint16_t* const source[3], uint16_t* const destination[3], const uint16_t* lut, int lutSize, size_t pixelCount);
+		static Tetrahedral3Fn getTetrahedral3(Isa isa);
+
+		static void tetrahedral3Scalar(const uint16_t* const source[3], uint16_t* const destination[3], const uint16_t* lut, int lutSize, size_t pixelCount);
+#ifdef PIXEL_KERNELS_X86
+		static void tetrahedral3AVX2(const uint16_t* const source[3], uint16_t* const destination[3], const uint16_t* lut, int lutSize, size_t pixelCount);
+#endif
+
+		// Swap the bytes of every 16 bit value, for file formats stored big endian (DPX).
+		// destination may be source.
+		static void swapBytes16(const uint16_t* source, uint16_t* destination, size_t count);
+		static SwapBytes16Fn getSwapBytes16(Isa isa);
+
+		static void swapBytes16Scalar(const uint16_t* source, uint16_t* destination, size_t count);
+#ifdef PIXEL_KERNELS_X86
+		static void swapBytes16SSE41(const uint16_t* source, uint16_t* destination, size_t count);
+		static void swapBytes16AVX2(const uint16_t* source, uint16_t* destination, size_t count);
+		static void swapBytes16AVX512(const uint16_t* source, uint16_t* destination, size_t count);
+#endif
+
+		// Split packed RGB48 (or RGB half) back into three planes, for file formats that
+		// store a scanline channel by channel (OpenEXR). The shuffles of the SSE4.1 version
+		// would have to cross 128 bit lanes in wider registers, AVX2 and AVX-512 use it.
+		static void deinterleave3(const uint16_t* rgb, uint16_t* red, uint16_t* green, uint16_t* blue, size_t pixelCount);
+		static Deinterleave3Fn getDeinterleave3(Isa isa);
+
+		static void deinterleave3Scalar(const uint16_t* rgb, uint16_t* red, uint16_t* green, uint16_t* blue, size_t pixelCount);
+#ifdef PIXEL_KERNELS_X86
+		static void deinterleave3SSE41(const uint16_t* rgb, uint16_t* red, uint16_t* green, uint16_t* blue, size_t pixelCount);
+#endif
+
+		// TIFF's horizontal predictor over one line: every value minus the one stride values
+		// before it, wrapping around, and the first stride values as they are. stride is
+		// the samples per pixel. destination must not be source.
+		static void horizontalDifference16(const uint16_t* source, uint16_t* destination, size_t count, size_t stride);
+		static HorizontalDifference16Fn getHorizontalDifference16(Isa isa);
+
+		static void horizontalDifference16Scalar(const uint16_t* source, uint16_t* destination, size_t count, size_t stride);
+#ifdef PIXEL_KERNELS_X86
+		static void horizontalDifference16SSE41(const uint16_t* source, uint16_t* destination, size_t count, size_t stride);
+		static void horizontalDifference16AVX2(const uint16_t* source, uint16_t* destination, size_t count, size_t stride);
+		static void horizontalDifference16AVX512(const uint16_t* source, uint16_t* destination, size_t count, size_t stride);
+#endif
+
+	private:
+		static Isa activeIsa;
+		static Isa detectIsa();
+};
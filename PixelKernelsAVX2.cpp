@@ -0,0 +1,391 @@
+/*
+*   PixelKernelsAVX2.cpp
+*	Film Scanner Master PC Control Software by Kyle Mikolajczyk
+*	kyle@kylem.org
+*
+*   AVX2 versions of the PixelKernels. Only called when the CPU and OS support AVX2.
+*/
+
+#include "PixelKernels.h"
+
+#ifdef PIXEL_KERNELS_X86
+
+#include <immintrin.h>
+
+/*
+* 16 pixels per step. vpshufb and vpblendw only work inside each 128 bit lane, so we
+* run the same shuffles as the SSE4.1 version on both lanes at once (pixels 0-7 in
+* the low lane, 8-15 in the high lane) and then swap lanes to put the six 128 bit
+* results back into memory order.
+*/
+PIXEL_KERNELS_TARGET("avx2")
+void PixelKernels::interleave3AVX2(const uint16_t* red, const uint16_t* green, const uint16_t* blue, uint16_t* rgb, size_t pixelCount)
+{
+    const __m256i redTo0 = _mm256_setr_epi8(0, 1, -1, -1, -1, -1, 2, 3, -1, -1, -1, -1, 4, 5, -1, -1,
+        0, 1, -1, -1, -1, -1, 2, 3, -1, -1, -1, -1, 4, 5, -1, -1);
+    const __m256i greenTo0 = _mm256_setr_epi8(-1, -1, 0, 1, -1, -1, -1, -1, 2, 3, -1, -1, -1, -1, 4, 5,
+        -1, -1, 0, 1, -1, -1, -1, -1, 2, 3, -1, -1, -1, -1, 4, 5);
+    const __m256i blueTo0 = _mm256_setr_epi8(-1, -1, -1, -1, 0, 1, -1, -1, -1, -1, 2, 3, -1, -1, -1, -1,
+        -1, -1, -1, -1, 0, 1, -1, -1, -1, -1, 2, 3, -1, -1, -1, -1);
+    const __m256i redTo1 = _mm256_setr_epi8(-1, -1, 6, 7, -1, -1, -1, -1, 8, 9, -1, -1, -1, -1, 10, 11,
+        -1, -1, 6, 7, -1, -1, -1, -1, 8, 9, -1, -1, -1, -1, 10, 11);
+    const __m256i greenTo1 = _mm256_setr_epi8(-1, -1, -1, -1, 6, 7, -1, -1, -1, -1, 8, 9, -1, -1, -1, -1,
+        -1, -1, -1, -1, 6, 7, -1, -1, -1, -1, 8, 9, -1, -1, -1, -1);
+    const __m256i blueTo1 = _mm256_setr_epi8(4, 5, -1, -1, -1, -1, 6, 7, -1, -1, -1, -1, 8, 9, -1, -1,
+        4, 5, -1, -1, -1, -1, 6, 7, -1, -1, -1, -1, 8, 9, -1, -1);
+    const __m256i redTo2 = _mm256_setr_epi8(-1, -1, -1, -1, 12, 13, -1, -1, -1, -1, 14, 15, -1, -1, -1, -1,
+        -1, -1, -1, -1, 12, 13, -1, -1, -1, -1, 14, 15, -1, -1, -1, -1);
+    const __m256i greenTo2 = _mm256_setr_epi8(10, 11, -1, -1, -1, -1, 12, 13, -1, -1, -1, -1, 14, 15, -1, -1,
+        10, 11, -1, -1, -1, -1, 12, 13, -1, -1, -1, -1, 14, 15, -1, -1);
+    const __m256i blueTo2 = _mm256_setr_epi8(-1, -1, 10, 11, -1, -1, -1, -1, 12, 13, -1, -1, -1, -1, 14, 15,
+        -1, -1, 10, 11, -1, -1, -1, -1, 12, 13, -1, -1, -1, -1, 14, 15);
+
+    size_t i = 0;
+    for (; i + 16 <= pixelCount; i += 16)
+    {
+        __m256i r = _mm256_loadu_si256((const __m256i*)(red + i));
+        __m256i g = _mm256_loadu_si256((const __m256i*)(green + i));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(blue + i));
+
+        // Low lanes hold outputs 0, 1, 2 and high lanes outputs 3, 4, 5
+        __m256i a = _mm256_blend_epi16(_mm256_shuffle_epi8(r, redTo0), _mm256_shuffle_epi8(g, greenTo0), 0x92);
+        a = _mm256_blend_epi16(a, _mm256_shuffle_epi8(b, blueTo0), 0x24);
+        __m256i c = _mm256_blend_epi16(_mm256_shuffle_epi8(r, redTo1), _mm256_shuffle_epi8(g, greenTo1), 0x24);
+        c = _mm256_blend_epi16(c, _mm256_shuffle_epi8(b, blueTo1), 0x49);
+        __m256i d = _mm256_blend_epi16(_mm256_shuffle_epi8(r, redTo2), _mm256_shuffle_epi8(g, greenTo2), 0x49);
+        d = _mm256_blend_epi16(d, _mm256_shuffle_epi8(b, blueTo2), 0x92);
+
+        __m256i* out = (__m256i*)(rgb + i * 3);
+        _mm256_storeu_si256(out + 0, _mm256_permute2x128_si256(a, c, 0x20)); // out0 | out1
+        _mm256_storeu_si256(out + 1, _mm256_permute2x128_si256(d, a, 0x30)); // out2 | out3
+        _mm256_storeu_si256(out + 2, _mm256_permute2x128_si256(c, d, 0x31)); // out4 | out5
+    }
+    interleave3Scalar(red + i, green + i, blue + i, rgb + i * 3, pixelCount - i);
+}
+
+PIXEL_KERNELS_TARGET("avx2")
+void PixelKernels::shift12To16AVX2(const uint16_t* source, uint16_t* destination, size_t pixelCount)
+{
+    size_t i = 0;
+    for (; i + 32 <= pixelCount; i += 32)
+    {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(source + i));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(source + i + 16));
+        _mm256_storeu_si256((__m256i*)(destination + i), _mm256_slli_epi16(a, 4));
+        _mm256_storeu_si256((__m256i*)(destination + i + 16), _mm256_slli_epi16(b, 4));
+    }
+    shift12To16Scalar(source + i, destination + i, pixelCount - i);
+}
+
+/*
+* 16 pixels (24 bytes) per step. Same trick as the SSE4.1 version, but pshufb only works
+* within each 128 bit lane, so the 24 bytes are first split 12 and 12 across the lanes.
+*/
+PIXEL_KERNELS_TARGET("avx2")
+void PixelKernels::unpack12pTo16AVX2(const uint8_t* source, uint16_t* destination, size_t pixelCount)
+{
+    const __m256i split = _mm256_setr_epi32(0, 1, 2, 0, 3, 4, 5, 0);
+    const __m256i spread = _mm256_setr_epi8(0, 1, 1, 2, 3, 4, 4, 5, 6, 7, 7, 8, 9, 10, 10, 11,
+        0, 1, 1, 2, 3, 4, 4, 5, 6, 7, 7, 8, 9, 10, 10, 11);
+    const __m256i highBits = _mm256_set1_epi16((short)0xFFF0);
+    size_t packedBytes = (pixelCount * 3 + 1) / 2;
+
+    size_t i = 0;
+    for (; i + 16 <= pixelCount && i / 2 * 3 + 32 <= packedBytes; i += 16)
+    {
+        __m256i packed = _mm256_permutevar8x32_epi32(_mm256_loadu_si256((const __m256i*)(source + i / 2 * 3)), split);
+        __m256i words = _mm256_shuffle_epi8(packed, spread);
+        _mm256_storeu_si256((__m256i*)(destination + i), _mm256_blend_epi16(_mm256_slli_epi16(words, 4), _mm256_and_si256(words, highBits), 0xAA));
+    }
+    unpack12pTo16Scalar(source + i / 2 * 3, destination + i, pixelCount - i);
+}
+
+/*
+* 16 pixels per step, the SSE4.1 version on a full register
+*/
+PIXEL_KERNELS_TARGET("avx2")
+void PixelKernels::flatFieldAVX2(const uint16_t* source, const uint16_t* offset, const uint16_t* gain, uint16_t* destination, size_t pixelCount)
+{
+    const __m256i maxHigh = _mm256_set1_epi16((1 << FLAT_FIELD_GAIN_BITS) - 1);
+    const __m256i allOnes = _mm256_set1_epi16(-1);
+
+    size_t i = 0;
+    for (; i + 16 <= pixelCount; i += 16)
+    {
+        __m256i value = _mm256_subs_epu16(_mm256_loadu_si256((const __m256i*)(source + i)), _mm256_loadu_si256((const __m256i*)(offset + i)));
+        __m256i g = _mm256_loadu_si256((const __m256i*)(gain + i));
+        __m256i low = _mm256_mullo_epi16(value, g);
+        __m256i high = _mm256_mulhi_epu16(value, g);
+        __m256i scaled = _mm256_or_si256(_mm256_srli_epi16(low, FLAT_FIELD_GAIN_BITS), _mm256_slli_epi16(high, 16 - FLAT_FIELD_GAIN_BITS));
+        __m256i fits = _mm256_cmpeq_epi16(_mm256_min_epu16(high, maxHigh), high);
+        _mm256_storeu_si256((__m256i*)(destination + i), _mm256_or_si256(scaled, _mm256_xor_si256(fits, allOnes)));
+    }
+    flatFieldScalar(source + i, offset + i, gain + i, destination + i, pixelCount - i);
+}
+
+/*
+* 16 pixels per step. Unpack and pack both work per 128 bit lane, so the pixels come
+* out of the pack in the order they went into the unpack.
+*/
+PIXEL_KERNELS_TARGET("avx2")
+void PixelKernels::bilinearRowAVX2(const uint16_t* top, const uint16_t* bottom, uint16_t* destination, size_t pixelCount, const uint16_t weights[4])
+{
+    const __m256i bias = _mm256_set1_epi16((short)0x8000);
+    const __m256i topWeights = _mm256_set1_epi32((int)(weights[0] | (uint32_t)weights[1] << 16));
+    const __m256i bottomWeights = _mm256_set1_epi32((int)(weights[2] | (uint32_t)weights[3] << 16));
+    const __m256i restore = _mm256_set1_epi32(32768 * 256 + 128);
+
+    size_t i = 0;
+    for (; i + 16 <= pixelCount; i += 16)
+    {
+        __m256i topLeft = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(top + i)), bias);
+        __m256i topRight = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(top + i + 1)), bias);
+        __m256i bottomLeft = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(bottom + i)), bias);
+        __m256i bottomRight = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(bottom + i + 1)), bias);
+        __m256i low = _mm256_add_epi32(_mm256_madd_epi16(_mm256_unpacklo_epi16(topLeft, topRight), topWeights),
+            _mm256_madd_epi16(_mm256_unpacklo_epi16(bottomLeft, bottomRight), bottomWeights));
+        __m256i high = _mm256_add_epi32(_mm256_madd_epi16(_mm256_unpackhi_epi16(topLeft, topRight), topWeights),
+            _mm256_madd_epi16(_mm256_unpackhi_epi16(bottomLeft, bottomRight), bottomWeights));
+        low = _mm256_srli_epi32(_mm256_add_epi32(low, restore), 8);
+        high = _mm256_srli_epi32(_mm256_add_epi32(high, restore), 8);
+        _mm256_storeu_si256((__m256i*)(destination + i), _mm256_packus_epi32(low, high));
+    }
+    bilinearRowScalar(top + i, bottom + i, destination + i, pixelCount - i, weights);
+}
+
+/*
+* 16 pixels per step, the SSE4.1 version on a full register
+*/
+PIXEL_KERNELS_TARGET("avx2")
+void PixelKernels::fuseExposureAVX2(const uint16_t* exposure, float* radiance, size_t pixelCount, float scale, bool first)
+{
+    const __m256 scales = _mm256_set1_ps(scale);
+    const __m256 clip = _mm256_set1_ps((float)HDR_CLIP);
+    const __m256 slope = _mm256_set1_ps(1.0f / (HDR_CLIP - HDR_KNEE));
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 one = _mm256_set1_ps(1.0f);
+
+    size_t i = 0;
+    for (; i + 16 <= pixelCount; i += 16)
+    {
+        __m128i low = _mm_loadu_si128((const __m128i*)(exposure + i));
+        __m128i high = _mm_loadu_si128((const __m128i*)(exposure + i + 8));
+        __m256 values[2] = { _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(low)), _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(high)) };
+        for (int half = 0; half < 2; half++)
+        {
+            float* out = radiance + i + half * 8;
+            __m256 scaled = _mm256_mul_ps(values[half], scales);
+            if (first)
+            {
+                _mm256_storeu_ps(out, scaled);
+                continue;
+            }
+            __m256 weight = _mm256_min_ps(one, _mm256_max_ps(zero, _mm256_mul_ps(_mm256_sub_ps(clip, values[half]), slope)));
+            __m256 current = _mm256_loadu_ps(out);
+            _mm256_storeu_ps(out, _mm256_add_ps(current, _mm256_mul_ps(weight, _mm256_sub_ps(scaled, current))));
+        }
+    }
+    fuseExposureScalar(exposure + i, radiance + i, pixelCount - i, scale, first);
+}
+
+/*
+* Blocks small enough to stay in L1 are converted with F16C into three half planes,
+* which the uint16 interleave then packs
+*/
+PIXEL_KERNELS_TARGET("avx2,f16c")
+void PixelKernels::interleave3HalfAVX2(const float* red, const float* green, const float* blue, uint16_t* rgb, size_t pixelCount)
+{
+    const size_t blockPixels = 256;
+    alignas(32) uint16_t halves[3][blockPixels];
+    const float* sources[3] = { red, green, blue };
+
+    size_t i = 0;
+    for (; i + blockPixels <= pixelCount; i += blockPixels)
+    {
+        for (int channel = 0; channel < 3; channel++)
+        {
+            for (size_t j = 0; j < blockPixels; j += 8)
+            {
+                __m128i converted = _mm256_cvtps_ph(_mm256_loadu_ps(sources[channel] + i + j), _MM_FROUND_TO_NEAREST_INT);
+                _mm_store_si128((__m128i*)(halves[channel] + j), converted);
+            }
+        }
+        interleave3AVX2(halves[0], halves[1], halves[2], rgb + i * 3, blockPixels);
+    }
+    interleave3HalfScalar(red + i, green + i, blue + i, rgb + i * 3, pixelCount - i);
+}
+
+/*
+* 16 columns per step, added up in registers like the SSE4.1 version
+*/
+PIXEL_KERNELS_TARGET("avx2")
+void PixelKernels::sumColumnsAVX2(const uint16_t* source, size_t rowStride, int rowCount, uint32_t* sums, size_t pixelCount)
+{
+    size_t i = 0;
+    for (; i + 16 <= pixelCount; i += 16)
+    {
+        __m256i low = _mm256_setzero_si256();
+        __m256i high = _mm256_setzero_si256();
+        for (int row = 0; row < rowCount; row++)
+        {
+            const uint16_t* pixels = source + row * rowStride + i;
+            low = _mm256_add_epi32(low, _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)pixels)));
+            high = _mm256_add_epi32(high, _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(pixels + 8))));
+        }
+        _mm256_storeu_si256((__m256i*)(sums + i), low);
+        _mm256_storeu_si256((__m256i*)(sums + i + 8), high);
+    }
+    sumColumnsScalar(source + i, rowStride, rowCount, sums + i, pixelCount - i);
+}
+
+/*
+* 16 pixels of a channel per step, two gathers of 32 bits from the 16 bit curve with
+* the upper half masked off
+*/
+PIXEL_KERNELS_TARGET("avx2")
+void PixelKernels::applyCurves3AVX2(const uint16_t* const source[3], uint16_t* const destination[3], const uint16_t* curves, size_t pixelCount)
+{
+    const __m256i lowHalf = _mm256_set1_epi32(0xFFFF);
+    size_t i = 0;
+    for (int channel = 0; channel < 3; channel++)
+    {
+        const int* curve = (const int*)(curves + channel * CURVE_ENTRIES);
+        const uint16_t* in = source[channel];
+        uint16_t* out = destination[channel];
+        for (i = 0; i + 16 <= pixelCount; i += 16)
+        {
+            __m256i low = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(in + i)));
+            __m256i high = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(in + i + 8)));
+            low = _mm256_and_si256(_mm256_i32gather_epi32(curve, low, 2), lowHalf);
+            high = _mm256_and_si256(_mm256_i32gather_epi32(curve, high, 2), lowHalf);
+            // packus works per lane, the permute puts the four quarters back in order
+            _mm256_storeu_si256((__m256i*)(out + i), _mm256_permute4x64_epi64(_mm256_packus_epi32(low, high), 0xD8));
+        }
+    }
+    const uint16_t* restSource[3] = { source[0] + i, source[1] + i, source[2] + i };
+    uint16_t* const restDestination[3] = { destination[0] + i, destination[1] + i, destination[2] + i };
+    applyCurves3Scalar(restSource, restDestination, curves, pixelCount - i);
+}
+
+/*
+* 8 pixels per step. The ordering of the fractions is done with compares and blends
+* on the strides, and every corner is one 64 bit gather per four pixels that brings in
+* all three channels. unpack spreads a gathered pixel over four 32 bit lanes (the even
+* pixels of the four in one register, the odd in another) to be multiplied by its
+* weight, and the rounded results go out through a small buffer into the planes.
+*/
+PIXEL_KERNELS_TARGET("avx2")
+void PixelKernels::tetrahedral3AVX2(const uint16_t* const source[3], uint16_t* const destination[3], const uint16_t* lut, int lutSize, size_t pixelCount)
+{
+    const __m256i steps = _mm256_set1_epi32(lutSize - 1);
+    const __m256i lastIndex = _mm256_set1_epi32(lutSize - 2);
+    const __m256i one = _mm256_set1_epi32(65536);
+    const __m256i half = _mm256_set1_epi32(32768);
+    const __m256i allSet = _mm256_set1_epi32(-1);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i strides[3] = { _mm256_set1_epi32(1), _mm256_set1_epi32(lutSize), _mm256_set1_epi32(lutSize * lutSize) };
+    const __m256i strideSum = _mm256_set1_epi32(1 + lutSize + lutSize * lutSize);
+    // Which pixel's weight each lane of an unpacked register needs
+    const __m256i spread[4] = { _mm256_setr_epi32(0, 0, 0, 0, 2, 2, 2, 2), _mm256_setr_epi32(1, 1, 1, 1, 3, 3, 3, 3),
+        _mm256_setr_epi32(4, 4, 4, 4, 6, 6, 6, 6), _mm256_setr_epi32(5, 5, 5, 5, 7, 7, 7, 7) };
+    const long long* entries = (const long long*)lut;
+    alignas(32) uint16_t results[8 * 4];
+
+    size_t i = 0;
+    for (; i + 8 <= pixelCount; i += 8)
+    {
+        __m256i fractions[3];
+        __m256i base = zero;
+        for (int channel = 0; channel < 3; channel++)
+        {
+            __m256i value = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(source[channel] + i)));
+            __m256i position = _mm256_mullo_epi32(_mm256_add_epi32(value, _mm256_srli_epi32(value, 15)), steps);
+            __m256i index = _mm256_min_epu32(_mm256_srli_epi32(position, 16), lastIndex);
+            fractions[channel] = _mm256_sub_epi32(position, _mm256_slli_epi32(index, 16));
+            base = _mm256_add_epi32(base, _mm256_mullo_epi32(index, strides[channel]));
+        }
+        // Fractions are at most 65536, so the signed compares are fine
+        __m256i redBelowGreen = _mm256_cmpgt_epi32(fractions[1], fractions[0]);
+        __m256i redBelowBlue = _mm256_cmpgt_epi32(fractions[2], fractions[0]);
+        __m256i greenBelowBlue = _mm256_cmpgt_epi32(fractions[2], fractions[1]);
+        __m256i firstRed = _mm256_xor_si256(_mm256_or_si256(redBelowGreen, redBelowBlue), allSet);
+        __m256i firstGreen = _mm256_andnot_si256(_mm256_or_si256(firstRed, greenBelowBlue), allSet);
+        __m256i lastBlue = _mm256_xor_si256(_mm256_or_si256(greenBelowBlue, redBelowBlue), allSet);
+        __m256i lastGreen = _mm256_andnot_si256(_mm256_or_si256(lastBlue, redBelowGreen), allSet);
+        __m256i firstStride = _mm256_blendv_epi8(_mm256_blendv_epi8(strides[2], strides[1], firstGreen), strides[0], firstRed);
+        __m256i lastStride = _mm256_blendv_epi8(_mm256_blendv_epi8(strides[0], strides[1], lastGreen), strides[2], lastBlue);
+        __m256i middleStride = _mm256_sub_epi32(_mm256_sub_epi32(strideSum, firstStride), lastStride);
+        __m256i largest = _mm256_max_epi32(_mm256_max_epi32(fractions[0], fractions[1]), fractions[2]);
+        __m256i smallest = _mm256_min_epi32(_mm256_min_epi32(fractions[0], fractions[1]), fractions[2]);
+        __m256i middle = _mm256_sub_epi32(_mm256_sub_epi32(_mm256_add_epi32(_mm256_add_epi32(fractions[0], fractions[1]), fractions[2]), largest), smallest);
+
+        __m256i corners[4];
+        corners[0] = base;
+        corners[1] = _mm256_add_epi32(base, firstStride);
+        corners[2] = _mm256_add_epi32(corners[1], middleStride);
+        corners[3] = _mm256_add_epi32(base, strideSum);
+        __m256i weights[4] = { _mm256_sub_epi32(one, largest), _mm256_sub_epi32(largest, middle), _mm256_sub_epi32(middle, smallest), smallest };
+
+        __m256i sums[4] = { half, half, half, half };
+        for (int corner = 0; corner < 4; corner++)
+        {
+            __m256i gathered[2] = {
+                _mm256_i32gather_epi64(entries, _mm256_castsi256_si128(corners[corner]), 8),
+                _mm256_i32gather_epi64(entries, _mm256_extracti128_si256(corners[corner], 1), 8) };
+            for (int quad = 0; quad < 2; quad++)
+            {
+                __m256i even = _mm256_unpacklo_epi16(gathered[quad], zero);
+                __m256i odd = _mm256_unpackhi_epi16(gathered[quad], zero);
+                sums[quad * 2] = _mm256_add_epi32(sums[quad * 2], _mm256_mullo_epi32(even, _mm256_permutevar8x32_epi32(weights[corner], spread[quad * 2])));
+                sums[quad * 2 + 1] = _mm256_add_epi32(sums[quad * 2 + 1], _mm256_mullo_epi32(odd, _mm256_permutevar8x32_epi32(weights[corner], spread[quad * 2 + 1])));
+            }
+        }
+        // Back to 16 bits, four pixels of red, green, blue and the unused value per register
+        for (int quad = 0; quad < 2; quad++)
+        {
+            __m256i packed = _mm256_packus_epi32(_mm256_srli_epi32(sums[quad * 2], 16), _mm256_srli_epi32(sums[quad * 2 + 1], 16));
+            _mm256_store_si256((__m256i*)(results + quad * 16), packed);
+        }
+        for (int pixel = 0; pixel < 8; pixel++)
+        {
+            destination[0][i + pixel] = results[pixel * 4];
+            destination[1][i + pixel] = results[pixel * 4 + 1];
+            destination[2][i + pixel] = results[pixel * 4 + 2];
+        }
+    }
+    const uint16_t* restSource[3] = { source[0] + i, source[1] + i, source[2] + i };
+    uint16_t* const restDestination[3] = { destination[0] + i, destination[1] + i, destination[2] + i };
+    tetrahedral3Scalar(restSource, restDestination, lut, lutSize, pixelCount - i);
+}
+
+PIXEL_KERNELS_TARGET("avx2")
+void PixelKernels::swapBytes16AVX2(const uint16_t* source, uint16_t* destination, size_t count)
+{
+    const __m256i swap = _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+        1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        _mm256_storeu_si256((__m256i*)(destination + i), _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*)(source + i)), swap));
+    }
+    swapBytes16Scalar(source + i, destination + i, count - i);
+}
+
+PIXEL_KERNELS_TARGET("avx2")
+void PixelKernels::horizontalDifference16AVX2(const uint16_t* source, uint16_t* destination, size_t count, size_t stride)
+{
+    size_t i = count < stride ? count : stride;
+    horizontalDifference16Scalar(source, destination, i, stride);
+    for (; i + 16 <= count; i += 16)
+    {
+        __m256i current = _mm256_loadu_si256((const __m256i*)(source + i));
+        __m256i previous = _mm256_loadu_si256((const __m256i*)(source + i - stride));
+        _mm256_storeu_si256((__m256i*)(destination + i), _mm256_sub_epi16(current, previous));
+    }
+    for (; i < count; ++i)
+    {
+        destination[i] = (uint16_t)(source[i] - source[i - stride]);
+    }
+}
+
+#endif
@@ -0,0 +1,296 @@
+/*
+*   PixelKernelsAVX512.cpp
+*	Film Scanner Master PC Control Software by Kyle Mikolajczyk
+*	kyle@kylem.org
+*
+*   AVX-512 (F + BW) versions of the PixelKernels. Only called when the CPU and OS
+*   support both.
+*/
+
+#include "PixelKernels.h"
+
+#ifdef PIXEL_KERNELS_X86
+
+#include <immintrin.h>
+
+/*
+* 32 pixels per step. AVX-512BW can permute words across the whole register, so each
+* of the three outputs is one two-source permute of red/green and one permute of blue,
+* merged with a mask. Output word j is channel j % 3 of pixel j / 3.
+*/
+PIXEL_KERNELS_TARGET("avx512f,avx512bw")
+void PixelKernels::interleave3AVX512(const uint16_t* red, const uint16_t* green, const uint16_t* blue, uint16_t* rgb, size_t pixelCount)
+{
+    alignas(64) uint16_t redGreenIndex[3][32];
+    alignas(64) uint16_t blueIndex[3][32];
+    __mmask32 blueMask[3] = { 0, 0, 0 };
+    for (int k = 0; k < 3; k++)
+    {
+        for (int w = 0; w < 32; w++)
+        {
+            int j = k * 32 + w;
+            int pixel = j / 3;
+            int channel = j % 3;
+            redGreenIndex[k][w] = (uint16_t)(channel == 1 ? 32 + pixel : pixel); // 32+ selects the second source
+            blueIndex[k][w] = (uint16_t)pixel;
+            if (channel == 2)
+            {
+                blueMask[k] |= (__mmask32)1 << w;
+            }
+        }
+    }
+    const __m512i rg0 = _mm512_load_si512(redGreenIndex[0]);
+    const __m512i rg1 = _mm512_load_si512(redGreenIndex[1]);
+    const __m512i rg2 = _mm512_load_si512(redGreenIndex[2]);
+    const __m512i b0 = _mm512_load_si512(blueIndex[0]);
+    const __m512i b1 = _mm512_load_si512(blueIndex[1]);
+    const __m512i b2 = _mm512_load_si512(blueIndex[2]);
+
+    size_t i = 0;
+    for (; i + 32 <= pixelCount; i += 32)
+    {
+        __m512i r = _mm512_loadu_si512(red + i);
+        __m512i g = _mm512_loadu_si512(green + i);
+        __m512i b = _mm512_loadu_si512(blue + i);
+
+        __m512i out0 = _mm512_mask_permutexvar_epi16(_mm512_permutex2var_epi16(r, rg0, g), blueMask[0], b0, b);
+        __m512i out1 = _mm512_mask_permutexvar_epi16(_mm512_permutex2var_epi16(r, rg1, g), blueMask[1], b1, b);
+        __m512i out2 = _mm512_mask_permutexvar_epi16(_mm512_permutex2var_epi16(r, rg2, g), blueMask[2], b2, b);
+
+        uint16_t* out = rgb + i * 3;
+        _mm512_storeu_si512(out, out0);
+        _mm512_storeu_si512(out + 32, out1);
+        _mm512_storeu_si512(out + 64, out2);
+    }
+    interleave3Scalar(red + i, green + i, blue + i, rgb + i * 3, pixelCount - i);
+}
+
+PIXEL_KERNELS_TARGET("avx512f,avx512bw")
+void PixelKernels::shift12To16AVX512(const uint16_t* source, uint16_t* destination, size_t pixelCount)
+{
+    size_t i = 0;
+    for (; i + 64 <= pixelCount; i += 64)
+    {
+        __m512i a = _mm512_loadu_si512(source + i);
+        __m512i b = _mm512_loadu_si512(source + i + 32);
+        _mm512_storeu_si512(destination + i, _mm512_slli_epi16(a, 4));
+        _mm512_storeu_si512(destination + i + 32, _mm512_slli_epi16(b, 4));
+    }
+    shift12To16Scalar(source + i, destination + i, pixelCount - i);
+}
+
+/*
+* 32 pixels (48 bytes) per step, 12 bytes to each 128 bit lane, then the SSE4.1 trick
+* with a mask blend for the odd words
+*/
+PIXEL_KERNELS_TARGET("avx512f,avx512bw")
+void PixelKernels::unpack12pTo16AVX512(const uint8_t* source, uint16_t* destination, size_t pixelCount)
+{
+    const __m512i split = _mm512_setr_epi32(0, 1, 2, 0, 3, 4, 5, 0, 6, 7, 8, 0, 9, 10, 11, 0);
+    const __m512i spread = _mm512_broadcast_i32x4(_mm_setr_epi8(0, 1, 1, 2, 3, 4, 4, 5, 6, 7, 7, 8, 9, 10, 10, 11));
+    const __m512i highBits = _mm512_set1_epi16((short)0xFFF0);
+    size_t packedBytes = (pixelCount * 3 + 1) / 2;
+
+    size_t i = 0;
+    for (; i + 32 <= pixelCount && i / 2 * 3 + 64 <= packedBytes; i += 32)
+    {
+        __m512i packed = _mm512_permutexvar_epi32(split, _mm512_loadu_si512(source + i / 2 * 3));
+        __m512i words = _mm512_shuffle_epi8(packed, spread);
+        _mm512_storeu_si512(destination + i, _mm512_mask_blend_epi16(0xAAAAAAAA, _mm512_slli_epi16(words, 4), _mm512_and_si512(words, highBits)));
+    }
+    unpack12pTo16Scalar(source + i / 2 * 3, destination + i, pixelCount - i);
+}
+
+/*
+* 32 pixels per step. Same split multiply as the SSE4.1 version, the saturation is a
+* compare into a mask instead of a blend.
+*/
+PIXEL_KERNELS_TARGET("avx512f,avx512bw")
+void PixelKernels::flatFieldAVX512(const uint16_t* source, const uint16_t* offset, const uint16_t* gain, uint16_t* destination, size_t pixelCount)
+{
+    const __m512i maxHigh = _mm512_set1_epi16((1 << FLAT_FIELD_GAIN_BITS) - 1);
+    const __m512i allOnes = _mm512_set1_epi16(-1);
+
+    size_t i = 0;
+    for (; i + 32 <= pixelCount; i += 32)
+    {
+        __m512i value = _mm512_subs_epu16(_mm512_loadu_si512(source + i), _mm512_loadu_si512(offset + i));
+        __m512i g = _mm512_loadu_si512(gain + i);
+        __m512i low = _mm512_mullo_epi16(value, g);
+        __m512i high = _mm512_mulhi_epu16(value, g);
+        __m512i scaled = _mm512_or_si512(_mm512_srli_epi16(low, FLAT_FIELD_GAIN_BITS), _mm512_slli_epi16(high, 16 - FLAT_FIELD_GAIN_BITS));
+        __mmask32 overflow = _mm512_cmpgt_epu16_mask(high, maxHigh);
+        _mm512_storeu_si512(destination + i, _mm512_mask_mov_epi16(scaled, overflow, allOnes));
+    }
+    flatFieldScalar(source + i, offset + i, gain + i, destination + i, pixelCount - i);
+}
+
+/*
+* 32 pixels per step, the AVX2 version on a full register
+*/
+PIXEL_KERNELS_TARGET("avx512f,avx512bw")
+void PixelKernels::bilinearRowAVX512(const uint16_t* top, const uint16_t* bottom, uint16_t* destination, size_t pixelCount, const uint16_t weights[4])
+{
+    const __m512i bias = _mm512_set1_epi16((short)0x8000);
+    const __m512i topWeights = _mm512_set1_epi32((int)(weights[0] | (uint32_t)weights[1] << 16));
+    const __m512i bottomWeights = _mm512_set1_epi32((int)(weights[2] | (uint32_t)weights[3] << 16));
+    const __m512i restore = _mm512_set1_epi32(32768 * 256 + 128);
+
+    size_t i = 0;
+    for (; i + 32 <= pixelCount; i += 32)
+    {
+        __m512i topLeft = _mm512_xor_si512(_mm512_loadu_si512(top + i), bias);
+        __m512i topRight = _mm512_xor_si512(_mm512_loadu_si512(top + i + 1), bias);
+        __m512i bottomLeft = _mm512_xor_si512(_mm512_loadu_si512(bottom + i), bias);
+        __m512i bottomRight = _mm512_xor_si512(_mm512_loadu_si512(bottom + i + 1), bias);
+        __m512i low = _mm512_add_epi32(_mm512_madd_epi16(_mm512_unpacklo_epi16(topLeft, topRight), topWeights),
+            _mm512_madd_epi16(_mm512_unpacklo_epi16(bottomLeft, bottomRight), bottomWeights));
+        __m512i high = _mm512_add_epi32(_mm512_madd_epi16(_mm512_unpackhi_epi16(topLeft, topRight), topWeights),
+            _mm512_madd_epi16(_mm512_unpackhi_epi16(bottomLeft, bottomRight), bottomWeights));
+        low = _mm512_srli_epi32(_mm512_add_epi32(low, restore), 8);
+        high = _mm512_srli_epi32(_mm512_add_epi32(high, restore), 8);
+        _mm512_storeu_si512(destination + i, _mm512_packus_epi32(low, high));
+    }
+    bilinearRowScalar(top + i, bottom + i, destination + i, pixelCount - i, weights);
+}
+
+/*
+* 32 pixels per step, as in the AVX2 version
+*/
+PIXEL_KERNELS_TARGET("avx512f,avx512bw")
+void PixelKernels::fuseExposureAVX512(const uint16_t* exposure, float* radiance, size_t pixelCount, float scale, bool first)
+{
+    const __m512 scales = _mm512_set1_ps(scale);
+    const __m512 clip = _mm512_set1_ps((float)HDR_CLIP);
+    const __m512 slope = _mm512_set1_ps(1.0f / (HDR_CLIP - HDR_KNEE));
+    const __m512 zero = _mm512_setzero_ps();
+    const __m512 one = _mm512_set1_ps(1.0f);
+
+    size_t i = 0;
+    for (; i + 32 <= pixelCount; i += 32)
+    {
+        __m256i low = _mm256_loadu_si256((const __m256i*)(exposure + i));
+        __m256i high = _mm256_loadu_si256((const __m256i*)(exposure + i + 16));
+        __m512 values[2] = { _mm512_cvtepi32_ps(_mm512_cvtepu16_epi32(low)), _mm512_cvtepi32_ps(_mm512_cvtepu16_epi32(high)) };
+        for (int half = 0; half < 2; half++)
+        {
+            float* out = radiance + i + half * 16;
+            __m512 scaled = _mm512_mul_ps(values[half], scales);
+            if (first)
+            {
+                _mm512_storeu_ps(out, scaled);
+                continue;
+            }
+            __m512 weight = _mm512_min_ps(one, _mm512_max_ps(zero, _mm512_mul_ps(_mm512_sub_ps(clip, values[half]), slope)));
+            __m512 current = _mm512_loadu_ps(out);
+            _mm512_storeu_ps(out, _mm512_add_ps(current, _mm512_mul_ps(weight, _mm512_sub_ps(scaled, current))));
+        }
+    }
+    fuseExposureScalar(exposure + i, radiance + i, pixelCount - i, scale, first);
+}
+
+/*
+* The AVX2 version with 16 conversions per instruction
+*/
+PIXEL_KERNELS_TARGET("avx512f,avx512bw")
+void PixelKernels::interleave3HalfAVX512(const float* red, const float* green, const float* blue, uint16_t* rgb, size_t pixelCount)
+{
+    const size_t blockPixels = 256;
+    alignas(64) uint16_t halves[3][blockPixels];
+    const float* sources[3] = { red, green, blue };
+
+    size_t i = 0;
+    for (; i + blockPixels <= pixelCount; i += blockPixels)
+    {
+        for (int channel = 0; channel < 3; channel++)
+        {
+            for (size_t j = 0; j < blockPixels; j += 16)
+            {
+                __m256i converted = _mm512_cvtps_ph(_mm512_loadu_ps(sources[channel] + i + j), _MM_FROUND_TO_NEAREST_INT);
+                _mm256_store_si256((__m256i*)(halves[channel] + j), converted);
+            }
+        }
+        interleave3AVX512(halves[0], halves[1], halves[2], rgb + i * 3, blockPixels);
+    }
+    interleave3HalfScalar(red + i, green + i, blue + i, rgb + i * 3, pixelCount - i);
+}
+
+/*
+* 32 columns per step, added up in registers like the SSE4.1 version
+*/
+PIXEL_KERNELS_TARGET("avx512f,avx512bw")
+void PixelKernels::sumColumnsAVX512(const uint16_t* source, size_t rowStride, int rowCount, uint32_t* sums, size_t pixelCount)
+{
+    size_t i = 0;
+    for (; i + 32 <= pixelCount; i += 32)
+    {
+        __m512i low = _mm512_setzero_si512();
+        __m512i high = _mm512_setzero_si512();
+        for (int row = 0; row < rowCount; row++)
+        {
+            const uint16_t* pixels = source + row * rowStride + i;
+            low = _mm512_add_epi32(low, _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i*)pixels)));
+            high = _mm512_add_epi32(high, _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i*)(pixels + 16))));
+        }
+        _mm512_storeu_si512(sums + i, low);
+        _mm512_storeu_si512(sums + i + 16, high);
+    }
+    sumColumnsScalar(source + i, rowStride, rowCount, sums + i, pixelCount - i);
+}
+
+/*
+* 32 pixels of a channel per step, like the AVX2 version but vpmovdw drops the upper
+* half of each gathered value on the way back to 16 bits
+*/
+PIXEL_KERNELS_TARGET("avx512f,avx512bw")
+void PixelKernels::applyCurves3AVX512(const uint16_t* const source[3], uint16_t* const destination[3], const uint16_t* curves, size_t pixelCount)
+{
+    size_t i = 0;
+    for (int channel = 0; channel < 3; channel++)
+    {
+        const int* curve = (const int*)(curves + channel * CURVE_ENTRIES);
+        const uint16_t* in = source[channel];
+        uint16_t* out = destination[channel];
+        for (i = 0; i + 32 <= pixelCount; i += 32)
+        {
+            __m512i low = _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i*)(in + i)));
+            __m512i high = _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i*)(in + i + 16)));
+            _mm256_storeu_si256((__m256i*)(out + i), _mm512_cvtepi32_epi16(_mm512_i32gather_epi32(low, curve, 2)));
+            _mm256_storeu_si256((__m256i*)(out + i + 16), _mm512_cvtepi32_epi16(_mm512_i32gather_epi32(high, curve, 2)));
+        }
+    }
+    const uint16_t* restSource[3] = { source[0] + i, source[1] + i, source[2] + i };
+    uint16_t* const restDestination[3] = { destination[0] + i, destination[1] + i, destination[2] + i };
+    applyCurves3Scalar(restSource, restDestination, curves, pixelCount - i);
+}
+
+PIXEL_KERNELS_TARGET("avx512f,avx512bw")
+void PixelKernels::swapBytes16AVX512(const uint16_t* source, uint16_t* destination, size_t count)
+{
+    const __m512i swap = _mm512_broadcast_i32x4(_mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14));
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32)
+    {
+        _mm512_storeu_si512((void*)(destination + i), _mm512_shuffle_epi8(_mm512_loadu_si512((const void*)(source + i)), swap));
+    }
+    swapBytes16Scalar(source + i, destination + i, count - i);
+}
+
+PIXEL_KERNELS_TARGET("avx512f,avx512bw")
+void PixelKernels::horizontalDifference16AVX512(const uint16_t* source, uint16_t* destination, size_t count, size_t stride)
+{
+    size_t i = count < stride ? count : stride;
+    horizontalDifference16Scalar(source, destination, i, stride);
+    for (; i + 32 <= count; i += 32)
+    {
+        __m512i current = _mm512_loadu_si512((const void*)(source + i));
+        __m512i previous = _mm512_loadu_si512((const void*)(source + i - stride));
+        _mm512_storeu_si512((void*)(destination + i), _mm512_sub_epi16(current, previous));
+    }
+    for (; i < count; ++i)
+    {
+        destination[i] = (uint16_t)(source[i] - source[i - stride]);
+    }
+}
+
+#endif
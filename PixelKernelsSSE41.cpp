@@ -0,0 +1,276 @@
+/*
+*   PixelKernelsSSE41.cpp
+*	Film Scanner Master PC Control Software by Kyle Mikolajczyk
+*	kyle@kylem.org
+*
+*   SSE4.1 versions of the PixelKernels. Only called when the CPU reports SSE4.1.
+*/
+
+#include "PixelKernels.h"
+
+#ifdef PIXEL_KERNELS_X86
+
+#include <immintrin.h>
+
+/*
+* 8 pixels per step. Each of the three output registers takes a few words from each
+* channel: pshufb moves them into place and pblendw picks the right channel per word.
+*   out0 = r0 g0 b0 r1 g1 b1 r2 g2
+*   out1 = b2 r3 g3 b3 r4 g4 b4 r5
+*   out2 = g5 b5 r6 g6 b6 r7 g7 b7
+*/
+PIXEL_KERNELS_TARGET("sse4.1")
+void PixelKernels::interleave3SSE41(const uint16_t* red, const uint16_t* green, const uint16_t* blue, uint16_t* rgb, size_t pixelCount)
+{
+    // Byte shuffles, -1 marks words that the blend will take from another channel
+    const __m128i redTo0 = _mm_setr_epi8(0, 1, -1, -1, -1, -1, 2, 3, -1, -1, -1, -1, 4, 5, -1, -1);
+    const __m128i greenTo0 = _mm_setr_epi8(-1, -1, 0, 1, -1, -1, -1, -1, 2, 3, -1, -1, -1, -1, 4, 5);
+    const __m128i blueTo0 = _mm_setr_epi8(-1, -1, -1, -1, 0, 1, -1, -1, -1, -1, 2, 3, -1, -1, -1, -1);
+    const __m128i redTo1 = _mm_setr_epi8(-1, -1, 6, 7, -1, -1, -1, -1, 8, 9, -1, -1, -1, -1, 10, 11);
+    const __m128i greenTo1 = _mm_setr_epi8(-1, -1, -1, -1, 6, 7, -1, -1, -1, -1, 8, 9, -1, -1, -1, -1);
+    const __m128i blueTo1 = _mm_setr_epi8(4, 5, -1, -1, -1, -1, 6, 7, -1, -1, -1, -1, 8, 9, -1, -1);
+    const __m128i redTo2 = _mm_setr_epi8(-1, -1, -1, -1, 12, 13, -1, -1, -1, -1, 14, 15, -1, -1, -1, -1);
+    const __m128i greenTo2 = _mm_setr_epi8(10, 11, -1, -1, -1, -1, 12, 13, -1, -1, -1, -1, 14, 15, -1, -1);
+    const __m128i blueTo2 = _mm_setr_epi8(-1, -1, 10, 11, -1, -1, -1, -1, 12, 13, -1, -1, -1, -1, 14, 15);
+
+    size_t i = 0;
+    for (; i + 8 <= pixelCount; i += 8)
+    {
+        __m128i r = _mm_loadu_si128((const __m128i*)(red + i));
+        __m128i g = _mm_loadu_si128((const __m128i*)(green + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(blue + i));
+
+        __m128i out0 = _mm_blend_epi16(_mm_shuffle_epi8(r, redTo0), _mm_shuffle_epi8(g, greenTo0), 0x92);
+        out0 = _mm_blend_epi16(out0, _mm_shuffle_epi8(b, blueTo0), 0x24);
+        __m128i out1 = _mm_blend_epi16(_mm_shuffle_epi8(r, redTo1), _mm_shuffle_epi8(g, greenTo1), 0x24);
+        out1 = _mm_blend_epi16(out1, _mm_shuffle_epi8(b, blueTo1), 0x49);
+        __m128i out2 = _mm_blend_epi16(_mm_shuffle_epi8(r, redTo2), _mm_shuffle_epi8(g, greenTo2), 0x49);
+        out2 = _mm_blend_epi16(out2, _mm_shuffle_epi8(b, blueTo2), 0x92);
+
+        __m128i* out = (__m128i*)(rgb + i * 3);
+        _mm_storeu_si128(out + 0, out0);
+        _mm_storeu_si128(out + 1, out1);
+        _mm_storeu_si128(out + 2, out2);
+    }
+    interleave3Scalar(red + i, green + i, blue + i, rgb + i * 3, pixelCount - i);
+}
+
+PIXEL_KERNELS_TARGET("sse4.1")
+void PixelKernels::shift12To16SSE41(const uint16_t* source, uint16_t* destination, size_t pixelCount)
+{
+    size_t i = 0;
+    for (; i + 16 <= pixelCount; i += 16)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i*)(source + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(source + i + 8));
+        _mm_storeu_si128((__m128i*)(destination + i), _mm_slli_epi16(a, 4));
+        _mm_storeu_si128((__m128i*)(destination + i + 8), _mm_slli_epi16(b, 4));
+    }
+    shift12To16Scalar(source + i, destination + i, pixelCount - i);
+}
+
+/*
+* 8 pixels (12 bytes) per step. pshufb gives each pixel the two bytes it sits in as one
+* word: even pixels are in the low 12 bits of theirs, odd pixels in the high 12 bits. So
+* even words only need the << 4 (which also pushes out the neighbour's nibble) and odd
+* words are already scaled once the neighbour's nibble is masked off.
+*/
+PIXEL_KERNELS_TARGET("sse4.1")
+void PixelKernels::unpack12pTo16SSE41(const uint8_t* source, uint16_t* destination, size_t pixelCount)
+{
+    const __m128i spread = _mm_setr_epi8(0, 1, 1, 2, 3, 4, 4, 5, 6, 7, 7, 8, 9, 10, 10, 11);
+    const __m128i highBits = _mm_set1_epi16((short)0xFFF0);
+    size_t packedBytes = (pixelCount * 3 + 1) / 2;
+
+    size_t i = 0;
+    for (; i + 8 <= pixelCount && i / 2 * 3 + 16 <= packedBytes; i += 8) // Each load reads 4 bytes past the group
+    {
+        __m128i words = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(source + i / 2 * 3)), spread);
+        _mm_storeu_si128((__m128i*)(destination + i), _mm_blend_epi16(_mm_slli_epi16(words, 4), _mm_and_si128(words, highBits), 0xAA));
+    }
+    unpack12pTo16Scalar(source + i / 2 * 3, destination + i, pixelCount - i);
+}
+
+/*
+* 8 pixels per step. The product of two 16 bit words needs 32 bits, so it is taken as
+* its low and high halves (pmullw, pmulhuw) and the shift by the gain bits is put back
+* together from both. Lanes whose high half still has bits above the result saturate.
+*/
+PIXEL_KERNELS_TARGET("sse4.1")
+void PixelKernels::flatFieldSSE41(const uint16_t* source, const uint16_t* offset, const uint16_t* gain, uint16_t* destination, size_t pixelCount)
+{
+    const __m128i maxHigh = _mm_set1_epi16((1 << FLAT_FIELD_GAIN_BITS) - 1);
+    const __m128i allOnes = _mm_set1_epi16(-1);
+
+    size_t i = 0;
+    for (; i + 8 <= pixelCount; i += 8)
+    {
+        __m128i value = _mm_subs_epu16(_mm_loadu_si128((const __m128i*)(source + i)), _mm_loadu_si128((const __m128i*)(offset + i)));
+        __m128i g = _mm_loadu_si128((const __m128i*)(gain + i));
+        __m128i low = _mm_mullo_epi16(value, g);
+        __m128i high = _mm_mulhi_epu16(value, g);
+        __m128i scaled = _mm_or_si128(_mm_srli_epi16(low, FLAT_FIELD_GAIN_BITS), _mm_slli_epi16(high, 16 - FLAT_FIELD_GAIN_BITS));
+        __m128i fits = _mm_cmpeq_epi16(_mm_min_epu16(high, maxHigh), high);
+        _mm_storeu_si128((__m128i*)(destination + i), _mm_or_si128(scaled, _mm_xor_si128(fits, allOnes)));
+    }
+    flatFieldScalar(source + i, offset + i, gain + i, destination + i, pixelCount - i);
+}
+
+/*
+* 8 pixels per step. pmaddwd multiplies neighbouring pairs of words and adds them, which
+* is exactly one row of the bilinear sum once the left and right pixels are interleaved.
+* It only takes signed words, so the pixels are moved down by 32768 first and the
+* difference (32768 * 256) is added back to the 32 bit sums.
+*/
+PIXEL_KERNELS_TARGET("sse4.1")
+void PixelKernels::bilinearRowSSE41(const uint16_t* top, const uint16_t* bottom, uint16_t* destination, size_t pixelCount, const uint16_t weights[4])
+{
+    const __m128i bias = _mm_set1_epi16((short)0x8000);
+    const __m128i topWeights = _mm_set1_epi32((int)(weights[0] | (uint32_t)weights[1] << 16));
+    const __m128i bottomWeights = _mm_set1_epi32((int)(weights[2] | (uint32_t)weights[3] << 16));
+    const __m128i restore = _mm_set1_epi32(32768 * 256 + 128);
+
+    size_t i = 0;
+    for (; i + 8 <= pixelCount; i += 8)
+    {
+        __m128i topLeft = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(top + i)), bias);
+        __m128i topRight = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(top + i + 1)), bias);
+        __m128i bottomLeft = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(bottom + i)), bias);
+        __m128i bottomRight = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(bottom + i + 1)), bias);
+        __m128i low = _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(topLeft, topRight), topWeights),
+            _mm_madd_epi16(_mm_unpacklo_epi16(bottomLeft, bottomRight), bottomWeights));
+        __m128i high = _mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(topLeft, topRight), topWeights),
+            _mm_madd_epi16(_mm_unpackhi_epi16(bottomLeft, bottomRight), bottomWeights));
+        low = _mm_srli_epi32(_mm_add_epi32(low, restore), 8);
+        high = _mm_srli_epi32(_mm_add_epi32(high, restore), 8);
+        _mm_storeu_si128((__m128i*)(destination + i), _mm_packus_epi32(low, high));
+    }
+    bilinearRowScalar(top + i, bottom + i, destination + i, pixelCount - i, weights);
+}
+
+/*
+* 8 pixels per step, widened to 32 bits and converted to float. The weight is clamped
+* with min/max in the same order as the scalar version.
+*/
+PIXEL_KERNELS_TARGET("sse4.1")
+void PixelKernels::fuseExposureSSE41(const uint16_t* exposure, float* radiance, size_t pixelCount, float scale, bool first)
+{
+    const __m128 scales = _mm_set1_ps(scale);
+    const __m128 clip = _mm_set1_ps((float)HDR_CLIP);
+    const __m128 slope = _mm_set1_ps(1.0f / (HDR_CLIP - HDR_KNEE));
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.0f);
+
+    size_t i = 0;
+    for (; i + 8 <= pixelCount; i += 8)
+    {
+        __m128i words = _mm_loadu_si128((const __m128i*)(exposure + i));
+        __m128 values[2] = { _mm_cvtepi32_ps(_mm_cvtepu16_epi32(words)), _mm_cvtepi32_ps(_mm_cvtepu16_epi32(_mm_srli_si128(words, 8))) };
+        for (int half = 0; half < 2; half++)
+        {
+            float* out = radiance + i + half * 4;
+            __m128 scaled = _mm_mul_ps(values[half], scales);
+            if (first)
+            {
+                _mm_storeu_ps(out, scaled);
+                continue;
+            }
+            __m128 weight = _mm_min_ps(one, _mm_max_ps(zero, _mm_mul_ps(_mm_sub_ps(clip, values[half]), slope)));
+            __m128 current = _mm_loadu_ps(out);
+            _mm_storeu_ps(out, _mm_add_ps(current, _mm_mul_ps(weight, _mm_sub_ps(scaled, current))));
+        }
+    }
+    fuseExposureScalar(exposure + i, radiance + i, pixelCount - i, scale, first);
+}
+
+/*
+* 8 columns per step, every row zero extended to 32 bits and added up in registers, so
+* each sum is only stored once
+*/
+PIXEL_KERNELS_TARGET("sse4.1")
+void PixelKernels::sumColumnsSSE41(const uint16_t* source, size_t rowStride, int rowCount, uint32_t* sums, size_t pixelCount)
+{
+    size_t i = 0;
+    for (; i + 8 <= pixelCount; i += 8)
+    {
+        __m128i low = _mm_setzero_si128();
+        __m128i high = _mm_setzero_si128();
+        for (int row = 0; row < rowCount; row++)
+        {
+            __m128i pixels = _mm_loadu_si128((const __m128i*)(source + row * rowStride + i));
+            low = _mm_add_epi32(low, _mm_cvtepu16_epi32(pixels));
+            high = _mm_add_epi32(high, _mm_cvtepu16_epi32(_mm_srli_si128(pixels, 8)));
+        }
+        _mm_storeu_si128((__m128i*)(sums + i), low);
+        _mm_storeu_si128((__m128i*)(sums + i + 4), high);
+    }
+    sumColumnsScalar(source + i, rowStride, rowCount, sums + i, pixelCount - i);
+}
+
+PIXEL_KERNELS_TARGET("sse4.1")
+void PixelKernels::swapBytes16SSE41(const uint16_t* source, uint16_t* destination, size_t count)
+{
+    const __m128i swap = _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        _mm_storeu_si128((__m128i*)(destination + i), _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(source + i)), swap));
+    }
+    swapBytes16Scalar(source + i, destination + i, count - i);
+}
+
+/*
+* 8 pixels per step, the interleave run backwards: each channel takes its words out of
+* all three input registers with one pshufb each and the three are ORed together.
+*   in0 = r0 g0 b0 r1 g1 b1 r2 g2
+*   in1 = b2 r3 g3 b3 r4 g4 b4 r5
+*   in2 = g5 b5 r6 g6 b6 r7 g7 b7
+*/
+PIXEL_KERNELS_TARGET("sse4.1")
+void PixelKernels::deinterleave3SSE41(const uint16_t* rgb, uint16_t* red, uint16_t* green, uint16_t* blue, size_t pixelCount)
+{
+    const __m128i redFrom0 = _mm_setr_epi8(0, 1, 6, 7, 12, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i redFrom1 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 2, 3, 8, 9, 14, 15, -1, -1, -1, -1);
+    const __m128i redFrom2 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 4, 5, 10, 11);
+    const __m128i greenFrom0 = _mm_setr_epi8(2, 3, 8, 9, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i greenFrom1 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 4, 5, 10, 11, -1, -1, -1, -1, -1, -1);
+    const __m128i greenFrom2 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 1, 6, 7, 12, 13);
+    const __m128i blueFrom0 = _mm_setr_epi8(4, 5, 10, 11, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i blueFrom1 = _mm_setr_epi8(-1, -1, -1, -1, 0, 1, 6, 7, 12, 13, -1, -1, -1, -1, -1, -1);
+    const __m128i blueFrom2 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 3, 8, 9, 14, 15);
+
+    size_t i = 0;
+    for (; i + 8 <= pixelCount; i += 8)
+    {
+        const __m128i* in = (const __m128i*)(rgb + i * 3);
+        __m128i in0 = _mm_loadu_si128(in + 0);
+        __m128i in1 = _mm_loadu_si128(in + 1);
+        __m128i in2 = _mm_loadu_si128(in + 2);
+        __m128i r = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(in0, redFrom0), _mm_shuffle_epi8(in1, redFrom1)), _mm_shuffle_epi8(in2, redFrom2));
+        __m128i g = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(in0, greenFrom0), _mm_shuffle_epi8(in1, greenFrom1)), _mm_shuffle_epi8(in2, greenFrom2));
+        __m128i b = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(in0, blueFrom0), _mm_shuffle_epi8(in1, blueFrom1)), _mm_shuffle_epi8(in2, blueFrom2));
+        _mm_storeu_si128((__m128i*)(red + i), r);
+        _mm_storeu_si128((__m128i*)(green + i), g);
+        _mm_storeu_si128((__m128i*)(blue + i), b);
+    }
+    deinterleave3Scalar(rgb + i * 3, red + i, green + i, blue + i, pixelCount - i);
+}
+
+PIXEL_KERNELS_TARGET("sse4.1")
+void PixelKernels::horizontalDifference16SSE41(const uint16_t* source, uint16_t* destination, size_t count, size_t stride)
+{
+    size_t i = count < stride ? count : stride;
+    horizontalDifference16Scalar(source, destination, i, stride);
+    for (; i + 8 <= count; i += 8)
+    {
+        __m128i current = _mm_loadu_si128((const __m128i*)(source + i));
+        __m128i previous = _mm_loadu_si128((const __m128i*)(source + i - stride));
+        _mm_storeu_si128((__m128i*)(destination + i), _mm_sub_epi16(current, previous));
+    }
+    for (; i < count; ++i)
+    {
+        destination[i] = (uint16_t)(source[i] - source[i - stride]);
+    }
+}
+
+#endif
@@ -0,0 +1,323 @@
+/*
+*   PreviewRing.cpp
+*	Film Scanner Master PC Control Software by Kyle Mikolajczyk
+*	kyle@kylem.org
+*/
+
+#include "PreviewRing.h"
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <new>
+
+#ifdef _WIN32
+#    include <windows.h>
+#else
+#    include <fcntl.h>
+#    include <sys/mman.h>
+#    include <sys/stat.h>
+#    include <unistd.h>
+#endif
+
+namespace
+{
+    struct RingHeader
+    {
+        std::atomic<uint32_t> magic; // Set last, a reader ignores the ring until then
+        uint32_t version;
+        uint32_t slotCount;
+        uint32_t reserved;
+        uint64_t slotBytes; // Pixel bytes per slot, not counting its header
+        std::atomic<uint64_t> published;
+        unsigned char padding[32];
+    };
+
+    struct SlotHeader
+    {
+        std::atomic<uint64_t> sequence;
+        uint64_t number; // The value of published once this preview is in
+        int32_t imageId;
+        int32_t width;
+        int32_t height;
+        unsigned char padding[36];
+    };
+
+    static_assert(sizeof(RingHeader) == 64, "The ring header is part of the layout readers rely on");
+    static_assert(sizeof(SlotHeader) == 64, "The slot header is part of the layout readers rely on");
+
+    size_t ringBytes(size_t slotCount, size_t slotBytes)
+    {
+        return sizeof(RingHeader) + slotCount * (sizeof(SlotHeader) + slotBytes);
+    }
+
+    SlotHeader* slotAt(void* mapping, size_t slotBytes, size_t slot)
+    {
+        return (SlotHeader*)((unsigned char*)mapping + sizeof(RingHeader) + slot * (sizeof(SlotHeader) + slotBytes));
+    }
+
+    std::string objectName(const std::string& name)
+    {
+#ifdef _WIN32
+        return "Local\\" + name;
+#else
+        return "/" + name;
+#endif
+    }
+}
+
+PreviewRing::PreviewRing(const std::string& name, size_t slotCount)
+    : name(name), slotCount(slotCount > 0 ? slotCount : 1), mapping(nullptr), mappingBytes(0), slotBytes(0), failed(false)
+#ifdef _WIN32
+    , fileMapping(nullptr)
+#endif
+{
+}
+
+bool PreviewRing::create(size_t bytesPerSlot)
+{
+    size_t bytes = ringBytes(slotCount, bytesPerSlot);
+    std::string object = objectName(name);
+#ifdef _WIN32
+    fileMapping = CreateFileMappingA(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, (DWORD)((uint64_t)bytes >> 32), (DWORD)bytes,
+        object.c_str());
+    if (fileMapping == nullptr)
+    {
+        std::cerr << "Error: Could not create the preview ring " << object << ", error " << GetLastError() << std::endl;
+        return false;
+    }
+    mapping = MapViewOfFile(fileMapping, FILE_MAP_ALL_ACCESS, 0, 0, bytes);
+    if (mapping == nullptr)
+    {
+        std::cerr << "Error: Could not map the preview ring " << object << ", error " << GetLastError() << std::endl;
+        CloseHandle(fileMapping);
+        fileMapping = nullptr;
+        return false;
+    }
+#else
+    // A ring left behind by a run that crashed may have other slot sizes, start afresh
+    shm_unlink(object.c_str());
+    int descriptor = shm_open(object.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (descriptor < 0 || ftruncate(descriptor, (off_t)bytes) != 0)
+    {
+        std::cerr << "Error: Could not create the preview ring " << object << ": " << strerror(errno) << std::endl;
+        if (descriptor >= 0)
+        {
+            close(descriptor);
+            shm_unlink(object.c_str());
+        }
+        return false;
+    }
+    void* mapped = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, descriptor, 0);
+    close(descriptor);
+    if (mapped == MAP_FAILED)
+    {
+        std::cerr << "Error: Could not map the preview ring " << object << ": " << strerror(errno) << std::endl;
+        shm_unlink(object.c_str());
+        return false;
+    }
+    mapping = mapped;
+#endif
+    mappingBytes = bytes;
+    slotBytes = bytesPerSlot;
+
+    // New shared memory is zero filled, which is an empty ring apart from the header
+    RingHeader* header = new (mapping) RingHeader();
+    header->version = VERSION;
+    header->slotCount = (uint32_t)slotCount;
+    header->slotBytes = slotBytes;
+    header->published.store(0, std::memory_order_relaxed);
+    for (size_t slot = 0; slot < slotCount; slot++)
+    {
+        new (slotAt(mapping, slotBytes, slot)) SlotHeader();
+    }
+    header->magic.store(MAGIC, std::memory_order_release);
+    std::cout << "Publishing previews to shared memory " << object << ", " << slotCount << " slot(s) of " << slotBytes << " bytes" << std::endl;
+    return true;
+}
+
+bool PreviewRing::publish(int imageId, int width, int height, const uint8_t* rgb)
+{
+    size_t bytes = (size_t)width * height * 3;
+    std::lock_guard<std::mutex> lock(mutex);
+    if (mapping == nullptr)
+    {
+        if (failed)
+        {
+            return false;
+        }
+        failed = !create(bytes);
+        if (failed)
+        {
+            return false;
+        }
+    }
+    if (bytes > slotBytes)
+    {
+        return false;
+    }
+
+    RingHeader* header = (RingHeader*)mapping;
+    uint64_t number = header->published.load(std::memory_order_relaxed) + 1;
+    SlotHeader* slot = slotAt(mapping, slotBytes, (size_t)((number - 1) % slotCount));
+    uint64_t sequence = slot->sequence.load(std::memory_order_relaxed);
+    slot->sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot->number = number;
+    slot->imageId = imageId;
+    slot->width = width;
+    slot->height = height;
+    memcpy((unsigned char*)slot + sizeof(SlotHeader), rgb, bytes);
+    slot->sequence.store(sequence + 2, std::memory_order_release);
+    header->published.store(number, std::memory_order_release);
+    return true;
+}
+
+uint64_t PreviewRing::getPublishedCount()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return mapping != nullptr ? ((RingHeader*)mapping)->published.load(std::memory_order_relaxed) : 0;
+}
+
+PreviewRing::~PreviewRing()
+{
+    if (mapping == nullptr)
+    {
+        return;
+    }
+#ifdef _WIN32
+    UnmapViewOfFile(mapping);
+    CloseHandle(fileMapping);
+#else
+    munmap(mapping, mappingBytes);
+    shm_unlink(objectName(name).c_str());
+#endif
+}
+
+PreviewRingReader::PreviewRingReader(const std::string& name) : name(name), mapping(nullptr), mappingBytes(0)
+#ifdef _WIN32
+    , fileMapping(nullptr)
+#endif
+{
+}
+
+bool PreviewRingReader::attach()
+{
+    detach();
+    std::string object = objectName(name);
+#ifdef _WIN32
+    fileMapping = OpenFileMappingA(FILE_MAP_READ, FALSE, object.c_str());
+    if (fileMapping == nullptr)
+    {
+        return false;
+    }
+    mapping = MapViewOfFile(fileMapping, FILE_MAP_READ, 0, 0, 0);
+    MEMORY_BASIC_INFORMATION region;
+    if (mapping == nullptr || VirtualQuery(mapping, &region, sizeof(region)) == 0)
+    {
+        detach();
+        return false;
+    }
+    mappingBytes = region.RegionSize;
+#else
+    int descriptor = shm_open(object.c_str(), O_RDONLY, 0);
+    if (descriptor < 0)
+    {
+        return false;
+    }
+    struct stat status;
+    void* mapped = MAP_FAILED;
+    if (fstat(descriptor, &status) == 0 && (size_t)status.st_size >= sizeof(RingHeader))
+    {
+        mapped = mmap(nullptr, (size_t)status.st_size, PROT_READ, MAP_SHARED, descriptor, 0);
+    }
+    close(descriptor);
+    if (mapped == MAP_FAILED)
+    {
+        return false;
+    }
+    mapping = mapped;
+    mappingBytes = (size_t)status.st_size;
+#endif
+
+    const RingHeader* header = (const RingHeader*)mapping;
+    if (header->magic.load(std::memory_order_acquire) != PreviewRing::MAGIC || header->version != PreviewRing::VERSION ||
+        header->slotCount == 0 || ringBytes(header->slotCount, (size_t)header->slotBytes) > mappingBytes)
+    {
+        detach();
+        return false;
+    }
+    return true;
+}
+
+void PreviewRingReader::detach()
+{
+#ifdef _WIN32
+    if (mapping != nullptr)
+    {
+        UnmapViewOfFile(mapping);
+    }
+    if (fileMapping != nullptr)
+    {
+        CloseHandle(fileMapping);
+        fileMapping = nullptr;
+    }
+#else
+    if (mapping != nullptr)
+    {
+        munmap(const_cast<void*>(mapping), mappingBytes);
+    }
+#endif
+    mapping = nullptr;
+    mappingBytes = 0;
+}
+
+/*
+* The scanner may overwrite the slot while it is copied out, that copy is thrown away
+* and the newest preview tried again
+*/
+bool PreviewRingReader::readLatest(Frame& frame, uint64_t afterNumber)
+{
+    if (mapping == nullptr)
+    {
+        return false;
+    }
+    const RingHeader* header = (const RingHeader*)mapping;
+    size_t slotBytes = (size_t)header->slotBytes;
+    for (int attempt = 0; attempt < 100; attempt++)
+    {
+        uint64_t number = header->published.load(std::memory_order_acquire);
+        if (number == 0 || number <= afterNumber)
+        {
+            return false;
+        }
+        const SlotHeader* slot = slotAt(const_cast<void*>(mapping), slotBytes, (size_t)((number - 1) % header->slotCount));
+        uint64_t before = slot->sequence.load(std::memory_order_acquire);
+        if (before & 1)
+        {
+            continue;
+        }
+        frame.number = slot->number;
+        frame.imageId = slot->imageId;
+        frame.width = slot->width;
+        frame.height = slot->height;
+        size_t bytes = (size_t)frame.width * frame.height * 3;
+        bool sane = frame.width > 0 && frame.height > 0 && bytes <= slotBytes;
+        if (sane)
+        {
+            frame.rgb.resize(bytes);
+            memcpy(frame.rgb.data(), (const unsigned char*)slot + sizeof(SlotHeader), bytes);
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot->sequence.load(std::memory_order_relaxed) == before && sane)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+PreviewRingReader::~PreviewRingReader()
+{
+    detach();
+}
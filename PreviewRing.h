@@ -0,0 +1,107 @@
+/*
+*   PreviewRing.h
+*	Film Scanner Master PC Control Software by Kyle Mikolajczyk
+*   kyle@kylem.org
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/*
+* The latest previews in named shared memory, for a viewer running as a process of
+* its own (POSIX shared memory /<name> on Linux and macOS, Local\<name> on Windows).
+* The scanner never waits for the viewer and the viewer never blocks the scanner: a
+* preview goes into the next of slotCount slots, and a viewer that falls behind simply
+* sees a later frame.
+*
+* Layout, little endian, offsets in bytes:
+*
+*   Ring header, 64 bytes
+*     0  uint32  magic "FSPV", written last
+*     4  uint32  version
+*     8  uint32  slot count
+*    12  uint32  reserved
+*    16  uint64  slot bytes, the pixels of one slot without its header
+*    24  uint64  previews published so far
+*   Then slot count slots of 64 + slot bytes each, the slot header
+*     0  uint64  sequence
+*     8  uint64  number, counting previews from 1; the newest is number published
+*                in slot (published - 1) % slot count
+*    16  int32   image ID
+*    20  int32   width
+*    24  int32   height
+*   and from 64 on the preview's packed 8 bit RGB pixels, width * height * 3 bytes.
+*
+* The sequence of a slot is odd while it is being written and even once it is complete,
+* so a reader copies the slot and only keeps the copy if the sequence was even and the
+* same before and after.
+*/
+class PreviewRing
+{
+	public:
+		static const uint32_t MAGIC = 0x56505346; // "FSPV"
+		static const uint32_t VERSION = 1;
+
+		PreviewRing(const std::string& name, size_t slotCount);
+		~PreviewRing();
+
+		// Copy a preview into the next slot. The ring is created by the first call, with
+		// slots the size of that preview; bigger ones later are refused. Safe to call from
+		// several threads.
+		bool publish(int imageId, int width, int height, const uint8_t* rgb);
+		uint64_t getPublishedCount();
+
+	private:
+		std::string name;
+		size_t slotCount;
+		std::mutex mutex;
+		void* mapping;
+		size_t mappingBytes;
+		size_t slotBytes;
+		bool failed; // Could not be created, not tried again
+#ifdef _WIN32
+		void* fileMapping;
+#endif
+
+		bool create(size_t bytesPerSlot);
+};
+
+/*
+* The viewer's side of a PreviewRing
+*/
+class PreviewRingReader
+{
+	public:
+		struct Frame
+		{
+			uint64_t number = 0; // 1 for the first preview the scanner published
+			int imageId = 0;
+			int width = 0;
+			int height = 0;
+			std::vector<uint8_t> rgb;
+		};
+
+		PreviewRingReader(const std::string& name);
+		~PreviewRingReader();
+
+		// False until the scanner has published its first preview. Attach again when
+		// nothing new turns up for a while, a new run of the scanner makes a new ring.
+		bool attach();
+		// The newest preview, false if there is none newer than afterNumber yet
+		bool readLatest(Frame& frame, uint64_t afterNumber);
+
+	private:
+		std::string name;
+		const void* mapping;
+		size_t mappingBytes;
+#ifdef _WIN32
+		void* fileMapping;
+#endif
+
+		void detach();
+};
@@ -0,0 +1,137 @@
+/*
+*   PtyDeviceEmulator.cpp
+*	Film Scanner Master PC Control Software by Kyle Mikolajczyk
+*	kyle@kylem.org
+*/
+
+#include "PtyDeviceEmulator.h"
+#include <chrono>
+#include <iostream>
+
+#ifdef __linux__
+#    include <fcntl.h>
+#    include <poll.h>
+#    include <stdlib.h>
+#    include <termios.h>
+#    include <unistd.h>
+#endif
+
+PtyDeviceEmulator::PtyDeviceEmulator(double baudRate) : baudRate(baudRate), master(-1), slave(-1), running(false)
+{
+}
+
+bool PtyDeviceEmulator::start()
+{
+#ifdef __linux__
+    master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0)
+    {
+        std::cerr << "Error: Could not create a pseudo-terminal." << std::endl;
+        return false;
+    }
+    portName = ptsname(master);
+
+    // Raw mode, so nothing is echoed back or turned into line endings on the way through
+    slave = open(portName.c_str(), O_RDWR | O_NOCTTY);
+    termios settings;
+    if (slave < 0 || tcgetattr(slave, &settings) != 0)
+    {
+        std::cerr << "Error: Could not open " << portName << std::endl;
+        return false;
+    }
+    cfmakeraw(&settings);
+    tcsetattr(slave, TCSANOW, &settings);
+
+    running = true;
+    thread = std::thread(&PtyDeviceEmulator::run, this);
+    return true;
+#else
+    std::cerr << "Device emulation needs a Linux pseudo-terminal." << std::endl;
+    return false;
+#endif
+}
+
+void PtyDeviceEmulator::waitWireTime(size_t bytes)
+{
+    if (baudRate > 0.0)
+    {
+        std::this_thread::sleep_for(std::chrono::duration<double>(bytes * 10.0 / baudRate));
+    }
+}
+
+void PtyDeviceEmulator::run()
+{
+#ifdef __linux__
+    char buffer[256];
+    while (running)
+    {
+        pollfd pending = { master, POLLIN, 0 };
+        if (poll(&pending, 1, 50) <= 0 || (pending.revents & POLLIN) == 0)
+        {
+            continue;
+        }
+        ssize_t bytesRead = read(master, buffer, sizeof(buffer));
+        if (bytesRead > 0)
+        {
+            waitWireTime(bytesRead);
+            handleBytes(buffer, bytesRead);
+        }
+    }
+#endif
+}
+
+void PtyDeviceEmulator::send(const std::string& data)
+{
+    std::lock_guard<std::mutex> lock(sendMutex);
+    waitWireTime(data.size());
+    writeToHost(data);
+}
+
+void PtyDeviceEmulator::echo(const std::string& data)
+{
+    std::lock_guard<std::mutex> lock(sendMutex);
+    writeToHost(data);
+}
+
+void PtyDeviceEmulator::writeToHost(const std::string& data)
+{
+#ifdef __linux__
+    size_t written = 0;
+    while (written < data.size())
+    {
+        ssize_t result = write(master, data.data() + written, data.size() - written);
+        if (result <= 0)
+        {
+            std::cerr << "Error: Emulated device could not write to the pseudo-terminal." << std::endl;
+            return;
+        }
+        written += result;
+    }
+#endif
+}
+
+void PtyDeviceEmulator::stop()
+{
+    running = false;
+    if (thread.joinable())
+    {
+        thread.join();
+    }
+#ifdef __linux__
+    if (slave >= 0)
+    {
+        close(slave);
+        slave = -1;
+    }
+    if (master >= 0)
+    {
+        close(master);
+        master = -1;
+    }
+#endif
+}
+
+PtyDeviceEmulator::~PtyDeviceEmulator()
+{
+    stop();
+}
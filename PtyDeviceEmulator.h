@@ -0,0 +1,53 @@
+/*
+*   PtyDeviceEmulator.h
+*	Film Scanner Master PC Control Software by Kyle Mikolajczyk
+*   kyle@kylem.org
+*/
+
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+
+/*
+* Base for a serial device emulated behind a Linux pseudo-terminal. The scanner code
+* opens getPortName() like a real COM port, and whatever it writes ends up in
+* handleBytes() on the emulator's own thread. With a baud rate set, reads and writes
+* are delayed by the time the bytes would take on the wire (10 bits per byte).
+*
+* Only used by the benchmark. On other platforms start() fails.
+*/
+class PtyDeviceEmulator
+{
+	public:
+		PtyDeviceEmulator(double baudRate = 0.0); // 0 means no wire time
+		virtual ~PtyDeviceEmulator();
+
+		bool start();
+		void stop();
+		std::string getPortName() { return portName; }
+
+		// Write raw bytes to the host, e.g. messages the device sends on its own
+		void send(const std::string& data);
+		// The same without wire time, for an echo that went out while the bytes it echoes
+		// were still coming in
+		void echo(const std::string& data);
+
+	protected:
+		virtual void handleBytes(const char* data, size_t length) = 0;
+
+	private:
+		double baudRate;
+		int master;
+		int slave; // Kept open so the terminal does not hang up between client opens
+		std::string portName;
+		std::atomic<bool> running;
+		std::thread thread;
+		std::mutex sendMutex;
+
+		void run();
+		void waitWireTime(size_t bytes);
+		void writeToHost(const std::string& data);
+};
@@ -0,0 +1,283 @@
+/*
+*   PylonFrameSource.cpp
+*	Film Scanner Master PC Control Software by Kyle Mikolajczyk
+*	kyle@kylem.org
+*/
+
+#include "PylonFrameSource.h"
+#include <algorithm>
+
+// Initialize the static member variable
+bool PylonFrameSource::pylonInitialized = false;
+
+/*
+* Pylon has to be initialized once per process before any camera is created
+*/
+void PylonFrameSource::initializePylon()
+{
+    if (!pylonInitialized)
+    {
+        PylonInitialize();
+        pylonInitialized = true;
+    }
+}
+
+PylonFrameSource::PylonFrameSource(bool usePackedPixels) : framesGrabbed(0), usePackedPixels(usePackedPixels)
+{
+}
+
+/*
+* Attach to the first camera Pylon can find and put it into the mode we scan with
+*/
+bool PylonFrameSource::open()
+{
+    try {
+        camera.Attach(CTlFactory::GetInstance().CreateFirstDevice());
+
+        // Print the model name of the camera.
+        cout << "Using device " << camera.GetDeviceInfo().GetModelName() << endl;
+
+        // The parameter MaxNumBuffer can be used to control the count of buffers
+        // allocated for grabbing. The default value of this parameter is 10.
+        camera.MaxNumBuffer = 5;
+
+        return initializeCamera();
+    }
+    catch (const GenericException& e)
+    {
+        cerr << "Pylon Camera was not found, please check the connection." << endl
+            << e.GetDescription() << endl;
+        return false;
+    }
+}
+
+/*
+* Setup the camera and various parameters to configure
+* that is different from the default values (such as set it to 12bit mode.
+* Mono12p is preferred: Mono12 pads every pixel to 16 bits on the wire, which is
+* what limits the frame rate on USB3 at full resolution.
+*/
+bool PylonFrameSource::initializeCamera()
+{
+    try
+    {
+        // Ensure the camera is open
+        if (!camera.IsOpen())
+        {
+            cout << "Opening camera..." << endl;
+            camera.Open();
+        }
+
+        // Set the pixel format to Mono12p, or Mono12
+        GenApi::INodeMap& nodemap = camera.GetNodeMap();
+        GenApi::CEnumerationPtr pixelFormat(nodemap.GetNode("PixelFormat"));
+        if (usePackedPixels && IsAvailable(pixelFormat->GetEntryByName("Mono12p")))
+        {
+            pixelFormat->FromString("Mono12p");
+            cout << "Pixel format set to Mono12p" << endl;
+        }
+        else if (IsAvailable(pixelFormat->GetEntryByName("Mono12")))
+        {
+            pixelFormat->FromString("Mono12");
+            cout << "Pixel format set to Mono12" << endl;
+        }
+        else
+        {
+            cout << "Mono12 pixel format not available. Cannot proceed." << endl;
+            return false;
+        }
+    }
+    catch (const GenericException& e)
+    {
+        cerr << "An exception occurred while initializing the camera." << endl
+            << e.GetDescription() << endl;
+    }
+
+#ifdef PYLON_WIN_BUILD
+    // Create a window and set its size
+    window.Create(1);
+#endif
+    return true;
+}
+
+void PylonFrameSource::startGrabbing()
+{
+    // Pre-allocate buffers and start grabbing
+    camera.StartGrabbing(GrabStrategy_OneByOne, GrabLoop_ProvidedByUser);
+}
+
+void PylonFrameSource::stopGrabbing()
+{
+    if (camera.IsGrabbing())
+    {
+        camera.StopGrabbing();
+    }
+}
+
+bool PylonFrameSource::isGrabbing()
+{
+    return camera.IsGrabbing();
+}
+
+/*
+* Wait for the next image from the camera. The returned frame points straight into
+* the Pylon grab buffer, which we hold on to until the next grab.
+*/
+bool PylonFrameSource::grabFrame(RawFrame& frame, unsigned int timeoutMs)
+{
+    try
+    {
+        camera.RetrieveResult(timeoutMs, ptrGrabResult, TimeoutHandling_ThrowException);
+
+        // Image grabbed successfully?
+        if (!ptrGrabResult->GrabSucceeded())
+        {
+            cout << "Error: " << std::hex << ptrGrabResult->GetErrorCode() << std::dec << " " << ptrGrabResult->GetErrorDescription() << endl;
+            return false;
+        }
+
+        frame.data = ptrGrabResult->GetBuffer();
+        frame.bufferSize = ptrGrabResult->GetBufferSize();
+        frame.width = ptrGrabResult->GetWidth();
+        frame.height = ptrGrabResult->GetHeight();
+        frame.format = ptrGrabResult->GetPixelType() == PixelType_Mono12p ? RawFrame::MONO12P : RawFrame::MONO12;
+        frame.frameNumber = framesGrabbed++;
+        frame.timestamp = std::chrono::steady_clock::now();
+        return true;
+    }
+    catch (const GenericException& e)
+    {
+        // Error handling.
+        cerr << "An exception occurred." << endl
+            << e.GetDescription() << endl;
+        return false;
+    }
+}
+
+/*
+* Switch from free-running to one exposure per ExecuteSoftwareTrigger(), so the
+* capture sequencer decides when each colour is exposed
+*/
+bool PylonFrameSource::enableSoftwareTrigger()
+{
+    try
+    {
+        GenApi::INodeMap& nodemap = camera.GetNodeMap();
+        GenApi::CEnumerationPtr triggerSelector(nodemap.GetNode("TriggerSelector"));
+        GenApi::CEnumerationPtr triggerMode(nodemap.GetNode("TriggerMode"));
+        GenApi::CEnumerationPtr triggerSource(nodemap.GetNode("TriggerSource"));
+        if (!IsAvailable(triggerSelector) || !IsAvailable(triggerSelector->GetEntryByName("FrameStart")))
+        {
+            cout << "Camera has no frame start trigger, it will free-run." << endl;
+            return false;
+        }
+        triggerSelector->FromString("FrameStart");
+        triggerMode->FromString("On");
+        triggerSource->FromString("Software");
+        cout << "Camera set to software trigger" << endl;
+        return true;
+    }
+    catch (const GenericException& e)
+    {
+        cerr << "Could not enable the software trigger." << endl
+            << e.GetDescription() << endl;
+        return false;
+    }
+}
+
+bool PylonFrameSource::triggerExposure()
+{
+    try
+    {
+        // Only fails if the previous exposure has not finished yet
+        if (camera.WaitForFrameTriggerReady(1000, TimeoutHandling_ThrowException))
+        {
+            camera.ExecuteSoftwareTrigger();
+            return true;
+        }
+    }
+    catch (const GenericException& e)
+    {
+        cerr << "Software trigger failed." << endl
+            << e.GetDescription() << endl;
+    }
+    return false;
+}
+
+/*
+* Exposure time in ms. Newer cameras call the node ExposureTime, older ones ExposureTimeAbs (both in us).
+*/
+double PylonFrameSource::getExposureTimeMs()
+{
+    try
+    {
+        GenApi::INodeMap& nodemap = camera.GetNodeMap();
+        GenApi::CFloatPtr exposureTime(nodemap.GetNode("ExposureTime"));
+        if (!IsReadable(exposureTime))
+        {
+            exposureTime = nodemap.GetNode("ExposureTimeAbs");
+        }
+        if (IsReadable(exposureTime))
+        {
+            return exposureTime->GetValue() / 1000.0;
+        }
+    }
+    catch (const GenericException& e)
+    {
+        cerr << "Could not read the exposure time." << endl
+            << e.GetDescription() << endl;
+    }
+    return 0.0;
+}
+
+/*
+* Same nodes as getExposureTimeMs(). Cameras only take exposure changes between frames,
+* so this is called before the trigger of the exposure it is for.
+*/
+bool PylonFrameSource::setExposureTimeMs(double exposureMs)
+{
+    try
+    {
+        GenApi::INodeMap& nodemap = camera.GetNodeMap();
+        GenApi::CFloatPtr exposureTime(nodemap.GetNode("ExposureTime"));
+        if (!IsWritable(exposureTime))
+        {
+            exposureTime = nodemap.GetNode("ExposureTimeAbs");
+        }
+        if (IsWritable(exposureTime))
+        {
+            double microseconds = std::min(exposureTime->GetMax(), std::max(exposureTime->GetMin(), exposureMs * 1000.0));
+            exposureTime->SetValue(microseconds);
+            return true;
+        }
+        cerr << "Camera exposure time cannot be changed." << endl;
+    }
+    catch (const GenericException& e)
+    {
+        cerr << "Could not set the exposure time." << endl
+            << e.GetDescription() << endl;
+    }
+    return false;
+}
+
+/*
+* If this is a windows computer we can view the image through the Basler window
+*/
+void PylonFrameSource::displayLastFrame()
+{
+#ifdef PYLON_WIN_BUILD
+    window.SetImage(ptrGrabResult);
+    window.Show();
+#endif
+}
+
+std::string PylonFrameSource::getName()
+{
+    return "Basler (Pylon)";
+}
+
+PylonFrameSource::~PylonFrameSource()
+{
+    stopGrabbing();
+    //PylonTerminate();
+}
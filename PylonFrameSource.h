@@ -0,0 +1,58 @@
+/*
+*   PylonFrameSource.h
+*	Film Scanner Master PC Control Software by Kyle Mikolajczyk
+*   kyle@kylem.org
+*/
+
+#pragma once
+
+// Include files to use the pylon API.
+#include <pylon/PylonIncludes.h>
+#ifdef PYLON_WIN_BUILD
+#    include <pylon/PylonGUI.h>
+#endif
+#include <pylon/BaslerUniversalInstantCamera.h>
+#include <iostream>
+#include "FrameSource.h"
+
+using namespace std;
+using namespace Pylon;
+
+/*
+* FrameSource backed by the first Basler camera found through Pylon
+*/
+class PylonFrameSource : public FrameSource
+{
+	public:
+		static void initializePylon(); // Static method to initialize Pylon
+
+		PylonFrameSource(bool usePackedPixels = true); // Packed Mono12p if the camera has it, otherwise Mono12
+		~PylonFrameSource();
+
+		bool open() override;
+		void startGrabbing() override;
+		void stopGrabbing() override;
+		bool isGrabbing() override;
+		bool grabFrame(RawFrame& frame, unsigned int timeoutMs) override;
+		bool enableSoftwareTrigger() override;
+		bool triggerExposure() override;
+		double getExposureTimeMs() override;
+		bool setExposureTimeMs(double exposureMs) override;
+		void displayLastFrame() override;
+		std::string getName() override;
+
+	private:
+		static bool pylonInitialized; // Static flag to check if Pylon is initialized
+
+		// This smart pointer will receive the grab result data.
+		CGrabResultPtr ptrGrabResult;
+		CInstantCamera camera;
+		uint64_t framesGrabbed;
+		bool usePackedPixels;
+
+		bool initializeCamera();
+
+#ifdef PYLON_WIN_BUILD
+		Pylon::CPylonImageWindow window;
+#endif
+};
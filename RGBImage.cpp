@@ -5,7 +5,7 @@
 * Once the 3 images are ready, the getMergedImage() method will combine them into a single image
 * and return a pointer to it. The caller is responsible for freeing the memory.
 */
-RGBImage::RGBImage()
+RGBImage::RGBImage(FrameBufferPool* pool) : pool(pool)
 {
 	redImage = nullptr;
 	greenImage = nullptr;
@@ -48,15 +48,31 @@ bool RGBImage::isReadyToMerge()
 	return redImage != nullptr && greenImage != nullptr && blueImage != nullptr;
 }
 
-RGBImage::~RGBImage()
+/*
+* Hand the channel buffers back to the pool they were borrowed from (or free them)
+*/
+void RGBImage::releaseChannels()
+{
+	releaseChannel(redImage);
+	releaseChannel(greenImage);
+	releaseChannel(blueImage);
+}
+
+void RGBImage::releaseChannel(OIIO::ImageBuf*& channel)
 {
-	if (redImage != nullptr) {
-		delete redImage;
+	if (channel == nullptr) {
+		return;
 	}
-	if (greenImage != nullptr) {
-		delete greenImage;
+	if (pool != nullptr) {
+		pool->release(channel);
 	}
-	if (blueImage != nullptr) {
-		delete blueImage;
+	else {
+		delete channel;
 	}
+	channel = nullptr;
+}
+
+RGBImage::~RGBImage()
+{
+	releaseChannels();
 }
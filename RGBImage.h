@@ -1,13 +1,17 @@
 #pragma once
 
 #include <OpenImageIO/imagebuf.h>
+#include <chrono>
 #include <iostream>
+#include "ChannelRegistration.h"
+#include "FrameBufferPool.h"
+#include "FrameStabilizer.h"
 #include "ImagesProcessor.h"
 
 class RGBImage
 {
 	public:
-		RGBImage();
+		RGBImage(FrameBufferPool* pool = nullptr); // Channels are returned to pool instead of deleted
 		~RGBImage();
 		void setRedImage(OIIO::ImageBuf* redImage);
 		void setGreenImage(OIIO::ImageBuf* greenImage);
@@ -21,16 +25,29 @@ class RGBImage
 		void setCaptureId(std::string id) { captureId = id; }
 		int getImageId() { return imageId; }
 		std::string getCaptureId() { return captureId; }
+		void setCaptureStartTime(std::chrono::steady_clock::time_point time) { captureStartTime = time; }
+		std::chrono::steady_clock::time_point getCaptureStartTime() { return captureStartTime; }
+		void setChannelOffsets(const ChannelOffsets& offsets) { channelOffsets = offsets; }
+		const ChannelOffsets& getChannelOffsets() { return channelOffsets; }
+		void setStabilization(const FrameStabilizer::Result& result) { stabilization = result; }
+		const FrameStabilizer::Result& getStabilization() { return stabilization; }
 
 		bool isReadyToMerge();
+		void releaseChannels(); // Give the 3 channel buffers back as soon as they have been merged
 
 		void fillWithSampleImages();
 	private:
 		int imageId;
 		std::string captureId;
+		std::chrono::steady_clock::time_point captureStartTime; // When the first colour started capturing
+		ChannelOffsets channelOffsets; // Red and blue against green, when registration is on
+		FrameStabilizer::Result stabilization; // Sprocket hole and offset to the first frame, when stabilizing
 		// These will contain the 3 images needed to make the master color image
 		OIIO::ImageBuf* redImage;
 		OIIO::ImageBuf* greenImage;
 		OIIO::ImageBuf* blueImage;
+		FrameBufferPool* pool;
+
+		void releaseChannel(OIIO::ImageBuf*& channel);
 };
 
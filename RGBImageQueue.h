@@ -1,37 +1,133 @@
 #pragma once
+#include <cstddef>
+#include <cstdint>
 #include <queue>
 #include <mutex>
 #include <condition_variable>
 #include "RGBImage.h"
 
+// What push() does when a bounded queue is full
+enum QueueFullPolicy
+{
+    QUEUE_BLOCK_WHEN_FULL, // Wait for a consumer to make room (backpressure on the producer)
+    QUEUE_DROP_WHEN_FULL // Reject the item straight away and count it as dropped
+};
+
+/*
+* Common interface for the queues between pipeline stages. Shutdown is a single
+* close(): after it push() refuses new items, and pop() keeps handing out what is
+* left and returns false once the queue is empty, which is the consumer's cue to exit.
+*/
+template <typename T>
+class FrameQueue
+{
+    public:
+        virtual ~FrameQueue() {}
+
+        // False if the item was not queued (queue closed, or full with the drop policy).
+        // The caller keeps ownership of a rejected item.
+        virtual bool push(T* value) = 0;
+        // Blocks until an item is available, false once closed and drained
+        virtual bool pop(T*& value) = 0;
+        // Never blocks, false if nothing is queued right now
+        virtual bool tryPop(T*& value) = 0;
+        virtual void close() = 0;
+
+        virtual size_t size() = 0;
+        virtual size_t capacity() = 0; // 0 for unbounded
+        virtual uint64_t droppedCount() = 0;
+
+        bool empty() { return size() == 0; }
+};
+
+/*
+* Mutex and condition variable queue. Any number of producers and consumers.
+* A capacity of 0 means unbounded.
+*/
 template <typename T>
-class RGBImageQueue
+class RGBImageQueue : public FrameQueue<T>
 {
     public:
-        void push(T* value)
+        RGBImageQueue(size_t capacity = 0, QueueFullPolicy policy = QUEUE_BLOCK_WHEN_FULL)
+            : capacity_(capacity), policy_(policy), closed_(false), dropped_(0) {}
+
+        bool push(T* value) override
         {
-            std::lock_guard<std::mutex> lock(mutex_);
+            std::unique_lock<std::mutex> lock(mutex_);
+            if (capacity_ > 0 && queue_.size() >= capacity_ && !closed_)
+            {
+                if (policy_ == QUEUE_DROP_WHEN_FULL)
+                {
+                    dropped_++;
+                    return false;
+                }
+                not_full_.wait(lock, [this] { return queue_.size() < capacity_ || closed_; });
+            }
+            if (closed_)
+            {
+                return false;
+            }
             queue_.push(value);
             cond_var_.notify_one();
+            return true;
         }
 
-        bool pop(T*& value)
+        bool pop(T*& value) override
         {
             std::unique_lock<std::mutex> lock(mutex_);
-            cond_var_.wait(lock, [this] { return !queue_.empty(); });
+            cond_var_.wait(lock, [this] { return !queue_.empty() || closed_; });
+            if (queue_.empty())
+            {
+                return false; // Closed and drained
+            }
             value = queue_.front();
             queue_.pop();
+            not_full_.notify_one();
             return true;
         }
 
-        bool empty()
+        bool tryPop(T*& value) override
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (queue_.empty())
+            {
+                return false;
+            }
+            value = queue_.front();
+            queue_.pop();
+            not_full_.notify_one();
+            return true;
+        }
+
+        void close() override
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            closed_ = true;
+            cond_var_.notify_all();
+            not_full_.notify_all();
+        }
+
+        size_t size() override
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return queue_.size();
+        }
+
+        size_t capacity() override { return capacity_; }
+
+        uint64_t droppedCount() override
         {
             std::lock_guard<std::mutex> lock(mutex_);
-            return queue_.empty();
+            return dropped_;
         }
 
     private:
         std::queue<T*> queue_;
         std::mutex mutex_;
         std::condition_variable cond_var_;
+        std::condition_variable not_full_;
+        size_t capacity_;
+        QueueFullPolicy policy_;
+        bool closed_;
+        uint64_t dropped_;
 };
@@ -0,0 +1,101 @@
+/*
+*   ReorderBuffer.h
+*	Film Scanner Master PC Control Software by Kyle Mikolajczyk
+*   kyle@kylem.org
+*/
+
+#pragma once
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <set>
+
+/*
+* Collects items that finish out of order and hands them back strictly in sequence.
+* Every sequence number has to be pushed or skipped exactly once (push a failed item
+* too), or everything after the gap will wait forever.
+*/
+template <typename T>
+class ReorderBuffer
+{
+    public:
+        ReorderBuffer(int firstSequence = 0) : nextSequence_(firstSequence) {}
+
+        void push(int sequence, const T& item)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            pending_[sequence] = item;
+        }
+
+        // Sequence numbers from first up to end that will never be pushed
+        void skip(int first, int end)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (first <= nextSequence_)
+            {
+                nextSequence_ = std::max(nextSequence_, end);
+            }
+            else
+            {
+                for (int sequence = first; sequence < end; sequence++)
+                {
+                    skipped_.insert(sequence);
+                }
+            }
+            stepOverSkipped();
+        }
+
+        // Take the next item in sequence, false if it has not arrived yet
+        bool popReady(T& item)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto it = pending_.find(nextSequence_);
+            if (it == pending_.end())
+            {
+                return false;
+            }
+            item = it->second;
+            pending_.erase(it);
+            nextSequence_++;
+            stepOverSkipped();
+            return true;
+        }
+
+        // Take the lowest item waiting, whether the ones before it arrived or not. For
+        // emptying the buffer at the end.
+        bool popAny(T& item)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (pending_.empty())
+            {
+                return false;
+            }
+            item = pending_.begin()->second;
+            nextSequence_ = pending_.begin()->first + 1;
+            pending_.erase(pending_.begin());
+            stepOverSkipped();
+            return true;
+        }
+
+        size_t waiting()
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return pending_.size();
+        }
+
+    private:
+        std::map<int, T> pending_;
+        std::set<int> skipped_; // Past nextSequence_
+        int nextSequence_;
+        std::mutex mutex_;
+
+        void stepOverSkipped()
+        {
+            skipped_.erase(skipped_.begin(), skipped_.lower_bound(nextSequence_));
+            while (!skipped_.empty() && *skipped_.begin() == nextSequence_)
+            {
+                skipped_.erase(skipped_.begin());
+                nextSequence_++;
+            }
+        }
+};
@@ -0,0 +1,187 @@
+/*
+*   Reprocessor.cpp
+*	Film Scanner Master PC Control Software by Kyle Mikolajczyk
+*	kyle@kylem.org
+*/
+
+#include "Reprocessor.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include "ImageCaptureController.h"
+#include "JournalFrameSource.h"
+
+static std::string directoryPath(std::string directory)
+{
+    if (!directory.empty() && directory.back() != '/' && directory.back() != '\\')
+    {
+        directory += "/";
+    }
+    return directory;
+}
+
+/*
+* Frames of the range in the journal, from the headers alone, so progress can be shown
+* against a total
+*/
+static uint64_t countFrames(const std::string& journalDirectory, const ReprocessOptions& options)
+{
+    JournalReader reader(journalDirectory, options.captureId);
+    JournalRecordHeader header;
+    uint64_t frames = 0;
+    int lastCounted = -1;
+    while (reader.skip(header))
+    {
+        if (header.imageId < options.firstImageId || header.imageId == lastCounted)
+        {
+            continue;
+        }
+        if (options.lastImageId >= 0 && header.imageId > options.lastImageId)
+        {
+            break;
+        }
+        lastCounted = header.imageId;
+        frames++;
+    }
+    return frames;
+}
+
+static void printProgress(uint64_t written, uint64_t total, uint64_t bytesRead, double seconds)
+{
+    double framesPerSecond = written / std::max(seconds, 1e-9);
+    std::cout << std::fixed << std::setprecision(1) << "Reprocessed " << written << " / " << total << " frames ("
+        << 100.0 * written / std::max<uint64_t>(total, 1) << "%), " << framesPerSecond << " frames/s, "
+        << bytesRead / (1024.0 * 1024.0) / std::max(seconds, 1e-9) << " MB/s read";
+    if (written > 0 && total > written)
+    {
+        std::cout << ", " << (total - written) / framesPerSecond << " s left";
+    }
+    std::cout << std::defaultfloat << std::endl;
+}
+
+bool Reprocessor::run(const ReprocessOptions& options, Result* result)
+{
+    auto start = std::chrono::steady_clock::now();
+    std::string journalDirectory = directoryPath(options.journalDirectory);
+    std::string outputDirectory = directoryPath(options.outputDirectory);
+    uint64_t total = countFrames(journalDirectory, options);
+
+    // Opened first, the settings depend on what was captured
+    JournalFrameSource* source = new JournalFrameSource(journalDirectory, options.captureId, options.firstImageId, options.lastImageId);
+    if (!source->open())
+    {
+        delete source;
+        return false;
+    }
+    if (source->getExposureCount() > 1 && source->getExposureTimeMs() <= 0.0)
+    {
+        std::cerr << "Error: Journal has HDR brackets without exposure times, they cannot be fused." << std::endl;
+        delete source;
+        return false;
+    }
+
+    CaptureSettings settings = options.settings;
+    settings.journalMode = JOURNAL_OFF;
+    settings.hdrExposures = source->getExposureCount();
+    if (settings.workerCount <= 0)
+    {
+        settings.workerCount = std::max(1, (int)std::thread::hardware_concurrency());
+    }
+    // The journal reads faster than frames can be merged, so the capture side has to wait
+    // for the workers rather than queue the whole reel
+    if (settings.queueCapacity == 0)
+    {
+        settings.queueCapacity = 2 * settings.workerCount;
+    }
+    settings.queueFullPolicy = QUEUE_BLOCK_WHEN_FULL;
+
+    std::shared_ptr<FlatFieldCalibration> calibration;
+    if (!options.calibrationPath.empty())
+    {
+        calibration = std::make_shared<FlatFieldCalibration>();
+        if (!calibration->load(options.calibrationPath))
+        {
+            std::cerr << "Error: Calibration " << options.calibrationPath << " could not be loaded." << std::endl;
+            delete source;
+            return false;
+        }
+    }
+
+    std::error_code error;
+    std::filesystem::create_directories(outputDirectory, error);
+
+    std::cout << "Reprocessing " << total << " frame(s) of capture " << options.captureId << " from " << journalDirectory << " into "
+        << outputDirectory << ", " << settings.hdrExposures << " exposure(s) per colour" << std::endl;
+
+    std::atomic<uint64_t> written(0);
+    std::atomic<uint64_t> failed(0);
+    uint64_t skipped = 0;
+    uint64_t bytesRead = 0;
+    {
+        ImageCaptureController controller(options.captureId, source, settings);
+        controller.setOutputDirectory(outputDirectory);
+        if (calibration)
+        {
+            controller.setCalibration(calibration);
+        }
+        controller.setFrameFinishedCallback([&written, &failed](RGBImage*, bool saved) {
+            if (saved)
+            {
+                written++;
+            }
+            else
+            {
+                failed++;
+            }
+        });
+
+        auto lastReport = start;
+        int imageId;
+        while ((imageId = source->peekImageId()) >= 0)
+        {
+            controller.setNextImageId(imageId);
+            if (controller.captureFrame() == ImageCaptureController::FRAME_DROPPED)
+            {
+                failed++;
+            }
+            auto now = std::chrono::steady_clock::now();
+            if (options.progressSeconds > 0.0 && std::chrono::duration<double>(now - lastReport).count() >= options.progressSeconds)
+            {
+                printProgress(written, total, source->getBytesRead(), std::chrono::duration<double>(now - start).count());
+                lastReport = now;
+            }
+        }
+        skipped = source->getSkippedFrames();
+        bytesRead = source->getBytesRead();
+        // Leaving this scope waits for every frame to be written
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printProgress(written, total, bytesRead, seconds);
+    std::cout << "Reprocessing took " << seconds << " s";
+    if (skipped > 0)
+    {
+        std::cout << ", " << skipped << " incomplete frame(s) skipped";
+    }
+    if (failed > 0)
+    {
+        std::cout << ", " << failed << " frame(s) failed";
+    }
+    std::cout << std::endl;
+
+    if (result != nullptr)
+    {
+        result->framesInRange = total;
+        result->framesWritten = written;
+        result->framesSkipped = skipped;
+        result->framesFailed = failed;
+        result->bytesRead = bytesRead;
+        result->seconds = seconds;
+    }
+    return true;
+}
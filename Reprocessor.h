@@ -0,0 +1,50 @@
+/*
+*   Reprocessor.h
+*	Film Scanner Master PC Control Software by Kyle Mikolajczyk
+*   kyle@kylem.org
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include "CaptureSettings.h"
+
+struct ReprocessOptions
+{
+	std::string journalDirectory;
+	std::string captureId;
+	std::string outputDirectory;
+	int firstImageId = 0;
+	int lastImageId = -1; // -1 for the end of the journal
+	std::string calibrationPath; // Flat field calibration saved by FlatFieldCalibration::save(), empty for none
+	double progressSeconds = 1.0; // How often to report progress, 0 for never
+
+	// Workers, strip threads, writers, registration, stabilization and the like. A
+	// workerCount of 0 uses every core. The journal and HDR settings are taken from the
+	// journal itself.
+	CaptureSettings settings;
+};
+
+/*
+* Runs frames captured into a CaptureJournal through the merge, correction and writing
+* again, without the scanner. The journal is played back through an
+* ImageCaptureController as its frame source, so the frames come out exactly as they
+* would have during the scan, under the same capture ID and image IDs.
+*/
+class Reprocessor
+{
+	public:
+		struct Result
+		{
+			uint64_t framesInRange = 0; // In the journal between the first and last image ID
+			uint64_t framesWritten = 0;
+			uint64_t framesSkipped = 0; // Not complete in the journal
+			uint64_t framesFailed = 0; // The merge or the write failed
+			uint64_t bytesRead = 0;
+			double seconds = 0.0;
+		};
+
+		// False if the journal has nothing to process or the calibration cannot be loaded
+		static bool run(const ReprocessOptions& options, Result* result = nullptr);
+};
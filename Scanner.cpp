@@ -20,22 +20,39 @@
 #endif
 
 #include "SerialConn.h"
+#include "SerialLedController.h"
 #include "ImageCaptureController.h"
+#include "PylonFrameSource.h"
 #include "MDriveConn.h"
+#include "ContinuousTransport.h"
+#include "PreviewRing.h"
+#include "Reprocessor.h"
 
 #include <OpenImageIO/imagebuf.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <thread>
 
 bool useCamera = false;
 bool enableSerialComms = false;
+// Keep the film moving and capture each frame as it passes instead of stopping for it
+bool continuousMotion = false;
+// Frames in the scan, counted from image ID 0 so a resumed scan ends at the same frame
+int scanFrameCount = 9;
 
 /*
 * Create the main Image Controller to handle the scans for this ID. 
-* (ID will we configurable later)
+* (ID will we configurable later). With an LED controller each colour is
+* exposed under its own light.
 */
-ImageCaptureController* initializeImageController() {
+ImageCaptureController* initializeImageController(LedController* led = nullptr) {
     ImageCaptureController* imageCaptureController = nullptr;
     ImageCaptureController::initializePylon();
-    imageCaptureController = new ImageCaptureController("EK00001");
+    imageCaptureController = new ImageCaptureController("EK00001", new PylonFrameSource(), led);
     
     return imageCaptureController;
 }
@@ -60,10 +77,229 @@ SerialConn* getArudinoConnection() {
 }
 #endif
 
+/*
+* Scanner reprocess --journal DIR --capture ID --output DIR [--first N] [--last N]
+*                   [--calibration FILE] [--workers N] [--strip-threads N] [--writers N]
+*                   [--register 0|1] [--stabilize 0|1|2] [--half 0|1] [--preview SCALE]
+*                   [--metrics PATH] [--invert 0|1] [--film-base R,G,B|auto] [--density D]
+*                   [--gamma G] [--lut FILE] [--base-region LEFT,TOP,RIGHT,BOTTOM]
+*                   [--format tiff|dpx|exr] [--compress none|lzw|deflate|zstd] [--compress-level N]
+*                   [--compress-threads N] [--predictor 0|1]
+*
+* Merges and writes the frames of a capture journal again, without the scanner attached.
+* --workers 0 (the default) uses every core. --film-base auto estimates the film base
+* from --base-region of the frames (fractions of the frame, the left 4% by default).
+* Exits with a failure unless every frame in the range was written.
+*/
+int reprocess(int argc, char* argv[]) {
+    ReprocessOptions options;
+    options.captureId = "EK00001";
+    options.outputDirectory = "img/";
+    options.settings.workerCount = 0;
+    for (int i = 0; i + 1 < argc; i += 2) {
+        std::string name = argv[i];
+        const char* value = argv[i + 1];
+        if (name == "--journal") {
+            options.journalDirectory = value;
+        }
+        else if (name == "--capture") {
+            options.captureId = value;
+        }
+        else if (name == "--output") {
+            options.outputDirectory = value;
+        }
+        else if (name == "--first") {
+            options.firstImageId = atoi(value);
+        }
+        else if (name == "--last") {
+            options.lastImageId = atoi(value);
+        }
+        else if (name == "--calibration") {
+            options.calibrationPath = value;
+        }
+        else if (name == "--workers") {
+            options.settings.workerCount = atoi(value);
+        }
+        else if (name == "--strip-threads") {
+            options.settings.processingThreads = atoi(value);
+        }
+        else if (name == "--writers") {
+            options.settings.writerThreads = atoi(value);
+        }
+        else if (name == "--register") {
+            options.settings.registerChannels = atoi(value) != 0;
+        }
+        else if (name == "--stabilize") {
+            options.settings.stabilization = (StabilizationMode)std::clamp(atoi(value), (int)STABILIZE_OFF, (int)STABILIZE_TRANSLATE);
+        }
+        else if (name == "--half") {
+            options.settings.hdrHalfFloat = atoi(value) != 0;
+        }
+        else if (name == "--preview") {
+            options.settings.previewScale = atoi(value);
+        }
+        else if (name == "--metrics") {
+            options.settings.metricsPath = value;
+        }
+        else if (name == "--invert") {
+            options.settings.color.invert = atoi(value) != 0;
+        }
+        else if (name == "--film-base") {
+            double* base = options.settings.color.filmBase;
+            options.settings.filmBaseEstimation.estimate = std::string(value) == "auto";
+            if (!options.settings.filmBaseEstimation.estimate && sscanf(value, "%lf,%lf,%lf", &base[0], &base[1], &base[2]) != 3) {
+                std::cerr << "--film-base takes the red, green and blue levels, e.g. 52000,31000,18000, or auto" << std::endl;
+                return EXIT_FAILURE;
+            }
+        }
+        else if (name == "--base-region") {
+            FilmBaseSettings& region = options.settings.filmBaseEstimation;
+            if (sscanf(value, "%f,%f,%f,%f", &region.left, &region.top, &region.right, &region.bottom) != 4) {
+                std::cerr << "--base-region takes the left, top, right and bottom as fractions of the frame, e.g. 0,0,0.04,1" << std::endl;
+                return EXIT_FAILURE;
+            }
+        }
+        else if (name == "--density") {
+            options.settings.color.densityRange = atof(value);
+        }
+        else if (name == "--gamma") {
+            options.settings.color.gamma = atof(value);
+        }
+        else if (name == "--lut") {
+            options.settings.color.lutPath = value;
+        }
+        else if (name == "--compress") {
+            if (!CompressedTiffWriter::parseCompression(value, options.settings.outputCompression)) {
+                std::cerr << "--compress takes none, lzw, deflate or zstd" << std::endl;
+                return EXIT_FAILURE;
+            }
+        }
+        else if (name == "--compress-level") {
+            options.settings.compressionLevel = atoi(value);
+        }
+        else if (name == "--compress-threads") {
+            options.settings.compressionThreads = atoi(value);
+        }
+        else if (name == "--predictor") {
+            options.settings.compressionPredictor = atoi(value) != 0;
+        }
+        else if (name == "--format") {
+            if (!SequenceWriter::parseFormat(value, options.settings.outputFormat)) {
+                std::cerr << "--format takes tiff, dpx or exr" << std::endl;
+                return EXIT_FAILURE;
+            }
+        }
+        else {
+            std::cerr << "Unknown reprocess option " << name << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+    if (options.journalDirectory.empty()) {
+        std::cerr << "Usage: Scanner reprocess --journal DIR --capture ID --output DIR [--first N] [--last N] [--calibration FILE]" << std::endl;
+        std::cerr << "                         [--workers N] [--strip-threads N] [--writers N] [--register 0|1] [--stabilize 0|1|2] [--half 0|1]" << std::endl;
+        std::cerr << "                         [--preview SCALE] [--metrics PATH] [--invert 0|1] [--film-base R,G,B|auto] [--density D]" << std::endl;
+        std::cerr << "                         [--gamma G] [--lut FILE] [--base-region LEFT,TOP,RIGHT,BOTTOM] [--format tiff|dpx|exr]" << std::endl;
+        std::cerr << "                         [--compress none|lzw|deflate|zstd] [--compress-level N] [--compress-threads N] [--predictor 0|1]" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    Reprocessor::Result result;
+    if (!Reprocessor::run(options, &result)) {
+        return EXIT_FAILURE;
+    }
+    // Anything short of every frame in the range on disk is a partial reprocess
+    return result.framesWritten < result.framesInRange || result.framesSkipped > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/*
+* Scanner preview [--ring NAME] [--output FILE] [--interval MS] [--frames N]
+*
+* Follows the previews a running scan publishes (CaptureSettings::previewScale) and
+* keeps the newest in a PPM file, replaced in one rename so any image viewer that
+* reloads the file never sees half of it. Runs until N previews were written, or for
+* ever with 0 (the default).
+*/
+int followPreviews(int argc, char* argv[]) {
+    std::string ringName = CaptureSettings().previewRingName;
+    std::string outputPath = "preview.ppm";
+    int intervalMs = 100;
+    int frameLimit = 0;
+    for (int i = 0; i + 1 < argc; i += 2) {
+        std::string name = argv[i];
+        const char* value = argv[i + 1];
+        if (name == "--ring") {
+            ringName = value;
+        }
+        else if (name == "--output") {
+            outputPath = value;
+        }
+        else if (name == "--interval") {
+            intervalMs = std::max(1, atoi(value));
+        }
+        else if (name == "--frames") {
+            frameLimit = atoi(value);
+        }
+        else {
+            std::cerr << "Usage: Scanner preview [--ring NAME] [--output FILE] [--interval MS] [--frames N]" << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    PreviewRingReader reader(ringName);
+    PreviewRingReader::Frame frame;
+    uint64_t lastNumber = 0;
+    int lastImageId = -1;
+    int framesWritten = 0;
+    auto lastNew = std::chrono::steady_clock::now();
+    bool attached = false;
+    bool reattached = false;
+    std::cout << "Waiting for previews in " << ringName << ", writing them to " << outputPath << std::endl;
+    while (frameLimit <= 0 || framesWritten < frameLimit) {
+        // A new run of the scanner makes a new ring, look for it when this one goes quiet
+        if (!attached || std::chrono::steady_clock::now() - lastNew > std::chrono::seconds(2)) {
+            attached = reader.attach();
+            reattached = attached;
+            lastNew = std::chrono::steady_clock::now();
+        }
+        // The newest preview of a ring that is new may have any number
+        bool found = attached && reader.readLatest(frame, reattached ? 0 : lastNumber);
+        reattached = false;
+        if (!found || (frame.number == lastNumber && frame.imageId == lastImageId)) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(intervalMs));
+            continue;
+        }
+        lastNumber = frame.number;
+        lastImageId = frame.imageId;
+        lastNew = std::chrono::steady_clock::now();
+
+        std::string partialPath = outputPath + ".partial";
+        std::ofstream out(partialPath, std::ios::binary | std::ios::trunc);
+        out << "P6\n" << frame.width << " " << frame.height << "\n255\n";
+        out.write((const char*)frame.rgb.data(), frame.rgb.size());
+        out.close();
+        std::remove(outputPath.c_str()); // rename() does not replace on Windows
+        if (!out || std::rename(partialPath.c_str(), outputPath.c_str()) != 0) {
+            std::cerr << "Error: Could not write " << outputPath << std::endl;
+            return EXIT_FAILURE;
+        }
+        std::cout << "Image " << frame.imageId << " (" << frame.width << "x" << frame.height << ")" << std::endl;
+        framesWritten++;
+    }
+    return EXIT_SUCCESS;
+}
+
 int main(int argc, char* argv[])
 {
     int exitCode = 0;
 
+    // Offline, so none of the hardware is touched
+    if (argc > 1 && strcmp(argv[1], "reprocess") == 0) {
+        return reprocess(argc - 2, argv + 2);
+    }
+    if (argc > 1 && strcmp(argv[1], "preview") == 0) {
+        return followPreviews(argc - 2, argv + 2);
+    }
+
 #ifdef ARDUINO
     SerialConn* arduinoConnection = getArudinoConnection();
 #endif
@@ -75,19 +311,50 @@ int main(int argc, char* argv[])
 #endif
 	
 
+#ifdef MDRIVE
+    // Outlives the controller, whose callbacks use it while the last frames are written
+    std::unique_ptr<ContinuousTransport> transport;
+#endif
     ImageCaptureController* imageCaptureController;
 
     if (useCamera) {
+#ifdef ARDUINO
+        imageCaptureController = initializeImageController(arduinoConnection != nullptr ? new SerialLedController(arduinoConnection) : nullptr);
+#else
         imageCaptureController = initializeImageController();
-        imageCaptureController->captureFrame();
-        imageCaptureController->captureFrame();
-        imageCaptureController->captureFrame();
-        imageCaptureController->captureFrame();
-        imageCaptureController->captureFrame();
-        imageCaptureController->captureFrame();
-        imageCaptureController->captureFrame();
-        imageCaptureController->captureFrame();
-        imageCaptureController->captureFrame();
+#endif
+        // Frames an earlier, crashed run already wrote are skipped
+        int firstFrame = imageCaptureController->resumeSession();
+#ifdef MDRIVE
+        if (continuousMotion) {
+            transport.reset(new ContinuousTransport(mDriveConnection));
+            ContinuousTransport* motion = transport.get();
+            imageCaptureController->setMotorPositionSource([motion](int64_t& position) { return motion->getPosition(position); });
+            imageCaptureController->setFrameFinishedCallback([motion](RGBImage*, bool) { motion->frameFinished(); });
+            // The controller was made with the default settings, so this is its queue policy
+            bool dropsWhenFull = CaptureSettings().queueFullPolicy == QUEUE_DROP_WHEN_FULL;
+            if (transport->start()) {
+                transport->run(firstFrame, std::max(0, scanFrameCount - firstFrame), [&](int) {
+                    int result = imageCaptureController->captureFrame();
+                    if (result != ImageCaptureController::FRAME_QUEUED) {
+                        transport->frameFinished(); // Dropped, skipped or only journaled, the callback never comes
+                    }
+                    // A blocking queue never drops, only a failed journal does and every frame
+                    // after it would be lost too. Dropping when full is the transport running
+                    // ahead, which the speed control slows down.
+                    return result != ImageCaptureController::FRAME_DROPPED || dropsWhenFull;
+                });
+                transport->stop();
+                transport->printStats();
+            }
+        }
+        else
+#endif
+        {
+            for (int frame = firstFrame; frame < scanFrameCount; frame++) {
+                imageCaptureController->captureFrame();
+            }
+        }
     }
 
     int i = 0;
@@ -115,11 +382,11 @@ int main(int argc, char* argv[])
 		arduinoConnection->sendCommand(SerialConn::SET_COLOR_RED);
 
 		cout << "Waiting for response" << endl;
-        char* buffer = arduinoConnection->readMessage(ARDUINO_MSG_START_DELIM, ARDUINO_MSG_END_DELIM);
-		cout << "Response recieved" << endl;
-        if (buffer != nullptr) {
-            cout << buffer << endl;
-            arduinoConnection->parseMessage(buffer);
+        SerialConn::Message message;
+        if (arduinoConnection->readMessage(message)) {
+            cout << "Response recieved" << endl;
+            cout << message.text << endl;
+            arduinoConnection->parseMessage(message.text);
         }
         else {
             cout << "No response recieved for try " << i << endl;
@@ -133,6 +400,9 @@ int main(int argc, char* argv[])
 	if (useCamera) {
 		delete imageCaptureController; // Clean up the dynamically allocated memory
 	}
+#ifdef MDRIVE
+    transport.reset(); // Stops the drive if it is still slewing
+#endif
 
     return exitCode;
 }
@@ -0,0 +1,3916 @@
+/*
+*   ScannerBenchmark.cpp
+*	Film Scanner Master PC Control Software by Kyle Mikolajczyk
+*   kyle@kylem.org
+*
+*   Standalone benchmark for the scanning pipeline. Runs without a camera by feeding
+*   the ImageCaptureController from a SyntheticFrameSource.
+*
+*   Usage: ScannerBenchmark pipeline [--frames N] [--width W] [--height H]
+*                                    [--fps F] [--jitter MS] [--output DIR]
+*                                    [--workers N] [--in-order 0|1]
+*                                    [--queue N] [--drop 0|1] [--lock-free 0|1]
+*                                    [--writers N] [--in-flight N] [--direct 0|1]
+*                                    [--packed 0|1] [--led-ms MS] [--exposure-ms MS]
+*                                    [--readout-ms MS] [--overlap 0|1]
+*                                    [--strip-threads N] [--calibrate N] [--register 0|1]
+*                                    [--stabilize 0|1|2] [--hdr N] [--hdr-stops S]
+*                                    [--hdr-half 0|1] [--journal 0|1|2] [--segment-mb MB]
+*                                    [--preview SCALE] [--metrics PATH] [--metrics-interval S]
+*                                    [--invert 0|1] [--film-base R,G,B|auto] [--lut FILE]
+*                                    [--format tiff|dpx|exr] [--compress none|lzw|deflate|zstd]
+*                                    [--compress-level N] [--compress-threads N] [--predictor 0|1]
+*          ScannerBenchmark kernels [--width W] [--height H] [--repeat N] [--strip-threads N]
+*          ScannerBenchmark serial [--count N] [--baud B] [--reply-ms MS]
+*          ScannerBenchmark mdrive [--frames N] [--baud B] [--speed-error E] [--capture-ms MS]
+*                                  [--write-ms MS] [--steps-per-frame N] [--poll-ms MS]
+*                                  [--max-fps F]
+*          ScannerBenchmark registration [--frames N] [--width W] [--height H]
+*                                        [--max-shift PX] [--strip-threads N]
+*          ScannerBenchmark stabilization [--frames N] [--width W] [--height H]
+*                                         [--max-shift PX] [--strip-threads N]
+*          ScannerBenchmark hdr [--width W] [--height H] [--exposures N] [--stops S]
+*                               [--strip-threads N]
+*          ScannerBenchmark reprocess [--frames N] [--width W] [--height H] [--first N]
+*                                     [--last N] [--workers N] [--strip-threads N]
+*                                     [--hdr N] [--packed 0|1] [--output DIR]
+*          ScannerBenchmark session [--frames N] [--width W] [--height H] [--workers N]
+*                                   [--in-order 0|1] [--output DIR]
+*          ScannerBenchmark preview [--width W] [--height H] [--repeat N] [--strip-threads N]
+*                                   [--frames N] [--output DIR]
+*          ScannerBenchmark metrics [--samples N] [--threads N] [--output DIR]
+*          ScannerBenchmark color [--width W] [--height H] [--repeat N] [--strip-threads N]
+*                                 [--output DIR]
+*          ScannerBenchmark writer [--width W] [--height H] [--repeat N] [--output DIR]
+*          ScannerBenchmark compress [--width W] [--height H] [--repeat N] [--threads N]
+*                                    [--direct 0|1] [--output DIR]
+*
+*   --led-ms simulates the Arduino LED (serial round trip plus settling) and puts the
+*   synthetic camera on a software trigger with the given exposure and readout times.
+*
+*   --journal 1 only appends the raw exposures to a journal in the output directory, 2
+*   journals and processes them. Either way the journal is read back and checked after
+*   the run.
+*
+*   --calibrate captures N flat frames per colour from the synthetic source first, saves
+*   and reloads the calibration, and then corrects every frame with it.
+*
+*   The serial mode runs SerialConn against an emulated Arduino behind a Linux
+*   pseudo-terminal. --baud adds the wire time of a real link, --reply-ms the time
+*   the sketch takes to answer.
+*
+*   The mdrive mode homes an emulated MDrive speaking MCode behind a pseudo-terminal and
+*   scans on the fly past it with ContinuousTransport, against a writer that slows down
+*   halfway. It reports how far from its mark each frame really was when it was
+*   triggered and the speeds the control settled at. --speed-error runs the drive's
+*   clock that much fast. A reply held back past the timeout first has to be dropped
+*   rather than taken for the answer to the next command.
+*
+*   The registration mode renders a film-like texture three times with known sub-pixel
+*   shifts between the colours, measures the shifts back and merges with them, and
+*   reports how far off the measurement was and how well the channels line up.
+*
+*   The stabilization mode renders frames of the same strip of film with sprocket holes
+*   down the left side, each moved by a random sub-pixel amount, and checks the offsets
+*   FrameStabilizer finds and how well the translated frames line up with the first.
+*   --stabilize in the pipeline is 1 to only log the holes and 2 to also move the frames.
+*
+*   The hdr mode shoots a bracket of a scene with ten stops of range through a simulated
+*   sensor with shot and read noise, fuses it and compares the error in the shadows,
+*   mid tones and highlights with the shortest exposure alone. --hdr in the pipeline
+*   shoots N exposures per colour (needs --led-ms for the exposure times).
+*
+*   The reprocess mode journals and processes a pipeline run, reprocesses the frames
+*   --first to --last from the journal on every core (--workers 0), and checks the
+*   result is byte for byte what the scan wrote.
+*
+*   The session mode scans a short reel with the session manifest, damages the output
+*   the way a crash would and checks that resuming takes exactly the lost frames again.
+*   The reel is journaled too, and the journal has to read back whole after the resume,
+*   the earlier run's records as they were and the frames taken again after them.
+*   --in-order 1 resumes through the reorder stage, which has to step over the frames
+*   that are not taken again.
+*
+*   The preview mode checks the previews made while merging against block means worked
+*   out directly, times the merge with and without them, and follows a preview ring from
+*   another thread while previews are published to it. --preview in the pipeline makes
+*   1/SCALE previews of every frame.
+*
+*   The metrics mode checks the percentiles of the stage histograms against the exact
+*   ones of the same samples, times recording from one thread and from several at once,
+*   and writes the JSON and Prometheus files. --metrics in the pipeline writes them
+*   every --metrics-interval seconds while it runs.
+*
+*   The color mode checks the colour stage against references worked out in doubles: an
+*   identity LUT, a smooth 3D LUT, a .cube file written and read back, and a synthetic
+*   negative inverted to the densities it was made with, and estimates the film base of
+*   a roll of them. Then it times the merge with the stage. --invert, --film-base and
+*   --lut in the pipeline turn the stage on for a scan, --film-base auto estimates it.
+*
+*   The writer mode reads DPX and EXR files written by SequenceWriter back by hand and
+*   compares them with the frames, then times writing full frames as TIFF and DPX through
+*   OIIO and as DPX and EXR with SequenceWriter, with and without direct I/O. --format in
+*   the pipeline picks the format of the frames written.
+*
+*   The compress mode reads TIFFs written by CompressedTiffWriter back by hand with every
+*   codec, with and without the predictor, then compresses full frames of a film-like
+*   texture on 0 to --threads threads and reports the ratio and how fast they were
+*   compressed and written. --compress in the pipeline writes compressed TIFFs, on
+*   --compress-threads threads per writer.
+*
+*   The kernels mode first checks every SIMD variant bit-for-bit against the scalar
+*   reference and fails if any of them disagree, then times them, and the merge with
+*   its stages chained over cache-sized strips against running them stage by stage.
+*/
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <zlib.h>
+#ifdef SCANNER_HAVE_ZSTD
+#include <zstd.h>
+#endif
+#include "ArduinoEmulator.h"
+#include "ChannelRegistration.h"
+#include "ColorTransform.h"
+#include "CompressedTiffWriter.h"
+#include "ContinuousTransport.h"
+#include "DirectFile.h"
+#include "FilmBaseEstimator.h"
+#include "FlatFieldCalibration.h"
+#include "FramePreview.h"
+#include "FrameStabilizer.h"
+#include "HdrFusion.h"
+#include "ImageCaptureController.h"
+#include "ImagesProcessor.h"
+#include "MDriveConn.h"
+#include "MDriveEmulator.h"
+#include "PipelineMetrics.h"
+#include "PixelKernels.h"
+#include "PreviewRing.h"
+#include "Reprocessor.h"
+#include "SequenceWriter.h"
+#include "SerialConn.h"
+#include "SessionManifest.h"
+#include "StripPipeline.h"
+#include "StripThreadPool.h"
+#include "SyntheticFrameSource.h"
+
+using namespace std;
+
+/*
+* Collects "--name value" pairs after the subcommand
+*/
+static map<string, string> parseOptions(int argc, char* argv[], int first)
+{
+    map<string, string> options;
+    for (int i = first; i + 1 < argc; i += 2)
+    {
+        if (strncmp(argv[i], "--", 2) != 0)
+        {
+            cerr << "Ignoring unexpected argument " << argv[i] << endl;
+            i--;
+            continue;
+        }
+        options[argv[i] + 2] = argv[i + 1];
+    }
+    return options;
+}
+
+static double optionOr(const map<string, string>& options, const string& name, double fallback)
+{
+    auto it = options.find(name);
+    return it == options.end() ? fallback : atof(it->second.c_str());
+}
+
+static double percentile(vector<double>& sorted, double p)
+{
+    if (sorted.empty())
+    {
+        return 0.0;
+    }
+    size_t index = (size_t)(p * (sorted.size() - 1) + 0.5);
+    return sorted[min(index, sorted.size() - 1)];
+}
+
+/*
+* Read the journal the pipeline run left behind and check every exposure is there, in
+* order, with the right header
+*/
+static bool verifyJournal(const string& directory, int frames, int exposures, int width, int height, RawFrame::PixelFormat format)
+{
+    auto start = chrono::steady_clock::now();
+    JournalReader reader(directory, "BENCH");
+    JournalRecordHeader header;
+    vector<unsigned char> payload;
+    size_t records = 0, bytes = 0;
+    bool valid = true;
+    while (reader.next(header, payload))
+    {
+        size_t exposure = records % exposures;
+        size_t color = records / exposures % 3;
+        int imageId = (int)(records / (exposures * 3));
+        if (header.imageId != imageId || header.color != (int)color || header.exposureIndex != (int)exposure || header.width != width ||
+            header.height != height || header.pixelFormat != format || payload.size() != rawFrameBytes(format, width, height))
+        {
+            cerr << "Journal record " << records << " is image " << header.imageId << " colour " << header.color << " exposure " << header.exposureIndex
+                << ", expected image " << imageId << " colour " << color << " exposure " << exposure << endl;
+            valid = false;
+            break;
+        }
+        records++;
+        bytes += header.recordBytes;
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    size_t expected = (size_t)frames * 3 * exposures;
+    cout << "  Journal:          " << records << " / " << expected << " exposures read back, " << bytes / (1024.0 * 1024.0) / max(seconds, 1e-9)
+        << " MB/s" << (reader.isDamaged() ? ", damaged" : "") << endl;
+    return valid && records == expected && !reader.isDamaged();
+}
+
+/*
+* Push N frames through captureFrame() -> processQueue() -> ImagesProcessor::saveImage()
+* and report frames/sec and capture-to-disk latency per frame
+*/
+static int runPipelineBenchmark(const map<string, string>& options)
+{
+    int frames = (int)optionOr(options, "frames", 50);
+    int width = (int)optionOr(options, "width", 6144);
+    int height = (int)optionOr(options, "height", 4096);
+    double fps = optionOr(options, "fps", 0.0);
+    double jitter = optionOr(options, "jitter", 0.0);
+    string outputDirectory = options.count("output") ? options.at("output") : "bench_img/";
+    if (outputDirectory.back() != '/' && outputDirectory.back() != '\\')
+    {
+        outputDirectory += "/";
+    }
+    std::filesystem::create_directories(outputDirectory);
+
+    CaptureSettings settings;
+    settings.workerCount = (int)optionOr(options, "workers", 1);
+    settings.commitInOrder = optionOr(options, "in-order", 0) != 0;
+    settings.queueCapacity = (size_t)optionOr(options, "queue", 0);
+    settings.queueFullPolicy = optionOr(options, "drop", 0) != 0 ? QUEUE_DROP_WHEN_FULL : QUEUE_BLOCK_WHEN_FULL;
+    settings.useLockFreeQueue = optionOr(options, "lock-free", 0) != 0;
+    settings.writerThreads = (int)optionOr(options, "writers", 0);
+    settings.maxInFlightWrites = (size_t)optionOr(options, "in-flight", 2);
+    settings.bypassPageCache = optionOr(options, "direct", 0) != 0;
+    RawFrame::PixelFormat format = optionOr(options, "packed", 0) != 0 ? RawFrame::MONO12P : RawFrame::MONO12;
+    settings.overlapLedSwitching = optionOr(options, "overlap", 1) != 0;
+    settings.processingThreads = (int)optionOr(options, "strip-threads", 0);
+    settings.registerChannels = optionOr(options, "register", 0) != 0;
+    settings.stabilization = (StabilizationMode)std::clamp((int)optionOr(options, "stabilize", 0), (int)STABILIZE_OFF, (int)STABILIZE_TRANSLATE);
+    settings.hdrExposures = max(1, (int)optionOr(options, "hdr", 1));
+    settings.hdrStops = optionOr(options, "hdr-stops", 2.0);
+    settings.hdrHalfFloat = optionOr(options, "hdr-half", 1) != 0;
+    settings.journalMode = (JournalMode)std::clamp((int)optionOr(options, "journal", 0), (int)JOURNAL_OFF, (int)JOURNAL_AND_PROCESS);
+    settings.journalSegmentBytes = (uint64_t)(optionOr(options, "segment-mb", 4096) * 1024 * 1024);
+    settings.previewScale = (int)optionOr(options, "preview", 0);
+    settings.metricsPath = options.count("metrics") ? options.at("metrics") : "";
+    settings.metricsIntervalSeconds = optionOr(options, "metrics-interval", 1.0);
+    settings.color.invert = optionOr(options, "invert", 0) != 0;
+    settings.filmBaseEstimation.estimate = options.count("film-base") && options.at("film-base") == "auto";
+    if (options.count("film-base") && !settings.filmBaseEstimation.estimate &&
+        sscanf(options.at("film-base").c_str(), "%lf,%lf,%lf", &settings.color.filmBase[0], &settings.color.filmBase[1], &settings.color.filmBase[2]) != 3)
+    {
+        cerr << "--film-base takes the red, green and blue levels, e.g. 52000,31000,18000, or auto" << endl;
+        return EXIT_FAILURE;
+    }
+    settings.color.lutPath = options.count("lut") ? options.at("lut") : "";
+    if (options.count("format") && !SequenceWriter::parseFormat(options.at("format"), settings.outputFormat))
+    {
+        cerr << "--format takes tiff, dpx or exr" << endl;
+        return EXIT_FAILURE;
+    }
+    if (options.count("compress") && !CompressedTiffWriter::parseCompression(options.at("compress"), settings.outputCompression))
+    {
+        cerr << "--compress takes none, lzw, deflate or zstd" << endl;
+        return EXIT_FAILURE;
+    }
+    settings.compressionLevel = (int)optionOr(options, "compress-level", 0);
+    settings.compressionThreads = (int)optionOr(options, "compress-threads", 0);
+    settings.compressionPredictor = optionOr(options, "predictor", 1) != 0;
+    double ledMs = optionOr(options, "led-ms", 0);
+    int calibrationFrames = (int)optionOr(options, "calibrate", 0);
+    int droppedFrames = 0;
+
+    mutex latencyMutex;
+    vector<double> latenciesMs;
+    latenciesMs.reserve(frames);
+    int lastWrittenId = -1;
+    int outOfOrderWrites = 0;
+
+    auto start = chrono::steady_clock::now();
+    double calibrationSeconds = 0.0;
+    {
+        SyntheticFrameSource* source = new SyntheticFrameSource(width, height, fps, jitter, 1, format);
+        LedController* led = nullptr;
+        if (ledMs > 0.0)
+        {
+            source->setTriggerTiming(optionOr(options, "exposure-ms", 10), optionOr(options, "readout-ms", 15));
+            led = new SimulatedLedController(ledMs);
+        }
+        ImageCaptureController controller("BENCH", source, led, settings);
+        controller.setOutputDirectory(outputDirectory);
+        if (calibrationFrames > 0)
+        {
+            // The synthetic frames have no dark level, so only flats are taken
+            FlatFieldCalibration captured;
+            auto calibrationStart = chrono::steady_clock::now();
+            if (!controller.captureCalibrationFrames(captured, false, calibrationFrames) || !captured.build())
+            {
+                return EXIT_FAILURE;
+            }
+            string calibrationPath = outputDirectory + "bench.cal";
+            auto calibration = make_shared<FlatFieldCalibration>();
+            auto loadStart = chrono::steady_clock::now();
+            if (!captured.save(calibrationPath) || !calibration->load(calibrationPath))
+            {
+                return EXIT_FAILURE;
+            }
+            chrono::duration<double, milli> loadMs = chrono::steady_clock::now() - loadStart;
+            calibration->printSummary();
+            cout << "Calibration saved and loaded again in " << loadMs.count() << " ms" << endl;
+            controller.setCalibration(calibration);
+            calibrationSeconds = chrono::duration<double>(chrono::steady_clock::now() - calibrationStart).count();
+        }
+        controller.setFrameFinishedCallback([&](RGBImage* image, bool saved) {
+            if (!saved)
+            {
+                return; // Counted as neither written nor dropped, the check below fails
+            }
+            chrono::duration<double, milli> latency = chrono::steady_clock::now() - image->getCaptureStartTime();
+            lock_guard<mutex> lock(latencyMutex);
+            latenciesMs.push_back(latency.count());
+            if (image->getImageId() < lastWrittenId)
+            {
+                outOfOrderWrites++;
+            }
+            lastWrittenId = image->getImageId();
+        });
+
+        for (int i = 0; i < frames; i++)
+        {
+            if (controller.captureFrame() == ImageCaptureController::FRAME_DROPPED)
+            {
+                droppedFrames++;
+            }
+        }
+        // Leaving this scope drains the processing queue before we stop the clock
+    }
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start - chrono::duration<double>(calibrationSeconds);
+
+    sort(latenciesMs.begin(), latenciesMs.end());
+    double sum = 0.0;
+    for (double latency : latenciesMs)
+    {
+        sum += latency;
+    }
+
+    cout << endl << "Pipeline benchmark: " << frames << " frames of " << width << "x" << height
+        << " (3 exposures each), " << settings.workerCount << " worker(s)" << (settings.commitInOrder ? ", in order" : "")
+        << ", " << settings.writerThreads << " writer(s)" << (settings.bypassPageCache ? ", direct I/O" : "")
+        << (settings.outputFormat != OUTPUT_TIFF ? ", " + SequenceWriter::getExtension(settings.outputFormat).substr(1) : "")
+        << (settings.outputCompression != COMPRESS_NONE ? string(", ") + CompressedTiffWriter::getName(settings.outputCompression) : "")
+        << ", " << settings.processingThreads << " strip thread(s)" << (calibrationFrames > 0 ? ", calibrated" : "")
+        << (settings.journalMode == JOURNAL_ONLY ? ", journal only" : settings.journalMode == JOURNAL_AND_PROCESS ? ", journaled" : "") << endl;
+    cout << fixed << setprecision(2);
+    size_t framesDone = settings.journalMode == JOURNAL_ONLY ? frames - droppedFrames : latenciesMs.size();
+    cout << "  Frames written:   " << framesDone << " / " << frames << endl;
+    cout << "  Frames dropped:   " << droppedFrames << endl;
+    cout << "  Out of order:     " << outOfOrderWrites << endl;
+    cout << "  Elapsed:          " << elapsed.count() << " s" << endl;
+    cout << "  Throughput:       " << framesDone / elapsed.count() << " frames/s" << endl;
+    if (!latenciesMs.empty())
+    {
+        cout << "  Latency mean:     " << sum / latenciesMs.size() << " ms" << endl;
+        cout << "  Latency p50:      " << percentile(latenciesMs, 0.50) << " ms" << endl;
+        cout << "  Latency p95:      " << percentile(latenciesMs, 0.95) << " ms" << endl;
+        cout << "  Latency max:      " << latenciesMs.back() << " ms" << endl;
+    }
+    bool complete = latenciesMs.size() + droppedFrames == (size_t)frames || settings.journalMode == JOURNAL_ONLY;
+    if (settings.journalMode != JOURNAL_OFF)
+    {
+        complete = verifyJournal(outputDirectory, frames - droppedFrames, max(1, settings.hdrExposures), width, height, format) && complete;
+    }
+    if (!settings.metricsPath.empty())
+    {
+        bool written = filesystem::exists(settings.metricsPath + ".json") && filesystem::exists(settings.metricsPath + ".prom");
+        cout << "  Metrics:          " << settings.metricsPath << (written ? ".json and .prom written" : " files missing") << endl;
+        complete = written && complete;
+    }
+    // Several writer threads may finish frames out of order even when they are committed in order
+    bool ordered = !settings.commitInOrder || settings.writerThreads > 1 || outOfOrderWrites == 0;
+    return complete && ordered ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/*
+* Run every built variant of the channel interleave over odd sizes and misaligned
+* pointers and compare each output word against interleave3Scalar
+*/
+static bool verifyInterleaveKernels()
+{
+    const size_t sizes[] = { 0, 1, 7, 8, 9, 15, 16, 17, 31, 32, 33, 63, 64, 65, 95, 96, 97, 1000, 4099 };
+    mt19937 rng(12345);
+    uniform_int_distribution<int> value(0, 65535);
+    bool allMatch = true;
+
+    for (int isa = PixelKernels::SSE41; isa < PixelKernels::ISA_COUNT; isa++)
+    {
+        PixelKernels::Interleave3Fn kernel = PixelKernels::getInterleave3((PixelKernels::Isa)isa);
+        if (kernel == nullptr || !PixelKernels::isIsaSupported((PixelKernels::Isa)isa))
+        {
+            cout << "  " << PixelKernels::getIsaName((PixelKernels::Isa)isa) << ": not supported on this CPU, skipped" << endl;
+            continue;
+        }
+
+        bool match = true;
+        for (size_t count : sizes)
+        {
+            for (size_t offset = 0; offset < 3 && match; offset++)
+            {
+                // One extra element at each end so an off-by-one write shows up as a mismatch
+                vector<uint16_t> red(count + 3), green(count + 3), blue(count + 3);
+                for (size_t i = 0; i < red.size(); i++)
+                {
+                    red[i] = (uint16_t)value(rng);
+                    green[i] = (uint16_t)value(rng);
+                    blue[i] = (uint16_t)value(rng);
+                }
+                vector<uint16_t> expected(count * 3 + 6, 0xABCD), actual(count * 3 + 6, 0xABCD);
+                PixelKernels::interleave3Scalar(red.data() + offset, green.data() + offset, blue.data() + offset, expected.data() + offset, count);
+                kernel(red.data() + offset, green.data() + offset, blue.data() + offset, actual.data() + offset, count);
+                if (expected != actual)
+                {
+                    cerr << "  " << PixelKernels::getIsaName((PixelKernels::Isa)isa) << ": mismatch for " << count << " pixels at offset " << offset << endl;
+                    match = false;
+                }
+            }
+        }
+        cout << "  " << PixelKernels::getIsaName((PixelKernels::Isa)isa) << ": " << (match ? "bit-exact" : "MISMATCH") << endl;
+        allMatch = allMatch && match;
+    }
+    return allMatch;
+}
+
+/*
+* Same check for the 12 to 16 bit scale, over the full 12 bit input range
+*/
+static bool verifyShiftKernels()
+{
+    const size_t sizes[] = { 0, 1, 7, 8, 15, 16, 17, 31, 32, 33, 63, 64, 65, 127, 128, 129, 4099 };
+    mt19937 rng(54321);
+    uniform_int_distribution<int> value(0, 4095);
+    bool allMatch = true;
+
+    for (int isa = PixelKernels::SSE41; isa < PixelKernels::ISA_COUNT; isa++)
+    {
+        PixelKernels::Shift12To16Fn kernel = PixelKernels::getShift12To16((PixelKernels::Isa)isa);
+        if (kernel == nullptr || !PixelKernels::isIsaSupported((PixelKernels::Isa)isa))
+        {
+            continue;
+        }
+
+        bool match = true;
+        for (size_t count : sizes)
+        {
+            for (size_t offset = 0; offset < 3 && match; offset++)
+            {
+                vector<uint16_t> source(count + 3);
+                for (uint16_t& sample : source)
+                {
+                    sample = (uint16_t)value(rng);
+                }
+                vector<uint16_t> expected(count + 6, 0xABCD), actual(count + 6, 0xABCD);
+                PixelKernels::shift12To16Scalar(source.data() + offset, expected.data() + offset, count);
+                kernel(source.data() + offset, actual.data() + offset, count);
+                if (expected != actual)
+                {
+                    cerr << "  " << PixelKernels::getIsaName((PixelKernels::Isa)isa) << ": mismatch for " << count << " pixels at offset " << offset << endl;
+                    match = false;
+                }
+            }
+        }
+        cout << "  " << PixelKernels::getIsaName((PixelKernels::Isa)isa) << ": " << (match ? "bit-exact" : "MISMATCH") << endl;
+        allMatch = allMatch && match;
+    }
+    return allMatch;
+}
+
+/*
+* Same check for the Mono12p unpack. The scalar unpack is first checked against plain
+* shift12To16 of the samples before packing, so a layout mistake cannot hide in both.
+*/
+static bool verifyUnpackKernels()
+{
+    const size_t sizes[] = { 0, 1, 2, 3, 7, 8, 9, 15, 16, 17, 31, 32, 33, 42, 43, 63, 64, 65, 127, 128, 129, 4099 };
+    mt19937 rng(24680);
+    uniform_int_distribution<int> value(0, 4095);
+    bool allMatch = true;
+
+    for (int isa = PixelKernels::SCALAR; isa < PixelKernels::ISA_COUNT; isa++)
+    {
+        PixelKernels::Unpack12pTo16Fn kernel = PixelKernels::getUnpack12pTo16((PixelKernels::Isa)isa);
+        if (kernel == nullptr || !PixelKernels::isIsaSupported((PixelKernels::Isa)isa))
+        {
+            continue;
+        }
+
+        bool match = true;
+        for (size_t count : sizes)
+        {
+            for (size_t offset = 0; offset < 3 && match; offset++)
+            {
+                vector<uint16_t> samples(count);
+                for (uint16_t& sample : samples)
+                {
+                    sample = (uint16_t)value(rng);
+                }
+                vector<uint8_t> packed;
+                SyntheticFrameSource::packMono12p(samples, packed);
+                packed.insert(packed.begin(), offset, 0); // Misalign the source
+
+                vector<uint16_t> expected(count + 6, 0xABCD), actual(count + 6, 0xABCD);
+                PixelKernels::shift12To16Scalar(samples.data(), expected.data() + offset, count);
+                kernel(packed.data() + offset, actual.data() + offset, count);
+                if (expected != actual)
+                {
+                    cerr << "  " << PixelKernels::getIsaName((PixelKernels::Isa)isa) << ": mismatch for " << count << " pixels at offset " << offset << endl;
+                    match = false;
+                }
+            }
+        }
+        cout << "  " << PixelKernels::getIsaName((PixelKernels::Isa)isa) << ": " << (match ? "bit-exact" : "MISMATCH") << endl;
+        allMatch = allMatch && match;
+    }
+    return allMatch;
+}
+
+/*
+* Same check for the dark/flat correction. Offsets and gains cover the whole range, so
+* both the clip at 0 and the saturation at full scale get hit.
+*/
+static bool verifyFlatFieldKernels()
+{
+    const size_t sizes[] = { 0, 1, 7, 8, 9, 15, 16, 17, 31, 32, 33, 63, 64, 65, 4099 };
+    mt19937 rng(13579);
+    uniform_int_distribution<int> value(0, 65535);
+    uniform_int_distribution<int> nearUnity(3000, 6000); // The usual case, gains around 1
+    bool allMatch = true;
+
+    for (int isa = PixelKernels::SSE41; isa < PixelKernels::ISA_COUNT; isa++)
+    {
+        PixelKernels::FlatFieldFn kernel = PixelKernels::getFlatField((PixelKernels::Isa)isa);
+        if (kernel == nullptr || !PixelKernels::isIsaSupported((PixelKernels::Isa)isa))
+        {
+            continue;
+        }
+
+        bool match = true;
+        for (size_t count : sizes)
+        {
+            for (size_t offset = 0; offset < 3 && match; offset++)
+            {
+                vector<uint16_t> source(count + 3), dark(count + 3), gain(count + 3);
+                for (size_t i = 0; i < source.size(); i++)
+                {
+                    source[i] = (uint16_t)value(rng);
+                    dark[i] = (uint16_t)(i % 4 == 0 ? value(rng) : value(rng) / 64);
+                    gain[i] = (uint16_t)(i % 3 == 0 ? value(rng) : nearUnity(rng));
+                }
+                vector<uint16_t> expected(count + 6, 0xABCD), actual(count + 6, 0xABCD);
+                PixelKernels::flatFieldScalar(source.data() + offset, dark.data() + offset, gain.data() + offset, expected.data() + offset, count);
+                kernel(source.data() + offset, dark.data() + offset, gain.data() + offset, actual.data() + offset, count);
+                if (expected != actual)
+                {
+                    cerr << "  " << PixelKernels::getIsaName((PixelKernels::Isa)isa) << ": mismatch for " << count << " pixels at offset " << offset << endl;
+                    match = false;
+                }
+            }
+        }
+        cout << "  " << PixelKernels::getIsaName((PixelKernels::Isa)isa) << ": " << (match ? "bit-exact" : "MISMATCH") << endl;
+        allMatch = allMatch && match;
+    }
+    return allMatch;
+}
+
+/*
+* Same check for the bilinear shift, with random weights that add up to 256 as they do
+* in the merge
+*/
+static bool verifyBilinearKernels()
+{
+    const size_t sizes[] = { 0, 1, 7, 8, 9, 15, 16, 17, 31, 32, 33, 63, 64, 65, 4099 };
+    mt19937 rng(97531);
+    uniform_int_distribution<int> value(0, 65535);
+    uniform_int_distribution<int> sixteenths(0, 15);
+    bool allMatch = true;
+
+    for (int isa = PixelKernels::SSE41; isa < PixelKernels::ISA_COUNT; isa++)
+    {
+        PixelKernels::BilinearRowFn kernel = PixelKernels::getBilinearRow((PixelKernels::Isa)isa);
+        if (kernel == nullptr || !PixelKernels::isIsaSupported((PixelKernels::Isa)isa))
+        {
+            continue;
+        }
+
+        bool match = true;
+        for (size_t count : sizes)
+        {
+            for (size_t offset = 0; offset < 3 && match; offset++)
+            {
+                int fx = sixteenths(rng), fy = sixteenths(rng);
+                uint16_t weights[4] = { (uint16_t)((16 - fx) * (16 - fy)), (uint16_t)(fx * (16 - fy)), (uint16_t)((16 - fx) * fy), (uint16_t)(fx * fy) };
+                vector<uint16_t> top(count + 4), bottom(count + 4);
+                for (size_t i = 0; i < top.size(); i++)
+                {
+                    top[i] = (uint16_t)(i % 5 == 0 ? 65535 : value(rng));
+                    bottom[i] = (uint16_t)value(rng);
+                }
+                vector<uint16_t> expected(count + 6, 0xABCD), actual(count + 6, 0xABCD);
+                PixelKernels::bilinearRowScalar(top.data() + offset, bottom.data() + offset, expected.data() + offset, count, weights);
+                kernel(top.data() + offset, bottom.data() + offset, actual.data() + offset, count, weights);
+                if (expected != actual)
+                {
+                    cerr << "  " << PixelKernels::getIsaName((PixelKernels::Isa)isa) << ": mismatch for " << count << " pixels at offset " << offset << endl;
+                    match = false;
+                }
+            }
+        }
+        cout << "  " << PixelKernels::getIsaName((PixelKernels::Isa)isa) << ": " << (match ? "bit-exact" : "MISMATCH") << endl;
+        allMatch = allMatch && match;
+    }
+    return allMatch;
+}
+
+/*
+* Same check for the bracket fusion, first exposures and blends, with the exposures
+* crowded around the knee and the clip. The blend may round differently in the last
+* bit when the compiler fuses its multiply and add, so a millionth of full scale is
+* allowed (every radiance here is between 0 and 1).
+*/
+static bool verifyFuseExposureKernels()
+{
+    const size_t sizes[] = { 0, 1, 7, 8, 9, 15, 16, 17, 31, 32, 33, 63, 64, 65, 4099 };
+    mt19937 rng(86420);
+    uniform_int_distribution<int> value(0, 65535);
+    uniform_int_distribution<int> nearClip(PixelKernels::HDR_KNEE - 500, PixelKernels::HDR_CLIP + 500);
+    uniform_real_distribution<float> level(0.0f, 1.0f);
+    bool allMatch = true;
+
+    for (int isa = PixelKernels::SSE41; isa < PixelKernels::ISA_COUNT; isa++)
+    {
+        PixelKernels::FuseExposureFn kernel = PixelKernels::getFuseExposure((PixelKernels::Isa)isa);
+        if (kernel == nullptr || !PixelKernels::isIsaSupported((PixelKernels::Isa)isa))
+        {
+            continue;
+        }
+
+        bool match = true, exact = true;
+        for (size_t count : sizes)
+        {
+            for (size_t offset = 0; offset < 3 && match; offset++)
+            {
+                bool first = offset == 1;
+                float scale = 1.0f / (65535.0f * (1 << (offset * 2)));
+                vector<uint16_t> exposure(count + 3);
+                vector<float> expected(count + 6), actual;
+                for (size_t i = 0; i < exposure.size(); i++)
+                {
+                    exposure[i] = (uint16_t)(i % 2 == 0 ? nearClip(rng) : value(rng));
+                }
+                for (float& radiance : expected)
+                {
+                    radiance = level(rng);
+                }
+                actual = expected;
+                PixelKernels::fuseExposureScalar(exposure.data() + offset, expected.data() + offset, count, scale, first);
+                kernel(exposure.data() + offset, actual.data() + offset, count, scale, first);
+                for (size_t i = 0; i < expected.size(); i++)
+                {
+                    exact = exact && expected[i] == actual[i];
+                    if (fabs(expected[i] - actual[i]) > 1e-6f)
+                    {
+                        cerr << "  " << PixelKernels::getIsaName((PixelKernels::Isa)isa) << ": mismatch for " << count << " pixels at offset " << offset << endl;
+                        match = false;
+                        break;
+                    }
+                }
+            }
+        }
+        cout << "  " << PixelKernels::getIsaName((PixelKernels::Isa)isa) << ": " << (!match ? "MISMATCH" : exact ? "bit-exact" : "within float rounding") << endl;
+        allMatch = allMatch && match;
+    }
+    return allMatch;
+}
+
+/*
+* Same check for the half float interleave, against F16C on the CPUs that have it. The
+* values cover every exponent a half has, plus the edge cases of the rounding: ties,
+* the largest half, the overflow to infinity and the denormals.
+*/
+static bool verifyHalfKernels()
+{
+    const size_t sizes[] = { 0, 1, 7, 8, 9, 31, 32, 33, 255, 256, 257, 511, 1000, 4099 };
+    const float specials[] = { 0.0f, -0.0f, 1.0f, 65504.0f, 65519.99f, 65520.0f, 1e9f, 6.1035156e-5f, 6.0e-5f, 5.9604645e-8f, 2.9802322e-8f, 2.9802326e-8f,
+        1.0f + 1.0f / 2048.0f, 1.0f + 3.0f / 2048.0f, -1.0f - 1.0f / 2048.0f, INFINITY, -INFINITY };
+    mt19937 rng(19283);
+    uniform_int_distribution<uint32_t> mantissa(0, (1u << 23) - 1);
+    uniform_int_distribution<int> exponent(127 - 26, 127 + 17); // Below the half denormals to past its largest value
+    uniform_int_distribution<int> special(0, (int)(sizeof(specials) / sizeof(specials[0])) - 1);
+    auto randomFloat = [&](size_t i) {
+        if (i % 5 == 0)
+        {
+            return specials[special(rng)];
+        }
+        uint32_t bits = (uint32_t)(i % 7 == 0) << 31 | (uint32_t)exponent(rng) << 23 | mantissa(rng);
+        float value;
+        memcpy(&value, &bits, sizeof(value));
+        return value;
+    };
+    bool allMatch = true;
+
+    for (int isa = PixelKernels::SSE41; isa < PixelKernels::ISA_COUNT; isa++)
+    {
+        PixelKernels::Interleave3HalfFn kernel = PixelKernels::getInterleave3Half((PixelKernels::Isa)isa);
+        if (kernel == nullptr || !PixelKernels::isIsaSupported((PixelKernels::Isa)isa))
+        {
+            continue;
+        }
+
+        bool match = true;
+        for (size_t count : sizes)
+        {
+            for (size_t offset = 0; offset < 3 && match; offset++)
+            {
+                vector<float> red(count + 3), green(count + 3), blue(count + 3);
+                for (size_t i = 0; i < red.size(); i++)
+                {
+                    red[i] = randomFloat(i);
+                    green[i] = randomFloat(i + 1);
+                    blue[i] = randomFloat(i + 2);
+                }
+                vector<uint16_t> expected(count * 3 + 6, 0xABCD), actual(count * 3 + 6, 0xABCD);
+                PixelKernels::interleave3HalfScalar(red.data() + offset, green.data() + offset, blue.data() + offset, expected.data() + offset, count);
+                kernel(red.data() + offset, green.data() + offset, blue.data() + offset, actual.data() + offset, count);
+                if (expected != actual)
+                {
+                    cerr << "  " << PixelKernels::getIsaName((PixelKernels::Isa)isa) << ": mismatch for " << count << " pixels at offset " << offset << endl;
+                    match = false;
+                }
+            }
+        }
+        cout << "  " << PixelKernels::getIsaName((PixelKernels::Isa)isa) << ": " << (match ? "bit-exact" : "MISMATCH") << endl;
+        allMatch = allMatch && match;
+    }
+    return allMatch;
+}
+
+/*
+* Same check for the column sums of the preview, over every block height and rows
+* further apart than the columns summed
+*/
+static bool verifySumColumnsKernels()
+{
+    const size_t sizes[] = { 0, 1, 7, 8, 9, 15, 16, 17, 31, 32, 33, 63, 64, 65, 4099 };
+    mt19937 rng(86420);
+    uniform_int_distribution<int> value(0, 65535);
+    bool allMatch = true;
+
+    for (int isa = PixelKernels::SSE41; isa < PixelKernels::ISA_COUNT; isa++)
+    {
+        PixelKernels::SumColumnsFn kernel = PixelKernels::getSumColumns((PixelKernels::Isa)isa);
+        if (kernel == nullptr || !PixelKernels::isIsaSupported((PixelKernels::Isa)isa))
+        {
+            continue;
+        }
+
+        bool match = true;
+        for (size_t count : sizes)
+        {
+            for (int rows = 1; rows <= 16 && match; rows++)
+            {
+                size_t offset = rows % 3;
+                size_t stride = count + 5;
+                vector<uint16_t> source(stride * rows + 3);
+                for (uint16_t& sample : source)
+                {
+                    sample = (uint16_t)(rows == 16 ? 65535 : value(rng)); // The largest sum there can be
+                }
+                vector<uint32_t> expected(count + 6, 0xABCDEF01u), actual(count + 6, 0xABCDEF01u);
+                PixelKernels::sumColumnsScalar(source.data() + offset, stride, rows, expected.data() + offset, count);
+                kernel(source.data() + offset, stride, rows, actual.data() + offset, count);
+                if (expected != actual)
+                {
+                    cerr << "  " << PixelKernels::getIsaName((PixelKernels::Isa)isa) << ": mismatch for " << count << " pixels of " << rows << " rows" << endl;
+                    match = false;
+                }
+            }
+        }
+        cout << "  " << PixelKernels::getIsaName((PixelKernels::Isa)isa) << ": " << (match ? "bit-exact" : "MISMATCH") << endl;
+        allMatch = allMatch && match;
+    }
+    return allMatch;
+}
+
+/*
+* Same check for the per channel curves, with random curves so a wrong lane or channel
+* shows, into separate planes and in place
+*/
+static bool verifyCurvesKernels()
+{
+    const size_t sizes[] = { 0, 1, 7, 8, 9, 15, 16, 17, 31, 32, 33, 63, 64, 65, 4099 };
+    mt19937 rng(31337);
+    uniform_int_distribution<int> value(0, 65535);
+    vector<uint16_t> curves(3 * PixelKernels::CURVE_ENTRIES + PixelKernels::CURVE_PADDING);
+    generate(curves.begin(), curves.end(), [&]() { return (uint16_t)value(rng); });
+    bool allMatch = true;
+
+    for (int isa = PixelKernels::SSE41; isa < PixelKernels::ISA_COUNT; isa++)
+    {
+        PixelKernels::ApplyCurves3Fn kernel = PixelKernels::getApplyCurves3((PixelKernels::Isa)isa);
+        if (kernel == nullptr || !PixelKernels::isIsaSupported((PixelKernels::Isa)isa))
+        {
+            continue;
+        }
+
+        bool match = true;
+        for (size_t count : sizes)
+        {
+            for (size_t offset = 0; offset < 3 && match; offset++)
+            {
+                bool inPlace = offset == 1;
+                vector<uint16_t> source[3], expected[3], actual[3];
+                const uint16_t* sources[3];
+                const uint16_t* actualSources[3];
+                uint16_t* expectedPlanes[3];
+                uint16_t* actualPlanes[3];
+                for (int channel = 0; channel < 3; channel++)
+                {
+                    source[channel].resize(count + 3);
+                    for (size_t i = 0; i < source[channel].size(); i++)
+                    {
+                        source[channel][i] = (uint16_t)(i % 5 == 0 ? (i % 2 ? 65535 : 0) : value(rng)); // The first and last entries too
+                    }
+                    actual[channel] = inPlace ? source[channel] : vector<uint16_t>(count + 3, 0xABCD);
+                    expected[channel] = actual[channel];
+                    sources[channel] = source[channel].data() + offset;
+                    expectedPlanes[channel] = expected[channel].data() + offset;
+                    actualPlanes[channel] = actual[channel].data() + offset;
+                    actualSources[channel] = inPlace ? actualPlanes[channel] : sources[channel];
+                }
+                PixelKernels::applyCurves3Scalar(sources, expectedPlanes, curves.data(), count);
+                kernel(actualSources, actualPlanes, curves.data(), count);
+                for (int channel = 0; channel < 3 && match; channel++)
+                {
+                    if (expected[channel] != actual[channel])
+                    {
+                        cerr << "  " << PixelKernels::getIsaName((PixelKernels::Isa)isa) << ": mismatch in channel " << channel << " for " << count
+                            << " pixels at offset " << offset << endl;
+                        match = false;
+                    }
+                }
+            }
+        }
+        cout << "  " << PixelKernels::getIsaName((PixelKernels::Isa)isa) << ": " << (match ? "bit-exact" : "MISMATCH") << endl;
+        allMatch = allMatch && match;
+    }
+    return allMatch;
+}
+
+/*
+* Same check for the 3D LUT lookup over LUT sizes from the smallest there can be up,
+* with random tables, values on the grid, ties between the fractions (where the choice
+* of tetrahedron is decided by the tie-break) and 0 and 65535
+*/
+static bool verifyTetrahedralKernels()
+{
+    const size_t sizes[] = { 0, 1, 7, 8, 9, 15, 16, 17, 31, 33, 1001 };
+    const int lutSizes[] = { 2, 3, 17, 33, 65 };
+    mt19937 rng(27182);
+    uniform_int_distribution<int> value(0, 65535);
+    bool allMatch = true;
+
+    for (int isa = PixelKernels::SSE41; isa < PixelKernels::ISA_COUNT; isa++)
+    {
+        PixelKernels::Tetrahedral3Fn kernel = PixelKernels::getTetrahedral3((PixelKernels::Isa)isa);
+        if (kernel == nullptr || !PixelKernels::isIsaSupported((PixelKernels::Isa)isa))
+        {
+            continue;
+        }
+
+        bool match = true;
+        for (int lutSize : lutSizes)
+        {
+            vector<uint16_t> lut((size_t)lutSize * lutSize * lutSize * 4);
+            generate(lut.begin(), lut.end(), [&]() { return (uint16_t)value(rng); });
+            for (size_t count : sizes)
+            {
+                for (size_t offset = 0; offset < 3 && match; offset++)
+                {
+                    bool inPlace = offset == 1;
+                    vector<uint16_t> source[3], expected[3], actual[3];
+                    const uint16_t* sources[3];
+                    const uint16_t* actualSources[3];
+                    uint16_t* expectedPlanes[3];
+                    uint16_t* actualPlanes[3];
+                    for (size_t i = 0; i < count + 3; i++)
+                    {
+                        uint16_t shared = (uint16_t)value(rng);
+                        for (int channel = 0; channel < 3; channel++)
+                        {
+                            source[channel].resize(count + 3);
+                            switch (i % 6)
+                            {
+                            case 0: source[channel][i] = (uint16_t)(channel == 1 ? 0 : 65535); break;
+                            case 1: source[channel][i] = shared; break; // All three fractions equal
+                            case 2: source[channel][i] = channel == 2 ? (uint16_t)value(rng) : shared; break;
+                            case 3: source[channel][i] = (uint16_t)(65535 * (i % lutSize) / (lutSize - 1)); break; // On the grid
+                            default: source[channel][i] = (uint16_t)value(rng); break;
+                            }
+                        }
+                    }
+                    for (int channel = 0; channel < 3; channel++)
+                    {
+                        actual[channel] = inPlace ? source[channel] : vector<uint16_t>(count + 3, 0xABCD);
+                        expected[channel] = actual[channel];
+                        sources[channel] = source[channel].data() + offset;
+                        expectedPlanes[channel] = expected[channel].data() + offset;
+                        actualPlanes[channel] = actual[channel].data() + offset;
+                        actualSources[channel] = inPlace ? actualPlanes[channel] : sources[channel];
+                    }
+                    PixelKernels::tetrahedral3Scalar(sources, expectedPlanes, lut.data(), lutSize, count);
+                    kernel(actualSources, actualPlanes, lut.data(), lutSize, count);
+                    for (int channel = 0; channel < 3 && match; channel++)
+                    {
+                        if (expected[channel] != actual[channel])
+                        {
+                            cerr << "  " << PixelKernels::getIsaName((PixelKernels::Isa)isa) << ": mismatch in channel " << channel << " for " << count
+                                << " pixels at offset " << offset << " with a " << lutSize << "^3 LUT" << endl;
+                            match = false;
+                        }
+                    }
+                }
+            }
+        }
+        cout << "  " << PixelKernels::getIsaName((PixelKernels::Isa)isa) << ": " << (match ? "bit-exact" : "MISMATCH") << endl;
+        allMatch = allMatch && match;
+    }
+    return allMatch;
+}
+
+/*
+* Same check for the DPX byte swap, in place and into another buffer
+*/
+static bool verifySwapBytesKernels()
+{
+    const size_t sizes[] = { 0, 1, 7, 8, 9, 15, 16, 17, 31, 32, 33, 63, 64, 65, 1000, 4099 };
+    mt19937 rng(6502);
+    bool allMatch = true;
+
+    for (int isa = PixelKernels::SSE41; isa < PixelKernels::ISA_COUNT; isa++)
+    {
+        PixelKernels::SwapBytes16Fn kernel = PixelKernels::getSwapBytes16((PixelKernels::Isa)isa);
+        if (kernel == nullptr || !PixelKernels::isIsaSupported((PixelKernels::Isa)isa))
+        {
+            continue;
+        }
+
+        bool match = true;
+        for (size_t count : sizes)
+        {
+            for (size_t offset = 0; offset < 3 && match; offset++)
+            {
+                vector<uint16_t> source(count + 3);
+                for (uint16_t& value : source)
+                {
+                    value = (uint16_t)rng();
+                }
+                vector<uint16_t> expected(count + 6, 0xABCD), actual(count + 6, 0xABCD);
+                PixelKernels::swapBytes16Scalar(source.data() + offset, expected.data() + offset, count);
+                kernel(source.data() + offset, actual.data() + offset, count);
+                vector<uint16_t> inPlace(source);
+                kernel(inPlace.data() + offset, inPlace.data() + offset, count);
+                if (expected != actual || !equal(inPlace.begin() + offset, inPlace.begin() + offset + count, expected.begin() + offset))
+                {
+                    cerr << "  " << PixelKernels::getIsaName((PixelKernels::Isa)isa) << ": mismatch for " << count << " values at offset " << offset << endl;
+                    match = false;
+                }
+            }
+        }
+        cout << "  " << PixelKernels::getIsaName((PixelKernels::Isa)isa) << ": " << (match ? "bit-exact" : "MISMATCH") << endl;
+        allMatch = allMatch && match;
+    }
+    return allMatch;
+}
+
+/*
+* Same check for splitting packed pixels back into planes
+*/
+static bool verifyDeinterleaveKernels()
+{
+    const size_t sizes[] = { 0, 1, 7, 8, 9, 15, 16, 17, 31, 32, 33, 255, 256, 257, 1000, 4099 };
+    mt19937 rng(8086);
+    bool allMatch = true;
+
+    for (int isa = PixelKernels::SSE41; isa < PixelKernels::ISA_COUNT; isa++)
+    {
+        PixelKernels::Deinterleave3Fn kernel = PixelKernels::getDeinterleave3((PixelKernels::Isa)isa);
+        if (kernel == nullptr || !PixelKernels::isIsaSupported((PixelKernels::Isa)isa))
+        {
+            continue;
+        }
+
+        bool match = true;
+        for (size_t count : sizes)
+        {
+            for (size_t offset = 0; offset < 3 && match; offset++)
+            {
+                vector<uint16_t> rgb(count * 3 + 3);
+                for (uint16_t& value : rgb)
+                {
+                    value = (uint16_t)rng();
+                }
+                // The three planes one after the other with a gap between them
+                vector<uint16_t> expected(count * 3 + 9, 0xABCD), actual(count * 3 + 9, 0xABCD);
+                size_t plane[3] = { offset, count + 3 + offset, count * 2 + 6 + offset };
+                PixelKernels::deinterleave3Scalar(rgb.data() + offset, &expected[plane[0]], &expected[plane[1]], &expected[plane[2]], count);
+                kernel(rgb.data() + offset, &actual[plane[0]], &actual[plane[1]], &actual[plane[2]], count);
+                if (expected != actual)
+                {
+                    cerr << "  " << PixelKernels::getIsaName((PixelKernels::Isa)isa) << ": mismatch for " << count << " pixels at offset " << offset << endl;
+                    match = false;
+                }
+            }
+        }
+        cout << "  " << PixelKernels::getIsaName((PixelKernels::Isa)isa) << ": " << (match ? "bit-exact" : "MISMATCH") << endl;
+        allMatch = allMatch && match;
+    }
+    return allMatch;
+}
+
+/*
+* Same check for the TIFF predictor, over strides of one to four values
+*/
+static bool verifyHorizontalDifferenceKernels()
+{
+    const size_t sizes[] = { 0, 1, 2, 3, 4, 7, 8, 9, 15, 16, 17, 31, 32, 33, 63, 64, 65, 1000, 4099 };
+    mt19937 rng(1978);
+    bool allMatch = true;
+
+    for (int isa = PixelKernels::SSE41; isa < PixelKernels::ISA_COUNT; isa++)
+    {
+        PixelKernels::HorizontalDifference16Fn kernel = PixelKernels::getHorizontalDifference16((PixelKernels::Isa)isa);
+        if (kernel == nullptr || !PixelKernels::isIsaSupported((PixelKernels::Isa)isa))
+        {
+            continue;
+        }
+
+        bool match = true;
+        for (size_t stride = 1; stride <= 4; stride++)
+        {
+            for (size_t count : sizes)
+            {
+                for (size_t offset = 0; offset < 3 && match; offset++)
+                {
+                    vector<uint16_t> source(count + 3);
+                    for (uint16_t& value : source)
+                    {
+                        value = (uint16_t)rng();
+                    }
+                    vector<uint16_t> expected(count + 6, 0xABCD), actual(count + 6, 0xABCD);
+                    PixelKernels::horizontalDifference16Scalar(source.data() + offset, expected.data() + offset, count, stride);
+                    kernel(source.data() + offset, actual.data() + offset, count, stride);
+                    if (expected != actual)
+                    {
+                        cerr << "  " << PixelKernels::getIsaName((PixelKernels::Isa)isa) << ": mismatch for " << count << " values with stride " << stride
+                            << " at offset " << offset << endl;
+                        match = false;
+                    }
+                }
+            }
+        }
+        cout << "  " << PixelKernels::getIsaName((PixelKernels::Isa)isa) << ": " << (match ? "bit-exact" : "MISMATCH") << endl;
+        allMatch = allMatch && match;
+    }
+    return allMatch;
+}
+
+/*
+* Time a kernel over a full frame and return the best of repeat runs in seconds
+*/
+template <typename Kernel>
+static double timeBest(int repeat, Kernel kernel)
+{
+    double best = 1e30;
+    for (int r = 0; r < repeat; r++)
+    {
+        auto start = chrono::steady_clock::now();
+        kernel();
+        chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+        best = min(best, elapsed.count());
+    }
+    return best;
+}
+
+/*
+* The whole merge step of a frame, plain, with dark/flat correction, with the red and
+* blue shifted on top, and all of that spread over a strip pool. The full chain also
+* runs with every stage over the whole frame before the next one starts, which is what
+* the strips save: the output has to be the same, only the trips through memory differ.
+* Making a preview on the way must not change it either.
+*/
+static bool runMergeBenchmark(int width, int height, int repeat, int stripThreads)
+{
+    OIIO::ImageSpec spec(width, height, 1, OIIO::TypeDesc::UINT16);
+    OIIO::ImageBuf red(spec), green(spec), blue(spec), dark(spec);
+    size_t pixels = (size_t)width * height;
+    FlatFieldCalibration calibration;
+    for (OIIO::ImageBuf* image : { &red, &green, &blue, &dark })
+    {
+        uint16_t* data = (uint16_t*)image->localpixels();
+        for (size_t i = 0; i < pixels; i++)
+        {
+            data[i] = image == &dark ? 256 : (uint16_t)(30000 + (i % width) * 4);
+        }
+    }
+    if (!calibration.addDarkFrame(&dark) || !calibration.addFlatFrame(LedController::LED_RED, &red) ||
+        !calibration.addFlatFrame(LedController::LED_GREEN, &green) || !calibration.addFlatFrame(LedController::LED_BLUE, &blue) || !calibration.build())
+    {
+        return false;
+    }
+
+    FrameBufferPool pool(0, 1);
+    StripThreadPool stripPool(stripThreads);
+    ChannelOffsets offsets;
+    offsets.measured = true;
+    offsets.red = { 1.3f, -0.6f, 1.0f, 1 };
+    offsets.blue = { -0.8f, 2.1f, 1.0f, 1 };
+    ProcessingOptions calibrated;
+    calibrated.calibration = &calibration;
+    ProcessingOptions shifted = calibrated;
+    shifted.channelOffsets = &offsets;
+    ProcessingOptions shiftedInStrips = shifted;
+    shiftedInStrips.stripPool = &stripPool;
+    ProcessingOptions wholeFrame = shifted;
+    wholeFrame.stripPixels = pixels;
+    FramePreview preview;
+    ProcessingOptions withPreview = shiftedInStrips;
+    withPreview.preview = &preview;
+    withPreview.previewScale = 4;
+    const pair<const char*, ProcessingOptions> variants[] = { { "merge only", ProcessingOptions() }, { "calibrated", calibrated },
+        { "calibrated, shifted", shifted }, { "shifted, strip pool", shiftedInStrips }, { "shifted, stage by stage", wholeFrame },
+        { "strip pool, 1/4 preview", withPreview } };
+
+    cout << endl << "Merge step, " << width << "x" << height << ", " << PixelKernels::getIsaName(PixelKernels::getActiveIsa())
+        << ", strip pool of " << stripThreads << " + 1 thread(s), best of " << repeat << ":" << endl;
+    streambuf* console = cout.rdbuf();
+    vector<uint16_t> stripOutput;
+    bool sameOutput = true;
+    for (const auto& variant : variants)
+    {
+        StageTimings timings;
+        ProcessingOptions options = variant.second;
+        options.timings = &timings;
+        OIIO::ImageBuf* merged = nullptr;
+        double seconds = timeBest(repeat, [&]() {
+            auto start = chrono::steady_clock::now();
+            pool.release(merged);
+            cout.rdbuf(nullptr); // createProcessedRGBImage reports every frame
+            merged = ImagesProcessor::createProcessedRGBImage(&red, &green, &blue, &pool, options);
+            cout.rdbuf(console);
+            timings.addFrame(chrono::duration<double, milli>(chrono::steady_clock::now() - start).count());
+        });
+        cout << "  " << setw(24) << variant.first << ": " << seconds * 1000.0 << " ms" << endl;
+        if (options.channelOffsets != nullptr)
+        {
+            const uint16_t* output = (const uint16_t*)merged->localpixels();
+            if (stripOutput.empty())
+            {
+                stripOutput.assign(output, output + pixels * 3);
+            }
+            sameOutput = sameOutput && equal(stripOutput.begin(), stripOutput.end(), output);
+        }
+        pool.release(merged);
+        if (options.channelOffsets != nullptr && options.stripPool == nullptr) // With the pool only the threads they ran on differ
+        {
+            timings.printStats();
+            cout << fixed << setprecision(2);
+        }
+    }
+    if (!sameOutput)
+    {
+        cerr << "The merge in strips and stage by stage differ." << endl;
+    }
+    return sameOutput;
+}
+
+static int runKernelBenchmark(const map<string, string>& options)
+{
+    int width = (int)optionOr(options, "width", 6144);
+    int height = (int)optionOr(options, "height", 4096);
+    int repeat = (int)optionOr(options, "repeat", 10);
+    size_t pixels = (size_t)width * height;
+
+    cout << "CPU supports up to " << PixelKernels::getIsaName(PixelKernels::getBestIsa()) << endl;
+    cout << "Verifying channel interleave against the scalar reference:" << endl;
+    bool verified = verifyInterleaveKernels();
+    cout << "Verifying 12 to 16 bit scale against the scalar reference:" << endl;
+    verified = verifyShiftKernels() && verified;
+    cout << "Verifying Mono12p unpack against the unpacked samples:" << endl;
+    verified = verifyUnpackKernels() && verified;
+    cout << "Verifying dark/flat correction against the scalar reference:" << endl;
+    verified = verifyFlatFieldKernels() && verified;
+    cout << "Verifying bilinear shift against the scalar reference:" << endl;
+    verified = verifyBilinearKernels() && verified;
+    cout << "Verifying HDR exposure fusion against the scalar reference:" << endl;
+    verified = verifyFuseExposureKernels() && verified;
+    cout << "Verifying half float interleave against the scalar reference:" << endl;
+    verified = verifyHalfKernels() && verified;
+    cout << "Verifying preview column sums against the scalar reference:" << endl;
+    verified = verifySumColumnsKernels() && verified;
+    cout << "Verifying colour curves against the scalar reference:" << endl;
+    verified = verifyCurvesKernels() && verified;
+    cout << "Verifying 3D LUT lookup against the scalar reference:" << endl;
+    verified = verifyTetrahedralKernels() && verified;
+    cout << "Verifying 16 bit byte swap against the scalar reference:" << endl;
+    verified = verifySwapBytesKernels() && verified;
+    cout << "Verifying channel deinterleave against the scalar reference:" << endl;
+    verified = verifyDeinterleaveKernels() && verified;
+    cout << "Verifying TIFF horizontal predictor against the scalar reference:" << endl;
+    verified = verifyHorizontalDifferenceKernels() && verified;
+    if (!verified)
+    {
+        cerr << "Kernel verification failed." << endl;
+        return EXIT_FAILURE;
+    }
+
+    vector<uint16_t> red(pixels, 1), green(pixels, 2), blue(pixels, 3), rgb(pixels * 3);
+    double bytesMoved = pixels * 3 * sizeof(uint16_t) * 2.0; // read three planes, write one packed
+    cout << endl << "Channel interleave, " << width << "x" << height << ", best of " << repeat << ":" << endl;
+    cout << fixed << setprecision(2);
+    for (int isa = PixelKernels::SCALAR; isa < PixelKernels::ISA_COUNT; isa++)
+    {
+        PixelKernels::Interleave3Fn kernel = PixelKernels::getInterleave3((PixelKernels::Isa)isa);
+        if (kernel == nullptr || !PixelKernels::isIsaSupported((PixelKernels::Isa)isa))
+        {
+            continue;
+        }
+        double seconds = timeBest(repeat, [&]() { kernel(red.data(), green.data(), blue.data(), rgb.data(), pixels); });
+        cout << "  " << setw(8) << PixelKernels::getIsaName((PixelKernels::Isa)isa) << ": " << seconds * 1000.0 << " ms, "
+            << bytesMoved / seconds / 1e9 << " GB/s" << endl;
+    }
+
+    bytesMoved = pixels * sizeof(uint16_t) * 2.0;
+    cout << endl << "12 to 16 bit scale, " << width << "x" << height << ", best of " << repeat << ":" << endl;
+    for (int isa = PixelKernels::SCALAR; isa < PixelKernels::ISA_COUNT; isa++)
+    {
+        PixelKernels::Shift12To16Fn kernel = PixelKernels::getShift12To16((PixelKernels::Isa)isa);
+        if (kernel == nullptr || !PixelKernels::isIsaSupported((PixelKernels::Isa)isa))
+        {
+            continue;
+        }
+        double seconds = timeBest(repeat, [&]() { kernel(red.data(), green.data(), pixels); });
+        cout << "  " << setw(8) << PixelKernels::getIsaName((PixelKernels::Isa)isa) << ": " << seconds * 1000.0 << " ms, "
+            << bytesMoved / seconds / 1e9 << " GB/s" << endl;
+    }
+
+    vector<uint8_t> packed;
+    SyntheticFrameSource::packMono12p(red, packed);
+    bytesMoved = packed.size() + pixels * sizeof(uint16_t);
+    cout << endl << "Mono12p unpack and scale, " << width << "x" << height << ", best of " << repeat << ":" << endl;
+    for (int isa = PixelKernels::SCALAR; isa < PixelKernels::ISA_COUNT; isa++)
+    {
+        PixelKernels::Unpack12pTo16Fn kernel = PixelKernels::getUnpack12pTo16((PixelKernels::Isa)isa);
+        if (kernel == nullptr || !PixelKernels::isIsaSupported((PixelKernels::Isa)isa))
+        {
+            continue;
+        }
+        double seconds = timeBest(repeat, [&]() { kernel(packed.data(), green.data(), pixels); });
+        cout << "  " << setw(8) << PixelKernels::getIsaName((PixelKernels::Isa)isa) << ": " << seconds * 1000.0 << " ms, "
+            << bytesMoved / seconds / 1e9 << " GB/s" << endl;
+    }
+
+    vector<uint16_t> gain(pixels, 1 << PixelKernels::FLAT_FIELD_GAIN_BITS);
+    bytesMoved = pixels * sizeof(uint16_t) * 4.0; // source, offset, gain, destination
+    cout << endl << "Dark/flat correction of one channel, " << width << "x" << height << ", best of " << repeat << ":" << endl;
+    for (int isa = PixelKernels::SCALAR; isa < PixelKernels::ISA_COUNT; isa++)
+    {
+        PixelKernels::FlatFieldFn kernel = PixelKernels::getFlatField((PixelKernels::Isa)isa);
+        if (kernel == nullptr || !PixelKernels::isIsaSupported((PixelKernels::Isa)isa))
+        {
+            continue;
+        }
+        double seconds = timeBest(repeat, [&]() { kernel(red.data(), blue.data(), gain.data(), green.data(), pixels); });
+        cout << "  " << setw(8) << PixelKernels::getIsaName((PixelKernels::Isa)isa) << ": " << seconds * 1000.0 << " ms, "
+            << bytesMoved / seconds / 1e9 << " GB/s" << endl;
+    }
+
+    vector<float> radiance(pixels, 0.5f);
+    bytesMoved = pixels * (sizeof(uint16_t) + sizeof(float) * 2.0); // exposure, radiance read and written
+    cout << endl << "HDR exposure fusion of one channel, " << width << "x" << height << ", best of " << repeat << ":" << endl;
+    for (int isa = PixelKernels::SCALAR; isa < PixelKernels::ISA_COUNT; isa++)
+    {
+        PixelKernels::FuseExposureFn kernel = PixelKernels::getFuseExposure((PixelKernels::Isa)isa);
+        if (kernel == nullptr || !PixelKernels::isIsaSupported((PixelKernels::Isa)isa))
+        {
+            continue;
+        }
+        double seconds = timeBest(repeat, [&]() { kernel(red.data(), radiance.data(), pixels, 1.0f / 65535.0f, false); });
+        cout << "  " << setw(8) << PixelKernels::getIsaName((PixelKernels::Isa)isa) << ": " << seconds * 1000.0 << " ms, "
+            << bytesMoved / seconds / 1e9 << " GB/s" << endl;
+    }
+
+    vector<float> radianceGreen(pixels, 0.25f), radianceBlue(pixels, 0.125f);
+    bytesMoved = pixels * (sizeof(float) * 3 + sizeof(uint16_t) * 3.0);
+    cout << endl << "Half float interleave, " << width << "x" << height << ", best of " << repeat << ":" << endl;
+    for (int isa = PixelKernels::SCALAR; isa < PixelKernels::ISA_COUNT; isa++)
+    {
+        PixelKernels::Interleave3HalfFn kernel = PixelKernels::getInterleave3Half((PixelKernels::Isa)isa);
+        if (kernel == nullptr || !PixelKernels::isIsaSupported((PixelKernels::Isa)isa))
+        {
+            continue;
+        }
+        double seconds = timeBest(repeat, [&]() { kernel(radiance.data(), radianceGreen.data(), radianceBlue.data(), rgb.data(), pixels); });
+        cout << "  " << setw(8) << PixelKernels::getIsaName((PixelKernels::Isa)isa) << ": " << seconds * 1000.0 << " ms, "
+            << bytesMoved / seconds / 1e9 << " GB/s" << endl;
+    }
+
+    vector<uint32_t> sums(width);
+    bytesMoved = pixels * sizeof(uint16_t) + pixels / 4 * sizeof(uint32_t);
+    cout << endl << "Preview column sums of one channel in blocks of 4 rows, " << width << "x" << height << ", best of " << repeat << ":" << endl;
+    for (int isa = PixelKernels::SCALAR; isa < PixelKernels::ISA_COUNT; isa++)
+    {
+        PixelKernels::SumColumnsFn kernel = PixelKernels::getSumColumns((PixelKernels::Isa)isa);
+        if (kernel == nullptr || !PixelKernels::isIsaSupported((PixelKernels::Isa)isa))
+        {
+            continue;
+        }
+        double seconds = timeBest(repeat, [&]() {
+            for (int y = 0; y + 4 <= height; y += 4)
+            {
+                kernel(red.data() + (size_t)y * width, width, 4, sums.data(), width);
+            }
+        });
+        cout << "  " << setw(8) << PixelKernels::getIsaName((PixelKernels::Isa)isa) << ": " << seconds * 1000.0 << " ms, "
+            << bytesMoved / seconds / 1e9 << " GB/s" << endl;
+    }
+
+    vector<uint16_t> curves(3 * PixelKernels::CURVE_ENTRIES + PixelKernels::CURVE_PADDING);
+    for (size_t i = 0; i < curves.size(); i++)
+    {
+        curves[i] = (uint16_t)(65535 - i % PixelKernels::CURVE_ENTRIES);
+    }
+    const uint16_t* planes[3] = { red.data(), green.data(), blue.data() };
+    uint16_t* outputPlanes[3] = { rgb.data(), rgb.data() + pixels, rgb.data() + pixels * 2 };
+    bytesMoved = pixels * 3 * sizeof(uint16_t) * 2.0;
+    cout << endl << "Colour curves of three channels, " << width << "x" << height << ", best of " << repeat << ":" << endl;
+    for (int isa = PixelKernels::SCALAR; isa < PixelKernels::ISA_COUNT; isa++)
+    {
+        PixelKernels::ApplyCurves3Fn kernel = PixelKernels::getApplyCurves3((PixelKernels::Isa)isa);
+        if (kernel == nullptr || !PixelKernels::isIsaSupported((PixelKernels::Isa)isa))
+        {
+            continue;
+        }
+        double seconds = timeBest(repeat, [&]() { kernel(planes, outputPlanes, curves.data(), pixels); });
+        cout << "  " << setw(8) << PixelKernels::getIsaName((PixelKernels::Isa)isa) << ": " << seconds * 1000.0 << " ms, "
+            << bytesMoved / seconds / 1e9 << " GB/s" << endl;
+    }
+
+    // A 33^3 LUT is what grading tools write by default, and random values through it touch
+    // every part of it like a real frame does
+    const int lutSize = 33;
+    vector<uint16_t> lut((size_t)lutSize * lutSize * lutSize * 4);
+    for (size_t i = 0; i < lut.size(); i++)
+    {
+        lut[i] = (uint16_t)(i * 2654435761u >> 16);
+    }
+    for (size_t i = 0; i < pixels; i++)
+    {
+        red[i] = (uint16_t)(i * 7919);
+        green[i] = (uint16_t)(i * 104729);
+        blue[i] = (uint16_t)(i * 1299709);
+    }
+    cout << endl << "3D LUT of " << lutSize << "^3, tetrahedral, " << width << "x" << height << ", best of " << repeat << ":" << endl;
+    for (int isa = PixelKernels::SCALAR; isa < PixelKernels::ISA_COUNT; isa++)
+    {
+        PixelKernels::Tetrahedral3Fn kernel = PixelKernels::getTetrahedral3((PixelKernels::Isa)isa);
+        if (kernel == nullptr || !PixelKernels::isIsaSupported((PixelKernels::Isa)isa))
+        {
+            continue;
+        }
+        double seconds = timeBest(repeat, [&]() { kernel(planes, outputPlanes, lut.data(), lutSize, pixels); });
+        cout << "  " << setw(8) << PixelKernels::getIsaName((PixelKernels::Isa)isa) << ": " << seconds * 1000.0 << " ms, "
+            << bytesMoved / seconds / 1e9 << " GB/s" << endl;
+    }
+
+    vector<uint16_t> swapped(pixels * 3);
+    cout << endl << "16 bit byte swap of packed RGB, " << width << "x" << height << ", best of " << repeat << ":" << endl;
+    for (int isa = PixelKernels::SCALAR; isa < PixelKernels::ISA_COUNT; isa++)
+    {
+        PixelKernels::SwapBytes16Fn kernel = PixelKernels::getSwapBytes16((PixelKernels::Isa)isa);
+        if (kernel == nullptr || !PixelKernels::isIsaSupported((PixelKernels::Isa)isa))
+        {
+            continue;
+        }
+        double seconds = timeBest(repeat, [&]() { kernel(rgb.data(), swapped.data(), pixels * 3); });
+        cout << "  " << setw(8) << PixelKernels::getIsaName((PixelKernels::Isa)isa) << ": " << seconds * 1000.0 << " ms, "
+            << bytesMoved / seconds / 1e9 << " GB/s" << endl;
+    }
+
+    cout << endl << "Channel deinterleave, " << width << "x" << height << ", best of " << repeat << ":" << endl;
+    for (int isa = PixelKernels::SCALAR; isa < PixelKernels::ISA_COUNT; isa++)
+    {
+        PixelKernels::Deinterleave3Fn kernel = PixelKernels::getDeinterleave3((PixelKernels::Isa)isa);
+        if (kernel == nullptr || !PixelKernels::isIsaSupported((PixelKernels::Isa)isa))
+        {
+            continue;
+        }
+        double seconds = timeBest(repeat, [&]() { kernel(rgb.data(), red.data(), green.data(), blue.data(), pixels); });
+        cout << "  " << setw(8) << PixelKernels::getIsaName((PixelKernels::Isa)isa) << ": " << seconds * 1000.0 << " ms, "
+            << bytesMoved / seconds / 1e9 << " GB/s" << endl;
+    }
+
+    cout << endl << "TIFF horizontal predictor of packed RGB, " << width << "x" << height << ", best of " << repeat << ":" << endl;
+    for (int isa = PixelKernels::SCALAR; isa < PixelKernels::ISA_COUNT; isa++)
+    {
+        PixelKernels::HorizontalDifference16Fn kernel = PixelKernels::getHorizontalDifference16((PixelKernels::Isa)isa);
+        if (kernel == nullptr || !PixelKernels::isIsaSupported((PixelKernels::Isa)isa))
+        {
+            continue;
+        }
+        double seconds = timeBest(repeat, [&]() {
+            for (size_t y = 0; y < (size_t)height; y++)
+            {
+                kernel(rgb.data() + y * width * 3, swapped.data() + y * width * 3, (size_t)width * 3, 3);
+            }
+        });
+        cout << "  " << setw(8) << PixelKernels::getIsaName((PixelKernels::Isa)isa) << ": " << seconds * 1000.0 << " ms, "
+            << bytesMoved / seconds / 1e9 << " GB/s" << endl;
+    }
+
+    return runMergeBenchmark(width, height, repeat, (int)optionOr(options, "strip-threads", 3)) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static void printLatencies(const char* label, vector<double>& latenciesMs)
+{
+    sort(latenciesMs.begin(), latenciesMs.end());
+    double sum = 0.0;
+    for (double latency : latenciesMs)
+    {
+        sum += latency;
+    }
+    cout << "  " << label << ": mean " << (latenciesMs.empty() ? 0.0 : sum / latenciesMs.size()) << " ms, p50 " << percentile(latenciesMs, 0.50)
+        << " ms, p95 " << percentile(latenciesMs, 0.95) << " ms, max " << (latenciesMs.empty() ? 0.0 : latenciesMs.back()) << " ms" << endl;
+}
+
+/*
+* Command round trips, pipelined commands, and messages split across reads, all over
+* a pseudo-terminal to the ArduinoEmulator
+*/
+static int runSerialBenchmark(const map<string, string>& options)
+{
+    int count = (int)optionOr(options, "count", 200);
+    double baud = optionOr(options, "baud", 0);
+    double replyMs = optionOr(options, "reply-ms", 0);
+
+    ArduinoEmulator arduino(baud, replyMs);
+    if (!arduino.start())
+    {
+        return EXIT_FAILURE;
+    }
+    bool ok = true;
+    cout << fixed << setprecision(3);
+    cout << "Serial benchmark over " << arduino.getPortName() << ", " << count << " messages, "
+        << (baud > 0 ? to_string((int)baud) + " baud" : string("no wire time")) << ", reply delay " << replyMs << " ms" << endl;
+    {
+        SerialConn connection(115200, arduino.getPortName().c_str());
+
+        // One colour change at a time, like the capture sequencer does
+        const SerialConn::Arduino_Command_Type colours[] = { SerialConn::SET_COLOR_RED, SerialConn::SET_COLOR_GREEN, SerialConn::SET_COLOR_BLUE };
+        const SerialConn::Arduino_Message_Type readies[] = { SerialConn::READY_RED, SerialConn::READY_GREEN, SerialConn::READY_BLUE };
+        vector<double> roundTripsMs;
+        for (int i = 0; i < count; i++)
+        {
+            auto sent = chrono::steady_clock::now();
+            SerialConn::Message reply = connection.sendCommandAsync(colours[i % 3], 0, readies[i % 3], 1000).get();
+            if (reply.type != readies[i % 3])
+            {
+                cerr << "  Round trip " << i << " got no READY reply" << endl;
+                ok = false;
+                break;
+            }
+            roundTripsMs.push_back(chrono::duration<double, milli>(reply.receivedAt - sent).count());
+        }
+        printLatencies("Command round trip", roundTripsMs);
+
+        // Everything sent at once, replies collected as they come
+        vector<future<SerialConn::Message>> replies;
+        auto start = chrono::steady_clock::now();
+        for (int i = 0; i < count; i++)
+        {
+            replies.push_back(connection.sendCommandAsync(SerialConn::GET_FRAME_ID, 0, SerialConn::CURRENT_FRAME_ID, 5000));
+        }
+        int answered = 0;
+        for (future<SerialConn::Message>& reply : replies)
+        {
+            answered += reply.get().type == SerialConn::CURRENT_FRAME_ID ? 1 : 0;
+        }
+        chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+        cout << "  Pipelined:          " << answered << " / " << count << " replies, " << count / elapsed.count() << " commands/s" << endl;
+        ok = ok && answered == count;
+
+        // Unsolicited messages, written in odd sized pieces so frames straddle reads
+        mutex receivedMutex;
+        vector<int> received;
+        vector<double> deliveryMs;
+        connection.setMessageCallback([&](const SerialConn::Message& message) {
+            lock_guard<mutex> lock(receivedMutex);
+            received.push_back(message.value);
+        });
+        string stream;
+        for (int i = 0; i < count; i++)
+        {
+            stream += "noise(STEPPER_POS:" + to_string(i) + ")";
+        }
+        mt19937 rng(777);
+        uniform_int_distribution<size_t> pieceSize(1, 40);
+        for (size_t offset = 0; offset < stream.size();)
+        {
+            size_t piece = min(pieceSize(rng), stream.size() - offset);
+            arduino.send(stream.substr(offset, piece));
+            offset += piece;
+        }
+        auto deadline = chrono::steady_clock::now() + chrono::seconds(5);
+        while (chrono::steady_clock::now() < deadline)
+        {
+            {
+                lock_guard<mutex> lock(receivedMutex);
+                if (received.size() >= (size_t)count)
+                {
+                    break;
+                }
+            }
+            this_thread::sleep_for(chrono::milliseconds(1));
+        }
+        bool inOrder = received.size() == (size_t)count;
+        for (size_t i = 0; inOrder && i < received.size(); i++)
+        {
+            inOrder = received[i] == (int)i;
+        }
+        cout << "  Split messages:     " << received.size() << " / " << count << (inOrder ? " framed correctly" : " MISFRAMED") << endl;
+        ok = ok && inOrder;
+        connection.setMessageCallback(nullptr);
+    }
+    arduino.stop();
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/*
+* Homes an emulated MDrive behind a pseudo-terminal, then scans on the fly past it. Each
+* capture takes --capture-ms, and a writer thread behind the captures takes --write-ms
+* per frame for the first half of the frames and twice that for the rest, so the speed
+* control has to find the rate the writer keeps up with twice. Every trigger is checked
+* against where the emulated motor really was at that moment.
+*/
+static int runMDriveBenchmark(const map<string, string>& options)
+{
+    int frames = (int)optionOr(options, "frames", 40);
+    double baud = optionOr(options, "baud", 9600);
+    double speedError = optionOr(options, "speed-error", 0.01);
+    double captureMs = optionOr(options, "capture-ms", 60);
+    double writeMs = optionOr(options, "write-ms", 200);
+    ContinuousMotionSettings settings;
+    settings.stepsPerFrame = optionOr(options, "steps-per-frame", settings.stepsPerFrame);
+    settings.pollIntervalMs = (int)optionOr(options, "poll-ms", settings.pollIntervalMs);
+    settings.maxFps = optionOr(options, "max-fps", settings.maxFps);
+
+    MDriveEmulator emulator(baud, speedError, 200.0);
+    if (!emulator.start())
+    {
+        return EXIT_FAILURE;
+    }
+    bool ok = true;
+    cout << fixed << setprecision(2);
+    cout << "MDrive benchmark over " << emulator.getPortName() << ", " << (baud > 0 ? to_string((int)baud) + " baud" : string("no wire time"))
+        << ", drive clock " << speedError * 100.0 << "% fast, " << frames << " frames of " << settings.stepsPerFrame << " steps" << endl;
+    {
+        MDriveConn drive(emulator.getPortName(), baud > 0 ? (unsigned int)baud : 115200);
+        auto homingStart = chrono::steady_clock::now();
+        drive.initializeAndHome();
+        cout << "  Homed in " << chrono::duration<double, milli>(chrono::steady_clock::now() - homingStart).count() << " ms" << endl;
+        string reply;
+        bool answered = drive.query("PR PN", reply) && reply == "MDI1PRD23C4-EQ";
+        cout << "  Part number:        " << (answered ? reply : "WRONG") << endl;
+        bool refused = !drive.query("XX 1", reply);
+        cout << "  Unknown command:    " << (refused ? "error prompt" : "ACCEPTED") << endl;
+        ok = answered && refused;
+
+        // A reply that comes after the timeout must not be taken for the next one's
+        emulator.delayNextReply(MDriveConn::DEFAULT_TIMEOUT_MS * 1.5);
+        int64_t polled = -1;
+        bool timedOut = !drive.readPosition(polled);
+        bool moved = drive.query("P 5000", reply);
+        bool inStep = true;
+        for (int i = 0; i < 3 && inStep; i++)
+        {
+            inStep = drive.readPosition(polled) && polled == 5000;
+        }
+        bool reset = drive.query("P 0", reply);
+        cout << "  Late reply:         " << (!timedOut ? "NOT TIMED OUT" : inStep ? "dropped" : "TAKEN FOR THE NEXT ONE") << endl;
+        ok = ok && timedOut && moved && inStep && reset;
+
+        vector<double> pollsMs;
+        for (int i = 0; i < 50 && ok; i++)
+        {
+            int64_t position = 0;
+            auto sent = chrono::steady_clock::now();
+            ok = drive.readPosition(position) && position == 0;
+            pollsMs.push_back(chrono::duration<double, milli>(chrono::steady_clock::now() - sent).count());
+        }
+        printLatencies("Position poll", pollsMs);
+
+        // The writer, frames captured and not written yet wait for it here
+        ContinuousTransport transport(&drive, settings);
+        mutex writerMutex;
+        condition_variable writerWake;
+        deque<int> pending;
+        bool capturing = true;
+        size_t maxBacklog = 0;
+        thread writer([&]() {
+            for (;;)
+            {
+                unique_lock<mutex> lock(writerMutex);
+                writerWake.wait(lock, [&]() { return !pending.empty() || !capturing; });
+                if (pending.empty())
+                {
+                    return;
+                }
+                int frame = pending.front();
+                lock.unlock();
+                this_thread::sleep_for(chrono::duration<double, milli>(frame < frames / 2 ? writeMs : writeMs * 2.0));
+                lock.lock();
+                pending.pop_front();
+                transport.frameFinished();
+            }
+        });
+
+        vector<double> errorsSteps, predictionSteps, speedsFps;
+        auto scanStart = chrono::steady_clock::now();
+        int capturedFrames = 0;
+        if (ok && transport.start())
+        {
+            capturedFrames = transport.run(0, frames, [&](int frame) {
+                double actual = emulator.getPosition();
+                int64_t predicted = 0;
+                transport.getPosition(predicted);
+                errorsSteps.push_back(actual - (settings.firstFrameSteps + frame * settings.stepsPerFrame));
+                predictionSteps.push_back(predicted - actual);
+                speedsFps.push_back(transport.getSpeedFps());
+                this_thread::sleep_for(chrono::duration<double, milli>(captureMs));
+                {
+                    lock_guard<mutex> lock(writerMutex);
+                    pending.push_back(frame);
+                    maxBacklog = max(maxBacklog, pending.size());
+                }
+                writerWake.notify_one();
+                return true;
+            });
+        }
+        chrono::duration<double> scanTime = chrono::steady_clock::now() - scanStart;
+        transport.stop();
+        double stoppedVelocity = emulator.getVelocity();
+        {
+            lock_guard<mutex> lock(writerMutex);
+            capturing = false;
+        }
+        writerWake.notify_one();
+        writer.join();
+
+        transport.printStats();
+        cout << setprecision(1);
+        cout << "  Frames captured:    " << capturedFrames << " / " << frames << " in " << scanTime.count() << " s, " << transport.getMissedFrames()
+            << " missed, writer backlog max " << maxBacklog << endl;
+        if (!errorsSteps.empty())
+        {
+            vector<double> errors, predictions;
+            for (size_t i = 0; i < errorsSteps.size(); i++)
+            {
+                errors.push_back(fabs(errorsSteps[i]));
+                predictions.push_back(fabs(predictionSteps[i]));
+            }
+            sort(errors.begin(), errors.end());
+            sort(predictions.begin(), predictions.end());
+            cout << "  Trigger error:      p50 " << percentile(errors, 0.50) << " p95 " << percentile(errors, 0.95) << " max " << errors.back()
+                << " steps (" << errors.back() / settings.stepsPerFrame * 100.0 << "% of a frame)" << endl;
+            cout << "  Position estimate:  p50 " << percentile(predictions, 0.50) << " p95 " << percentile(predictions, 0.95) << " max "
+                << predictions.back() << " steps off the motor" << endl;
+            for (int half = 0; half < 2; half++)
+            {
+                int last = half == 0 ? frames / 2 - 1 : (int)speedsFps.size() - 1;
+                if (last >= 0 && last < (int)speedsFps.size())
+                {
+                    cout << "  Speed at frame " << setw(3) << last << ":  " << speedsFps[last] << " frames/s, the writer keeps up with "
+                        << 1000.0 / (half == 0 ? writeMs : writeMs * 2.0) << endl;
+                }
+            }
+        }
+        cout << "  Stopped:            " << (stoppedVelocity == 0.0 ? "yes" : "STILL MOVING") << endl;
+        ok = ok && capturedFrames == frames && stoppedVelocity == 0.0;
+    }
+    emulator.stop();
+    cout << defaultfloat;
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/*
+* Smooth random texture that can be sampled anywhere, so a channel can be rendered
+* shifted by any fraction of a pixel without interpolating an image. A few octaves of
+* value noise, from blotches down to grain sized detail, in the 12 bit range.
+*/
+class NoiseTexture
+{
+    public:
+        NoiseTexture(unsigned int seed) : lattice(LATTICE_SIZE * LATTICE_SIZE)
+        {
+            mt19937 rng(seed);
+            uniform_real_distribution<float> value(-1.0f, 1.0f);
+            for (float& point : lattice)
+            {
+                point = value(rng);
+            }
+        }
+
+        float sample(double x, double y) const
+        {
+            const double cellSizes[] = { 96.0, 24.0, 6.0 };
+            const float amplitudes[] = { 900.0f, 500.0f, 250.0f };
+            float total = 2048.0f;
+            for (int octave = 0; octave < 3; octave++)
+            {
+                total += amplitudes[octave] * valueNoise(x / cellSizes[octave] + octave * 17.0, y / cellSizes[octave] + octave * 31.0);
+            }
+            return total;
+        }
+
+    private:
+        static const int LATTICE_SIZE = 1024;
+        vector<float> lattice;
+
+        float at(int x, int y) const
+        {
+            return lattice[(size_t)(y & (LATTICE_SIZE - 1)) * LATTICE_SIZE + (x & (LATTICE_SIZE - 1))];
+        }
+
+        float valueNoise(double x, double y) const
+        {
+            int cellX = (int)floor(x), cellY = (int)floor(y);
+            double fx = x - cellX, fy = y - cellY;
+            fx = fx * fx * (3.0 - 2.0 * fx);
+            fy = fy * fy * (3.0 - 2.0 * fy);
+            double top = at(cellX, cellY) + (at(cellX + 1, cellY) - at(cellX, cellY)) * fx;
+            double bottom = at(cellX, cellY + 1) + (at(cellX + 1, cellY + 1) - at(cellX, cellY + 1)) * fx;
+            return (float)(top + (bottom - top) * fy);
+        }
+};
+
+/*
+* Render the texture into a mono16 channel moved by (dx, dy), with a little grain that
+* differs between exposures, scaled like captureImageAsBuffer does
+*/
+static void renderChannel(const NoiseTexture& texture, OIIO::ImageBuf& image, double dx, double dy, mt19937& rng)
+{
+    int width = image.spec().width;
+    int height = image.spec().height;
+    uint16_t* pixels = (uint16_t*)image.localpixels();
+    normal_distribution<float> grain(0.0f, 12.0f);
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            float value = texture.sample(x - dx, y - dy) + grain(rng);
+            pixels[(size_t)y * width + x] = (uint16_t)((int)std::clamp(value, 0.0f, 4095.0f) << 4);
+        }
+    }
+}
+
+/*
+* RMS difference between one channel of the merged RGB and the green channel, away from
+* the edges where a shifted channel repeats its border
+*/
+static double channelMismatch(const uint16_t* rgb, int channel, int width, int height, int margin)
+{
+    double sum = 0.0;
+    size_t count = 0;
+    for (int y = margin; y < height - margin; y++)
+    {
+        for (int x = margin; x < width - margin; x++)
+        {
+            const uint16_t* pixel = rgb + ((size_t)y * width + x) * 3;
+            double difference = (double)pixel[channel] - pixel[1];
+            sum += difference * difference;
+            count++;
+        }
+    }
+    return count > 0 ? sqrt(sum / count) : 0.0;
+}
+
+static int runRegistrationBenchmark(const map<string, string>& options)
+{
+    int frames = (int)optionOr(options, "frames", 5);
+    int width = (int)optionOr(options, "width", 4096);
+    int height = (int)optionOr(options, "height", 3000);
+    double maxShift = optionOr(options, "max-shift", 4.0);
+    int stripThreads = (int)optionOr(options, "strip-threads", 0);
+
+    OIIO::ImageSpec spec(width, height, 1, OIIO::TypeDesc::UINT16);
+    OIIO::ImageBuf red(spec), green(spec), blue(spec);
+    FrameBufferPool pool(0, 1);
+    StripThreadPool stripPool(stripThreads);
+    ChannelRegistration registration;
+    mt19937 rng(2468);
+    uniform_real_distribution<double> shift(-maxShift, maxShift);
+    int margin = (int)ceil(maxShift) + 2;
+
+    cout << "Registration benchmark, " << frames << " frame(s) of " << width << "x" << height << ", shifts up to " << maxShift
+        << " px, strip pool of " << stripThreads << " + 1 thread(s)" << endl;
+    cout << fixed << setprecision(3);
+    double worstError = 0.0;
+    vector<double> measureMs, plainMergeMs, shiftedMergeMs;
+    streambuf* console = cout.rdbuf();
+    for (int frame = 0; frame < frames; frame++)
+    {
+        NoiseTexture texture(1000 + frame);
+        double redDx = shift(rng), redDy = shift(rng), blueDx = shift(rng), blueDy = shift(rng);
+        renderChannel(texture, red, redDx, redDy, rng);
+        renderChannel(texture, green, 0.0, 0.0, rng);
+        renderChannel(texture, blue, blueDx, blueDy, rng);
+
+        auto start = chrono::steady_clock::now();
+        ChannelOffsets offsets = registration.measure(&red, &green, &blue, &stripPool);
+        measureMs.push_back(chrono::duration<double, milli>(chrono::steady_clock::now() - start).count());
+
+        double error = max(max(fabs(offsets.red.dx - redDx), fabs(offsets.red.dy - redDy)), max(fabs(offsets.blue.dx - blueDx), fabs(offsets.blue.dy - blueDy)));
+        worstError = offsets.measured ? max(worstError, error) : 1e30;
+        cout << "  Frame " << frame << ": red " << redDx << ", " << redDy << " measured " << offsets.red.dx << ", " << offsets.red.dy
+            << " (" << offsets.red.windowsUsed << " windows); blue " << blueDx << ", " << blueDy << " measured " << offsets.blue.dx << ", " << offsets.blue.dy
+            << " (" << offsets.blue.windowsUsed << " windows)" << endl;
+
+        ProcessingOptions plain;
+        plain.stripPool = &stripPool;
+        ProcessingOptions shifted = plain;
+        shifted.channelOffsets = &offsets;
+        double mismatch[2][2];
+        for (int registered = 0; registered < 2; registered++)
+        {
+            start = chrono::steady_clock::now();
+            cout.rdbuf(nullptr); // createProcessedRGBImage reports every frame
+            OIIO::ImageBuf* merged = ImagesProcessor::createProcessedRGBImage(&red, &green, &blue, &pool, registered ? shifted : plain);
+            cout.rdbuf(console);
+            (registered ? shiftedMergeMs : plainMergeMs).push_back(chrono::duration<double, milli>(chrono::steady_clock::now() - start).count());
+            mismatch[registered][0] = channelMismatch((const uint16_t*)merged->localpixels(), 0, width, height, margin);
+            mismatch[registered][1] = channelMismatch((const uint16_t*)merged->localpixels(), 2, width, height, margin);
+            pool.release(merged);
+        }
+        cout << "    RMS difference to green: red " << mismatch[0][0] << " -> " << mismatch[1][0] << ", blue " << mismatch[0][1] << " -> " << mismatch[1][1] << endl;
+    }
+
+    auto mean = [](const vector<double>& values) {
+        double sum = 0.0;
+        for (double value : values)
+        {
+            sum += value;
+        }
+        return values.empty() ? 0.0 : sum / values.size();
+    };
+    cout << "  Worst shift error:  " << worstError << " px" << endl;
+    cout << "  Measure:            " << mean(measureMs) << " ms/frame" << endl;
+    cout << "  Merge:              " << mean(plainMergeMs) << " ms/frame, " << mean(shiftedMergeMs) << " ms/frame with the shift" << endl;
+    return worstError < 0.25 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/*
+* Film moved by (dx, dy): the texture, darkened like an exposed frame, with clear
+* sprocket holes down the left edge. The hole edges are anti-aliased by how much of
+* each pixel they cover, so sub-pixel offsets show up in the image.
+*/
+static void renderPerforatedFrame(const NoiseTexture& texture, OIIO::ImageBuf& image, double dx, double dy, mt19937& rng)
+{
+    int width = image.spec().width;
+    int height = image.spec().height;
+    uint16_t* pixels = (uint16_t*)image.localpixels();
+    normal_distribution<float> grain(0.0f, 12.0f);
+    double holeLeft = width * 0.01, holeRight = width * 0.05;
+    double holeLength = height * 0.04, pitch = height * 0.125;
+    auto overlap = [](double first, double last, double pixel) { return max(0.0, min(last, pixel + 0.5) - max(first, pixel - 0.5)); };
+    for (int y = 0; y < height; y++)
+    {
+        // Holes are centred at k * pitch along the film
+        double filmY = y - dy;
+        double nearest = floor(filmY / pitch + 0.5) * pitch;
+        double along = overlap(nearest - holeLength / 2, nearest + holeLength / 2, filmY);
+        for (int x = 0; x < width; x++)
+        {
+            double coverage = x < holeRight + dx + 1.0 ? along * overlap(holeLeft + dx, holeRight + dx, x) : 0.0;
+            float film = texture.sample(x - dx, y - dy) * 0.6f + grain(rng);
+            float value = (float)(film * (1.0 - coverage) + 4000.0 * coverage);
+            pixels[(size_t)y * width + x] = (uint16_t)((int)std::clamp(value, 0.0f, 4095.0f) << 4);
+        }
+    }
+}
+
+/*
+* RMS difference between the green of the merged RGB and a mono frame, inside margin
+*/
+static double greenMismatch(const uint16_t* rgb, const uint16_t* reference, int width, int height, int margin)
+{
+    double sum = 0.0;
+    size_t count = 0;
+    for (int y = margin; y < height - margin; y++)
+    {
+        for (int x = margin; x < width - margin; x++)
+        {
+            double difference = (double)rgb[((size_t)y * width + x) * 3 + 1] - reference[(size_t)y * width + x];
+            sum += difference * difference;
+            count++;
+        }
+    }
+    return count > 0 ? sqrt(sum / count) : 0.0;
+}
+
+static int runStabilizationBenchmark(const map<string, string>& options)
+{
+    int frames = (int)optionOr(options, "frames", 5);
+    int width = (int)optionOr(options, "width", 4096);
+    int height = (int)optionOr(options, "height", 3000);
+    double maxShift = optionOr(options, "max-shift", 20.0);
+    int stripThreads = (int)optionOr(options, "strip-threads", 0);
+
+    OIIO::ImageSpec spec(width, height, 1, OIIO::TypeDesc::UINT16);
+    OIIO::ImageBuf first(spec), green(spec);
+    FrameBufferPool pool(0, 1);
+    StripThreadPool stripPool(stripThreads);
+    FrameStabilizer stabilizer(PERFORATION_LEFT);
+    NoiseTexture texture(777);
+    mt19937 rng(1357);
+    uniform_real_distribution<double> shift(-maxShift, maxShift);
+    int margin = (int)ceil(2 * maxShift) + 2;
+
+    cout << "Stabilization benchmark, " << frames << " frame(s) of " << width << "x" << height << ", frames moved up to " << maxShift
+        << " px, strip pool of " << stripThreads << " + 1 thread(s)" << endl;
+    cout << fixed << setprecision(3);
+    double worstError = 0.0, firstDx = 0.0, firstDy = 0.0;
+    vector<double> measureMs, mergeMs;
+    streambuf* console = cout.rdbuf();
+    for (int frame = 0; frame < frames; frame++)
+    {
+        double dx = frame == 0 ? 0.0 : shift(rng), dy = frame == 0 ? 0.0 : shift(rng);
+        OIIO::ImageBuf& target = frame == 0 ? first : green;
+        renderPerforatedFrame(texture, target, dx, dy, rng);
+
+        auto start = chrono::steady_clock::now();
+        cout.rdbuf(nullptr); // The first frame reports the reference
+        FrameStabilizer::Result result = stabilizer.measure(&target);
+        cout.rdbuf(console);
+        measureMs.push_back(chrono::duration<double, milli>(chrono::steady_clock::now() - start).count());
+        if (frame == 0)
+        {
+            firstDx = dx;
+            firstDy = dy;
+            cout << "  Reference hole at " << result.hole.x << ", " << result.hole.y << (result.hole.found ? "" : " (not found)") << endl;
+            if (!result.hole.found)
+            {
+                return EXIT_FAILURE;
+            }
+            continue;
+        }
+
+        double error = result.hole.found ? max(fabs(result.correction.dx - (dx - firstDx)), fabs(result.correction.dy - (dy - firstDy))) : 1e30;
+        worstError = max(worstError, error);
+
+        ProcessingOptions plain;
+        plain.stripPool = &stripPool;
+        ProcessingOptions translated = plain;
+        translated.frameShift = &result.correction;
+        double mismatch[2];
+        for (int pass = 0; pass < 2; pass++)
+        {
+            start = chrono::steady_clock::now();
+            cout.rdbuf(nullptr);
+            OIIO::ImageBuf* merged = ImagesProcessor::createProcessedRGBImage(&green, &green, &green, &pool, pass ? translated : plain);
+            cout.rdbuf(console);
+            if (pass)
+            {
+                mergeMs.push_back(chrono::duration<double, milli>(chrono::steady_clock::now() - start).count());
+            }
+            mismatch[pass] = greenMismatch((const uint16_t*)merged->localpixels(), (const uint16_t*)first.localpixels(), width, height, margin);
+            pool.release(merged);
+        }
+        cout << "  Frame " << frame << ": moved " << dx << ", " << dy << " measured " << result.correction.dx << ", " << result.correction.dy
+            << "; RMS difference to the first frame " << mismatch[0] << " -> " << mismatch[1] << endl;
+    }
+
+    auto mean = [](const vector<double>& values) {
+        double sum = 0.0;
+        for (double value : values)
+        {
+            sum += value;
+        }
+        return values.empty() ? 0.0 : sum / values.size();
+    };
+    cout << "  Worst offset error: " << worstError << " px" << endl;
+    cout << "  Measure:            " << mean(measureMs) << " ms/frame" << endl;
+    cout << "  Translated merge:   " << mean(mergeMs) << " ms/frame" << endl;
+    return worstError < 0.25 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/*
+* Scene radiance for the HDR mode, 1.0 at full scale of the shortest exposure and down
+* to 1/1024 in the densest parts, so one 12 bit exposure loses the shadows in noise
+*/
+static float sceneRadiance(const NoiseTexture& texture, int x, int y)
+{
+    float t = std::clamp((texture.sample(x, y) - 400.0f) / 3300.0f, 0.0f, 1.0f);
+    return exp2f(-10.0f * t);
+}
+
+static int runHdrBenchmark(const map<string, string>& options)
+{
+    int width = (int)optionOr(options, "width", 4096);
+    int height = (int)optionOr(options, "height", 3000);
+    int exposures = max(2, (int)optionOr(options, "exposures", 3));
+    double stops = optionOr(options, "stops", 2.0);
+    int stripThreads = (int)optionOr(options, "strip-threads", 0);
+    size_t pixels = (size_t)width * height;
+
+    OIIO::ImageSpec spec(width, height, 1, OIIO::TypeDesc::UINT16);
+    OIIO::ImageBuf exposure(spec);
+    OIIO::ImageBuf fused(HdrFusion::radianceSpec(spec)), single(HdrFusion::radianceSpec(spec));
+    FrameBufferPool pool(0, 1);
+    StripThreadPool stripPool(stripThreads);
+    NoiseTexture texture(4242);
+    mt19937 rng(9753);
+    normal_distribution<float> noise(0.0f, 1.0f);
+    const float readNoise = 2.0f, electronsPerCount = 4.0f;
+
+    vector<float> scene(pixels);
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            scene[(size_t)y * width + x] = sceneRadiance(texture, x, y);
+        }
+    }
+
+    cout << "HDR benchmark, " << exposures << " exposures " << stops << " stops apart, " << width << "x" << height
+        << ", strip pool of " << stripThreads << " + 1 thread(s)" << endl;
+    cout << fixed << setprecision(3);
+    vector<double> exposureMs = HdrFusion::bracketExposures(1.0, exposures, stops);
+    vector<double> foldMs;
+    for (int i = 0; i < exposures; i++)
+    {
+        // Shot noise from the electrons collected, read noise on top, clipped like the ADC
+        uint16_t* counts = (uint16_t*)exposure.localpixels();
+        for (size_t p = 0; p < pixels; p++)
+        {
+            float signal = scene[p] * (float)exposureMs[i] * 4095.0f;
+            float value = signal + noise(rng) * sqrtf(signal / electronsPerCount + readNoise * readNoise);
+            counts[p] = (uint16_t)((int)std::clamp(value + 0.5f, 0.0f, 4095.0f) << 4);
+        }
+
+        auto start = chrono::steady_clock::now();
+        if (!HdrFusion::fold(&fused, &exposure, exposureMs[i], i == 0, nullptr, LedController::LED_GREEN, &stripPool))
+        {
+            return EXIT_FAILURE;
+        }
+        foldMs.push_back(chrono::duration<double, milli>(chrono::steady_clock::now() - start).count());
+        if (i == 0)
+        {
+            HdrFusion::fold(&single, &exposure, 1.0, true, nullptr, LedController::LED_GREEN, nullptr);
+        }
+    }
+
+    // RMS relative error in the shadows, the mid tones and the highlights
+    const float* fusedPixels = (const float*)fused.localpixels();
+    const float* singlePixels = (const float*)single.localpixels();
+    const char* zoneNames[] = { "shadows (below 1/64)", "mid tones", "highlights (above 1/4)" };
+    double sums[2][3] = {}, counts[3] = {};
+    bool finite = true;
+    for (size_t p = 0; p < pixels; p++)
+    {
+        int zone = scene[p] < 1.0f / 64.0f ? 0 : scene[p] < 0.25f ? 1 : 2;
+        double fusedError = (fusedPixels[p] - scene[p]) / scene[p];
+        double singleError = (singlePixels[p] - scene[p]) / scene[p];
+        sums[0][zone] += singleError * singleError;
+        sums[1][zone] += fusedError * fusedError;
+        counts[zone]++;
+        finite = finite && isfinite(fusedPixels[p]);
+    }
+    double rms[2][3];
+    for (int zone = 0; zone < 3; zone++)
+    {
+        rms[0][zone] = counts[zone] > 0 ? sqrt(sums[0][zone] / counts[zone]) : 0.0;
+        rms[1][zone] = counts[zone] > 0 ? sqrt(sums[1][zone] / counts[zone]) : 0.0;
+        cout << "  " << setw(24) << zoneNames[zone] << ": RMS relative error " << rms[0][zone] << " single exposure, " << rms[1][zone]
+            << " fused (" << (size_t)counts[zone] << " pixels)" << endl;
+    }
+
+    // The merge into half floats, as the worker does it
+    ProcessingOptions processing;
+    processing.stripPool = &stripPool;
+    streambuf* console = cout.rdbuf();
+    auto start = chrono::steady_clock::now();
+    cout.rdbuf(nullptr); // createProcessedRGBImage reports every frame
+    OIIO::ImageBuf* merged = ImagesProcessor::createProcessedRGBImage(&fused, &fused, &fused, &pool, processing);
+    cout.rdbuf(console);
+    double mergeMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    bool halfOutput = merged != nullptr && merged->spec().format == OIIO::TypeDesc::HALF;
+    pool.release(merged);
+
+    double sumFoldMs = 0.0;
+    for (double ms : foldMs)
+    {
+        sumFoldMs += ms;
+    }
+    double megabyte = 1024.0 * 1024.0;
+    cout << "  Fold:               " << sumFoldMs / foldMs.size() << " ms/exposure" << endl;
+    cout << "  Half float merge:   " << mergeMs << " ms/frame" << (halfOutput ? "" : " (NOT half floats)") << endl;
+    cout << "  Memory per colour:  " << pixels * (sizeof(float) + 2 * sizeof(uint16_t)) / megabyte << " MB folding as the bracket comes in, "
+        << pixels * (sizeof(float) + exposures * sizeof(uint16_t)) / megabyte << " MB holding the whole bracket" << endl;
+    if (!finite)
+    {
+        cerr << "Fused radiance is not finite everywhere." << endl;
+    }
+    return finite && halfOutput && rms[1][0] < rms[0][0] ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static bool sameFile(const filesystem::path& a, const filesystem::path& b)
+{
+    ifstream first(a, ios::binary), second(b, ios::binary);
+    istreambuf_iterator<char> end;
+    return first.is_open() && second.is_open() && vector<char>(istreambuf_iterator<char>(first), end) == vector<char>(istreambuf_iterator<char>(second), end);
+}
+
+/*
+* Scan with the journal on, then reprocess part of the reel from the journal alone and
+* compare what comes out with what the scan wrote
+*/
+static int runReprocessBenchmark(const map<string, string>& options)
+{
+    int frames = (int)optionOr(options, "frames", 20);
+    int first = (int)optionOr(options, "first", frames / 4);
+    int last = (int)optionOr(options, "last", frames - 1 - frames / 4);
+    int exposures = max(1, (int)optionOr(options, "hdr", 1));
+    string outputDirectory = options.count("output") ? options.at("output") : "bench_img/";
+    if (outputDirectory.back() != '/' && outputDirectory.back() != '\\')
+    {
+        outputDirectory += "/";
+    }
+    string scanDirectory = outputDirectory + "scan/";
+    string reprocessDirectory = outputDirectory + "reprocessed/";
+    filesystem::remove_all(scanDirectory);
+    filesystem::remove_all(reprocessDirectory);
+
+    map<string, string> scanOptions = options;
+    scanOptions["output"] = scanDirectory;
+    scanOptions["frames"] = to_string(frames);
+    scanOptions["journal"] = "2";
+    if (exposures > 1)
+    {
+        scanOptions["hdr"] = to_string(exposures);
+        scanOptions.emplace("led-ms", "0.1"); // Brackets need a triggered source with known exposure times
+    }
+    scanOptions.erase("workers");
+    if (runPipelineBenchmark(scanOptions) != EXIT_SUCCESS)
+    {
+        return EXIT_FAILURE;
+    }
+
+    cout << defaultfloat << endl;
+    ReprocessOptions reprocess;
+    reprocess.journalDirectory = scanDirectory;
+    reprocess.captureId = "BENCH";
+    reprocess.outputDirectory = reprocessDirectory;
+    reprocess.firstImageId = first;
+    reprocess.lastImageId = last;
+    reprocess.settings.workerCount = (int)optionOr(options, "workers", 0);
+    reprocess.settings.processingThreads = (int)optionOr(options, "strip-threads", 0);
+    Reprocessor::Result result;
+    if (!Reprocessor::run(reprocess, &result))
+    {
+        return EXIT_FAILURE;
+    }
+
+    int expected = max(0, min(last, frames - 1) - max(first, 0) + 1);
+    int matching = 0, different = 0, outside = 0;
+    for (const auto& entry : filesystem::directory_iterator(reprocessDirectory))
+    {
+        string name = entry.path().filename().string();
+        if (entry.path().extension() != ".tiff")
+        {
+            continue; // Sidecar logs
+        }
+        size_t underscore = name.rfind('_');
+        int imageId = underscore == string::npos ? -1 : atoi(name.c_str() + underscore + 1);
+        if (imageId < first || imageId > last)
+        {
+            cerr << "  " << name << " is outside the range" << endl;
+            outside++;
+        }
+        else if (sameFile(entry.path(), scanDirectory + name))
+        {
+            matching++;
+        }
+        else
+        {
+            cerr << "  " << name << " differs from the scan" << endl;
+            different++;
+        }
+    }
+    cout << endl << "Reprocess benchmark: images " << first << " to " << last << " of " << frames << " (" << 3 * exposures << " exposures each)" << endl;
+    cout << fixed << setprecision(2);
+    cout << "  Frames written:   " << result.framesWritten << " / " << expected << endl;
+    cout << "  Same as the scan: " << matching << ", different " << different << ", outside the range " << outside << endl;
+    cout << "  Throughput:       " << result.framesWritten / max(result.seconds, 1e-9) << " frames/s, "
+        << result.bytesRead / (1024.0 * 1024.0) / max(result.seconds, 1e-9) << " MB/s read" << endl;
+    cout << defaultfloat;
+    return matching == expected && different == 0 && outside == 0 && result.framesSkipped == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/*
+* One run of the session benchmark: capture until the reel's frameCount frames are done,
+* resuming whatever an earlier run left. Returns the image IDs that were written.
+*/
+static vector<int> runSession(const string& directory, int frameCount, int width, int height, int workers, bool inOrder, int& resumedAt)
+{
+    CaptureSettings settings;
+    settings.workerCount = workers;
+    settings.commitInOrder = inOrder;
+    settings.sessionManifest = true;
+    settings.journalMode = JOURNAL_AND_PROCESS;
+    settings.journalSegmentBytes = 8 << 20; // A few records each, so the reel spans segments
+    mutex writtenMutex;
+    vector<int> written;
+    {
+        ImageCaptureController controller("BENCH", new SyntheticFrameSource(width, height, 0.0, 0.0, 1, RawFrame::MONO12), settings);
+        controller.setOutputDirectory(directory);
+        int frame = 0;
+        controller.setMotorPositionSource([&frame](int64_t& position) {
+            position = (int64_t)frame * 4000; // Steps per frame of a 35mm pull-down
+            return true;
+        });
+        controller.setFrameFinishedCallback([&](RGBImage* image, bool saved) {
+            if (!saved)
+            {
+                return;
+            }
+            lock_guard<mutex> lock(writtenMutex);
+            written.push_back(image->getImageId());
+        });
+        resumedAt = controller.resumeSession();
+        for (frame = resumedAt; frame < frameCount; frame++)
+        {
+            controller.captureFrame();
+        }
+    }
+    sort(written.begin(), written.end());
+    return written;
+}
+
+/*
+* The image ID of every record in the session's journal, in order, and the payload of the
+* first one. False if the journal is damaged.
+*/
+static bool readSessionJournal(const string& directory, vector<int>& imageIds, vector<unsigned char>& firstPayload)
+{
+    JournalReader reader(directory, "BENCH");
+    JournalRecordHeader header;
+    vector<unsigned char> payload;
+    imageIds.clear();
+    while (reader.next(header, payload))
+    {
+        if (imageIds.empty())
+        {
+            firstPayload = payload;
+        }
+        imageIds.push_back(header.imageId);
+    }
+    return !reader.isDamaged();
+}
+
+/*
+* Scan a short reel with the session manifest, then damage it the way a crash would: a
+* frame's file gone, one cut short, the last batch of the manifest never synced and a
+* line cut in half, and the journal cut off halfway through the last frame. Resuming has
+* to take exactly those frames again, after the journal the crashed run left.
+*/
+static int runSessionBenchmark(const map<string, string>& options)
+{
+    int frames = max(8, (int)optionOr(options, "frames", 12));
+    int width = (int)optionOr(options, "width", 1024);
+    int height = (int)optionOr(options, "height", 768);
+    int workers = (int)optionOr(options, "workers", 2);
+    bool inOrder = optionOr(options, "in-order", 0) != 0;
+    string outputDirectory = options.count("output") ? options.at("output") : "bench_img/";
+    if (outputDirectory.back() != '/' && outputDirectory.back() != '\\')
+    {
+        outputDirectory += "/";
+    }
+    string directory = outputDirectory + "session/";
+    filesystem::remove_all(directory);
+    filesystem::create_directories(directory);
+    auto imagePath = [&directory](int imageId) { return directory + "imageBENCH_" + to_string(imageId) + ".tiff"; };
+
+    int resumedAt = 0;
+    auto start = chrono::steady_clock::now();
+    vector<int> firstRun = runSession(directory, frames, width, height, workers, inOrder, resumedAt);
+    double firstSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    if ((int)firstRun.size() != frames)
+    {
+        cerr << "First run wrote " << firstRun.size() << " of " << frames << " frames" << endl;
+        return EXIT_FAILURE;
+    }
+
+    // The crash
+    vector<int> expected = { 2, 5, frames - 2, frames - 1 };
+    filesystem::remove(imagePath(2));
+    filesystem::resize_file(imagePath(5), filesystem::file_size(imagePath(5)) / 2);
+    string manifestPath = SessionManifest::pathFor(directory, "BENCH");
+    vector<int> journaledFirst;
+    vector<unsigned char> firstPayload;
+    readSessionJournal(directory, journaledFirst, firstPayload);
+    // The last frame's second exposure half written, and nothing after it
+    int cutSegment = 0;
+    uint64_t cutAt = 0;
+    {
+        JournalReader reader(directory, "BENCH");
+        JournalRecordHeader header;
+        while (reader.getRecordCount() < (uint64_t)frames * 3 - 2 && reader.skip(header))
+        {
+        }
+        reader.peek(header); // Moves to the segment the record is in
+        cutSegment = reader.getSegmentIndex();
+        cutAt = reader.getOffset() + header.recordBytes / 2;
+    }
+    for (int later = cutSegment + 1; filesystem::exists(CaptureJournal::segmentPath(directory, "BENCH", later)); later++)
+    {
+        filesystem::remove(CaptureJournal::segmentPath(directory, "BENCH", later));
+    }
+    filesystem::resize_file(CaptureJournal::segmentPath(directory, "BENCH", cutSegment), cutAt);
+    vector<string> lines;
+    {
+        ifstream in(manifestPath);
+        string line;
+        while (getline(in, line))
+        {
+            if (line.rfind("written," + to_string(frames - 2) + ",", 0) != 0 && line.rfind("written," + to_string(frames - 1) + ",", 0) != 0)
+            {
+                lines.push_back(line);
+            }
+        }
+    }
+    {
+        ofstream out(manifestPath, ios::trunc);
+        for (const string& line : lines)
+        {
+            out << line << "\n";
+        }
+        out << "written," << frames - 1 << ",12"; // Cut off mid-line
+    }
+
+    cout << endl;
+    start = chrono::steady_clock::now();
+    vector<int> retaken = runSession(directory, frames, width, height, workers, inOrder, resumedAt);
+    double resumeSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    SessionManifest check(manifestPath);
+    bool allVerified = check.open() && check.getVerifiedCount() == frames && check.getResumeImageId() == frames;
+    int64_t position = 0;
+    bool positionKept = check.getMotorPosition(frames - 1, position) && position == (int64_t)(frames - 1) * 4000;
+    check.close();
+
+    // The crashed run's whole frames, then the frames taken again, three colours each
+    vector<int> expectedJournal;
+    for (int id = 0; id < frames - 1; id++)
+    {
+        expectedJournal.insert(expectedJournal.end(), 3, id);
+    }
+    for (int id : expected)
+    {
+        expectedJournal.insert(expectedJournal.end(), 3, id);
+    }
+    vector<int> journaled;
+    vector<unsigned char> firstPayloadAfter;
+    bool journalReadable = readSessionJournal(directory, journaled, firstPayloadAfter);
+    bool journalKept = journalReadable && journaledFirst.size() == (size_t)frames * 3 && journaled == expectedJournal && firstPayloadAfter == firstPayload;
+
+    cout << endl << "Session benchmark: " << frames << " frames of " << width << "x" << height << ", " << workers << " worker(s)" << (inOrder ? ", in order" : "") << endl;
+    cout << fixed << setprecision(2);
+    cout << "  Resumed at:       image " << resumedAt << " (expected 2)" << endl;
+    cout << "  Taken again:     ";
+    for (int id : retaken)
+    {
+        cout << " " << id;
+    }
+    cout << " (expected";
+    for (int id : expected)
+    {
+        cout << " " << id;
+    }
+    cout << ")" << endl;
+    cout << "  Time:             " << firstSeconds << " s for the reel, " << resumeSeconds << " s to resume" << endl;
+    cout << "  All verified:     " << (allVerified ? "yes" : "no") << ", motor positions " << (positionKept ? "kept" : "lost") << endl;
+    cout << "  Journal:          " << journaled.size() << " / " << expectedJournal.size() << " exposures read back after the resume"
+        << (journalReadable ? "" : ", damaged") << ", earlier run " << (journalKept ? "kept" : "lost") << endl;
+    cout << defaultfloat;
+    return resumedAt == 2 && retaken == expected && allVerified && positionKept && journalKept ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/*
+* What FramePreview should make of one block, worked out the slow way
+*/
+static uint8_t referencePreviewPixel(uint64_t sum, int scale)
+{
+    uint64_t area = (uint64_t)scale * scale;
+    double linear = (double)((sum + area / 2) / area) / 65535.0;
+    double encoded = linear <= 0.0031308 ? 12.92 * linear : 1.055 * pow(linear, 1.0 / 2.4) - 0.055;
+    return (uint8_t)lround(min(1.0, encoded) * 255.0);
+}
+
+/*
+* Merge a frame whose size is not a multiple of the block with a preview, over a strip
+* pool, and compare every preview pixel with the block means worked out directly
+*/
+static bool verifyPreview(int width, int height, int scale, bool floatChannels, StripThreadPool& stripPool, mt19937& rng)
+{
+    OIIO::ImageSpec spec(width, height, 1, floatChannels ? OIIO::TypeDesc::FLOAT : OIIO::TypeDesc::UINT16);
+    OIIO::ImageBuf channels[3] = { OIIO::ImageBuf(spec), OIIO::ImageBuf(spec), OIIO::ImageBuf(spec) };
+    size_t pixels = (size_t)width * height;
+    vector<uint16_t> quantised[3];
+    uniform_int_distribution<int> value(0, 65535);
+    uniform_real_distribution<float> radiance(-0.1f, 1.2f); // Past black and white both
+    for (int channel = 0; channel < 3; channel++)
+    {
+        quantised[channel].resize(pixels);
+        for (size_t i = 0; i < pixels; i++)
+        {
+            if (floatChannels)
+            {
+                float sample = radiance(rng);
+                ((float*)channels[channel].localpixels())[i] = sample;
+                quantised[channel][i] = (uint16_t)(min(1.0f, max(0.0f, sample)) * 65535.0f + 0.5f);
+            }
+            else
+            {
+                quantised[channel][i] = (uint16_t)value(rng);
+                ((uint16_t*)channels[channel].localpixels())[i] = quantised[channel][i];
+            }
+        }
+    }
+
+    FrameBufferPool pool(0, 1);
+    FramePreview preview;
+    ProcessingOptions options;
+    options.stripPool = &stripPool;
+    options.preview = &preview;
+    options.previewScale = scale;
+    streambuf* console = cout.rdbuf();
+    cout.rdbuf(nullptr);
+    OIIO::ImageBuf* merged = ImagesProcessor::createProcessedRGBImage(&channels[0], &channels[1], &channels[2], &pool, options);
+    cout.rdbuf(console);
+    pool.release(merged);
+    if (merged == nullptr || preview.getWidth() != width / scale || preview.getHeight() != height / scale)
+    {
+        cerr << "  Preview of " << width << "x" << height << " at 1/" << scale << " was not made" << endl;
+        return false;
+    }
+
+    int mismatches = 0;
+    const uint8_t* actual = preview.getPixels();
+    for (int y = 0; y < preview.getHeight(); y++)
+    {
+        for (int x = 0; x < preview.getWidth(); x++)
+        {
+            for (int channel = 0; channel < 3; channel++)
+            {
+                uint64_t sum = 0;
+                for (int row = 0; row < scale; row++)
+                {
+                    for (int column = 0; column < scale; column++)
+                    {
+                        sum += quantised[channel][(size_t)(y * scale + row) * width + x * scale + column];
+                    }
+                }
+                mismatches += actual[((size_t)y * preview.getWidth() + x) * 3 + channel] != referencePreviewPixel(sum, scale) ? 1 : 0;
+            }
+        }
+    }
+    cout << "  " << width << "x" << height << (floatChannels ? " float" : " 16 bit") << " at 1/" << scale << ": "
+        << (mismatches == 0 ? "exact" : to_string(mismatches) + " MISMATCHES") << endl;
+    return mismatches == 0;
+}
+
+/*
+* Checks the preview against block means worked out directly, times the merge with and
+* without it, and has a reader in another thread follow a PreviewRing while previews
+* are published to it as fast as a scan would, checking no copy it keeps was torn.
+*/
+static int runPreviewBenchmark(const map<string, string>& options)
+{
+    int width = (int)optionOr(options, "width", 6144);
+    int height = (int)optionOr(options, "height", 4096);
+    int repeat = (int)optionOr(options, "repeat", 5);
+    int stripThreads = (int)optionOr(options, "strip-threads", 3);
+    int frames = (int)optionOr(options, "frames", 200);
+    string outputDirectory = options.count("output") ? options.at("output") : "bench_img/";
+    if (outputDirectory.back() != '/' && outputDirectory.back() != '\\')
+    {
+        outputDirectory += "/";
+    }
+    filesystem::create_directories(outputDirectory);
+    StripThreadPool stripPool(stripThreads);
+    mt19937 rng(11235);
+
+    cout << "Verifying previews against block means:" << endl;
+    bool verified = true;
+    for (int scale : { 2, 4, 8, 16 })
+    {
+        verified = verifyPreview(1003, 757, scale, false, stripPool, rng) && verified;
+    }
+    verified = verifyPreview(1003, 757, 4, true, stripPool, rng) && verified;
+    verified = verifyPreview(515, 389, 8, true, stripPool, rng) && verified;
+
+    // The cost of the preview on top of the merge it rides along with
+    OIIO::ImageSpec spec(width, height, 1, OIIO::TypeDesc::UINT16);
+    OIIO::ImageBuf red(spec), green(spec), blue(spec);
+    size_t pixels = (size_t)width * height;
+    for (OIIO::ImageBuf* image : { &red, &green, &blue })
+    {
+        uint16_t* data = (uint16_t*)image->localpixels();
+        for (size_t i = 0; i < pixels; i++)
+        {
+            data[i] = (uint16_t)(image == &red ? i * 7 : image == &green ? i * 13 : i * 29);
+        }
+    }
+    FrameBufferPool pool(0, 1);
+    FramePreview preview;
+    ChannelOffsets offsets;
+    offsets.measured = true;
+    offsets.red = { 1.3f, -0.6f, 1.0f, 1 };
+    offsets.blue = { -0.8f, 2.1f, 1.0f, 1 };
+    streambuf* console = cout.rdbuf();
+    cout << endl << "Merge step with red and blue shifted, " << width << "x" << height << ", strip pool of " << stripThreads << " + 1 thread(s), best of "
+        << repeat << ":" << endl;
+    cout << fixed << setprecision(2);
+    double plainMs = 0.0;
+    for (int scale : { 0, 4, 8 })
+    {
+        ProcessingOptions processing;
+        processing.channelOffsets = &offsets;
+        processing.stripPool = &stripPool;
+        processing.preview = scale > 0 ? &preview : nullptr;
+        processing.previewScale = scale;
+        OIIO::ImageBuf* merged = nullptr;
+        double seconds = timeBest(repeat, [&]() {
+            pool.release(merged);
+            cout.rdbuf(nullptr);
+            merged = ImagesProcessor::createProcessedRGBImage(&red, &green, &blue, &pool, processing);
+            cout.rdbuf(console);
+        });
+        pool.release(merged);
+        if (scale == 0)
+        {
+            plainMs = seconds * 1000.0;
+            cout << "  No preview:       " << plainMs << " ms" << endl;
+        }
+        else
+        {
+            double overhead = (seconds * 1000.0 - plainMs) / plainMs * 100.0;
+            cout << "  1/" << scale << " preview:      " << seconds * 1000.0 << " ms, " << (overhead >= 0.0 ? "+" : "") << overhead << "%" << endl;
+        }
+    }
+    auto saveStart = chrono::steady_clock::now();
+    string proxyPath = outputDirectory + "preview_proxy.jpg";
+    bool saved = preview.save(proxyPath) && filesystem::exists(proxyPath);
+    double saveMs = chrono::duration<double, milli>(chrono::steady_clock::now() - saveStart).count();
+    cout << "  Proxy file:       " << preview.getWidth() << "x" << preview.getHeight() << " written in " << saveMs << " ms" << endl;
+
+    // Every byte of a published preview is worked out from its image ID, so a torn copy shows
+    auto patternByte = [](int imageId, size_t i) { return (uint8_t)(imageId * 31 + i % 251); };
+    const string ringName = "FilmScannerPreviewBench";
+    vector<uint8_t> rgb(preview.getBytes());
+    atomic<bool> publishing(true);
+    atomic<int> lastRead(-1);
+    int framesRead = 0, tornFrames = 0;
+    thread viewer([&]() {
+        PreviewRingReader reader(ringName);
+        while (!reader.attach())
+        {
+            if (!publishing)
+            {
+                return;
+            }
+            this_thread::sleep_for(chrono::milliseconds(1));
+        }
+        PreviewRingReader::Frame frame;
+        uint64_t lastNumber = 0;
+        while (lastRead != frames - 1)
+        {
+            if (!reader.readLatest(frame, lastNumber))
+            {
+                if (!publishing)
+                {
+                    return;
+                }
+                this_thread::yield();
+                continue;
+            }
+            lastNumber = frame.number;
+            framesRead++;
+            bool intact = frame.rgb.size() == rgb.size();
+            for (size_t i = 0; i < frame.rgb.size() && intact; i++)
+            {
+                intact = frame.rgb[i] == patternByte(frame.imageId, i);
+            }
+            tornFrames += intact ? 0 : 1;
+            lastRead = frame.imageId;
+        }
+    });
+    double publishMs = 0.0;
+    {
+        PreviewRing ring(ringName, 4);
+        for (int imageId = 0; imageId < frames; imageId++)
+        {
+            for (size_t i = 0; i < rgb.size(); i++)
+            {
+                rgb[i] = patternByte(imageId, i);
+            }
+            auto publishStart = chrono::steady_clock::now();
+            ring.publish(imageId, preview.getWidth(), preview.getHeight(), rgb.data());
+            publishMs += chrono::duration<double, milli>(chrono::steady_clock::now() - publishStart).count();
+        }
+        // The ring goes away with the scanner, give the viewer time to catch the last one
+        for (int wait = 0; wait < 1000 && lastRead != frames - 1; wait++)
+        {
+            this_thread::sleep_for(chrono::milliseconds(1));
+        }
+        publishing = false;
+    }
+    viewer.join();
+    bool followed = framesRead > 0 && tornFrames == 0 && lastRead == frames - 1;
+    cout << endl << "Preview ring, " << frames << " previews of " << preview.getWidth() << "x" << preview.getHeight() << ":" << endl;
+    cout << "  Publish:          " << publishMs * 1000.0 / frames << " us per preview" << endl;
+    cout << "  Viewer read:      " << framesRead << " (the newest each time it looked), " << tornFrames << " torn, last image " << lastRead.load() << endl;
+    cout << defaultfloat;
+    if (!verified)
+    {
+        cerr << "Preview verification failed." << endl;
+    }
+    return verified && saved && followed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/*
+* Percentiles of a histogram against the exact ones of the same samples. A histogram
+* percentile is the upper edge of its bucket, so it may be up to a bucket width above
+* the exact value but never below it.
+*/
+static bool verifyHistogram(const vector<double>& samplesMs)
+{
+    LatencyHistogram histogram;
+    for (double ms : samplesMs)
+    {
+        histogram.record(ms, 1);
+    }
+    vector<double> sorted = samplesMs;
+    sort(sorted.begin(), sorted.end());
+    const double bucketWidth = exp2(1.0 / LatencyHistogram::BUCKETS_PER_DOUBLING);
+    bool match = histogram.getCount() == sorted.size() && histogram.getBytes() == sorted.size();
+    for (double fraction : { 0.01, 0.5, 0.9, 0.95, 0.99, 0.999, 1.0 })
+    {
+        double exact = sorted[max<size_t>(1, (size_t)ceil(fraction * sorted.size())) - 1];
+        double estimate = histogram.getPercentileMs(fraction);
+        // Times are kept to the nanosecond, and anything up to the first edge is one bucket
+        bool close = estimate >= exact - 1e-6 && estimate <= max(exact * bucketWidth, LatencyHistogram::FIRST_BUCKET_MS) + 1e-6;
+        if (!close)
+        {
+            cout << "  p" << fraction * 100.0 << " is " << estimate << " ms, exactly " << exact << " ms" << endl;
+        }
+        match = close && match;
+    }
+    double total = 0.0;
+    for (double ms : sorted)
+    {
+        total += ms;
+    }
+    match = fabs(histogram.getMeanMs() - total / sorted.size()) <= 1e-6 && fabs(histogram.getMaxMs() - sorted.back()) <= 1e-6 && match;
+    return match;
+}
+
+static int runMetricsBenchmark(const map<string, string>& options)
+{
+    size_t samples = (size_t)optionOr(options, "samples", 1000000);
+    int threadCount = max(1, (int)optionOr(options, "threads", 4));
+    string outputDirectory = options.count("output") ? options.at("output") : "bench_img/";
+    if (outputDirectory.back() != '/' && outputDirectory.back() != '\\')
+    {
+        outputDirectory += "/";
+    }
+    filesystem::create_directories(outputDirectory);
+
+    // Times spread like a pipeline stage's: mostly around a typical value with a long tail,
+    // plus the awkward ones right on bucket edges, zero, and past the last bucket
+    mt19937 rng(2024);
+    vector<double> typical(100000), spread(100000), edges;
+    lognormal_distribution<double> typicalMs(log(20.0), 0.3), spreadMs(log(0.5), 3.0);
+    generate(typical.begin(), typical.end(), [&]() { return typicalMs(rng); });
+    generate(spread.begin(), spread.end(), [&]() { return spreadMs(rng); });
+    for (int bucket = 0; bucket < LatencyHistogram::BUCKET_COUNT; bucket++)
+    {
+        edges.push_back(LatencyHistogram::getBucketUpperMs(bucket));
+    }
+    edges.push_back(0.0);
+    edges.push_back(1e8);
+    bool verified = true;
+    cout << fixed << setprecision(3) << "Histogram percentiles against the exact ones:" << endl;
+    for (const auto& test : { make_pair("typical", &typical), make_pair("spread", &spread), make_pair("bucket edges", &edges) })
+    {
+        bool match = verifyHistogram(*test.second);
+        cout << "  " << left << setw(18) << test.first << right << (match ? "ok" : "MISMATCH") << endl;
+        verified = match && verified;
+    }
+
+    PipelineMetrics metrics;
+    LatencyHistogram* direct = metrics.stage("direct");
+    auto recordStart = chrono::steady_clock::now();
+    for (size_t i = 0; i < samples; i++)
+    {
+        direct->record(typical[i % typical.size()], 4096);
+    }
+    double directNs = chrono::duration<double, nano>(chrono::steady_clock::now() - recordStart).count() / samples;
+    recordStart = chrono::steady_clock::now();
+    for (size_t i = 0; i < samples; i++)
+    {
+        metrics.record("by_name", typical[i % typical.size()]);
+    }
+    double byNameNs = chrono::duration<double, nano>(chrono::steady_clock::now() - recordStart).count() / samples;
+
+    // Every thread into the same histogram, as the workers and writers do
+    LatencyHistogram* shared = metrics.stage("shared");
+    vector<thread> threads;
+    recordStart = chrono::steady_clock::now();
+    for (int t = 0; t < threadCount; t++)
+    {
+        threads.push_back(thread([&, t]() {
+            for (size_t i = 0; i < samples; i++)
+            {
+                shared->record(spread[(i + t) % spread.size()]);
+            }
+        }));
+    }
+    for (thread& worker : threads)
+    {
+        worker.join();
+    }
+    double sharedNs = chrono::duration<double, nano>(chrono::steady_clock::now() - recordStart).count() / ((double)samples * threadCount);
+    bool counted = direct->getCount() == samples && direct->getBytes() == samples * 4096 && shared->getCount() == samples * threadCount;
+
+    cout << endl << "Recording " << samples << " times:" << endl;
+    cout << setprecision(1);
+    cout << "  Into a histogram: " << directNs << " ns each" << endl;
+    cout << "  By stage name:    " << byNameNs << " ns each" << endl;
+    cout << "  " << threadCount << " threads shared: " << sharedNs << " ns each, " << (counted ? "none lost" : "COUNTS WRONG") << endl;
+
+    // Files written by the sampler while a gauge moves, then once more on stop()
+    string path = outputDirectory + "bench_metrics";
+    atomic<int> depth(0);
+    metrics.addGauge("bench_queue_depth", [&depth]() { return (double)depth.load(); });
+    metrics.start(path, 0.2);
+    for (int i = 0; i < 10; i++)
+    {
+        depth = i;
+        this_thread::sleep_for(chrono::milliseconds(50));
+    }
+    metrics.stop();
+    ifstream prometheusFile(path + ".prom");
+    string prometheus((istreambuf_iterator<char>(prometheusFile)), istreambuf_iterator<char>());
+    ifstream jsonFile(path + ".json");
+    string json((istreambuf_iterator<char>(jsonFile)), istreambuf_iterator<char>());
+    string sharedCount = "scanner_stage_seconds_count{stage=\"shared\"} " + to_string(samples * threadCount) + "\n";
+    string sharedInf = "scanner_stage_seconds_bucket{stage=\"shared\",le=\"+Inf\"} " + to_string(samples * threadCount) + "\n";
+    bool written = prometheus.find(sharedCount) != string::npos && prometheus.find(sharedInf) != string::npos &&
+        prometheus.find("scanner_bench_queue_depth_max 9\n") != string::npos && json.find("\"shared\": {\"count\": " + to_string(samples * threadCount)) != string::npos;
+    cout << endl << "Files:              " << path << ".json (" << json.size() << " bytes) and .prom (" << prometheus.size() << " bytes)"
+        << (written ? "" : ", CONTENTS WRONG") << endl << endl;
+    metrics.printSummary();
+    cout << defaultfloat;
+    if (!verified)
+    {
+        cerr << "Histogram verification failed." << endl;
+    }
+    return verified && counted && written ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/*
+* Tetrahedral interpolation worked out in doubles straight from the definition, the
+* reference the fixed point kernels are held to
+*/
+static double referenceTetrahedral(const vector<float>& lut, int lutSize, const double input[3], int channel)
+{
+    double fractions[3];
+    int index[3];
+    for (int axis = 0; axis < 3; axis++)
+    {
+        double position = input[axis] * (lutSize - 1);
+        index[axis] = min((int)position, lutSize - 2);
+        fractions[axis] = position - index[axis];
+    }
+    int order[3] = { 0, 1, 2 };
+    sort(order, order + 3, [&](int a, int b) { return fractions[a] > fractions[b]; });
+    auto entry = [&](int r, int g, int b) { return (double)lut[(((size_t)b * lutSize + g) * lutSize + r) * 3 + channel]; };
+    int corner[3] = { index[0], index[1], index[2] };
+    double result = (1.0 - fractions[order[0]]) * entry(corner[0], corner[1], corner[2]);
+    for (int step = 0; step < 3; step++)
+    {
+        corner[order[step]]++;
+        double weight = fractions[order[step]] - (step < 2 ? fractions[order[step + 1]] : 0.0);
+        result += weight * entry(corner[0], corner[1], corner[2]);
+    }
+    return result;
+}
+
+/*
+* A roll of synthetic negatives whose rebate has a known film base with grain on it and
+* sprocket holes through it, plus a few frames of leader and one with no film in the
+* gate, merged with the film base sampled and folded into an estimator. The estimate has
+* to land on the base whatever the leader reads, and the empty frame has to be left out.
+*/
+static bool verifyFilmBaseEstimate(StripThreadPool& stripPool, mt19937& rng)
+{
+    const int width = 1200, height = 800, frames = 40;
+    const double base[3] = { 52000.0, 31000.0, 17500.0 };
+    FilmBaseSettings settings;
+    settings.estimate = true;
+    FilmBaseEstimator estimator(settings);
+    FilmBaseSample sample(settings);
+    OIIO::ImageSpec spec(width, height, 1, OIIO::TypeDesc::UINT16);
+    OIIO::ImageBuf channels[3] = { OIIO::ImageBuf(spec), OIIO::ImageBuf(spec), OIIO::ImageBuf(spec) };
+    FrameBufferPool pool(0, 1);
+    normal_distribution<double> grain(1.0, 0.01);
+    uniform_real_distribution<double> density(0.2, 2.0);
+    int rebateWidth = (int)(width * settings.right);
+    streambuf* console = cout.rdbuf();
+    double worst = 0.0;
+
+    for (int frame = 0; frame < frames; frame++)
+    {
+        bool leader = frame == 5 || frame == 17 || frame == 30;
+        bool empty = frame == 22;
+        for (int y = 0; y < height; y++)
+        {
+            double pictureDensity = density(rng);
+            for (int x = 0; x < width; x++)
+            {
+                bool hole = x >= rebateWidth / 6 && x < rebateWidth * 5 / 6 && (y + frame * 37) % 200 < 80;
+                for (int channel = 0; channel < 3; channel++)
+                {
+                    double level = base[channel] * grain(rng);
+                    if (x >= rebateWidth)
+                    {
+                        level *= pow(10.0, -pictureDensity - 0.1 * channel);
+                    }
+                    else if (empty || hole)
+                    {
+                        level = 65535.0;
+                    }
+                    else if (leader)
+                    {
+                        level *= 0.05;
+                    }
+                    ((uint16_t*)channels[channel].localpixels())[(size_t)y * width + x] = (uint16_t)lround(min(65535.0, level));
+                }
+            }
+        }
+        ProcessingOptions options;
+        options.stripPool = &stripPool;
+        options.filmBaseSample = &sample;
+        cout.rdbuf(nullptr);
+        OIIO::ImageBuf* merged = ImagesProcessor::createProcessedRGBImage(&channels[0], &channels[1], &channels[2], &pool, options);
+        cout.rdbuf(console);
+        pool.release(merged);
+        double level[3];
+        estimator.addFrame(sample, level);
+    }
+
+    double estimate[3] = { 0.0, 0.0, 0.0 };
+    bool estimated = estimator.getEstimate(estimate);
+    for (int channel = 0; channel < 3; channel++)
+    {
+        worst = max(worst, fabs(estimate[channel] / base[channel] - 1.0));
+    }
+    bool counted = estimator.getFrameCount() == frames - 1 && estimator.getRejectedCount() == 1;
+    bool close = estimated && worst <= 0.002;
+    cout << "  Film base estimate:    " << lround(estimate[0]) << " " << lround(estimate[1]) << " " << lround(estimate[2]) << " over "
+        << estimator.getFrameCount() << " frames, " << estimator.getRejectedCount() << " left out, off by " << setprecision(3) << worst * 100.0 << "%"
+        << (close && counted ? "" : ", WRONG") << endl;
+    return close && counted;
+}
+
+/*
+* Checks the colour stage: an identity LUT has to leave a frame alone, a smooth LUT
+* has to come out as the double precision interpolation of it, a .cube file has to
+* survive being written and read back, and a synthetic negative with a known film base
+* has to invert to the densities it was made with. A roll of them has to give back its
+* film base. Then times the merge with the film base sampled, and with the stage, with
+* curves only and with a 3D LUT on top.
+*/
+static int runColorBenchmark(const map<string, string>& options)
+{
+    int width = (int)optionOr(options, "width", 6144);
+    int height = (int)optionOr(options, "height", 4096);
+    int repeat = (int)optionOr(options, "repeat", 5);
+    int stripThreads = (int)optionOr(options, "strip-threads", 3);
+    string outputDirectory = options.count("output") ? options.at("output") : "bench_img/";
+    if (outputDirectory.back() != '/' && outputDirectory.back() != '\\')
+    {
+        outputDirectory += "/";
+    }
+    filesystem::create_directories(outputDirectory);
+    mt19937 rng(16180);
+    uniform_int_distribution<int> value(0, 65535);
+    const size_t samples = 200000;
+    vector<uint16_t> input[3], output[3];
+    for (int channel = 0; channel < 3; channel++)
+    {
+        input[channel].resize(samples);
+        output[channel].resize(samples);
+        generate(input[channel].begin(), input[channel].end(), [&]() { return (uint16_t)value(rng); });
+        input[channel][0] = 0;
+        input[channel][1] = 65535;
+    }
+    const uint16_t* inputPlanes[3] = { input[0].data(), input[1].data(), input[2].data() };
+    uint16_t* outputPlanes[3] = { output[0].data(), output[1].data(), output[2].data() };
+    bool verified = true;
+    cout << "Colour stage against references over " << samples << " random pixels:" << endl;
+
+    // Tables written to .cube files and loaded the way a scan loads them
+    auto writeLut = [&](const string& name, int size, function<void(const double[3], float[3])> mapping) {
+        ColorTransform::Cube cube;
+        cube.size3d = size;
+        for (int b = 0; b < size; b++)
+        {
+            for (int g = 0; g < size; g++)
+            {
+                for (int r = 0; r < size; r++)
+                {
+                    double coordinates[3] = { (double)r / (size - 1), (double)g / (size - 1), (double)b / (size - 1) };
+                    float mapped[3];
+                    mapping(coordinates, mapped);
+                    cube.lut3d.insert(cube.lut3d.end(), mapped, mapped + 3);
+                }
+            }
+        }
+        string path = outputDirectory + name;
+        ColorTransform::saveCube(path, cube);
+        return path;
+    };
+    for (int size : { 2, 17, 33 })
+    {
+        ColorSettings settings;
+        settings.lutPath = writeLut("identity_" + to_string(size) + ".cube", size, [](const double in[3], float out[3]) {
+            copy(in, in + 3, out);
+        });
+        ColorTransform identity;
+        int worst = 0;
+        if (identity.build(settings))
+        {
+            identity.apply(inputPlanes, outputPlanes, samples);
+            for (int channel = 0; channel < 3; channel++)
+            {
+                for (size_t i = 0; i < samples; i++)
+                {
+                    worst = max(worst, abs((int)output[channel][i] - (int)input[channel][i]));
+                }
+            }
+        }
+        else
+        {
+            worst = 65535;
+        }
+        cout << "  Identity " << setw(2) << size << "^3 LUT:     largest change " << worst << (worst <= 1 ? "" : ", TOO LARGE") << endl;
+        verified = worst <= 1 && verified;
+    }
+
+    // A LUT like a print emulation: a saturation boost and a different curve per channel
+    ColorSettings smoothSettings;
+    smoothSettings.lutPath = writeLut("smooth_33.cube", 33, [](const double in[3], float out[3]) {
+        double luma = 0.25 * in[0] + 0.6 * in[1] + 0.15 * in[2];
+        for (int channel = 0; channel < 3; channel++)
+        {
+            double saturated = min(1.0, max(0.0, luma + 1.4 * (in[channel] - luma)));
+            out[channel] = (float)pow(saturated, 0.8 + 0.2 * channel);
+        }
+    });
+    ColorTransform::Cube smoothCube;
+    ColorTransform smooth;
+    double worstError = 65535.0;
+    if (ColorTransform::loadCube(smoothSettings.lutPath, smoothCube) && smooth.build(smoothSettings))
+    {
+        worstError = 0.0;
+        smooth.apply(inputPlanes, outputPlanes, samples);
+        for (size_t i = 0; i < samples; i++)
+        {
+            double coordinates[3] = { input[0][i] / 65535.0, input[1][i] / 65535.0, input[2][i] / 65535.0 };
+            for (int channel = 0; channel < 3; channel++)
+            {
+                double expected = min(1.0, max(0.0, referenceTetrahedral(smoothCube.lut3d, 33, coordinates, channel))) * 65535.0;
+                worstError = max(worstError, fabs(output[channel][i] - expected));
+            }
+        }
+    }
+    cout << "  Smooth 33^3 LUT:       largest error " << fixed << setprecision(2) << worstError << " levels"
+        << (worstError <= 2.0 ? "" : ", TOO LARGE") << endl;
+    verified = worstError <= 2.0 && verified;
+
+    // A file with both tables and its own input range, read back value for value
+    ColorTransform::Cube written;
+    written.size1d = 16;
+    written.size3d = 5;
+    uniform_real_distribution<float> entry(-0.1f, 1.1f);
+    written.lut1d.resize(16 * 3);
+    written.lut3d.resize(5 * 5 * 5 * 3);
+    generate(written.lut1d.begin(), written.lut1d.end(), [&]() { return entry(rng); });
+    generate(written.lut3d.begin(), written.lut3d.end(), [&]() { return entry(rng); });
+    for (int channel = 0; channel < 3; channel++)
+    {
+        written.domainMax1d[channel] = 4.0f;
+        written.domainMin3d[channel] = -0.5f;
+    }
+    string roundTripPath = outputDirectory + "round_trip.cube";
+    ColorTransform::Cube read;
+    bool roundTrip = ColorTransform::saveCube(roundTripPath, written) && ColorTransform::loadCube(roundTripPath, read) &&
+        read.size1d == written.size1d && read.size3d == written.size3d && read.lut1d.size() == written.lut1d.size() &&
+        read.lut3d.size() == written.lut3d.size() && read.domainMax1d[2] == 4.0f && read.domainMin3d[1] == -0.5f;
+    for (size_t i = 0; roundTrip && i < written.lut1d.size(); i++)
+    {
+        roundTrip = fabs(read.lut1d[i] - written.lut1d[i]) <= 1e-6f;
+    }
+    for (size_t i = 0; roundTrip && i < written.lut3d.size(); i++)
+    {
+        roundTrip = fabs(read.lut3d[i] - written.lut3d[i]) <= 1e-6f;
+    }
+    cout << "  .cube round trip:      " << (roundTrip ? "ok" : "MISMATCH") << endl;
+    verified = roundTrip && verified;
+
+    // A negative: a strong orange base and frame densities from clear film up past the range
+    ColorSettings negativeSettings;
+    negativeSettings.invert = true;
+    negativeSettings.filmBase[0] = 52000.0;
+    negativeSettings.filmBase[1] = 31000.0;
+    negativeSettings.filmBase[2] = 17500.0;
+    ColorTransform negative;
+    negative.build(negativeSettings);
+    uniform_real_distribution<double> density(0.0, 2.2);
+    vector<double> densities[3];
+    for (int channel = 0; channel < 3; channel++)
+    {
+        densities[channel].resize(samples);
+        for (size_t i = 0; i < samples; i++)
+        {
+            densities[channel][i] = i == 0 ? 0.0 : density(rng);
+            input[channel][i] = (uint16_t)lround(negativeSettings.filmBase[channel] * pow(10.0, -densities[channel][i]));
+        }
+    }
+    negative.apply(inputPlanes, outputPlanes, samples);
+    double worstLevels = 0.0, worstDensity = 0.0;
+    bool baseNeutral = true;
+    for (int channel = 0; channel < 3; channel++)
+    {
+        for (size_t i = 0; i < samples; i++)
+        {
+            // What the quantised level should give, and how far that is from the density the film had
+            double measured = min(1.0, input[channel][i] / negativeSettings.filmBase[channel]);
+            double expected = min(1.0, -log10(max(measured, pow(10.0, -negativeSettings.densityRange))) / negativeSettings.densityRange);
+            worstLevels = max(worstLevels, fabs(output[channel][i] - expected * 65535.0));
+            if (densities[channel][i] < negativeSettings.densityRange && input[channel][i] >= 1000)
+            {
+                worstDensity = max(worstDensity, fabs(output[channel][i] / 65535.0 * negativeSettings.densityRange - densities[channel][i]));
+            }
+        }
+        baseNeutral = baseNeutral && output[channel][0] == 0;
+    }
+    bool inverted = worstLevels <= 0.5 && worstDensity <= 0.001 && baseNeutral;
+    cout << "  Negative inversion:    largest error " << worstLevels << " levels, " << setprecision(4) << worstDensity << " D above level 1000, base "
+        << (baseNeutral ? "neutral" : "NOT NEUTRAL") << (inverted ? "" : ", TOO LARGE") << endl;
+    verified = inverted && verified;
+    StripThreadPool stripPool(stripThreads);
+    verified = verifyFilmBaseEstimate(stripPool, rng) && verified;
+
+    // What the stage costs on top of the merge
+    OIIO::ImageSpec spec(width, height, 1, OIIO::TypeDesc::UINT16);
+    OIIO::ImageBuf red(spec), green(spec), blue(spec);
+    size_t pixels = (size_t)width * height;
+    for (OIIO::ImageBuf* image : { &red, &green, &blue })
+    {
+        uint16_t* data = (uint16_t*)image->localpixels();
+        for (size_t i = 0; i < pixels; i++)
+        {
+            data[i] = (uint16_t)(image == &red ? i * 7 : image == &green ? i * 13 : i * 29);
+        }
+    }
+    FrameBufferPool pool(0, 1);
+    ColorTransform smoothNegative;
+    negativeSettings.lutPath = smoothSettings.lutPath;
+    smoothNegative.build(negativeSettings);
+    streambuf* console = cout.rdbuf();
+    cout << endl << "Merge step, " << width << "x" << height << ", " << PixelKernels::getIsaName(PixelKernels::getActiveIsa()) << ", strip pool of "
+        << stripThreads << " + 1 thread(s), best of " << repeat << ":" << endl;
+    cout << setprecision(2);
+    double plainMs = 0.0;
+    FilmBaseSample filmBaseSample;
+    struct Variant
+    {
+        const char* name;
+        const ColorTransform* color;
+        FilmBaseSample* sample;
+    };
+    const Variant variants[] = { { "No colour stage:", nullptr, nullptr }, { "Film base sampled:", nullptr, &filmBaseSample },
+        { "Inverted:", &negative, nullptr }, { "Inverted, 33^3 LUT:", &smoothNegative, nullptr } };
+    for (const Variant& variant : variants)
+    {
+        ProcessingOptions processing;
+        processing.stripPool = &stripPool;
+        processing.color = variant.color;
+        processing.filmBaseSample = variant.sample;
+        OIIO::ImageBuf* merged = nullptr;
+        double seconds = timeBest(repeat, [&]() {
+            pool.release(merged);
+            cout.rdbuf(nullptr);
+            merged = ImagesProcessor::createProcessedRGBImage(&red, &green, &blue, &pool, processing);
+            cout.rdbuf(console);
+        });
+        pool.release(merged);
+        cout << "  " << left << setw(22) << variant.name << right << seconds * 1000.0 << " ms";
+        if (variant.color == nullptr && variant.sample == nullptr)
+        {
+            plainMs = seconds * 1000.0;
+            cout << endl;
+        }
+        else
+        {
+            cout << ", +" << (seconds * 1000.0 - plainMs) / plainMs * 100.0 << "%" << endl;
+        }
+    }
+    cout << defaultfloat;
+    if (!verified)
+    {
+        cerr << "Colour stage verification failed." << endl;
+    }
+    return verified ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static uint32_t getBig32(const unsigned char* field)
+{
+    return (uint32_t)field[0] << 24 | (uint32_t)field[1] << 16 | (uint32_t)field[2] << 8 | field[3];
+}
+
+static uint32_t getLittle32(const unsigned char* field)
+{
+    return (uint32_t)field[3] << 24 | (uint32_t)field[2] << 16 | (uint32_t)field[1] << 8 | field[0];
+}
+
+static bool readWholeFile(const string& path, vector<unsigned char>& contents)
+{
+    ifstream file(path, ios::binary);
+    contents.assign(istreambuf_iterator<char>(file), istreambuf_iterator<char>());
+    return (bool)file || file.eof();
+}
+
+/*
+* Read a DPX back using nothing but the layout in SMPTE 268M and compare it with the
+* frame it was written from
+*/
+static bool verifyDpx(const string& path, const OIIO::ImageBuf& frame, int frameNumber, bool printingDensity)
+{
+    const OIIO::ImageSpec& spec = frame.spec();
+    vector<unsigned char> file;
+    size_t pixelBytes = spec.image_bytes();
+    if (!readWholeFile(path, file) || file.size() != SequenceWriter::DPX_DATA_OFFSET + pixelBytes)
+    {
+        cerr << "  " << path << " is " << file.size() << " bytes, expected " << SequenceWriter::DPX_DATA_OFFSET + pixelBytes << endl;
+        return false;
+    }
+    const unsigned char* element = &file[780];
+    bool headerValid = memcmp(&file[0], "SDPX", 4) == 0 && getBig32(&file[4]) == SequenceWriter::DPX_DATA_OFFSET && getBig32(&file[16]) == file.size()
+        && file[770] == 0 && file[771] == 1 && getBig32(&file[772]) == (uint32_t)spec.width && getBig32(&file[776]) == (uint32_t)spec.height
+        && element[20] == 50 && element[21] == (printingDensity ? 1 : 2) && element[23] == 16 && getBig32(element + 28) == SequenceWriter::DPX_DATA_OFFSET
+        && getBig32(&file[1712]) == (uint32_t)frameNumber && string((const char*)&file[36]) == filesystem::path(path).filename().string();
+    if (!headerValid)
+    {
+        cerr << "  " << path << " has a wrong DPX header" << endl;
+        return false;
+    }
+    const uint16_t* pixels = (const uint16_t*)frame.localpixels();
+    for (size_t i = 0; i < pixelBytes / 2; i++)
+    {
+        const unsigned char* value = &file[SequenceWriter::DPX_DATA_OFFSET + i * 2];
+        if ((uint16_t)(value[0] << 8 | value[1]) != pixels[i])
+        {
+            cerr << "  " << path << " differs from the frame at value " << i << endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+* Same for an EXR, walking its attributes and line offset table the way a reader does.
+* 16 bit frames have to come back as the half float nearest to level / 65535.
+*/
+static bool verifyExr(const string& path, const OIIO::ImageBuf& frame)
+{
+    const OIIO::ImageSpec& spec = frame.spec();
+    vector<unsigned char> file;
+    if (!readWholeFile(path, file) || file.size() < 8 || getLittle32(&file[0]) != 20000630 || getLittle32(&file[4]) != 2)
+    {
+        cerr << "  " << path << " is not a single part scanline EXR" << endl;
+        return false;
+    }
+    size_t position = 8;
+    bool channelsValid = false, uncompressed = false;
+    int32_t dataWindow[4] = { -1, -1, -1, -1 };
+    while (position < file.size() && file[position] != 0)
+    {
+        string name((const char*)&file[position]);
+        position += name.size() + 1;
+        string type((const char*)&file[position]);
+        position += type.size() + 1;
+        uint32_t size = getLittle32(&file[position]);
+        position += 4;
+        if (position + size > file.size())
+        {
+            break;
+        }
+        const unsigned char* value = &file[position];
+        if (name == "channels")
+        {
+            const unsigned char expected[] = { 'B', 0, 1, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 1, 0, 0, 0,
+                'G', 0, 1, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 1, 0, 0, 0,
+                'R', 0, 1, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 1, 0, 0, 0, 0 };
+            channelsValid = type == "chlist" && size == sizeof(expected) && memcmp(value, expected, size) == 0;
+        }
+        else if (name == "compression")
+        {
+            uncompressed = size == 1 && value[0] == 0;
+        }
+        else if (name == "dataWindow" && size == sizeof(dataWindow))
+        {
+            memcpy(dataWindow, value, size);
+        }
+        position += size;
+    }
+    position++;
+    size_t width = (size_t)spec.width, height = (size_t)spec.height;
+    if (!channelsValid || !uncompressed || dataWindow[0] != 0 || dataWindow[1] != 0 || dataWindow[2] != spec.width - 1 || dataWindow[3] != spec.height - 1
+        || position + height * 8 > file.size())
+    {
+        cerr << "  " << path << " has a wrong EXR header" << endl;
+        return false;
+    }
+
+    const uint16_t* pixels = (const uint16_t*)frame.localpixels();
+    bool half = spec.format == OIIO::TypeDesc::HALF;
+    for (size_t y = 0; y < height; y++)
+    {
+        uint64_t offset;
+        memcpy(&offset, &file[position + y * 8], sizeof(offset));
+        if (offset + 8 + width * 6 > file.size() || getLittle32(&file[offset]) != y || getLittle32(&file[offset + 4]) != width * 6)
+        {
+            cerr << "  " << path << " has a wrong chunk for line " << y << endl;
+            return false;
+        }
+        const unsigned char* planes = &file[offset + 8];
+        for (size_t x = 0; x < width; x++)
+        {
+            for (int channel = 0; channel < 3; channel++)
+            {
+                uint16_t source = pixels[(y * width + x) * 3 + channel];
+                uint16_t expected = half ? source : PixelKernels::floatToHalf(source / 65535.0f);
+                uint16_t actual;
+                memcpy(&actual, planes + ((2 - channel) * width + x) * 2, sizeof(actual)); // Stored blue, green, red
+                if (actual != expected)
+                {
+                    cerr << "  " << path << " differs from the frame at " << x << "," << y << endl;
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+/*
+* Checks DPX and EXR files against the frames they were written from, then writes full
+* frames from pooled buffers the way the frame writer does, in TIFF as before (through
+* OIIO, or encoded in memory and written with DirectFile for --direct 1), DPX through
+* OIIO, and DPX and EXR from SequenceWriter, and reports the time per frame and the rate.
+*/
+static int runWriterBenchmark(const map<string, string>& options)
+{
+    int width = (int)optionOr(options, "width", 6144);
+    int height = (int)optionOr(options, "height", 4096);
+    int repeat = (int)optionOr(options, "repeat", 5);
+    string outputDirectory = options.count("output") ? options.at("output") : "bench_img/";
+    if (outputDirectory.back() != '/' && outputDirectory.back() != '\\')
+    {
+        outputDirectory += "/";
+    }
+    filesystem::create_directories(outputDirectory);
+    mt19937 rng(35);
+    uniform_int_distribution<int> level(0, 65535);
+    uniform_real_distribution<float> radiance(0.0f, 4.0f);
+
+    // Random values for the first lines so every level and half goes through the check,
+    // a cheaper ramp for the rest
+    auto fill = [&](OIIO::ImageBuf* levelFrame, OIIO::ImageBuf* halfFrame) {
+        uint16_t* levels = (uint16_t*)levelFrame->localpixels();
+        uint16_t* halves = (uint16_t*)halfFrame->localpixels();
+        size_t values = levelFrame->spec().image_pixels() * 3;
+        size_t randomValues = min(values, (size_t)levelFrame->spec().width * 3 * 64);
+        for (size_t i = 0; i < values; i++)
+        {
+            levels[i] = i < randomValues ? (uint16_t)level(rng) : (uint16_t)(i * 7);
+            halves[i] = PixelKernels::floatToHalf(i < randomValues ? radiance(rng) : (float)(i % 4096) / 1024.0f);
+        }
+    };
+    FrameBufferPool pool(0, 4);
+    OIIO::ImageBuf* frame = pool.acquire(OIIO::ImageSpec(width, height, 3, OIIO::TypeDesc::UINT16));
+    OIIO::ImageBuf* hdrFrame = pool.acquire(OIIO::ImageSpec(width, height, 3, OIIO::TypeDesc::HALF));
+    fill(frame, hdrFrame);
+    // And an odd size, where neither the lines nor the end of the file fall on a block
+    OIIO::ImageBuf* oddFrame = pool.acquire(OIIO::ImageSpec(1001, 37, 3, OIIO::TypeDesc::UINT16));
+    OIIO::ImageBuf* oddHdrFrame = pool.acquire(OIIO::ImageSpec(1001, 37, 3, OIIO::TypeDesc::HALF));
+    fill(oddFrame, oddHdrFrame);
+    auto releaseFrames = [&]() {
+        for (OIIO::ImageBuf* buffer : { frame, hdrFrame, oddFrame, oddHdrFrame })
+        {
+            pool.release(buffer);
+        }
+    };
+
+    cout << "Sequence files against the frames they were written from:" << endl;
+    bool verified = true;
+    for (bool direct : { false, true })
+    {
+        for (OIIO::ImageBuf* source : { oddFrame, frame })
+        {
+            string size = to_string(source->spec().width) + "x" + to_string(source->spec().height);
+            for (bool printingDensity : { false, true })
+            {
+                SequenceWriter dpx(OUTPUT_DPX, direct);
+                dpx.setPrintingDensity(printingDensity);
+                uint64_t bytes = 0;
+                string path = outputDirectory + "writer_check.dpx";
+                bool match = dpx.write(source, path, 1000 + printingDensity, bytes) && bytes == filesystem::file_size(path)
+                    && verifyDpx(path, *source, 1000 + printingDensity, printingDensity);
+                cout << "  " << size << " DPX" << (printingDensity ? " printing density" : " linear") << (direct ? ", direct I/O: " : ": ")
+                    << (match ? "match" : "MISMATCH") << endl;
+                verified = verified && match;
+                filesystem::remove(path);
+            }
+        }
+        for (OIIO::ImageBuf* source : { oddFrame, oddHdrFrame, frame, hdrFrame })
+        {
+            SequenceWriter exr(OUTPUT_EXR, direct);
+            uint64_t bytes = 0;
+            string path = outputDirectory + "writer_check.exr";
+            bool match = exr.write(source, path, 0, bytes) && bytes == filesystem::file_size(path) && verifyExr(path, *source);
+            cout << "  " << source->spec().width << "x" << source->spec().height << " EXR from "
+                << (source->spec().format == OIIO::TypeDesc::HALF ? "half float" : "16 bit") << (direct ? ", direct I/O: " : ": ")
+                << (match ? "match" : "MISMATCH") << endl;
+            verified = verified && match;
+            filesystem::remove(path);
+        }
+    }
+    if (!verified)
+    {
+        cerr << "Sequence writer verification failed." << endl;
+        releaseFrames();
+        return EXIT_FAILURE;
+    }
+
+    struct WriterCase
+    {
+        const char* label;
+        OutputFormat format;
+        bool native;
+        OIIO::ImageBuf* source;
+    };
+    const WriterCase cases[] = {
+        { "TIFF, OIIO", OUTPUT_TIFF, false, frame },
+        { "DPX, OIIO", OUTPUT_DPX, false, frame },
+        { "DPX", OUTPUT_DPX, true, frame },
+        { "EXR from 16 bit", OUTPUT_EXR, true, frame },
+        { "EXR from half", OUTPUT_EXR, true, hdrFrame },
+    };
+    cout << endl << "Writing " << width << "x" << height << " frames, mean of " << repeat << ":" << endl;
+    cout << fixed << setprecision(1);
+    vector<unsigned char> encodeBuffer;
+    for (bool direct : { false, true })
+    {
+        for (const WriterCase& writerCase : cases)
+        {
+            SequenceWriter writer(writerCase.format, direct);
+            double totalMs = 0.0, convertMs = 0.0;
+            uint64_t bytes = 0;
+            bool written = true;
+            for (int r = 0; r < repeat && written; r++)
+            {
+                string path = outputDirectory + "writer_" + to_string(r) + SequenceWriter::getExtension(writerCase.format);
+                auto start = chrono::steady_clock::now();
+                if (writerCase.native)
+                {
+                    written = writer.write(writerCase.source, path, r, bytes);
+                    convertMs += writer.getConvertMs();
+                }
+                else if (direct)
+                {
+                    written = ImagesProcessor::encodeImage(writerCase.source, path, encodeBuffer)
+                        && DirectFile::writeFile(path, encodeBuffer.data(), encodeBuffer.size(), true);
+                    bytes = encodeBuffer.size();
+                }
+                else
+                {
+                    written = ImagesProcessor::saveImage(writerCase.source, path);
+                    bytes = written ? filesystem::file_size(path) : 0;
+                }
+                totalMs += chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+                filesystem::remove(path);
+            }
+            if (!written)
+            {
+                cerr << "  " << writerCase.label << ": write failed" << endl;
+                verified = false;
+                continue;
+            }
+            double frameMs = totalMs / repeat;
+            cout << "  " << setw(16) << writerCase.label << (direct ? ", direct I/O: " : ":              ") << setw(7) << frameMs << " ms, "
+                << setw(6) << bytes / (frameMs / 1000.0) / (1024.0 * 1024.0) << " MB/s";
+            if (writerCase.native)
+            {
+                cout << " (" << convertMs / repeat << " ms converting)";
+            }
+            cout << endl;
+        }
+    }
+    cout << defaultfloat;
+    releaseFrames();
+    return verified ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/*
+* TIFF LZW the way libtiff reads it, the code width going up one code before the table
+* needs it
+*/
+static bool decodeLzw(const unsigned char* data, size_t bytes, vector<unsigned char>& decoded)
+{
+    const int CLEAR = 256, END = 257, FIRST = 258;
+    vector<uint16_t> prefixes(4096), lengths(4096);
+    vector<unsigned char> suffixes(4096), firsts(4096);
+    for (int code = 0; code < 256; code++)
+    {
+        lengths[code] = 1;
+        suffixes[code] = firsts[code] = (unsigned char)code;
+    }
+    size_t bitPosition = 0;
+    int width = 9, nextCode = FIRST, previous = -1;
+    auto appendString = [&](int code) {
+        size_t length = lengths[code];
+        size_t end = decoded.size() + length;
+        decoded.resize(end);
+        for (size_t i = end; i > end - length; i--, code = prefixes[code])
+        {
+            decoded[i - 1] = suffixes[code];
+        }
+    };
+    while (true)
+    {
+        if (bitPosition + width > bytes * 8)
+        {
+            return false; // Ran out before the end code
+        }
+        int code = 0;
+        for (int bit = 0; bit < width; bit++, bitPosition++)
+        {
+            code = code << 1 | (data[bitPosition / 8] >> (7 - bitPosition % 8) & 1);
+        }
+        if (code == END)
+        {
+            return true;
+        }
+        if (code == CLEAR)
+        {
+            width = 9;
+            nextCode = FIRST;
+            previous = -1;
+            continue;
+        }
+        if (previous < 0)
+        {
+            if (code >= 256)
+            {
+                return false;
+            }
+            decoded.push_back((unsigned char)code);
+            previous = code;
+            continue;
+        }
+        if (code > nextCode || nextCode >= 4096)
+        {
+            return false;
+        }
+        prefixes[nextCode] = (uint16_t)previous;
+        suffixes[nextCode] = code < nextCode ? firsts[code] : firsts[previous];
+        firsts[nextCode] = firsts[previous];
+        lengths[nextCode] = (uint16_t)(lengths[previous] + 1);
+        nextCode++;
+        appendString(code);
+        if (nextCode >= (1 << width) - 1 && width < 12)
+        {
+            width++;
+        }
+        previous = code;
+    }
+}
+
+/*
+* Read a TIFF written by CompressedTiffWriter back by hand: walk its directory,
+* decompress every strip, undo the predictor and compare it with the frame
+*/
+static bool verifyCompressedTiff(const string& path, const OIIO::ImageBuf& frame, OutputCompression compression, bool predictor)
+{
+    vector<unsigned char> file;
+    if (!readWholeFile(path, file) || file.size() < 8 || file[0] != 'I' || file[1] != 'I' || file[2] != 42)
+    {
+        cerr << "  " << path << " is not a little endian TIFF" << endl;
+        return false;
+    }
+    auto get16 = [&](size_t at) { return (uint32_t)file[at] | (uint32_t)file[at + 1] << 8; };
+    map<uint32_t, vector<uint32_t>> tags;
+    size_t directory = getLittle32(&file[4]);
+    for (size_t entry = 0; entry < get16(directory); entry++)
+    {
+        size_t at = directory + 2 + entry * 12;
+        uint32_t type = get16(at + 2), count = getLittle32(&file[at + 4]);
+        size_t size = type == 3 ? 2 : 4;
+        size_t values = count * size <= 4 ? at + 8 : getLittle32(&file[at + 8]);
+        for (uint32_t i = 0; i < count; i++)
+        {
+            tags[get16(at)].push_back(size == 2 ? get16(values + i * 2) : getLittle32(&file[values + i * 4]));
+        }
+    }
+    const OIIO::ImageSpec& spec = frame.spec();
+    const uint32_t compressionCodes[] = { 1, 5, 8, 50000 };
+    const uint32_t sampleFormat = spec.format == OIIO::TypeDesc::HALF ? 3 : 1;
+    bool differenced = predictor && sampleFormat == 1 && compression != COMPRESS_NONE;
+    if (tags[256] != vector<uint32_t>{ (uint32_t)spec.width } || tags[257] != vector<uint32_t>{ (uint32_t)spec.height }
+        || tags[258] != vector<uint32_t>{ 16, 16, 16 } || tags[259] != vector<uint32_t>{ compressionCodes[compression] } || tags[262] != vector<uint32_t>{ 2 }
+        || tags[277] != vector<uint32_t>{ 3 } || tags[278].size() != 1 || tags[273].size() != tags[279].size()
+        || tags[317] != vector<uint32_t>{ differenced ? 2u : 1u } || tags[339] != vector<uint32_t>{ sampleFormat, sampleFormat, sampleFormat })
+    {
+        cerr << "  " << path << " has a wrong TIFF directory" << endl;
+        return false;
+    }
+
+    size_t lineValues = (size_t)spec.width * 3;
+    size_t stripRows = tags[278][0];
+    const uint16_t* pixels = (const uint16_t*)frame.localpixels();
+    vector<unsigned char> decoded;
+    for (size_t strip = 0; strip < tags[273].size(); strip++)
+    {
+        size_t firstRow = strip * stripRows;
+        size_t rows = min(stripRows, (size_t)spec.height - firstRow);
+        size_t expectedBytes = rows * lineValues * 2;
+        const unsigned char* data = &file[tags[273][strip]];
+        size_t bytes = tags[279][strip];
+        decoded.clear();
+        bool ok = tags[273][strip] + (uint64_t)bytes <= file.size();
+        if (ok && compression == COMPRESS_NONE)
+        {
+            decoded.assign(data, data + bytes);
+        }
+        else if (ok && compression == COMPRESS_LZW)
+        {
+            ok = decodeLzw(data, bytes, decoded);
+        }
+        else if (ok && compression == COMPRESS_DEFLATE)
+        {
+            uLongf length = (uLongf)expectedBytes;
+            decoded.resize(expectedBytes);
+            ok = uncompress(decoded.data(), &length, data, (uLong)bytes) == Z_OK;
+            decoded.resize(length);
+        }
+#ifdef SCANNER_HAVE_ZSTD
+        else if (ok && compression == COMPRESS_ZSTD)
+        {
+            decoded.resize(expectedBytes);
+            size_t length = ZSTD_decompress(decoded.data(), decoded.size(), data, bytes);
+            ok = !ZSTD_isError(length);
+            decoded.resize(ok ? length : 0);
+        }
+#endif
+        if (!ok || decoded.size() != expectedBytes)
+        {
+            cerr << "  " << path << ": strip " << strip << " does not decompress to " << expectedBytes << " bytes" << endl;
+            return false;
+        }
+        vector<uint16_t> values(decoded.size() / 2);
+        memcpy(values.data(), decoded.data(), decoded.size());
+        for (size_t row = 0; row < rows && differenced; row++)
+        {
+            for (size_t i = 3; i < lineValues; i++)
+            {
+                values[row * lineValues + i] += values[row * lineValues + i - 3];
+            }
+        }
+        if (memcmp(values.data(), pixels + firstRow * lineValues, decoded.size()) != 0)
+        {
+            cerr << "  " << path << ": strip " << strip << " differs from the frame" << endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+* Checks every codec by reading the files back, then compresses full frames of the
+* film-like texture with and without the predictor and on more and more threads, and
+* reports the compression ratio, how fast the frame was compressed and how fast it
+* reached the disk against writing it uncompressed.
+*/
+static int runCompressBenchmark(const map<string, string>& options)
+{
+    int width = (int)optionOr(options, "width", 6144);
+    int height = (int)optionOr(options, "height", 4096);
+    int repeat = (int)optionOr(options, "repeat", 3);
+    int maxThreads = (int)optionOr(options, "threads", max(1u, thread::hardware_concurrency()) - 1);
+    bool direct = optionOr(options, "direct", 0) != 0;
+    string outputDirectory = options.count("output") ? options.at("output") : "bench_img/";
+    if (outputDirectory.back() != '/' && outputDirectory.back() != '\\')
+    {
+        outputDirectory += "/";
+    }
+    filesystem::create_directories(outputDirectory);
+
+    // Grain on a texture like the other modes' frames, each colour its own, with
+    // the full 16 bit range in use
+    FrameBufferPool pool(3, 2);
+    OIIO::ImageBuf* frame = pool.acquire(OIIO::ImageSpec(width, height, 3, OIIO::TypeDesc::UINT16));
+    OIIO::ImageBuf* hdrFrame = pool.acquire(OIIO::ImageSpec(1001, 37, 3, OIIO::TypeDesc::HALF));
+    {
+        mt19937 rng(2718);
+        vector<OIIO::ImageBuf*> channels;
+        for (int channel = 0; channel < 3; channel++)
+        {
+            channels.push_back(pool.acquire(OIIO::ImageSpec(width, height, 1, OIIO::TypeDesc::UINT16)));
+            renderChannel(NoiseTexture(300 + channel), *channels.back(), channel * 0.3, 0.0, rng);
+        }
+        uint16_t* rgb = (uint16_t*)frame->localpixels();
+        PixelKernels::interleave3((uint16_t*)channels[0]->localpixels(), (uint16_t*)channels[1]->localpixels(), (uint16_t*)channels[2]->localpixels(), rgb,
+            (size_t)width * height);
+        for (OIIO::ImageBuf* channel : channels)
+        {
+            pool.release(channel);
+        }
+        uniform_real_distribution<float> radiance(0.0f, 4.0f);
+        uint16_t* halves = (uint16_t*)hdrFrame->localpixels();
+        for (size_t i = 0; i < hdrFrame->spec().image_pixels() * 3; i++)
+        {
+            halves[i] = PixelKernels::floatToHalf(radiance(rng));
+        }
+    }
+    auto releaseFrames = [&]() {
+        pool.release(frame);
+        pool.release(hdrFrame);
+    };
+
+    vector<OutputCompression> codecs;
+    for (OutputCompression codec : { COMPRESS_NONE, COMPRESS_LZW, COMPRESS_DEFLATE, COMPRESS_ZSTD })
+    {
+        if (CompressedTiffWriter::isAvailable(codec))
+        {
+            codecs.push_back(codec);
+        }
+    }
+    StripThreadPool checkPool(2);
+    bool verified = true;
+    cout << "Compressed TIFFs read back by hand against the frames:" << endl;
+    for (OutputCompression codec : codecs)
+    {
+        for (bool predictor : { false, true })
+        {
+            for (OIIO::ImageBuf* source : { frame, hdrFrame })
+            {
+                string path = outputDirectory + "compress_check.tiff";
+                CompressedTiffWriter writer(codec, 0, predictor, &checkPool, direct);
+                uint64_t bytes = 0;
+                bool match = writer.write(source, path, bytes) && bytes == filesystem::file_size(path) && verifyCompressedTiff(path, *source, codec, predictor);
+                cout << "  " << setw(7) << CompressedTiffWriter::getName(codec) << (predictor ? ", predictor, " : ",            ")
+                    << source->spec().width << "x" << source->spec().height << (source == hdrFrame ? " half: " : ":      ") << (match ? "match" : "MISMATCH") << endl;
+                verified = verified && match;
+                filesystem::remove(path);
+            }
+        }
+    }
+    if (!verified)
+    {
+        cerr << "Compressed TIFF verification failed." << endl;
+        releaseFrames();
+        return EXIT_FAILURE;
+    }
+
+    vector<int> threadCounts = { 0 };
+    for (int threads = 1; threads <= maxThreads; threads *= 2)
+    {
+        threadCounts.push_back(threads);
+    }
+    if (threadCounts.back() != maxThreads && maxThreads > 0)
+    {
+        threadCounts.push_back(maxThreads);
+    }
+    double rawMegabytes = frame->spec().image_bytes() / (1024.0 * 1024.0);
+    cout << endl << "Compressing " << width << "x" << height << " frames (" << fixed << setprecision(1) << rawMegabytes << " MB)"
+        << (direct ? " with direct I/O" : "") << ", mean of " << repeat << ":" << endl;
+    cout << "  codec    predictor threads  ratio  compress MB/s  compress ms  write ms  frame MB/s" << endl;
+    for (OutputCompression codec : codecs)
+    {
+        for (bool predictor : { false, true })
+        {
+            if (codec == COMPRESS_NONE && predictor)
+            {
+                continue;
+            }
+            for (int threads : threadCounts)
+            {
+                if (codec == COMPRESS_NONE && threads > 0)
+                {
+                    break;
+                }
+                StripThreadPool compressionPool(threads);
+                CompressedTiffWriter writer(codec, 0, predictor, threads > 0 ? &compressionPool : nullptr, direct);
+                double compressMs = 0.0, writeMs = 0.0;
+                uint64_t bytes = 0, totalBytes = 0;
+                bool written = true;
+                for (int r = 0; r < repeat && written; r++)
+                {
+                    string path = outputDirectory + "compress_" + to_string(r) + ".tiff";
+                    written = writer.write(frame, path, bytes);
+                    compressMs += writer.getCompressMs();
+                    writeMs += writer.getWriteMs();
+                    totalBytes += bytes;
+                    filesystem::remove(path);
+                }
+                if (!written)
+                {
+                    verified = false;
+                    continue;
+                }
+                compressMs /= repeat;
+                writeMs /= repeat;
+                double ratio = rawMegabytes * 1024.0 * 1024.0 * repeat / totalBytes;
+                cout << "  " << left << setw(9) << CompressedTiffWriter::getName(codec) << setw(10) << (predictor ? "yes" : "no") << right << setw(7) << threads
+                    << setw(7) << setprecision(2) << ratio << setprecision(1);
+                if (codec == COMPRESS_NONE)
+                {
+                    cout << setw(15) << "-" << setw(13) << "-";
+                }
+                else
+                {
+                    cout << setw(15) << rawMegabytes / (compressMs / 1000.0) << setw(13) << compressMs;
+                }
+                cout << setw(10) << writeMs << setw(12) << rawMegabytes / ((compressMs + writeMs) / 1000.0) << endl;
+            }
+        }
+    }
+    cout << defaultfloat;
+    releaseFrames();
+    return verified ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static void printUsage()
+{
+    cerr << "Usage: ScannerBenchmark pipeline [--frames N] [--width W] [--height H] [--fps F] [--jitter MS] [--output DIR]" << endl;
+    cerr << "                                 [--workers N] [--in-order 0|1] [--queue N] [--drop 0|1] [--lock-free 0|1]" << endl;
+    cerr << "                                 [--writers N] [--in-flight N] [--direct 0|1] [--packed 0|1]" << endl;
+    cerr << "                                 [--led-ms MS] [--exposure-ms MS] [--readout-ms MS] [--overlap 0|1]" << endl;
+    cerr << "                                 [--strip-threads N] [--calibrate N] [--register 0|1] [--stabilize 0|1|2]" << endl;
+    cerr << "                                 [--hdr N] [--hdr-stops S] [--hdr-half 0|1] [--journal 0|1|2] [--segment-mb MB]" << endl;
+    cerr << "                                 [--preview SCALE] [--metrics PATH] [--metrics-interval S]" << endl;
+    cerr << "                                 [--invert 0|1] [--film-base R,G,B|auto] [--lut FILE] [--format tiff|dpx|exr]" << endl;
+    cerr << "                                 [--compress none|lzw|deflate|zstd] [--compress-level N] [--compress-threads N] [--predictor 0|1]" << endl;
+    cerr << "       ScannerBenchmark kernels [--width W] [--height H] [--repeat N] [--strip-threads N]" << endl;
+    cerr << "       ScannerBenchmark serial [--count N] [--baud B] [--reply-ms MS]" << endl;
+    cerr << "       ScannerBenchmark mdrive [--frames N] [--baud B] [--speed-error E] [--capture-ms MS] [--write-ms MS]" << endl;
+    cerr << "                               [--steps-per-frame N] [--poll-ms MS] [--max-fps F]" << endl;
+    cerr << "       ScannerBenchmark registration [--frames N] [--width W] [--height H] [--max-shift PX] [--strip-threads N]" << endl;
+    cerr << "       ScannerBenchmark stabilization [--frames N] [--width W] [--height H] [--max-shift PX] [--strip-threads N]" << endl;
+    cerr << "       ScannerBenchmark hdr [--width W] [--height H] [--exposures N] [--stops S] [--strip-threads N]" << endl;
+    cerr << "       ScannerBenchmark reprocess [--frames N] [--width W] [--height H] [--first N] [--last N] [--workers N]" << endl;
+    cerr << "                                  [--strip-threads N] [--hdr N] [--packed 0|1] [--output DIR]" << endl;
+    cerr << "       ScannerBenchmark session [--frames N] [--width W] [--height H] [--workers N] [--in-order 0|1] [--output DIR]" << endl;
+    cerr << "       ScannerBenchmark preview [--width W] [--height H] [--repeat N] [--strip-threads N] [--frames N] [--output DIR]" << endl;
+    cerr << "       ScannerBenchmark metrics [--samples N] [--threads N] [--output DIR]" << endl;
+    cerr << "       ScannerBenchmark color [--width W] [--height H] [--repeat N] [--strip-threads N] [--output DIR]" << endl;
+    cerr << "       ScannerBenchmark writer [--width W] [--height H] [--repeat N] [--output DIR]" << endl;
+    cerr << "       ScannerBenchmark compress [--width W] [--height H] [--repeat N] [--threads N] [--direct 0|1] [--output DIR]" << endl;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 2)
+    {
+        printUsage();
+        return EXIT_FAILURE;
+    }
+
+    string mode = argv[1];
+    map<string, string> options = parseOptions(argc, argv, 2);
+
+    if (mode == "pipeline")
+    {
+        return runPipelineBenchmark(options);
+    }
+    if (mode == "kernels")
+    {
+        return runKernelBenchmark(options);
+    }
+    if (mode == "serial")
+    {
+        return runSerialBenchmark(options);
+    }
+    if (mode == "mdrive")
+    {
+        return runMDriveBenchmark(options);
+    }
+    if (mode == "registration")
+    {
+        return runRegistrationBenchmark(options);
+    }
+    if (mode == "stabilization")
+    {
+        return runStabilizationBenchmark(options);
+    }
+    if (mode == "hdr")
+    {
+        return runHdrBenchmark(options);
+    }
+    if (mode == "reprocess")
+    {
+        return runReprocessBenchmark(options);
+    }
+    if (mode == "session")
+    {
+        return runSessionBenchmark(options);
+    }
+    if (mode == "preview")
+    {
+        return runPreviewBenchmark(options);
+    }
+    if (mode == "metrics")
+    {
+        return runMetricsBenchmark(options);
+    }
+    if (mode == "color")
+    {
+        return runColorBenchmark(options);
+    }
+    if (mode == "writer")
+    {
+        return runWriterBenchmark(options);
+    }
+    if (mode == "compress")
+    {
+        return runCompressBenchmark(options);
+    }
+
+    printUsage();
+    return EXIT_FAILURE;
+}
@@ -0,0 +1,375 @@
+/*
+*   SequenceWriter.cpp
+*	Film Scanner Master PC Control Software by Kyle Mikolajczyk
+*	kyle@kylem.org
+*/
+
+#include "SequenceWriter.h"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <ctime>
+#include <filesystem>
+#include <iostream>
+#include <utility>
+#include "PixelKernels.h"
+
+SequenceWriter::SequenceWriter(OutputFormat format, bool bypassCache) : format(format), bypassCache(bypassCache), printingDensity(false),
+    chunk(nullptr), chunkSize(0), templateWidth(0), templateHeight(0), rowBytes(0), convertMs(0.0), writeMs(0.0)
+{
+}
+
+std::string SequenceWriter::getExtension(OutputFormat format)
+{
+    switch (format)
+    {
+    case OUTPUT_DPX: return ".dpx";
+    case OUTPUT_EXR: return ".exr";
+    default: return ".tiff";
+    }
+}
+
+bool SequenceWriter::parseFormat(const std::string& name, OutputFormat& format)
+{
+    const std::pair<const char*, OutputFormat> formats[] = { { "tiff", OUTPUT_TIFF }, { "dpx", OUTPUT_DPX }, { "exr", OUTPUT_EXR } };
+    for (const auto& known : formats)
+    {
+        if (name == known.first)
+        {
+            format = known.second;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool SequenceWriter::isNative(OutputFormat format, const OIIO::ImageSpec& spec)
+{
+    if (spec.nchannels != 3)
+    {
+        return false;
+    }
+    if (format == OUTPUT_DPX)
+    {
+        return spec.format == OIIO::TypeDesc::UINT16;
+    }
+    if (format == OUTPUT_EXR)
+    {
+        return spec.format == OIIO::TypeDesc::UINT16 || spec.format == OIIO::TypeDesc::HALF;
+    }
+    return false;
+}
+
+void SequenceWriter::setPrintingDensity(bool newPrintingDensity)
+{
+    if (printingDensity != newPrintingDensity)
+    {
+        printingDensity = newPrintingDensity;
+        templateWidth = 0; // Built again with the next frame
+    }
+}
+
+static void putBig32(unsigned char* field, uint32_t value)
+{
+    field[0] = (unsigned char)(value >> 24);
+    field[1] = (unsigned char)(value >> 16);
+    field[2] = (unsigned char)(value >> 8);
+    field[3] = (unsigned char)value;
+}
+
+static void putBig16(unsigned char* field, uint16_t value)
+{
+    field[0] = (unsigned char)(value >> 8);
+    field[1] = (unsigned char)value;
+}
+
+static void putBigFloat(unsigned char* field, float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    putBig32(field, bits);
+}
+
+/*
+* SMPTE 268M version 2.0. Fields we do not fill are left undefined, all ones for
+* numbers and empty for text, as the standard asks. The header is padded to
+* DPX_DATA_OFFSET so the pixels start on a block.
+*/
+void SequenceWriter::buildDpxHeader(int width, int height)
+{
+    header.assign(DPX_DATA_OFFSET, 0xFF);
+    // The text fields and reserved areas
+    const size_t textFields[][2] = {
+        { 8, 16 }, { 36, 660 }, { 664, 768 }, // Version, file name to copyright, reserved
+        { 780 + 40, 780 + 72 }, { 1356, 1408 }, // Element description, reserved
+        { 1432, 1620 }, { 1644, 1664 }, // Source file name, time, device and serial, reserved
+        { 1664, 1712 }, { 1732, 1920 }, // Film ids, prefix, count and format, frame id and slate
+        { 1972, DPX_DATA_OFFSET } // Reserved, then the padding
+    };
+    for (const auto& field : textFields)
+    {
+        memset(&header[field[0]], 0, field[1] - field[0]);
+    }
+
+    uint64_t fileSize = DPX_DATA_OFFSET + (uint64_t)width * height * 6;
+    memcpy(&header[0], "SDPX", 4);
+    putBig32(&header[4], (uint32_t)DPX_DATA_OFFSET);
+    memcpy(&header[8], "V2.0", 4);
+    putBig32(&header[16], (uint32_t)std::min<uint64_t>(fileSize, UINT32_MAX));
+    putBig32(&header[20], 1); // A new frame, not a copy of the last one's header
+    putBig32(&header[24], 1664); // File and image headers
+    putBig32(&header[28], 384); // Film and television headers
+    putBig32(&header[32], 0); // No user data
+    strcpy((char*)&header[160], "Film Scanner");
+
+    putBig16(&header[768], 0); // Left to right, top to bottom
+    putBig16(&header[770], 1);
+    putBig32(&header[772], (uint32_t)width);
+    putBig32(&header[776], (uint32_t)height);
+    unsigned char* element = &header[780];
+    putBig32(element + 0, 0); // Unsigned
+    putBig32(element + 4, 0);
+    putBigFloat(element + 8, 0.0f);
+    putBig32(element + 12, 65535);
+    element[20] = 50; // RGB
+    element[21] = printingDensity ? 1 : 2; // Printing density or linear
+    element[22] = printingDensity ? 1 : 0; // Printing density or user defined
+    element[23] = 16;
+    putBig16(element + 24, 0); // Packed, which at 16 bits is no padding
+    putBig16(element + 26, 0); // Not run length encoded
+    putBig32(element + 28, (uint32_t)DPX_DATA_OFFSET);
+    putBig32(element + 32, 0);
+    putBig32(element + 36, 0);
+
+    putBig32(&header[1408], 0);
+    putBig32(&header[1412], 0);
+    putBig32(&header[1424], (uint32_t)width);
+    putBig32(&header[1428], (uint32_t)height);
+    putBig32(&header[1628], 1); // Square pixels
+    putBig32(&header[1632], 1);
+
+    rowBytes = (size_t)width * 6;
+}
+
+/*
+* Only what changes from frame to frame: the file name, the time and the frame number
+*/
+void SequenceWriter::patchDpxHeader(const std::string& filename, int frameNumber)
+{
+    std::string name = std::filesystem::path(filename).filename().string().substr(0, 99);
+    memset(&header[36], 0, 100);
+    memcpy(&header[36], name.data(), name.size());
+
+    std::time_t now = std::time(nullptr);
+    std::tm local;
+#ifdef _WIN32
+    localtime_s(&local, &now);
+#else
+    localtime_r(&now, &local);
+#endif
+    memset(&header[136], 0, 24);
+    std::strftime((char*)&header[136], 24, "%Y:%m:%d:%H:%M:%S", &local);
+
+    putBig32(&header[1712], (uint32_t)frameNumber);
+}
+
+static void putAttribute(std::vector<unsigned char>& header, const char* name, const char* type, const void* value, int32_t size)
+{
+    header.insert(header.end(), name, name + strlen(name) + 1);
+    header.insert(header.end(), type, type + strlen(type) + 1);
+    const unsigned char* sizeBytes = (const unsigned char*)&size;
+    header.insert(header.end(), sizeBytes, sizeBytes + 4);
+    header.insert(header.end(), (const unsigned char*)value, (const unsigned char*)value + size);
+}
+
+/*
+* A single part scanline file without compression, one line per chunk. Everything is
+* little endian like the PC writing it. The channels are kept in the alphabetical
+* order the format wants, so every line is its blue, green and red halves in turn. With
+* no compression every chunk is the same size, so the offset table only depends on the
+* frame size and is part of the template too.
+*/
+void SequenceWriter::buildExrHeader(int width, int height)
+{
+    header.clear();
+    const unsigned char magic[8] = { 0x76, 0x2F, 0x31, 0x01, 2, 0, 0, 0 };
+    header.insert(header.end(), magic, magic + 8);
+
+    std::vector<unsigned char> channels;
+    for (const char* name : { "B", "G", "R" })
+    {
+        const int32_t description[4] = { 1, 0, 1, 1 }; // HALF, not linear and reserved, sampling
+        channels.insert(channels.end(), name, name + 2);
+        channels.insert(channels.end(), (const unsigned char*)description, (const unsigned char*)(description + 4));
+    }
+    channels.push_back(0);
+    putAttribute(header, "channels", "chlist", channels.data(), (int32_t)channels.size());
+    const unsigned char none = 0;
+    putAttribute(header, "compression", "compression", &none, 1);
+    const int32_t window[4] = { 0, 0, width - 1, height - 1 };
+    putAttribute(header, "dataWindow", "box2i", window, sizeof(window));
+    putAttribute(header, "displayWindow", "box2i", window, sizeof(window));
+    const unsigned char increasingY = 0;
+    putAttribute(header, "lineOrder", "lineOrder", &increasingY, 1);
+    const float one = 1.0f;
+    putAttribute(header, "pixelAspectRatio", "float", &one, sizeof(one));
+    const float center[2] = { 0.0f, 0.0f };
+    putAttribute(header, "screenWindowCenter", "v2f", center, sizeof(center));
+    putAttribute(header, "screenWindowWidth", "float", &one, sizeof(one));
+    header.push_back(0);
+
+    rowBytes = 8 + (size_t)width * 6;
+    uint64_t offset = header.size() + (uint64_t)height * 8;
+    for (int y = 0; y < height; y++)
+    {
+        const unsigned char* offsetBytes = (const unsigned char*)&offset;
+        header.insert(header.end(), offsetBytes, offsetBytes + 8);
+        offset += rowBytes;
+    }
+}
+
+/*
+* 16 bit levels to half floats with 65535 as 1.0, the way OIIO converts them
+*/
+static const uint16_t* getHalfTable()
+{
+    static const std::vector<uint16_t> table = []()
+    {
+        std::vector<uint16_t> levels(65536);
+        for (size_t level = 0; level < levels.size(); level++)
+        {
+            levels[level] = PixelKernels::floatToHalf(level / 65535.0f);
+        }
+        return levels;
+    }();
+    return table.data();
+}
+
+void SequenceWriter::convertRow(const OIIO::ImageBuf* image, int y, unsigned char* destination)
+{
+    const OIIO::ImageSpec& spec = image->spec();
+    const uint16_t* source = (const uint16_t*)((const unsigned char*)image->localpixels() + (size_t)y * spec.scanline_bytes());
+    size_t width = (size_t)spec.width;
+    if (format == OUTPUT_DPX)
+    {
+        PixelKernels::swapBytes16(source, (uint16_t*)destination, width * 3);
+        return;
+    }
+
+    const int32_t line[2] = { y, (int32_t)(width * 6) };
+    memcpy(destination, line, sizeof(line));
+    uint16_t* blue = (uint16_t*)(destination + 8);
+    uint16_t* green = blue + width;
+    uint16_t* red = green + width;
+    if (spec.format == OIIO::TypeDesc::HALF)
+    {
+        PixelKernels::deinterleave3(source, red, green, blue, width);
+        return;
+    }
+    const uint16_t* halves = getHalfTable();
+    for (size_t x = 0; x < width; x++)
+    {
+        red[x] = halves[source[x * 3 + 0]];
+        green[x] = halves[source[x * 3 + 1]];
+        blue[x] = halves[source[x * 3 + 2]];
+    }
+}
+
+/*
+* Lines are converted into the buffer behind the header until the next one does not
+* fit. Then the block aligned part goes to the file in one write and the rest (under a
+* block) moves to the front. The last write leaves a partial block, which DirectFile
+* pads and cuts off again.
+*/
+bool SequenceWriter::write(const OIIO::ImageBuf* image, const std::string& filename, int frameNumber, uint64_t& bytes)
+{
+    auto start = std::chrono::steady_clock::now();
+    convertMs = 0.0;
+    writeMs = 0.0;
+    bytes = 0;
+    const OIIO::ImageSpec& spec = image->spec();
+    if (!isNative(format, spec) || image->localpixels() == nullptr)
+    {
+        std::cerr << "Error: " << filename << " can not be written without OIIO" << std::endl;
+        return false;
+    }
+
+    if (spec.width != templateWidth || spec.height != templateHeight)
+    {
+        if (format == OUTPUT_DPX)
+        {
+            buildDpxHeader(spec.width, spec.height);
+        }
+        else
+        {
+            buildExrHeader(spec.width, spec.height);
+        }
+        templateWidth = spec.width;
+        templateHeight = spec.height;
+        size_t needed = std::max(CHUNK_SIZE, std::max(header.size(), DirectFile::ALIGNMENT) + rowBytes);
+        needed = (needed + DirectFile::ALIGNMENT - 1) & ~(DirectFile::ALIGNMENT - 1);
+        if (needed > chunkSize)
+        {
+            DirectFile::freeAligned(chunk);
+            chunk = (unsigned char*)DirectFile::allocateAligned(needed);
+            chunkSize = chunk != nullptr ? needed : 0;
+        }
+    }
+    if (chunk == nullptr)
+    {
+        std::cerr << "Error: Out of memory writing " << filename << std::endl;
+        return false;
+    }
+    if (format == OUTPUT_DPX)
+    {
+        patchDpxHeader(filename, frameNumber);
+    }
+
+    DirectFile file;
+    if (!file.open(filename, bypassCache))
+    {
+        return false;
+    }
+    bool ok = true;
+    auto timedWrite = [&](size_t length)
+    {
+        auto writeStart = std::chrono::steady_clock::now();
+        ok = file.write(chunk, length);
+        writeMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - writeStart).count();
+    };
+
+    memcpy(chunk, header.data(), header.size());
+    size_t used = header.size();
+    for (int y = 0; y < spec.height && ok; y++)
+    {
+        if (used + rowBytes > chunkSize)
+        {
+            size_t aligned = used & ~(DirectFile::ALIGNMENT - 1);
+            timedWrite(aligned);
+            memmove(chunk, chunk + aligned, used - aligned);
+            used -= aligned;
+        }
+        convertRow(image, y, chunk + used);
+        used += rowBytes;
+    }
+    if (ok)
+    {
+        timedWrite(used);
+    }
+    auto closeStart = std::chrono::steady_clock::now();
+    ok = file.close() && ok;
+    writeMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - closeStart).count();
+    convertMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() - writeMs;
+    if (!ok)
+    {
+        std::cerr << "Error: Could not write " << filename << std::endl;
+        return false;
+    }
+    bytes = file.getSize();
+    return true;
+}
+
+SequenceWriter::~SequenceWriter()
+{
+    DirectFile::freeAligned(chunk);
+}
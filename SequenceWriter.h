@@ -0,0 +1,82 @@
+/*
+*   SequenceWriter.h
+*	Film Scanner Master PC Control Software by Kyle Mikolajczyk
+*   kyle@kylem.org
+*/
+
+#pragma once
+
+#include <OpenImageIO/imagebuf.h>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "DirectFile.h"
+
+enum OutputFormat
+{
+	OUTPUT_TIFF, // Through OpenImageIO, as the scanner always wrote
+	OUTPUT_DPX, // 16 bit RGB DPX, what film scanners hand to grading and conform
+	OUTPUT_EXR // Uncompressed half float OpenEXR, scene linear for HDR frames
+};
+
+/*
+* Writes one frame per file of a DPX or OpenEXR sequence without going through
+* OpenImageIO. Every frame of a scan has the same size and type, so the header (and for
+* EXR the whole line offset table) is built once and only the few fields that change
+* per frame are patched. The pixels are converted (byte swapped for DPX, split into
+* half float planes per line for EXR) into an aligned buffer of CHUNK_SIZE that starts
+* with the header, and every full buffer goes to DirectFile as one aligned write, which
+* it passes to the disk without a copy.
+*
+* One per writer thread, it keeps the buffer and the header between frames.
+*/
+class SequenceWriter
+{
+	public:
+		static constexpr size_t CHUNK_SIZE = 4 * 1024 * 1024;
+		static constexpr size_t DPX_DATA_OFFSET = 4096; // The DPX header, padded to a block
+
+		SequenceWriter(OutputFormat format, bool bypassCache);
+		~SequenceWriter();
+
+		// ".tiff", ".dpx" or ".exr"
+		static std::string getExtension(OutputFormat format);
+		// "tiff", "dpx" or "exr", false for anything else
+		static bool parseFormat(const std::string& name, OutputFormat& format);
+		// Whether frames of this spec are written natively: 3 channel UINT16 for DPX,
+		// UINT16 or HALF for EXR. Anything else is written with OIIO in the same format.
+		static bool isNative(OutputFormat format, const OIIO::ImageSpec& spec);
+
+		// The transfer characteristic written in the DPX header, printing density for
+		// inverted negatives and linear otherwise
+		void setPrintingDensity(bool printingDensity);
+
+		// Write the frame to filename, frameNumber going into the DPX film header. bytes
+		// is the size of the file.
+		bool write(const OIIO::ImageBuf* image, const std::string& filename, int frameNumber, uint64_t& bytes);
+
+		// Time the last write spent converting pixels and waiting for the file
+		double getConvertMs() const { return convertMs; }
+		double getWriteMs() const { return writeMs; }
+
+	private:
+		OutputFormat format;
+		bool bypassCache;
+		bool printingDensity;
+		unsigned char* chunk;
+		size_t chunkSize;
+
+		std::vector<unsigned char> header; // Built for templateWidth x templateHeight
+		int templateWidth;
+		int templateHeight;
+		size_t rowBytes; // Of one line in the file
+
+		double convertMs;
+		double writeMs;
+
+		void buildDpxHeader(int width, int height);
+		void buildExrHeader(int width, int height);
+		void patchDpxHeader(const std::string& filename, int frameNumber);
+		void convertRow(const OIIO::ImageBuf* image, int y, unsigned char* destination);
+};
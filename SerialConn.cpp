@@ -5,11 +5,20 @@
 */
 
 #include "SerialConn.h"
+#include <cstring>
+
+using namespace boost::asio;
+
+// Unclaimed messages kept for readMessage(). When it is full the oldest one is dropped.
+#define SERIAL_MESSAGE_QUEUE_SIZE 64
 
 /*
-* Constructor for the SerialConn class.
+* Constructor for the SerialConn class. Reading starts straight away and runs for the
+* life of the connection on the I/O thread.
 */
-SerialConn::SerialConn(int baudRate, const char* portId) : io(), work(io), serial(io, portId)
+SerialConn::SerialConn(int baudRate, const char* portId) : io(), serial(io, portId), work(io),
+    partialLength(0), inMessage(false), messages(SERIAL_MESSAGE_QUEUE_SIZE), messageHead(0), messageCount(0), droppedMessages(0),
+    nextExpectationId(0)
 {
     try {
         serial.set_option(serial_port_base::baud_rate(baudRate));
@@ -18,6 +27,8 @@ SerialConn::SerialConn(int baudRate, const char* portId) : io(), work(io), seria
         serial.set_option(serial_port_base::stop_bits(serial_port_base::stop_bits::one));
         serial.set_option(serial_port_base::flow_control(serial_port_base::flow_control::none));
 
+        startRead();
+
         // Start the io_service in a separate thread
         ioThread = std::thread([this]() { io.run(); });
     }
@@ -26,143 +37,215 @@ SerialConn::SerialConn(int baudRate, const char* portId) : io(), work(io), seria
     }
 }
 
-void SerialConn::checkDeadline(boost::asio::deadline_timer* timer, boost::asio::serial_port* serial)
+/*
+* Read whatever has arrived, up to a whole buffer at a time
+*/
+void SerialConn::startRead()
 {
-    if (timer->expires_at() <= boost::asio::deadline_timer::traits_type::now())
-    {
-        timed_out = true;
-        boost::system::error_code ignored_ec;
-        serial->cancel(ignored_ec);
-        timer->expires_at(boost::posix_time::pos_infin);
-    }
-
-    timer->async_wait([this, timer, serial](const boost::system::error_code& ec)
+    serial.async_read_some(boost::asio::buffer(readBuffer, sizeof(readBuffer)),
+        [this](const boost::system::error_code& ec, std::size_t bytesRead)
         {
-            if (!ec)
-            {
-                checkDeadline(timer, serial);
-            }
+            handleRead(ec, bytesRead);
         });
 }
 
-
 /*
-* Reads a single character from the serial connection.
+* Split the bytes that came in into (...) messages. A message can be spread over
+* several reads, and one read can hold several messages.
 */
-char SerialConn::getCharFromConn()
+void SerialConn::handleRead(const boost::system::error_code& ec, size_t bytesRead)
 {
-    //std::cout << "Reading char" << std::endl;
-    readComplete = false;
-    timed_out = false;
-    boost::asio::deadline_timer timer(io);
-    timer.expires_from_now(boost::posix_time::seconds(5)); // Set timeout duration
+    if (ec)
+    {
+        if (ec != boost::asio::error::operation_aborted)
+        {
+            std::cerr << "Error reading from serial connection: " << ec.message() << std::endl;
+        }
+        return; // Connection closed or we are shutting down
+    }
 
-    checkDeadline(&timer, &serial);
+    for (size_t i = 0; i < bytesRead; i++)
+    {
+        char c = readBuffer[i];
+        if (c == MSG_START_DELIM)
+        {
+            inMessage = true; // Start reading when start delimiter is found
+            partialLength = 0;
+            continue;
+        }
+        if (!inMessage)
+        {
+            continue;
+        }
+        if (c == MSG_END_DELIM)
+        {
+            partial.text[partialLength] = '\0';
+            partial.type = decodeMessage(partial.text, partial.value);
+            partial.receivedAt = std::chrono::steady_clock::now();
+            deliver(partial);
+            inMessage = false;
+        }
+        else if ((isprint(static_cast<unsigned char>(c)) || c == '\n' || c == '\r') && partialLength < MSG_SIZE - 1)
+        {
+            partial.text[partialLength++] = c;
+        }
+    }
+    startRead();
+}
 
-    serial.async_read_some(boost::asio::buffer(&readChar, 1),
-        [this, &timer](const boost::system::error_code& ec, std::size_t bytes_transferred)
+/*
+* Hand a message to whoever is waiting for its type, otherwise to the callback or the queue
+*/
+void SerialConn::deliver(const Message& message)
+{
+    std::shared_ptr<std::promise<Message>> promise;
+    std::shared_ptr<boost::asio::steady_timer> timer;
+    MessageCallback callback;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto it = expectations.begin(); it != expectations.end(); ++it)
         {
-            if (!ec && bytes_transferred > 0)
+            if (it->type == message.type)
             {
-                timer.expires_at(boost::posix_time::pos_infin); // Cancel the timer
-                readComplete = true;
+                promise = it->promise;
+                timer = it->timer;
+                expectations.erase(it);
+                break;
             }
-            else if (ec != boost::asio::error::operation_aborted)
+        }
+        if (!promise)
+        {
+            if (messageCallback)
             {
-                std::cerr << "Error: " << ec.message() << std::endl;
+                callback = messageCallback;
+            }
+            else
+            {
+                if (messageCount == messages.size())
+                {
+                    messageHead = (messageHead + 1) % messages.size(); // Full, drop the oldest
+                    messageCount--;
+                    droppedMessages++;
+                }
+                messages[(messageHead + messageCount) % messages.size()] = message;
+                messageCount++;
+                messageArrived.notify_one();
             }
-        });
-    //std::cout << "Done reading char" << std::endl;
-
-    // Run the I/O service to process the asynchronous operation
-    while (!readComplete && !timed_out)
-    {
-        //std::cout << "In while loop" << std::endl;
-        if (io.poll_one() == 0) {
-            std::this_thread::sleep_for(std::chrono::milliseconds(10));
         }
     }
-	//std::cout << "Out of while loop" << std::endl;
 
-    // Ensure the timer is canceled and no longer active
-    boost::system::error_code ignored_ec;
-    timer.cancel(ignored_ec);
+    if (promise)
+    {
+        timer->cancel();
+        promise->set_value(message);
+    }
+    else if (callback)
+    {
+        callback(message);
+    }
+}
 
-    if (timed_out)
+/*
+* Pop the oldest unclaimed message
+*/
+bool SerialConn::readMessage(Message& message, int timeoutMs)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    if (!messageArrived.wait_for(lock, std::chrono::milliseconds(timeoutMs), [this] { return messageCount > 0; }))
     {
         std::cerr << "Timeout reading from serial connection." << std::endl;
-        return '\t'; // Return a null character in case of timeout
+        return false;
     }
+    message = messages[messageHead];
+    messageHead = (messageHead + 1) % messages.size();
+    messageCount--;
+    return true;
+}
 
-    if (readComplete)
+std::future<SerialConn::Message> SerialConn::expectMessage(Arduino_Message_Type expected, int timeoutMs)
+{
+    Expectation expectation;
+    expectation.type = expected;
+    expectation.promise = std::make_shared<std::promise<Message>>();
+    expectation.timer = std::make_shared<boost::asio::steady_timer>(io);
+    std::future<Message> future = expectation.promise->get_future();
     {
-        // NOTE: When debugging you can remove the comment to see the raw chars being received
-        //std::cout << "Finished reading char: " << readChar << std::endl;
-        return readChar;
+        std::lock_guard<std::mutex> lock(mutex);
+        expectation.id = nextExpectationId++;
+        expectations.push_back(expectation);
     }
 
-    return '\t'; // Return a null character in case of error
+    // The timer is only ever touched on the I/O thread, so arming it is posted there too
+    std::shared_ptr<boost::asio::steady_timer> timer = expectation.timer;
+    uint64_t id = expectation.id;
+    io.post([this, timer, id, timeoutMs]()
+        {
+            timer->expires_after(std::chrono::milliseconds(timeoutMs));
+            timer->async_wait([this, timer, id](const boost::system::error_code& ec)
+                {
+                    if (!ec)
+                    {
+                        expire(id);
+                    }
+                });
+        });
+    return future;
 }
 
-
-
 /*
-* Reads from the serial connection until the start and end delimiters are found.
+* Nothing of the expected type arrived in time, resolve it with an UNKNOWN message
 */
-char* SerialConn::readMessage(const char startDelim, const char endDelim)
+void SerialConn::expire(uint64_t id)
 {
-    try {
-        char* buffer = new char[256](); // Initialize buffer to zero
-        int i = 0;
-        bool started = false;
-
-        //std::cout << "Starting read message..." << std::endl;
-
-        while (true) {
-			//std::cout << "Reading char" << std::endl;
-            char c = getCharFromConn(); // NOTE: Can hang here
-			//std::cout << c << std::endl;
-            
-			if (c == '\t') {
-				std::cerr << "Error reading from serial connection." << std::endl;
-				return nullptr;
-			}
-
-            if (c == startDelim) {
-                started = true; // Start reading when start delimiter is found
-                continue;
-            }
-
-            if (started) {
-                if (isprint(static_cast<unsigned char>(c)) || c == '\n' || c == '\r') { // Check for valid characters
-                    buffer[i] = c;
-                    if (buffer[i] == endDelim) {
-                        buffer[i] = '\0';
-                        break;
-                    }
-                    i++;
-                    if (i >= 255) { // Prevent buffer overflow
-                        buffer[255] = '\0';
-                        break;
-                    }
-                }
+    std::shared_ptr<std::promise<Message>> promise;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto it = expectations.begin(); it != expectations.end(); ++it)
+        {
+            if (it->id == id)
+            {
+                promise = it->promise;
+                expectations.erase(it);
+                break;
             }
         }
-
-        return buffer;
     }
-    catch (boost::system::system_error& e) {
-        std::cout << "error happened";
-        std::cerr << "Error: " << e.what() << std::endl;
+    if (promise)
+    {
+        Message timedOut;
+        timedOut.receivedAt = std::chrono::steady_clock::now();
+        promise->set_value(timedOut);
     }
-    return nullptr;
 }
 
-void SerialConn::parseMessage(const char* message)
+std::future<SerialConn::Message> SerialConn::sendCommandAsync(Arduino_Command_Type command, int value, Arduino_Message_Type expected, int timeoutMs)
+{
+    std::future<Message> reply = expectMessage(expected, timeoutMs);
+    sendCommand(command, value);
+    return reply;
+}
+
+void SerialConn::setMessageCallback(MessageCallback callback)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    messageCallback = callback;
+}
+
+uint64_t SerialConn::getDroppedMessageCount()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return droppedMessages;
+}
+
+/*
+* Work out the message type from its text. Runs on the I/O thread for every message, so
+* it neither allocates nor logs.
+*/
+SerialConn::Arduino_Message_Type SerialConn::decodeMessage(const char* message, int& value)
 {
     // Determine the message type from the message string
     Arduino_Message_Type messageType;
-    int value = -1;
+    value = -1;
 
     if (strcmp(message, "ACK") == 0)
     {
@@ -194,28 +277,38 @@ void SerialConn::parseMessage(const char* message)
         char* endPtr;
         value = strtol(message + 17, &endPtr, 10); // Extract the number after "CURRENT_FRAME_ID:", 10 here is base10 number system
         if (*endPtr != '\0') {
-            std::cerr << "Invalid number format in message: " << message << std::endl;
-            return;
+            return UNKNOWN; // Invalid number format in message
         }
     }
-    else if (strncmp(message, "STEPPER_POS:", 12) == 0)
+    else if (strncmp(message, "STEPPER_POS:", 12) == 0 || strncmp(message, "CURRENT_STEPPER_POS:", 20) == 0)
     {
         messageType = CURRENT_STEPPER_POS;
         char* endPtr;
-        value = strtol(message + 12, &endPtr, 10); // Extract the number after "CURRENT_FRAME_ID:", 10 here is base10 number system
+        value = strtol(strchr(message, ':') + 1, &endPtr, 10); // Extract the number after "CURRENT_FRAME_ID:", 10 here is base10 number system
         if (*endPtr != '\0') {
-            std::cerr << "Invalid number format in message: " << message << std::endl;
-            return;
+            return UNKNOWN; // Invalid number format in message
         }
     }
     else
     {
-        std::cerr << "Unknown message received from Arduino: " << message << std::endl;
-        return;
+        return UNKNOWN;
+    }
+    return messageType;
+}
+
+SerialConn::Arduino_Message_Type SerialConn::parseMessage(const char* message)
+{
+    int value = -1;
+    Arduino_Message_Type messageType = decodeMessage(message, value);
+    if (messageType == UNKNOWN)
+    {
+        std::cerr << "Unknown or malformed message received from Arduino: " << message << std::endl;
+        return UNKNOWN;
     }
 
     // Handle the message
     handleArduinoMessage(messageType, value);
+    return messageType;
 }
 
 void SerialConn::handleArduinoMessage(Arduino_Message_Type messageType, int value)
@@ -260,25 +353,48 @@ void SerialConn::handleArduinoMessage(Arduino_Message_Type messageType, int valu
     }
 }
 
+/*
+* Queue a message for writing on the I/O thread. Only the delimited text is sent; the
+* Arduino skips anything before the start delimiter, so there is no need to pad every
+* command out to MSG_SIZE bytes (which took ~20 ms per command at 115200 baud).
+*/
 void SerialConn::printToSerialWithDelimiters(const char* message)
 {
-    // Buffer to hold the formatted message
-    char formattedMessage[MSG_SIZE];
-    for (int i = 0; i < MSG_SIZE; i++) {
-        formattedMessage[i] = 0;
-    }
-    // Add the start delimiter to the message
-    formattedMessage[0] = MSG_START_DELIM;
-    int i = 1;
-    // Copy the message to the buffer
-    for (int j = 0; j < strlen(message); j++) {
-        formattedMessage[i] = message[j];
-        i++;
-    }
-    // Add the end delimiter to the message
-    formattedMessage[i] = MSG_END_DELIM;
-    // Write the message to the serial connection
-    boost::asio::write(serial, buffer(formattedMessage, MSG_SIZE));
+    std::string formattedMessage;
+    formattedMessage.reserve(strlen(message) + 2);
+    formattedMessage += MSG_START_DELIM;
+    formattedMessage += message;
+    formattedMessage += MSG_END_DELIM;
+    io.post([this, formattedMessage]()
+        {
+            writeQueue.push_back(formattedMessage);
+            if (writeQueue.size() == 1)
+            {
+                startWrite();
+            }
+        });
+}
+
+/*
+* Write queued messages one at a time, in order
+*/
+void SerialConn::startWrite()
+{
+    boost::asio::async_write(serial, boost::asio::buffer(writeQueue.front()),
+        [this](const boost::system::error_code& ec, std::size_t)
+        {
+            if (ec)
+            {
+                std::cerr << "Error writing to serial connection: " << ec.message() << std::endl;
+                writeQueue.clear();
+                return;
+            }
+            writeQueue.pop_front();
+            if (!writeQueue.empty())
+            {
+                startWrite();
+            }
+        });
 }
 
 /*
@@ -350,10 +466,15 @@ void SerialConn::sendCommand(Arduino_Command_Type command, int value)
 
 SerialConn::~SerialConn()
 {
-    // Destructor body can be empty as the io_service and serial_port
-    // will automatically clean up their resources.
     io.stop();
     if (ioThread.joinable()) {
         ioThread.join();
     }
+
+    // Anyone still waiting for a reply gets a timed out message rather than a broken promise
+    for (Expectation& expectation : expectations)
+    {
+        expectation.promise->set_value(Message());
+    }
+    expectations.clear();
 }
@@ -6,16 +6,24 @@
 
 #pragma once
 #include <iostream>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
 #include <boost/asio.hpp>
-#include <boost/asio/deadline_timer.hpp>
-#include <boost/bind.hpp>
+#include <boost/asio/steady_timer.hpp>
 
 #define MSG_SIZE 256
 #define MSG_START_DELIM '('
 #define MSG_END_DELIM ')'
 
-using namespace boost::asio;
-
 class SerialConn
 {
 	/*
@@ -67,30 +75,85 @@ class SerialConn
 			SET_FRAME_OFFSET,
 			RESET_FRAME_ID
 		};
+		/*
+		* One message from the Arduino. Stored inline so receiving one never allocates.
+		*/
+		struct Message
+		{
+			Arduino_Message_Type type = UNKNOWN; // Also UNKNOWN when waiting for a message timed out
+			int value = -1; // Number after the ':' for CURRENT_FRAME_ID and STEPPER_POS
+			char text[MSG_SIZE] = {}; // Raw text between the delimiters, null terminated
+			std::chrono::steady_clock::time_point receivedAt;
+		};
+		typedef std::function<void(const Message&)> MessageCallback;
+
+		static const int DEFAULT_TIMEOUT_MS = 5000;
+
 		SerialConn(int baudRate, const char* portId);
 		~SerialConn();
 
-		char* readMessage(const char startDelim, const char endDelim);
-		void parseMessage(const char* message);
+		// Next message from the Arduino, false if nothing arrived within timeoutMs
+		bool readMessage(Message& message, int timeoutMs = DEFAULT_TIMEOUT_MS);
+		// Decode and log a message, UNKNOWN if it could not be parsed
+		Arduino_Message_Type parseMessage(const char* message);
+		// Decode without logging, value is set for messages that carry a number
+		static Arduino_Message_Type decodeMessage(const char* message, int& value);
+
+		// Resolves with the first message of the given type, or with an UNKNOWN message once
+		// timeoutMs has passed. Claimed messages do not also go to readMessage().
+		std::future<Message> expectMessage(Arduino_Message_Type expected, int timeoutMs = DEFAULT_TIMEOUT_MS);
+		// Send a command and wait for its reply without blocking. The expectation is in place
+		// before the command goes out, so a fast reply cannot be missed.
+		std::future<Message> sendCommandAsync(Arduino_Command_Type command, int value, Arduino_Message_Type expected, int timeoutMs = DEFAULT_TIMEOUT_MS);
+		// Unclaimed messages go to this callback (on the I/O thread) instead of the readMessage() queue
+		void setMessageCallback(MessageCallback callback);
 
 		void sendCommand(Arduino_Command_Type command);
 		void sendCommand(Arduino_Command_Type command, int value);
-	private:
-		io_service io;
-		serial_port serial;
 
-		bool timed_out = false;
+		uint64_t getDroppedMessageCount();
+	private:
+		// A message waiting for its reply
+		struct Expectation
+		{
+			uint64_t id;
+			Arduino_Message_Type type;
+			std::shared_ptr<std::promise<Message>> promise;
+			std::shared_ptr<boost::asio::steady_timer> timer;
+		};
 
+		boost::asio::io_service io;
+		boost::asio::serial_port serial;
 		boost::asio::io_service::work work;
 		std::thread ioThread;
-		char readChar;
-		bool readComplete;
 
-		void checkDeadline(boost::asio::deadline_timer* timer, boost::asio::serial_port* serial);
+		// Reading, only touched on the I/O thread
+		char readBuffer[MSG_SIZE];
+		Message partial; // Message currently being framed
+		size_t partialLength;
+		bool inMessage;
+
+		// Writing, only touched on the I/O thread
+		std::deque<std::string> writeQueue;
+
+		// Shared between the I/O thread and callers
+		std::mutex mutex;
+		std::condition_variable messageArrived;
+		std::vector<Message> messages; // Ring of unclaimed messages for readMessage()
+		size_t messageHead;
+		size_t messageCount;
+		uint64_t droppedMessages;
+		std::list<Expectation> expectations;
+		uint64_t nextExpectationId;
+		MessageCallback messageCallback;
+
+		void startRead();
+		void handleRead(const boost::system::error_code& ec, size_t bytesRead);
+		void deliver(const Message& message);
+		void expire(uint64_t id);
+		void startWrite();
 
 		void handleArduinoMessage(Arduino_Message_Type messageType, int value);
-		char getCharFromConn();
 		void printToSerialWithDelimiters(const char* message);
 
 };
-
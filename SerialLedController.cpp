@@ -0,0 +1,58 @@
+/*
+*   SerialLedController.cpp
+*	Film Scanner Master PC Control Software by Kyle Mikolajczyk
+*	kyle@kylem.org
+*/
+
+// How long the Arduino gets to answer SET_COLOR_* with READY_*
+#define LED_ACK_TIMEOUT_MS 1000
+
+#include "SerialLedController.h"
+
+SerialLedController::SerialLedController(SerialConn* connection) : connection(connection)
+{
+}
+
+/*
+* Send the colour command, with the READY_* reply it should get
+*/
+std::future<SerialConn::Message> SerialLedController::sendColor(LedColor color, SerialConn::Arduino_Message_Type& expected)
+{
+    SerialConn::Arduino_Command_Type command = SerialConn::SET_COLOR_RED;
+    expected = SerialConn::READY_RED;
+    if (color == LED_GREEN)
+    {
+        command = SerialConn::SET_COLOR_GREEN;
+        expected = SerialConn::READY_GREEN;
+    }
+    else if (color == LED_BLUE)
+    {
+        command = SerialConn::SET_COLOR_BLUE;
+        expected = SerialConn::READY_BLUE;
+    }
+    return connection->sendCommandAsync(command, 0, expected, LED_ACK_TIMEOUT_MS);
+}
+
+bool SerialLedController::setColor(LedColor color)
+{
+    return setColorAsync(color).get();
+}
+
+/*
+* The result is deferred: checking the reply happens in whichever thread waits on the
+* future, so no thread is started per colour change
+*/
+std::future<bool> SerialLedController::setColorAsync(LedColor color)
+{
+    SerialConn::Arduino_Message_Type expected;
+    std::shared_future<SerialConn::Message> reply = sendColor(color, expected).share();
+    return std::async(std::launch::deferred, [reply, expected]()
+        {
+            if (reply.get().type != expected)
+            {
+                std::cerr << "Error: Arduino did not acknowledge the colour change." << std::endl;
+                return false;
+            }
+            return true;
+        });
+}
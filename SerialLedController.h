@@ -0,0 +1,28 @@
+/*
+*   SerialLedController.h
+*	Film Scanner Master PC Control Software by Kyle Mikolajczyk
+*   kyle@kylem.org
+*/
+
+#pragma once
+
+#include "LedController.h"
+#include "SerialConn.h"
+
+/*
+* LED on the Arduino, switched with SET_COLOR_* and acknowledged with READY_*
+*/
+class SerialLedController : public LedController
+{
+	public:
+		SerialLedController(SerialConn* connection); // The connection is not owned, it can be shared
+
+		bool setColor(LedColor color) override;
+		std::future<bool> setColorAsync(LedColor color) override; // No extra thread, the reply arrives on the serial I/O thread
+		std::string getName() override { return "Arduino"; }
+
+	private:
+		SerialConn* connection;
+
+		std::future<SerialConn::Message> sendColor(LedColor color, SerialConn::Arduino_Message_Type& expected);
+};
@@ -0,0 +1,309 @@
+/*
+*   SessionManifest.cpp
+*	Film Scanner Master PC Control Software by Kyle Mikolajczyk
+*	kyle@kylem.org
+*/
+
+#include "SessionManifest.h"
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <vector>
+
+static const char* HEADER_LINE = "event,image_id,value,path\n";
+
+SessionManifest::SessionManifest(const std::string& path, size_t batchEntries, unsigned int flushIntervalMs)
+    : path(path), batchEntries(batchEntries > 0 ? batchEntries : 1), flushIntervalMs(flushIntervalMs), pendingEntries(0), closing(false),
+    failed(false)
+{
+}
+
+std::string SessionManifest::pathFor(const std::string& outputDirectory, const std::string& captureId)
+{
+    return outputDirectory + "image" + captureId + "_session.csv";
+}
+
+static bool parseInteger(const std::string& text, int64_t& value)
+{
+    if (text.empty())
+    {
+        return false;
+    }
+    char* end = nullptr;
+    value = strtoll(text.c_str(), &end, 10);
+    return *end == '\0';
+}
+
+/*
+* False for anything that is not a complete entry, the header included
+*/
+bool SessionManifest::parseLine(const std::string& line)
+{
+    // The path is last and may itself hold commas
+    std::vector<std::string> fields;
+    size_t start = 0;
+    while (fields.size() < 3)
+    {
+        size_t comma = line.find(',', start);
+        if (comma == std::string::npos)
+        {
+            break;
+        }
+        fields.push_back(line.substr(start, comma - start));
+        start = comma + 1;
+    }
+    fields.push_back(line.substr(start));
+
+    int64_t imageId, value;
+    if (fields.size() < 3 || !parseInteger(fields[1], imageId) || imageId < 0)
+    {
+        return false;
+    }
+    if (fields[0] == "captured" && fields.size() == 3)
+    {
+        Frame& frame = frames[(int)imageId];
+        frame = Frame();
+        frame.captured = true;
+        frame.positionKnown = parseInteger(fields[2], frame.motorPosition);
+        return true;
+    }
+    if (fields[0] == "written" && fields.size() == 4 && parseInteger(fields[2], value) && value >= 0 && !fields[3].empty())
+    {
+        Frame& frame = frames[(int)imageId];
+        frame.written = true;
+        frame.bytes = (uint64_t)value;
+        frame.path = fields[3];
+        return true;
+    }
+    return false;
+}
+
+/*
+* Only whole lines count. A line the last run was cut off in the middle of is trimmed
+* away, so the next entry does not get appended to it.
+*/
+void SessionManifest::load()
+{
+    std::ifstream in(path, std::ios::binary);
+    if (!in)
+    {
+        return;
+    }
+    std::stringstream contents;
+    contents << in.rdbuf();
+    in.close();
+    std::string text = contents.str();
+
+    size_t complete = text.rfind('\n');
+    complete = complete == std::string::npos ? 0 : complete + 1;
+    std::istringstream lines(text.substr(0, complete));
+    std::string line;
+    while (std::getline(lines, line))
+    {
+        if (!line.empty() && line.back() == '\r')
+        {
+            line.pop_back();
+        }
+        parseLine(line);
+    }
+    if (complete < text.size())
+    {
+        std::cout << "Session manifest " << path << " ends in a partial entry, dropping it." << std::endl;
+        std::error_code error;
+        std::filesystem::resize_file(path, complete, error);
+    }
+
+    for (auto& entry : frames)
+    {
+        Frame& frame = entry.second;
+        std::error_code error;
+        frame.verified = frame.written && std::filesystem::file_size(frame.path, error) == frame.bytes && !error;
+    }
+}
+
+bool SessionManifest::open()
+{
+    load();
+    std::error_code error;
+    std::filesystem::path parent = std::filesystem::path(path).parent_path();
+    if (!parent.empty())
+    {
+        std::filesystem::create_directories(parent, error);
+    }
+    bool existed = std::filesystem::exists(path, error) && std::filesystem::file_size(path, error) > 0;
+    if (!file.openForAppend(path))
+    {
+        return false;
+    }
+    if (!existed)
+    {
+        append(HEADER_LINE);
+    }
+    flusher = std::thread(&SessionManifest::flushLoop, this);
+    printSummary();
+    return true;
+}
+
+void SessionManifest::append(const std::string& line)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (closing)
+    {
+        return;
+    }
+    pending += line;
+    if (++pendingEntries >= batchEntries)
+    {
+        batchReady.notify_one();
+    }
+}
+
+void SessionManifest::frameCaptured(int imageId, bool positionKnown, int64_t motorPosition)
+{
+    std::ostringstream line;
+    line << "captured," << imageId << ",";
+    if (positionKnown)
+    {
+        line << motorPosition;
+    }
+    line << "\n";
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        Frame& frame = frames[imageId];
+        frame = Frame(); // Taken again, whatever was there before no longer counts
+        frame.captured = true;
+        frame.positionKnown = positionKnown;
+        frame.motorPosition = motorPosition;
+    }
+    append(line.str());
+}
+
+void SessionManifest::frameWritten(int imageId, const std::string& framePath, uint64_t bytes)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        Frame& frame = frames[imageId];
+        frame.written = true;
+        frame.bytes = bytes;
+        frame.path = framePath;
+    }
+    append("written," + std::to_string(imageId) + "," + std::to_string(bytes) + "," + framePath + "\n");
+}
+
+/*
+* One write and one sync per batch, outside the lock so appending never waits for the
+* disk
+*/
+void SessionManifest::flushLoop()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true)
+    {
+        batchReady.wait_for(lock, std::chrono::milliseconds(flushIntervalMs), [this]() { return closing || pendingEntries >= batchEntries; });
+        if (pending.empty())
+        {
+            if (closing)
+            {
+                return;
+            }
+            continue;
+        }
+        std::string lines;
+        lines.swap(pending);
+        pendingEntries = 0;
+        lock.unlock();
+        bool written = file.write(lines.data(), lines.size()) && file.sync();
+        lock.lock();
+        if (!written && !failed)
+        {
+            std::cerr << "Error: Session manifest " << path << " could not be written, a crash from now on means rescanning." << std::endl;
+        }
+        failed = failed || !written;
+    }
+}
+
+bool SessionManifest::close()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        closing = true;
+    }
+    batchReady.notify_one();
+    if (flusher.joinable())
+    {
+        flusher.join();
+    }
+    bool closedCleanly = file.close();
+    std::lock_guard<std::mutex> lock(mutex);
+    return closedCleanly && !failed;
+}
+
+bool SessionManifest::isVerified(int imageId)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    auto found = frames.find(imageId);
+    return found != frames.end() && found->second.verified;
+}
+
+int SessionManifest::getResumeImageId()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    int imageId = 0;
+    for (auto found = frames.find(0); found != frames.end() && found->first == imageId && found->second.verified; ++found)
+    {
+        imageId++;
+    }
+    return imageId;
+}
+
+bool SessionManifest::getMotorPosition(int imageId, int64_t& position)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    auto found = frames.find(imageId);
+    if (found == frames.end() || !found->second.positionKnown)
+    {
+        return false;
+    }
+    position = found->second.motorPosition;
+    return true;
+}
+
+int SessionManifest::getVerifiedCount()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    int verified = 0;
+    for (auto& entry : frames)
+    {
+        verified += entry.second.verified ? 1 : 0;
+    }
+    return verified;
+}
+
+void SessionManifest::printSummary()
+{
+    int verified = getVerifiedCount();
+    int resumeImageId = getResumeImageId();
+    if (verified == 0)
+    {
+        std::cout << "Session manifest " << path << ", starting a new session" << std::endl;
+        return;
+    }
+    std::cout << "Session manifest " << path << ": " << verified << " frame(s) verified on disk, resuming at image " << resumeImageId;
+    int64_t position;
+    if (getMotorPosition(resumeImageId, position))
+    {
+        std::cout << ", captured before at motor position " << position;
+    }
+    else if (resumeImageId > 0 && getMotorPosition(resumeImageId - 1, position))
+    {
+        std::cout << ", the frame before it was at motor position " << position;
+    }
+    std::cout << std::endl;
+}
+
+SessionManifest::~SessionManifest()
+{
+    close();
+}
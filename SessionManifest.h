@@ -0,0 +1,90 @@
+/*
+*   SessionManifest.h
+*	Film Scanner Master PC Control Software by Kyle Mikolajczyk
+*   kyle@kylem.org
+*/
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "DirectFile.h"
+
+/*
+* Index of a scan session that survives a crash, image<captureId>_session.csv next to
+* the images. One line is appended when a frame is captured (with the motor position
+* it was taken at) and another once its file has been written:
+*
+*   captured,<image id>,<motor position>
+*   written,<image id>,<bytes>,<path>
+*
+* The lines are batched and synced to disk by a thread of their own, at most
+* batchEntries lines or flushIntervalMs apart, so the capture thread never waits for an
+* fsync. A crash loses at most the last batch, and those frames are simply taken
+* again. A line cut off by the crash is ignored.
+*
+* When the session is opened again the frames that were written are checked against
+* the files on disk; a frame is verified if its file is still there at the size that
+* was written. Scanning resumes at the first frame that is not.
+*/
+class SessionManifest
+{
+	public:
+		struct Frame
+		{
+			bool captured = false;
+			bool positionKnown = false;
+			int64_t motorPosition = 0;
+			bool written = false;
+			uint64_t bytes = 0;
+			std::string path;
+			bool verified = false; // Written in an earlier run and still on disk as it was
+		};
+
+		SessionManifest(const std::string& path, size_t batchEntries = 32, unsigned int flushIntervalMs = 500);
+		~SessionManifest();
+
+		static std::string pathFor(const std::string& outputDirectory, const std::string& captureId);
+
+		// Read what an earlier run left behind, verify its frames, and start appending
+		bool open();
+		bool close(); // Sync what is left, false if anything could not be written
+
+		void frameCaptured(int imageId, bool positionKnown, int64_t motorPosition);
+		void frameWritten(int imageId, const std::string& path, uint64_t bytes);
+
+		bool isVerified(int imageId);
+		// The first frame from 0 up that is not verified, where a new run should start
+		int getResumeImageId();
+		// Where the motor was when imageId was captured, false if that is not known
+		bool getMotorPosition(int imageId, int64_t& position);
+
+		int getVerifiedCount();
+		void printSummary();
+
+	private:
+		std::string path;
+		size_t batchEntries;
+		unsigned int flushIntervalMs;
+
+		std::mutex mutex;
+		std::condition_variable batchReady;
+		std::map<int, Frame> frames;
+		std::string pending; // Lines not yet handed to the file
+		size_t pendingEntries;
+		bool closing;
+		bool failed;
+
+		DirectFile file; // Flusher thread only, once open
+		std::thread flusher;
+
+		void load();
+		bool parseLine(const std::string& line);
+		void append(const std::string& line);
+		void flushLoop();
+};
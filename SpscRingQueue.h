@@ -0,0 +1,175 @@
+/*
+*   SpscRingQueue.h
+*	Film Scanner Master PC Control Software by Kyle Mikolajczyk
+*   kyle@kylem.org
+*/
+
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "RGBImageQueue.h"
+
+/*
+* Lock free ring buffer for exactly one producer thread and one consumer thread.
+* Pushing and popping are just an atomic load and store when the other side is
+* keeping up. A thread only falls back to sleeping on the condition variable after
+* spinning for a while, and the other side only takes the mutex to wake it when
+* it has announced that it is asleep.
+*/
+template <typename T>
+class SpscRingQueue : public FrameQueue<T>
+{
+    public:
+        SpscRingQueue(size_t capacity, QueueFullPolicy policy = QUEUE_BLOCK_WHEN_FULL)
+            : policy_(policy), head_(0), tail_(0), closed_(false), dropped_(0),
+            consumer_waiting_(false), producer_waiting_(false)
+        {
+            // Round up to a power of two so a slot index is a mask rather than a division
+            size_t slots = 2;
+            while (slots < capacity)
+            {
+                slots <<= 1;
+            }
+            slots_.resize(slots, nullptr);
+            mask_ = slots - 1;
+            capacity_ = capacity < 2 ? 2 : capacity;
+        }
+
+        // Producer thread only
+        bool push(T* value) override
+        {
+            size_t tail = tail_.load(std::memory_order_relaxed);
+            for (int spin = 0; tail - head_.load(std::memory_order_acquire) >= capacity_; spin++)
+            {
+                if (closed_.load(std::memory_order_acquire))
+                {
+                    return false;
+                }
+                if (policy_ == QUEUE_DROP_WHEN_FULL)
+                {
+                    dropped_.fetch_add(1, std::memory_order_relaxed);
+                    return false;
+                }
+                if (spin < SPIN_LIMIT)
+                {
+                    std::this_thread::yield();
+                    continue;
+                }
+                sleepUntil(producer_waiting_, [this, tail] { return tail - head_.load(std::memory_order_acquire) < capacity_; });
+            }
+            if (closed_.load(std::memory_order_acquire))
+            {
+                return false;
+            }
+
+            slots_[tail & mask_] = value;
+            tail_.store(tail + 1, std::memory_order_release);
+            wake(consumer_waiting_);
+            return true;
+        }
+
+        // Consumer thread only
+        bool pop(T*& value) override
+        {
+            for (int spin = 0; ; spin++)
+            {
+                if (tryPop(value))
+                {
+                    return true;
+                }
+                if (closed_.load(std::memory_order_acquire))
+                {
+                    return tryPop(value); // Anything pushed before close() still gets handed out
+                }
+                if (spin < SPIN_LIMIT)
+                {
+                    std::this_thread::yield();
+                    continue;
+                }
+                sleepUntil(consumer_waiting_, [this] { return !isEmpty(); });
+            }
+        }
+
+        // Consumer thread only
+        bool tryPop(T*& value) override
+        {
+            size_t head = head_.load(std::memory_order_relaxed);
+            if (head == tail_.load(std::memory_order_acquire))
+            {
+                return false;
+            }
+            value = slots_[head & mask_];
+            head_.store(head + 1, std::memory_order_release);
+            wake(producer_waiting_);
+            return true;
+        }
+
+        void close() override
+        {
+            closed_.store(true, std::memory_order_release);
+            std::lock_guard<std::mutex> lock(wait_mutex_);
+            wait_cond_.notify_all();
+        }
+
+        size_t size() override
+        {
+            return tail_.load(std::memory_order_acquire) - head_.load(std::memory_order_acquire);
+        }
+
+        size_t capacity() override { return capacity_; }
+
+        uint64_t droppedCount() override { return dropped_.load(std::memory_order_relaxed); }
+
+    private:
+        static const int SPIN_LIMIT = 64;
+
+        std::vector<T*> slots_;
+        size_t mask_;
+        size_t capacity_;
+        QueueFullPolicy policy_;
+
+        // Kept on separate cache lines so the two threads do not fight over one line
+        alignas(64) std::atomic<size_t> head_; // Next slot to pop, written by the consumer
+        alignas(64) std::atomic<size_t> tail_; // Next slot to push, written by the producer
+        alignas(64) std::atomic<bool> closed_;
+        std::atomic<uint64_t> dropped_;
+
+        std::atomic<bool> consumer_waiting_;
+        std::atomic<bool> producer_waiting_;
+        std::mutex wait_mutex_;
+        std::condition_variable wait_cond_;
+
+        bool isEmpty()
+        {
+            return head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_acquire);
+        }
+
+        /*
+        * Announce we are going to sleep, then check the condition again. The seq_cst
+        * fences pair with the one in wake(): either the other side sees our flag and
+        * notifies, or we see its update here and do not sleep at all.
+        */
+        template <typename Ready>
+        void sleepUntil(std::atomic<bool>& waiting, Ready ready)
+        {
+            std::unique_lock<std::mutex> lock(wait_mutex_);
+            waiting.store(true, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            wait_cond_.wait(lock, [&] { return ready() || closed_.load(std::memory_order_acquire); });
+            waiting.store(false, std::memory_order_relaxed);
+        }
+
+        void wake(std::atomic<bool>& waiting)
+        {
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (waiting.load(std::memory_order_relaxed))
+            {
+                std::lock_guard<std::mutex> lock(wait_mutex_);
+                wait_cond_.notify_all();
+            }
+        }
+};
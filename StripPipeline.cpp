@@ -0,0 +1,154 @@
+/*
+*   StripPipeline.cpp
+*	Film Scanner Master PC Control Software by Kyle Mikolajczyk
+*	kyle@kylem.org
+*/
+
+#include "StripPipeline.h"
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include "PipelineMetrics.h"
+#include "StripThreadPool.h"
+
+void StageTimings::setMetrics(PipelineMetrics* newMetrics, const std::string& newFrameStage)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    metrics = newMetrics;
+    frameStage = newFrameStage;
+}
+
+void StageTimings::add(const std::string& stage, double ms)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (metrics != nullptr)
+    {
+        metrics->record(stage, ms);
+    }
+    auto found = stages.find(stage);
+    if (found == stages.end())
+    {
+        order.push_back(stage);
+        found = stages.emplace(stage, Totals()).first;
+    }
+    found->second.frames++;
+    found->second.totalMs += ms;
+    found->second.maxMs = std::max(found->second.maxMs, ms);
+}
+
+void StageTimings::addFrame(double wallMs)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (metrics != nullptr)
+    {
+        metrics->record(frameStage, wallMs);
+    }
+    frames.frames++;
+    frames.totalMs += wallMs;
+    frames.maxMs = std::max(frames.maxMs, wallMs);
+}
+
+/*
+* A stage that only runs for some frames (e.g. registration after it was turned on)
+* is averaged over the frames it ran for
+*/
+void StageTimings::printStats()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (frames.frames == 0)
+    {
+        return;
+    }
+    std::cout << std::fixed << std::setprecision(2) << "Processing timing over " << frames.frames << " frame(s), mean "
+        << frames.totalMs / frames.frames << " ms per frame (max " << frames.maxMs << " ms), CPU time per stage:" << std::endl;
+    for (const std::string& name : order)
+    {
+        const Totals& stage = stages[name];
+        std::cout << "  " << std::setw(12) << std::left << name << std::right << stage.totalMs / stage.frames << " ms/frame, longest "
+            << stage.maxMs << " ms" << std::endl;
+    }
+    std::cout << std::defaultfloat;
+}
+
+uint16_t* StripPipeline::Strip::buffer(int index, size_t pixels)
+{
+    thread_local std::vector<uint16_t> buffers[BUFFER_COUNT];
+    std::vector<uint16_t>& buffer = buffers[index];
+    if (buffer.size() < pixels)
+    {
+        buffer.resize(pixels);
+    }
+    return buffer.data();
+}
+
+StripPipeline::StripPipeline(int width, int height, const uint16_t* const planes[CHANNEL_COUNT])
+    : width(width), height(height), wallMs(0.0), rowAlignment(1)
+{
+    for (int channel = 0; channel < CHANNEL_COUNT; channel++)
+    {
+        framePlanes[channel] = planes[channel];
+    }
+}
+
+void StripPipeline::addStage(const std::string& name, StageFn stage)
+{
+    stages.push_back({ name, stage });
+}
+
+void StripPipeline::run(StripThreadPool* pool, size_t stripPixels)
+{
+    auto start = std::chrono::steady_clock::now();
+    stageNanoseconds.reset(new std::atomic<int64_t>[stages.size()]);
+    for (size_t i = 0; i < stages.size(); i++)
+    {
+        stageNanoseconds[i] = 0;
+    }
+
+    auto runStrip = [this](size_t firstRow, size_t endRow) {
+        Strip strip;
+        strip.firstRow = firstRow;
+        strip.endRow = endRow;
+        strip.firstPixel = firstRow * width;
+        strip.pixelCount = (endRow - firstRow) * width;
+        for (int channel = 0; channel < CHANNEL_COUNT; channel++)
+        {
+            strip.planes[channel] = framePlanes[channel] != nullptr ? framePlanes[channel] + strip.firstPixel : nullptr;
+        }
+        auto stageStart = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < stages.size(); i++)
+        {
+            stages[i].run(strip);
+            auto stageEnd = std::chrono::steady_clock::now();
+            stageNanoseconds[i] += std::chrono::duration_cast<std::chrono::nanoseconds>(stageEnd - stageStart).count();
+            stageStart = stageEnd;
+        }
+    };
+
+    size_t stripRows = std::max<size_t>(1, stripPixels / std::max(1, width));
+    stripRows = (stripRows + rowAlignment - 1) / rowAlignment * rowAlignment;
+    if (pool != nullptr)
+    {
+        pool->run(height, stripRows, runStrip);
+    }
+    else
+    {
+        for (size_t row = 0; row < (size_t)height; row += stripRows)
+        {
+            runStrip(row, std::min((size_t)height, row + stripRows));
+        }
+    }
+    wallMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+void StripPipeline::addTimings(StageTimings* timings)
+{
+    if (timings == nullptr || !stageNanoseconds)
+    {
+        return;
+    }
+    for (size_t i = 0; i < stages.size(); i++)
+    {
+        timings->add(stages[i].name, getStageMs((int)i));
+    }
+}
@@ -0,0 +1,116 @@
+/*
+*   StripPipeline.h
+*	Film Scanner Master PC Control Software by Kyle Mikolajczyk
+*   kyle@kylem.org
+*/
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+class PipelineMetrics;
+class StripThreadPool;
+
+/*
+* Mean and longest time per frame of each named processing stage, summed over every
+* frame processed. Safe to add to from several workers at once. With setMetrics every
+* time is also recorded in that stage's histogram, and a frame's wall time as frameStage.
+*/
+class StageTimings
+{
+	public:
+		StageTimings() : metrics(nullptr) {}
+
+		// ms is the time one frame spent in stage, counted once per frame
+		void add(const std::string& stage, double ms);
+		void addFrame(double wallMs); // Wall time of a whole frame's processing
+		void printStats();
+		void setMetrics(PipelineMetrics* newMetrics, const std::string& newFrameStage);
+
+	private:
+		struct Totals
+		{
+			uint64_t frames = 0;
+			double totalMs = 0.0;
+			double maxMs = 0.0;
+		};
+
+		std::mutex mutex;
+		std::vector<std::string> order; // Stages in the order they were first seen
+		std::map<std::string, Totals> stages;
+		Totals frames;
+		PipelineMetrics* metrics;
+		std::string frameStage;
+};
+
+/*
+* A chain of per-pixel stages run over a frame strip by strip. All stages of a strip
+* run one after the other on the same thread before it takes the next strip, so what one
+* stage writes is still in the L2 cache when the next reads it, and a chain of N stages
+* costs about one trip through memory instead of N. The strips are spread over a
+* StripThreadPool when there is one.
+*
+* Stages read from and write to the Strip they are given: planes start out pointing at
+* the strip's rows in the frame, and a stage that changes a channel writes it into one
+* of the strip's buffers and points the plane there. The time spent in each stage is
+* summed over strips and threads, so it is CPU time, not wall time.
+*/
+class StripPipeline
+{
+	public:
+		static const int CHANNEL_COUNT = 3;
+		static const int BUFFER_COUNT = 8;
+
+		struct Strip
+		{
+			size_t firstRow;
+			size_t endRow;
+			size_t firstPixel; // Of the strip in the frame, firstRow * width
+			size_t pixelCount;
+			const uint16_t* planes[CHANNEL_COUNT]; // Each channel's pixels of the strip
+
+			// Scratch buffer index of the calling thread with room for pixels, kept from
+			// strip to strip and from frame to frame
+			uint16_t* buffer(int index, size_t pixels);
+		};
+		typedef std::function<void(Strip& strip)> StageFn;
+
+		// planes are the full frames of each channel, null for a channel no stage reads
+		StripPipeline(int width, int height, const uint16_t* const planes[CHANNEL_COUNT]);
+
+		void addStage(const std::string& name, StageFn stage);
+		int getStageCount() { return (int)stages.size(); }
+
+		// Strips start on multiples of rows, for stages that work on blocks of rows
+		void setRowAlignment(int rows) { rowAlignment = rows > 1 ? rows : 1; }
+
+		// Run every stage over strips of about stripPixels pixels (whole rows)
+		void run(StripThreadPool* pool, size_t stripPixels);
+
+		double getStageMs(int stage) { return stageNanoseconds[stage].load() / 1e6; }
+		double getWallMs() { return wallMs; }
+		void addTimings(StageTimings* timings); // The time of every stage in the last run, as one frame
+
+	private:
+		struct Stage
+		{
+			std::string name;
+			StageFn run;
+		};
+
+		int width;
+		int height;
+		const uint16_t* framePlanes[CHANNEL_COUNT];
+		std::vector<Stage> stages;
+		std::unique_ptr<std::atomic<int64_t>[]> stageNanoseconds;
+		double wallMs;
+		int rowAlignment;
+};
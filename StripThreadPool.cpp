@@ -0,0 +1,119 @@
+/*
+*   StripThreadPool.cpp
+*	Film Scanner Master PC Control Software by Kyle Mikolajczyk
+*	kyle@kylem.org
+*/
+
+#include "StripThreadPool.h"
+#include <algorithm>
+
+StripThreadPool::StripThreadPool(int threadCount) : stopping(false)
+{
+    for (int i = 0; i < threadCount; i++)
+    {
+        threads.push_back(std::thread(&StripThreadPool::threadLoop, this));
+    }
+}
+
+/*
+* Hand out the next strip of the oldest job. A job leaves the list once its last strip
+* has been taken, the caller of run() is still waiting for it to finish.
+*/
+bool StripThreadPool::takeStrip(Job*& job, size_t& strip)
+{
+    if (jobs.empty())
+    {
+        return false;
+    }
+    job = jobs.front();
+    strip = job->nextStrip++;
+    if (job->nextStrip == job->stripCount)
+    {
+        jobs.pop_front();
+    }
+    return true;
+}
+
+void StripThreadPool::runStrip(Job* job, size_t strip)
+{
+    size_t firstRow = strip * job->stripRows;
+    size_t endRow = std::min(job->rowCount, firstRow + job->stripRows);
+    (*job->strip)(firstRow, endRow);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    job->doneStrips++;
+    if (job->doneStrips == job->stripCount)
+    {
+        stripDone.notify_all();
+    }
+}
+
+void StripThreadPool::run(size_t rowCount, size_t stripRows, const StripFn& strip)
+{
+    if (rowCount == 0)
+    {
+        return;
+    }
+    stripRows = std::max<size_t>(1, stripRows);
+    Job job = { &strip, rowCount, stripRows, (rowCount + stripRows - 1) / stripRows, 0, 0 };
+    if (threads.empty() || job.stripCount == 1)
+    {
+        for (size_t i = 0; i < job.stripCount; i++)
+        {
+            strip(i * stripRows, std::min(rowCount, (i + 1) * stripRows));
+        }
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    jobs.push_back(&job);
+    workAvailable.notify_all();
+
+    // Work on our own strips until they have all been taken, then wait for the rest
+    while (job.nextStrip < job.stripCount)
+    {
+        size_t index = job.nextStrip++;
+        if (job.nextStrip == job.stripCount)
+        {
+            jobs.erase(std::find(jobs.begin(), jobs.end(), &job));
+        }
+        lock.unlock();
+        runStrip(&job, index);
+        lock.lock();
+    }
+    stripDone.wait(lock, [&job]() { return job.doneStrips == job.stripCount; });
+}
+
+void StripThreadPool::threadLoop()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true)
+    {
+        workAvailable.wait(lock, [this]() { return stopping || !jobs.empty(); });
+        if (stopping)
+        {
+            return;
+        }
+        Job* job;
+        size_t strip;
+        if (takeStrip(job, strip))
+        {
+            lock.unlock();
+            runStrip(job, strip);
+            lock.lock();
+        }
+    }
+}
+
+StripThreadPool::~StripThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    workAvailable.notify_all();
+    for (std::thread& thread : threads)
+    {
+        thread.join();
+    }
+}
@@ -0,0 +1,59 @@
+/*
+*   StripThreadPool.h
+*	Film Scanner Master PC Control Software by Kyle Mikolajczyk
+*   kyle@kylem.org
+*/
+
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+* Splits one frame's per-pixel work into strips of rows and runs them on a few
+* threads. The thread calling run() works on its own frame's strips too, so several
+* merge workers can share one pool and none of them sits idle waiting. Strips are
+* handed out one at a time from a shared list; each is a few hundred KB of pixels, so
+* the lock is taken a few hundred times per frame at most.
+*/
+class StripThreadPool
+{
+	public:
+		typedef std::function<void(size_t firstRow, size_t endRow)> StripFn;
+
+		StripThreadPool(int threadCount); // 0 runs every strip on the calling thread
+		~StripThreadPool();
+
+		// Call strip for [first, end) ranges covering rows 0..rowCount-1, stripRows at a
+		// time, and return once all of them are done
+		void run(size_t rowCount, size_t stripRows, const StripFn& strip);
+
+		int getThreadCount() { return (int)threads.size(); }
+
+	private:
+		struct Job
+		{
+			const StripFn* strip;
+			size_t rowCount;
+			size_t stripRows;
+			size_t stripCount;
+			size_t nextStrip; // Guarded by mutex, like everything else in here
+			size_t doneStrips;
+		};
+
+		std::mutex mutex;
+		std::condition_variable workAvailable;
+		std::condition_variable stripDone;
+		std::deque<Job*> jobs; // Jobs that still have strips nobody has started
+		std::vector<std::thread> threads;
+		bool stopping;
+
+		void threadLoop();
+		bool takeStrip(Job*& job, size_t& strip); // mutex must be held
+		void runStrip(Job* job, size_t strip);
+};
@@ -0,0 +1,219 @@
+/*
+*   SyntheticFrameSource.cpp
+*	Film Scanner Master PC Control Software by Kyle Mikolajczyk
+*	kyle@kylem.org
+*/
+
+#include "SyntheticFrameSource.h"
+#include <algorithm>
+#include <iostream>
+#include <thread>
+
+SyntheticFrameSource::SyntheticFrameSource(int width, int height, double frameRate, double jitterMs, unsigned int seed, RawFrame::PixelFormat format)
+    : width(width), height(height), frameRate(frameRate), jitterMs(jitterMs), format(format), grabbing(false),
+    triggered(false), exposureMs(0.0), patternExposureMs(0.0), readoutMs(0.0), framesGenerated(0),
+    rng(seed), jitter(0.0, jitterMs > 0.0 ? jitterMs : 1.0)
+{
+}
+
+/*
+* Build the test patterns. Each one is a soft gradient with a little noise so it
+* looks like a frame of film as far as the merge and writer are concerned.
+*/
+bool SyntheticFrameSource::open()
+{
+    if (width <= 0 || height <= 0)
+    {
+        std::cerr << "Synthetic frame source needs a positive resolution." << std::endl;
+        return false;
+    }
+    for (int i = 0; i < PATTERN_COUNT; i++)
+    {
+        generatePattern(patterns[i], i);
+        if (format == RawFrame::MONO12P)
+        {
+            packMono12p(patterns[i], packedPatterns[i]);
+        }
+    }
+    std::cout << "Using synthetic " << (format == RawFrame::MONO12P ? "Mono12p" : "Mono12") << " frame source " << width << "x" << height
+        << " @ " << frameRate << " fps (jitter " << jitterMs << " ms)" << std::endl;
+    return true;
+}
+
+void SyntheticFrameSource::generatePattern(std::vector<uint16_t>& pattern, int variant)
+{
+    pattern.resize((size_t)width * height);
+    std::uniform_int_distribution<int> noise(-32, 32);
+    for (int y = 0; y < height; ++y)
+    {
+        for (int x = 0; x < width; ++x)
+        {
+            int value = ((x * 2048) / width) + ((y * 1024) / height) + (variant * 512) + noise(rng);
+            pattern[(size_t)y * width + x] = (uint16_t)std::clamp(value, 0, 4095); // Mono12 range
+        }
+    }
+}
+
+void SyntheticFrameSource::packMono12p(const std::vector<uint16_t>& samples, std::vector<uint8_t>& packed)
+{
+    packed.assign((samples.size() * 3 + 1) / 2, 0);
+    for (size_t i = 0; i < samples.size(); i++)
+    {
+        uint8_t* pair = &packed[i / 2 * 3];
+        uint16_t sample = samples[i] & 0x0FFF;
+        if (i % 2 == 0)
+        {
+            pair[0] = (uint8_t)sample;
+            pair[1] = (uint8_t)((pair[1] & 0xF0) | (sample >> 8));
+        }
+        else
+        {
+            pair[1] = (uint8_t)((pair[1] & 0x0F) | (sample & 0x0F) << 4);
+            pair[2] = (uint8_t)(sample >> 4);
+        }
+    }
+}
+
+void SyntheticFrameSource::setTriggerTiming(double exposure, double readout)
+{
+    exposureMs = patternExposureMs = exposure;
+    readoutMs = readout;
+    scaledPatterns.clear();
+}
+
+bool SyntheticFrameSource::setExposureTimeMs(double exposure)
+{
+    if (exposure <= 0.0 || patternExposureMs <= 0.0 || patterns[0].empty())
+    {
+        return false; // Not open, or no exposure the patterns could be scaled from
+    }
+    exposureMs = exposure;
+    double brightness = exposureMs / patternExposureMs;
+    if (brightness != 1.0 && scaledPatterns.find(brightness) == scaledPatterns.end())
+    {
+        ScaledPatterns& scaled = scaledPatterns[brightness];
+        for (int i = 0; i < PATTERN_COUNT; i++)
+        {
+            scaled.samples[i].resize(patterns[i].size());
+            for (size_t j = 0; j < patterns[i].size(); j++)
+            {
+                scaled.samples[i][j] = (uint16_t)std::min(4095.0, patterns[i][j] * brightness + 0.5);
+            }
+            if (format == RawFrame::MONO12P)
+            {
+                packMono12p(scaled.samples[i], scaled.packed[i]);
+            }
+        }
+    }
+    return true;
+}
+
+bool SyntheticFrameSource::enableSoftwareTrigger()
+{
+    triggered = true;
+    return true;
+}
+
+bool SyntheticFrameSource::triggerExposure()
+{
+    if (!triggered || !grabbing)
+    {
+        return false;
+    }
+    pendingTriggers.push_back(std::chrono::steady_clock::now());
+    return true;
+}
+
+void SyntheticFrameSource::startGrabbing()
+{
+    startTime = std::chrono::steady_clock::now();
+    framesGenerated = 0;
+    pendingTriggers.clear();
+    grabbing = true;
+}
+
+void SyntheticFrameSource::stopGrabbing()
+{
+    grabbing = false;
+}
+
+bool SyntheticFrameSource::isGrabbing()
+{
+    return grabbing;
+}
+
+/*
+* Hand out the next pattern once its scheduled arrival time has passed. Arrival times
+* are on a fixed grid from startGrabbing() so jitter does not accumulate into drift.
+*/
+bool SyntheticFrameSource::grabFrame(RawFrame& frame, unsigned int timeoutMs)
+{
+    if (!grabbing)
+    {
+        return false;
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    if (triggered)
+    {
+        // Like the camera: nothing arrives until it has been triggered, exposed and read out
+        if (pendingTriggers.empty())
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(timeoutMs));
+            std::cerr << "Timeout waiting for synthetic frame, it was never triggered." << std::endl;
+            return false;
+        }
+        auto arrival = pendingTriggers.front() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double, std::milli>(exposureMs + readoutMs));
+        pendingTriggers.erase(pendingTriggers.begin());
+        std::this_thread::sleep_until(arrival);
+    }
+    else if (frameRate > 0.0)
+    {
+        double arrivalMs = (framesGenerated * 1000.0) / frameRate;
+        if (jitterMs > 0.0)
+        {
+            arrivalMs += jitter(rng);
+        }
+        auto arrival = startTime + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double, std::milli>(arrivalMs));
+        if (arrival - now > std::chrono::milliseconds(timeoutMs))
+        {
+            std::cerr << "Timeout waiting for synthetic frame." << std::endl;
+            return false;
+        }
+        if (arrival > now)
+        {
+            std::this_thread::sleep_until(arrival);
+        }
+    }
+
+    int pattern = framesGenerated % PATTERN_COUNT;
+    const std::vector<uint16_t>* samples = &patterns[pattern];
+    const std::vector<uint8_t>* packed = &packedPatterns[pattern];
+    auto scaled = patternExposureMs > 0.0 ? scaledPatterns.find(exposureMs / patternExposureMs) : scaledPatterns.end();
+    if (scaled != scaledPatterns.end())
+    {
+        samples = &scaled->second.samples[pattern];
+        packed = &scaled->second.packed[pattern];
+    }
+    if (format == RawFrame::MONO12P)
+    {
+        frame.data = packed->data();
+        frame.bufferSize = packed->size();
+    }
+    else
+    {
+        frame.data = samples->data();
+        frame.bufferSize = samples->size() * sizeof(uint16_t);
+    }
+    frame.width = width;
+    frame.height = height;
+    frame.format = format;
+    frame.frameNumber = framesGenerated++;
+    frame.timestamp = std::chrono::steady_clock::now();
+    return true;
+}
+
+std::string SyntheticFrameSource::getName()
+{
+    return "Synthetic";
+}
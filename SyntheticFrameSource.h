@@ -0,0 +1,78 @@
+/*
+*   SyntheticFrameSource.h
+*	Film Scanner Master PC Control Software by Kyle Mikolajczyk
+*   kyle@kylem.org
+*/
+
+#pragma once
+
+#include <map>
+#include <random>
+#include <vector>
+#include "FrameSource.h"
+
+/*
+* Generates Mono12 (or packed Mono12p) exposures in software so the pipeline can be run and benchmarked
+* without a camera. Frames are paced to the requested frame rate, with optional
+* random jitter on each frame's arrival time to mimic a real sensor and USB link.
+*/
+class SyntheticFrameSource : public FrameSource
+{
+	public:
+		// frameRate of 0 means deliver frames as fast as they are asked for
+		SyntheticFrameSource(int width, int height, double frameRate = 0.0, double jitterMs = 0.0, unsigned int seed = 1,
+			RawFrame::PixelFormat format = RawFrame::MONO12);
+
+		// Pack Mono12 samples the way the camera sends Mono12p
+		static void packMono12p(const std::vector<uint16_t>& samples, std::vector<uint8_t>& packed);
+
+		bool open() override;
+		void startGrabbing() override;
+		void stopGrabbing() override;
+		bool isGrabbing() override;
+		bool grabFrame(RawFrame& frame, unsigned int timeoutMs) override;
+		bool enableSoftwareTrigger() override;
+		bool triggerExposure() override;
+		double getExposureTimeMs() override { return exposureMs; }
+		// Frames come out brighter or darker by exposureMs over the exposure set with
+		// setTriggerTiming(), clipped like the sensor
+		bool setExposureTimeMs(double exposureMs) override;
+
+		// Timing of triggered frames: the frame arrives exposureMs + readoutMs after its
+		// trigger. The patterns are what an exposure of exposureMs sees.
+		void setTriggerTiming(double exposureMs, double readoutMs);
+		std::string getName() override;
+
+	private:
+		static const int PATTERN_COUNT = 3; // One test pattern per LED colour
+
+		int width;
+		int height;
+		double frameRate;
+		double jitterMs;
+		RawFrame::PixelFormat format;
+		bool grabbing;
+		bool triggered;
+		double exposureMs;
+		double patternExposureMs;
+		double readoutMs;
+		std::vector<std::chrono::steady_clock::time_point> pendingTriggers;
+		uint64_t framesGenerated;
+
+		std::chrono::steady_clock::time_point startTime;
+		std::mt19937 rng;
+		std::normal_distribution<double> jitter;
+
+		// Patterns are generated once up front, so pixel synthesis does not show up in the timings
+		std::vector<uint16_t> patterns[PATTERN_COUNT];
+		std::vector<uint8_t> packedPatterns[PATTERN_COUNT];
+		// The patterns at other exposures, made the first time each one is asked for
+		struct ScaledPatterns
+		{
+			std::vector<uint16_t> samples[PATTERN_COUNT];
+			std::vector<uint8_t> packed[PATTERN_COUNT];
+		};
+		std::map<double, ScaledPatterns> scaledPatterns;
+
+		void generatePattern(std::vector<uint16_t>& pattern, int variant);
+};